@@ -0,0 +1,125 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#define _GNU_SOURCE /* for cpu_set_t and pthread_attr_setaffinity_np() */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include "radsecproxy.h"
+#include "debug.h"
+#include "affinity.h"
+
+#if defined(HAVE_PTHREAD_ATTR_SETAFFINITY_NP)
+struct cpulist {
+    int *cpus;
+    int n;
+    uint32_t next; /* atomic */
+};
+
+static struct cpulist cpulists[AFFINITY_CLASSES];
+static cpu_set_t startcpus; /* of the process, before any pinning */
+static uint8_t pinning;
+
+/* parses a CPU or a range of them like 0-3 from s to *lo and *hi,
+ * returning where it ends, or NULL if invalid */
+static const char *parserange(const char *s, long *lo, long *hi) {
+    char *end;
+
+    *lo = strtol(s, &end, 10);
+    if (end == s || *lo < 0 || *lo >= CPU_SETSIZE)
+	return NULL;
+    *hi = *lo;
+    if (*end == '-') {
+	s = end + 1;
+	*hi = strtol(s, &end, 10);
+	if (end == s || *hi < *lo || *hi >= CPU_SETSIZE)
+	    return NULL;
+    }
+    return end;
+}
+
+int affinity_set(enum affinity_class cls, const char *cpus) {
+    struct cpulist *list = &cpulists[cls];
+    const char *s;
+    long lo, hi;
+    int n = 0;
+
+    /* counted first, then stored */
+    for (s = cpus; ; s++) {
+	s = parserange(s, &lo, &hi);
+	if (!s || (*s && *s != ','))
+	    return 0;
+	n += hi - lo + 1;
+	if (!*s)
+	    break;
+    }
+    if (!pinning && sched_getaffinity(0, sizeof(startcpus), &startcpus)) {
+	debugerrno(errno, DBG_ERR, "affinity_set: sched_getaffinity failed");
+	return 0;
+    }
+    pinning = 1;
+    free(list->cpus);
+    list->cpus = malloc(n * sizeof(int));
+    if (!list->cpus) {
+	debug(DBG_ERR, "malloc failed");
+	return 0;
+    }
+    list->n = 0;
+    for (s = cpus; ; s++) {
+	s = parserange(s, &lo, &hi);
+	for (; lo <= hi; lo++) {
+	    if (!CPU_ISSET(lo, &startcpus)) {
+		debug(DBG_ERR, "affinity_set: CPU %ld is not available to the process", lo);
+		return 0;
+	    }
+	    list->cpus[list->n++] = lo;
+	}
+	if (!*s)
+	    break;
+    }
+    return 1;
+}
+
+int affinity_create(pthread_t *th, enum affinity_class cls, void *(*start)(void *), void *arg) {
+    struct cpulist *list = &cpulists[cls];
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    int cpu, r;
+
+    if (!pinning)
+	return pthread_create(th, &pthread_attr, start, arg);
+    if (list->n) {
+	cpu = list->cpus[__atomic_fetch_add(&list->next, 1, __ATOMIC_RELAXED) % list->n];
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	debug(DBG_DBG, "affinity_create: starting thread on CPU %d", cpu);
+    } else
+	cpus = startcpus;
+    /* pthread_attr can't be copied, so is made again */
+    r = pthread_attr_init(&attr);
+    if (r)
+	return r;
+    r = pthread_attr_setstacksize(&attr, PTHREAD_STACK_SIZE);
+    if (!r)
+	r = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    if (!r)
+	r = pthread_create(th, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    return r;
+}
+#else
+int affinity_set(enum affinity_class cls, const char *cpus) {
+    debug(DBG_ERR, "affinity_set: pinning threads to CPUs is not supported on this platform");
+    return 0;
+}
+
+int affinity_create(pthread_t *th, enum affinity_class cls, void *(*start)(void *), void *arg) {
+    return pthread_create(th, &pthread_attr, start, arg);
+}
+#endif
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,34 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <pthread.h>
+
+/* Pinning of threads to CPUs. Each class of threads is given a list
+ * of CPUs, and every thread of the class started is pinned to the
+ * next CPU of the list in turn; threads it starts in turn stay on the
+ * same CPU. Memory being placed on the NUMA node of the thread first
+ * touching it, a thread pinned before it runs gets its thread pools,
+ * queues and dupcaches on its own node. pthread_attr must be set up
+ * first. */
+
+enum affinity_class {
+    AFFINITY_LISTENER, /* the listeners, each socket of ListenWorkers */
+    AFFINITY_UPSTREAM, /* clientwr, and the readers of server replies */
+    AFFINITY_WORKER, /* IOWorkers, HandshakeWorkers and the threads of
+		      * TCP and TLS clients */
+    AFFINITY_CLASSES
+};
+
+/* sets the CPUs of cls from a list like 0-3,8; returns 1 if ok, 0 if
+ * the list is invalid or pinning is not supported here */
+int affinity_set(enum affinity_class cls, const char *cpus);
+
+/* starts a thread of cls, like pthread_create() with pthread_attr,
+ * returning what that returns. If any class has CPUs set, a thread of
+ * a class without is given all the CPUs the process started with,
+ * rather than those of the thread starting it. */
+int affinity_create(pthread_t *th, enum affinity_class cls, void *(*start)(void *), void *arg);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
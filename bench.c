@@ -0,0 +1,631 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+/* radsecproxy-bench sends RADIUS requests to a proxy over UDP, TCP,
+ * TLS or DTLS, keeping a window of them outstanding on each of a
+ * number of connections, and reports the rate of the replies and
+ * their latency. It can also answer as the server the proxy forwards
+ * to, over UDP, so that the whole path can be measured on one host. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include "radsecproxy.h"
+#include "debug.h"
+#include "pool.h"
+
+enum transport { T_UDP, T_TCP, T_TLS, T_DTLS };
+
+static struct {
+    enum transport transport;
+    char *host, *port;
+    char *secret, *rsecret;
+    char *user;
+    char *responder;
+    char *cafile, *certfile, *keyfile;
+    uint8_t acct;
+    uint32_t requests, window, conns, timeout;
+} opts;
+static struct radsecret secret, rsecret;
+
+static SSL_CTX *sslctx;
+static struct addrinfo *target;
+
+/* the requests of one connection waiting for a reply, by id */
+struct pending {
+    uint8_t used;
+    uint8_t auth[16];
+    struct timespec sent;
+};
+
+struct conn {
+    int s;
+    SSL *ssl;
+    uint32_t quota; /* requests to send */
+    uint32_t sent, replies, timeouts, invalid, outstanding;
+    struct pending pending[256];
+    uint8_t freeids[256];
+    uint16_t freehead, nfree;
+    uint8_t rbuf[65536 + 4096];
+    int rlen;
+    uint32_t *latency; /* in microseconds, one per reply */
+    unsigned int seed;
+};
+
+static void usage() {
+    fprintf(stderr,
+	    "usage: radsecproxy-bench [-t udp|tcp|tls|dtls] [-n requests] [-w window] [-p connections]\n"
+	    "                         [-s secret] [-u user] [-a] [-T timeout] [-C cafile] [-c certfile]\n"
+	    "                         [-k keyfile] [-r [host:]port [-S secret]] [host:port]\n");
+    exit(1);
+}
+
+static double elapsed(struct timespec *from, struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* splits [host:]port, with [] around IPv6 addresses */
+static int splithostport(char *arg, char **host, char **port) {
+    char *p;
+
+    if (*arg == '[') {
+	p = strchr(arg, ']');
+	if (!p || p[1] != ':')
+	    return 0;
+	*p = '\0';
+	*host = arg + 1;
+	*port = p + 2;
+	return 1;
+    }
+    p = strrchr(arg, ':');
+    if (!p) {
+	*host = NULL;
+	*port = arg;
+	return 1;
+    }
+    *p = '\0';
+    *host = arg;
+    *port = p + 1;
+    return 1;
+}
+
+static struct addrinfo *resolve(char *host, char *port, int socktype, int passive) {
+    struct addrinfo hints, *res;
+    int err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = socktype;
+    hints.ai_family = AF_UNSPEC;
+    if (passive)
+	hints.ai_flags = AI_PASSIVE;
+    err = getaddrinfo(host, port, &hints, &res);
+    if (err) {
+	fprintf(stderr, "radsecproxy-bench: %s: %s\n", host ? host : port, gai_strerror(err));
+	return NULL;
+    }
+    return res;
+}
+
+static void sslerrors(const char *what) {
+    unsigned long error;
+
+    while ((error = ERR_get_error()))
+	fprintf(stderr, "radsecproxy-bench: %s: %s\n", what, ERR_error_string(error, NULL));
+}
+
+static int createsslctx() {
+    sslctx = SSL_CTX_new(opts.transport == T_TLS ? TLS_client_method() : DTLS_client_method());
+    if (!sslctx)
+	return 0;
+    if (opts.cafile) {
+	if (!SSL_CTX_load_verify_locations(sslctx, opts.cafile, NULL))
+	    return 0;
+	SSL_CTX_set_verify(sslctx, SSL_VERIFY_PEER, NULL);
+    }
+    if (opts.certfile && !SSL_CTX_use_certificate_chain_file(sslctx, opts.certfile))
+	return 0;
+    if (opts.keyfile && !SSL_CTX_use_PrivateKey_file(sslctx, opts.keyfile, SSL_FILETYPE_PEM))
+	return 0;
+    return 1;
+}
+
+static int connectconn(struct conn *c) {
+    BIO *bio;
+    int rcvbuf = 1 << 20;
+    int stream = opts.transport == T_TCP || opts.transport == T_TLS;
+
+    c->s = socket(target->ai_family, stream ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (c->s < 0 || connect(c->s, target->ai_addr, target->ai_addrlen)) {
+	perror("radsecproxy-bench: connect");
+	return 0;
+    }
+    if (!stream)
+	setsockopt(c->s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (opts.transport == T_TLS || opts.transport == T_DTLS) {
+	c->ssl = SSL_new(sslctx);
+	if (!c->ssl)
+	    return 0;
+	if (opts.transport == T_TLS)
+	    SSL_set_fd(c->ssl, c->s);
+	else {
+	    bio = BIO_new_dgram(c->s, BIO_NOCLOSE);
+	    if (!bio)
+		return 0;
+	    BIO_ctrl(bio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, target->ai_addr);
+	    SSL_set_bio(c->ssl, bio, bio);
+	}
+	if (SSL_connect(c->ssl) <= 0) {
+	    sslerrors("SSL_connect");
+	    return 0;
+	}
+    }
+    return !fcntl(c->s, F_SETFL, fcntl(c->s, F_GETFL, 0) | O_NONBLOCK);
+}
+
+static void waitfor(struct conn *c, short events) {
+    struct pollfd pfd;
+
+    pfd.fd = c->s;
+    pfd.events = events;
+    poll(&pfd, 1, 1000);
+}
+
+static int writeall(struct conn *c, uint8_t *buf, int len) {
+    int n;
+
+    while (len) {
+	if (c->ssl) {
+	    n = SSL_write(c->ssl, buf, len);
+	    if (n <= 0) {
+		switch (SSL_get_error(c->ssl, n)) {
+		case SSL_ERROR_WANT_READ:
+		    waitfor(c, POLLIN);
+		    continue;
+		case SSL_ERROR_WANT_WRITE:
+		    waitfor(c, POLLOUT);
+		    continue;
+		default:
+		    sslerrors("SSL_write");
+		    return 0;
+		}
+	    }
+	} else {
+	    n = send(c->s, buf, len, 0);
+	    if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		    waitfor(c, POLLOUT);
+		    continue;
+		}
+		/* a UDP peer not listening yet */
+		if (errno == ECONNREFUSED && (opts.transport == T_UDP || opts.transport == T_DTLS))
+		    return 1;
+		perror("radsecproxy-bench: send");
+		return 0;
+	    }
+	}
+	buf += n;
+	len -= n;
+    }
+    return 1;
+}
+
+/* returns the number of bytes read, 0 if none now, -1 if closed */
+static int readsome(struct conn *c) {
+    int n;
+
+    if (c->ssl) {
+	n = SSL_read(c->ssl, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+	if (n > 0)
+	    return n;
+	switch (SSL_get_error(c->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    return 0;
+	default:
+	    sslerrors("SSL_read");
+	    return -1;
+	}
+    }
+    n = recv(c->s, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+    if (n > 0)
+	return n;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED))
+	return 0;
+    return -1;
+}
+
+static int sendrequest(struct conn *c) {
+    struct radmsg *msg;
+    struct pending *p;
+    uint8_t id, auth[16], *buf, zero[16], status[4];
+    char user[256];
+    int i, ok;
+
+    id = c->freeids[c->freehead];
+    c->freehead = (c->freehead + 1) % 256;
+    c->nfree--;
+
+    for (i = 0; i < 16; i++)
+	auth[i] = rand_r(&c->seed);
+    memset(zero, 0, sizeof(zero));
+    msg = radmsg_init(opts.acct ? RAD_Accounting_Request : RAD_Access_Request, id, opts.acct ? zero : auth);
+    if (!msg)
+	return 0;
+    snprintf(user, sizeof(user), "%u-%s", c->sent, opts.user);
+    ok = radmsg_add(msg, maketlv(RAD_Attr_User_Name, strlen(user), user));
+    if (opts.acct) {
+	/* Acct-Status-Type Interim-Update */
+	status[0] = status[1] = status[2] = 0;
+	status[3] = 3;
+	ok = ok && radmsg_add(msg, maketlv(40, 4, status));
+	ok = ok && radmsg_add(msg, maketlv(44, strlen(user), user));
+    } else
+	ok = ok && radmsg_add(msg, maketlv(RAD_Attr_Message_Authenticator, 16, zero));
+    buf = ok ? radmsg2buf(msg, &secret) : NULL;
+    if (!buf) {
+	radmsg_free(msg);
+	return 0;
+    }
+
+    p = &c->pending[id];
+    p->used = 1;
+    memcpy(p->auth, msg->auth, 16);
+    clock_gettime(CLOCK_MONOTONIC, &p->sent);
+    radmsg_free(msg);
+    c->sent++;
+    c->outstanding++;
+    ok = writeall(c, buf, RADLEN(buf));
+    radbuf_free(buf);
+    return ok;
+}
+
+static void freeid(struct conn *c, uint8_t id) {
+    c->pending[id].used = 0;
+    c->freeids[(c->freehead + c->nfree) % 256] = id;
+    c->nfree++;
+    c->outstanding--;
+}
+
+static void gotreply(struct conn *c, uint8_t *rad, int len) {
+    struct pending *p = &c->pending[rad[1]];
+    struct radmsg *msg;
+    struct timespec now;
+    uint8_t *buf;
+
+    if (!p->used) {
+	c->invalid++;
+	return;
+    }
+    buf = radbuf_alloc(len);
+    if (!buf)
+	return;
+    memcpy(buf, rad, len);
+    msg = buf2radmsg(buf, &secret, p->auth);
+    if (!msg) {
+	radbuf_free(buf);
+	c->invalid++;
+	return;
+    }
+    radmsg_free(msg);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    c->latency[c->replies++] = (uint32_t)(elapsed(&p->sent, &now) * 1e6);
+    freeid(c, rad[1]);
+}
+
+/* takes the replies out of what has been read */
+static void gotbytes(struct conn *c, int n) {
+    int pos = 0, len;
+
+    c->rlen += n;
+    while (c->rlen - pos >= 20) {
+	len = RADLEN(c->rbuf + pos);
+	if (len < 20) {
+	    c->rlen = 0;
+	    return;
+	}
+	if (c->rlen - pos < len)
+	    break;
+	gotreply(c, c->rbuf + pos, len);
+	pos += len;
+    }
+    /* a datagram is one packet */
+    if (opts.transport == T_UDP || opts.transport == T_DTLS)
+	pos = c->rlen;
+    c->rlen -= pos;
+    memmove(c->rbuf, c->rbuf + pos, c->rlen);
+}
+
+static void expire(struct conn *c) {
+    struct timespec now;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (i = 0; i < 256; i++)
+	if (c->pending[i].used && elapsed(&c->pending[i].sent, &now) > opts.timeout) {
+	    c->timeouts++;
+	    freeid(c, i);
+	}
+}
+
+static void *runconn(void *arg) {
+    struct conn *c = (struct conn *)arg;
+    struct pollfd pfd;
+    struct timespec last, now;
+    int i, n;
+
+    if (!connectconn(c))
+	return NULL;
+    for (i = 0; i < 256; i++)
+	c->freeids[i] = i;
+    c->nfree = 256;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+
+    while (c->sent < c->quota || c->outstanding) {
+	while (c->sent < c->quota && c->outstanding < opts.window && c->nfree)
+	    if (!sendrequest(c))
+		return NULL;
+	if (!c->ssl || !SSL_pending(c->ssl)) {
+	    pfd.fd = c->s;
+	    pfd.events = POLLIN;
+	    poll(&pfd, 1, 100);
+	}
+	while ((n = readsome(c)) > 0)
+	    gotbytes(c, n);
+	if (n < 0) {
+	    fprintf(stderr, "radsecproxy-bench: connection closed\n");
+	    break;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (elapsed(&last, &now) > 0.1) {
+	    expire(c);
+	    last = now;
+	}
+    }
+    if (c->ssl)
+	SSL_shutdown(c->ssl);
+    return NULL;
+}
+
+/* Answers every Access-Request with an Access-Accept, and every
+ * Accounting-Request with an Accounting-Response. */
+static void *responder(void *arg) {
+    int s = *(int *)arg;
+    struct sockaddr_storage from;
+    socklen_t fromlen;
+    struct radmsg *msg, *reply;
+    uint8_t *buf, *rbuf;
+    int n;
+
+    for (;;) {
+	buf = radbuf_alloc(4096);
+	if (!buf)
+	    return NULL;
+	fromlen = sizeof(from);
+	n = recvfrom(s, buf, 4096, 0, (struct sockaddr *)&from, &fromlen);
+	if (n < 20 || RADLEN(buf) > n) {
+	    radbuf_free(buf);
+	    continue;
+	}
+	msg = buf2radmsg(buf, &rsecret, NULL);
+	if (!msg) {
+	    radbuf_free(buf);
+	    continue;
+	}
+	reply = NULL;
+	if (msg->code == RAD_Access_Request)
+	    reply = radmsg_init(RAD_Access_Accept, msg->id, msg->auth);
+	else if (msg->code == RAD_Accounting_Request)
+	    reply = radmsg_init(RAD_Accounting_Response, msg->id, msg->auth);
+	radmsg_free(msg);
+	if (!reply)
+	    continue;
+	rbuf = radmsg2buf(reply, &rsecret);
+	radmsg_free(reply);
+	if (rbuf) {
+	    sendto(s, rbuf, RADLEN(rbuf), 0, (struct sockaddr *)&from, fromlen);
+	    radbuf_free(rbuf);
+	}
+    }
+    return NULL;
+}
+
+static int startresponder() {
+    static int s;
+    int rcvbuf = 4 << 20;
+    struct addrinfo *res;
+    char *host, *port;
+    pthread_t th;
+
+    if (!splithostport(opts.responder, &host, &port))
+	return 0;
+    res = resolve(host, port, SOCK_DGRAM, 1);
+    if (!res)
+	return 0;
+    s = socket(res->ai_family, SOCK_DGRAM, 0);
+    if (s < 0 || bind(s, res->ai_addr, res->ai_addrlen)) {
+	perror("radsecproxy-bench: bind");
+	return 0;
+    }
+    /* what the proxy sends in a burst should not be dropped here */
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    freeaddrinfo(res);
+    return !pthread_create(&th, NULL, responder, &s);
+}
+
+static int cmplatency(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(uint32_t *sorted, uint32_t n, double p) {
+    return n ? sorted[(uint32_t)((n - 1) * p)] / 1000.0 : 0;
+}
+
+static void report(struct conn *conns, double secs) {
+    uint32_t sent = 0, replies = 0, timeouts = 0, invalid = 0, i, n = 0, *all;
+
+    for (i = 0; i < opts.conns; i++) {
+	sent += conns[i].sent;
+	replies += conns[i].replies;
+	timeouts += conns[i].timeouts;
+	invalid += conns[i].invalid;
+    }
+    all = malloc((replies ? replies : 1) * sizeof(uint32_t));
+    if (!all)
+	return;
+    for (i = 0; i < opts.conns; i++) {
+	memcpy(all + n, conns[i].latency, conns[i].replies * sizeof(uint32_t));
+	n += conns[i].replies;
+    }
+    qsort(all, n, sizeof(uint32_t), cmplatency);
+    printf("%u requests, %u replies, %u timeouts, %u invalid in %.2f s\n", sent, replies, timeouts, invalid, secs);
+    printf("%.0f replies/s, latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms, max %.3f ms\n",
+	   secs > 0 ? replies / secs : 0, percentile(all, n, 0.5), percentile(all, n, 0.99),
+	   percentile(all, n, 0.999), n ? all[n - 1] / 1000.0 : 0);
+    free(all);
+}
+
+int main(int argc, char **argv) {
+    struct conn *conns;
+    pthread_t *ths;
+    struct timespec start, end;
+    char *hostport = NULL;
+    uint32_t i;
+    int c;
+
+    debug_init("radsecproxy-bench");
+    debug_set_level(2);
+    opts.requests = 10000;
+    opts.window = 100;
+    opts.conns = 1;
+    opts.timeout = 5;
+    opts.user = "bench@example.org";
+
+    while ((c = getopt(argc, argv, "t:n:w:p:s:S:u:aT:C:c:k:r:h")) != -1) {
+	switch (c) {
+	case 't':
+	    if (!strcasecmp(optarg, "udp"))
+		opts.transport = T_UDP;
+	    else if (!strcasecmp(optarg, "tcp"))
+		opts.transport = T_TCP;
+	    else if (!strcasecmp(optarg, "tls"))
+		opts.transport = T_TLS;
+	    else if (!strcasecmp(optarg, "dtls"))
+		opts.transport = T_DTLS;
+	    else
+		usage();
+	    break;
+	case 'n':
+	    opts.requests = atoi(optarg);
+	    break;
+	case 'w':
+	    opts.window = atoi(optarg);
+	    if (opts.window < 1 || opts.window > 256)
+		usage();
+	    break;
+	case 'p':
+	    opts.conns = atoi(optarg);
+	    if (opts.conns < 1)
+		usage();
+	    break;
+	case 's':
+	    opts.secret = optarg;
+	    break;
+	case 'S':
+	    opts.rsecret = optarg;
+	    break;
+	case 'u':
+	    opts.user = optarg;
+	    break;
+	case 'a':
+	    opts.acct = 1;
+	    break;
+	case 'T':
+	    opts.timeout = atoi(optarg);
+	    break;
+	case 'C':
+	    opts.cafile = optarg;
+	    break;
+	case 'c':
+	    opts.certfile = optarg;
+	    break;
+	case 'k':
+	    opts.keyfile = optarg;
+	    break;
+	case 'r':
+	    opts.responder = optarg;
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind < argc)
+	hostport = argv[optind++];
+    if (optind < argc || (!hostport && !opts.responder))
+	usage();
+    if (!opts.secret)
+	opts.secret = opts.transport == T_TLS || opts.transport == T_DTLS ? "radsec" : "testing123";
+    if (!opts.rsecret)
+	opts.rsecret = opts.secret;
+    radsecret_init(&secret, opts.secret);
+    radsecret_init(&rsecret, opts.rsecret);
+
+    if (opts.responder && !startresponder())
+	exit(1);
+    if (!hostport) {
+	/* just answering */
+	for (;;)
+	    pause();
+    }
+
+    if (!splithostport(hostport, &opts.host, &opts.port))
+	usage();
+    target = resolve(opts.host, opts.port, opts.transport == T_TCP || opts.transport == T_TLS ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (!target)
+	exit(1);
+    if ((opts.transport == T_TLS || opts.transport == T_DTLS) && !createsslctx()) {
+	sslerrors("SSL_CTX");
+	exit(1);
+    }
+
+    conns = calloc(opts.conns, sizeof(struct conn));
+    ths = calloc(opts.conns, sizeof(pthread_t));
+    if (!conns || !ths)
+	exit(1);
+    for (i = 0; i < opts.conns; i++) {
+	conns[i].quota = opts.requests / opts.conns + (i < opts.requests % opts.conns);
+	conns[i].latency = malloc((conns[i].quota ? conns[i].quota : 1) * sizeof(uint32_t));
+	conns[i].seed = getpid() + i;
+	if (!conns[i].latency)
+	    exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < opts.conns; i++)
+	if (pthread_create(&ths[i], NULL, runconn, &conns[i]))
+	    exit(1);
+    for (i = 0; i < opts.conns; i++)
+	pthread_join(ths[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    report(conns, elapsed(&start, &end));
+    return 0;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
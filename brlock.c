@@ -0,0 +1,70 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include "brlock.h"
+
+static pthread_once_t keyonce = PTHREAD_ONCE_INIT;
+static pthread_key_t slotkey;
+static uint8_t keyok;
+static uint32_t nextslot;
+
+static void createkey() {
+    keyok = !pthread_key_create(&slotkey, NULL);
+}
+
+/* returns the slot of the calling thread, the same for all locks;
+ * threads are given the slots in turn */
+static uint32_t getslot() {
+    uintptr_t slot;
+
+    pthread_once(&keyonce, createkey);
+    if (!keyok)
+	return 0;
+    slot = (uintptr_t)pthread_getspecific(slotkey);
+    if (!slot) {
+	slot = __atomic_fetch_add(&nextslot, 1, __ATOMIC_RELAXED) % BRLOCK_SLOTS + 1;
+	pthread_setspecific(slotkey, (void *)slot);
+    }
+    return slot - 1;
+}
+
+void brlock_rdlock(struct brlock *l) {
+    uint32_t *readers = &l->slots[getslot()].readers;
+
+    for (;;) {
+	/* counted before looking at writing, while the writer sets
+	 * writing before looking at the counters */
+	__atomic_add_fetch(readers, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&l->writing, __ATOMIC_SEQ_CST))
+	    return;
+	__atomic_sub_fetch(readers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&l->lock);
+	pthread_mutex_unlock(&l->lock);
+    }
+}
+
+void brlock_rdunlock(struct brlock *l) {
+    __atomic_sub_fetch(&l->slots[getslot()].readers, 1, __ATOMIC_RELEASE);
+}
+
+void brlock_wrlock(struct brlock *l) {
+    int i;
+
+    pthread_mutex_lock(&l->lock);
+    __atomic_store_n(&l->writing, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < BRLOCK_SLOTS; i++)
+	while (__atomic_load_n(&l->slots[i].readers, __ATOMIC_SEQ_CST))
+	    sched_yield();
+}
+
+void brlock_wrunlock(struct brlock *l) {
+    __atomic_store_n(&l->writing, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
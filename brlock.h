@@ -0,0 +1,39 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <pthread.h>
+
+/* A reader-writer lock for what is read from many threads at once and
+ * written rarely. Every thread counts itself as a reader in one of
+ * BRLOCK_SLOTS counters, each on a cache line of its own, so readers
+ * on different cores don't write to the same memory. A writer waits
+ * for all counters to drain, and readers coming meanwhile wait for the
+ * writer. Readers must not take the lock again, nor for writing. */
+
+#define BRLOCK_SLOTS 32
+
+struct brlock_slot {
+    uint32_t readers;
+} __attribute__ ((aligned (64)));
+
+struct brlock {
+    struct brlock_slot slots[BRLOCK_SLOTS];
+    uint32_t writing;
+    pthread_mutex_t lock; /* held by the writer */
+};
+
+#define BRLOCK_INITIALIZER { { { 0 } }, 0, PTHREAD_MUTEX_INITIALIZER }
+
+void brlock_rdlock(struct brlock *l);
+void brlock_rdunlock(struct brlock *l);
+void brlock_wrlock(struct brlock *l);
+void brlock_wrunlock(struct brlock *l);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -7,6 +7,7 @@
 #endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <strings.h>
@@ -15,16 +16,69 @@
 #include <syslog.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include "debug.h"
 #include "util.h"
 
 static char *debug_ident = NULL;
-static uint8_t debug_level = DBG_INFO;
+uint8_t debug_level = DBG_INFO;
 static char *debug_filepath = NULL;
 static FILE *debug_file = NULL;
 static int debug_syslogfacility = 0;
 static int fticks_syslogfacility = 0;
 static uint8_t debug_timestamp = 0;
+static jmp_buf *exitcatch; /* see debug_catchexit() */
+static pthread_t exitcatcher;
+
+/* Once debug_async_on() is called, log lines are put in a ring buffer
+ * of the calling thread and written by a flusher thread, so that the
+ * packet handling threads never wait for syslog or the disk. Each
+ * ring has one writer, its thread, and one reader, whoever holds
+ * writelock, so no locking is needed to put a line. Lines that don't
+ * fit in the ring are counted and dropped. Records are aligned to 8
+ * bytes, ends of the ring too short for a record header are skipped.
+ * The flusher looks at the rings every 20 ms, or when woken by a
+ * thread whose ring got half full. */
+#define LOGRING_SIZE 65536
+#define LOGLINE_MAX 1024
+#define LOGOUT_SIZE 65536
+
+#define LOGREC_DEBUG 0
+#define LOGREC_FTICKS 1
+#define LOGREC_PAD 2
+
+struct logrec {
+    uint32_t len; /* of the record including this header */
+    uint8_t kind;
+    uint8_t level;
+    uint64_t seq;
+    time_t sec;
+    char msg[];
+};
+
+struct logring {
+    struct logring *next;
+    uint32_t head, tail; /* offsets that only grow, head is the reader's */
+    uint8_t dead; /* the thread has exited, free when drained */
+    char buf[LOGRING_SIZE];
+};
+
+static uint8_t debug_async = 0;
+static pthread_once_t ringkeyonce = PTHREAD_ONCE_INIT;
+static pthread_key_t ringkey;
+static uint8_t ringkeyok;
+static pthread_mutex_t ringslock = PTHREAD_MUTEX_INITIALIZER;
+static struct logring *rings;
+static uint64_t logseq, logdropped;
+
+/* held while writing to the log, and while reading the rings */
+static pthread_mutex_t writelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flushermutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flushercond = PTHREAD_COND_INITIALIZER;
+static char logout[LOGOUT_SIZE];
+static size_t logoutlen;
+static time_t timebufsec;
+static char timebuf[32];
 
 void debug_init(char *ident) {
     debug_file = stderr;
@@ -119,6 +173,7 @@ int debug_set_destination(char *dest, int log_type) {
 
 void debug_reopen_log() {
     extern int errno;
+    int err = 0;
 
     /* not a file, noop, return success */
     if (!debug_filepath) {
@@ -126,116 +181,380 @@ void debug_reopen_log() {
 	return;
     }
 
+    /* the flusher may be writing to the file */
+    pthread_mutex_lock(&writelock);
     if (debug_file != stderr)
 	fclose(debug_file);
 
     debug_file = fopen(debug_filepath, "a");
-    if (debug_file)
-	debug(DBG_ERR, "Reopened logfile %s", debug_filepath);
-    else {
+    if (!debug_file) {
+	err = errno;
 	debug_file = stderr;
-	debug(DBG_ERR, "Failed to open logfile %s, using stderr\n%s",
-	      debug_filepath, strerror(errno));
     }
     setvbuf(debug_file, NULL, _IONBF, 0);
+    pthread_mutex_unlock(&writelock);
+
+    if (!err)
+	debug(DBG_ERR, "Reopened logfile %s", debug_filepath);
+    else
+	debug(DBG_ERR, "Failed to open logfile %s, using stderr\n%s",
+	      debug_filepath, strerror(err));
 }
 
-void debug_logit(uint8_t level, const char *format, va_list ap) {
-    struct timeval now;
-    char *timebuf;
-    int priority;
+static int level2priority(uint8_t level) {
+    switch (level) {
+    case DBG_INFO:
+	return LOG_INFO;
+    case DBG_NOTICE:
+	return LOG_NOTICE;
+    case DBG_WARN:
+	return LOG_WARNING;
+    case DBG_ERR:
+	return LOG_ERR;
+    default:
+	return LOG_DEBUG;
+    }
+}
+
+/* must hold writelock */
+static void flushlogout() {
+    if (logoutlen)
+	fwrite(logout, 1, logoutlen, debug_file);
+    logoutlen = 0;
+}
 
+/* writes one line, file output is gathered in logout until
+ * flushlogout(); must hold writelock */
+static void logline(uint8_t kind, uint8_t level, time_t sec, const char *msg, size_t len) {
+    char t[32];
+
+    if (kind == LOGREC_FTICKS && (debug_syslogfacility || fticks_syslogfacility)) {
+	syslog(LOG_DEBUG | fticks_syslogfacility, "%s", msg);
+	return;
+    }
     if (debug_syslogfacility) {
-	switch (level) {
-	case DBG_DBG:
-	    priority = LOG_DEBUG;
-	    break;
-	case DBG_INFO:
-	    priority = LOG_INFO;
-	    break;
-	case DBG_NOTICE:
-	    priority = LOG_NOTICE;
-	    break;
-	case DBG_WARN:
-	    priority = LOG_WARNING;
-	    break;
-	case DBG_ERR:
-	    priority = LOG_ERR;
-	    break;
-	default:
-	    priority = LOG_DEBUG;
+	syslog(level2priority(level), "%s", msg);
+	return;
+    }
+    if (logoutlen + sizeof(timebuf) + len + 1 > sizeof(logout))
+	flushlogout();
+    if (debug_timestamp) {
+	/* formatted once a second */
+	if (sec != timebufsec) {
+	    ctime_r(&sec, t);
+	    t[strlen(t) - 1] = '\0';
+	    snprintf(timebuf, sizeof(timebuf), "%s: ", t + 4);
+	    timebufsec = sec;
+	}
+	logoutlen += sprintf(logout + logoutlen, "%s", timebuf);
+    }
+    if (len + 1 > sizeof(logout) - logoutlen) {
+	flushlogout();
+	fwrite(msg, 1, len, debug_file);
+	fputc('\n', debug_file);
+	return;
+    }
+    memcpy(logout + logoutlen, msg, len);
+    logoutlen += len;
+    logout[logoutlen++] = '\n';
+}
+
+static void freering(void *arg) {
+    __atomic_store_n(&((struct logring *)arg)->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void createringkey() {
+    ringkeyok = !pthread_key_create(&ringkey, freering);
+}
+
+/* returns the ring of the calling thread, or NULL if it can't be had */
+static struct logring *getring() {
+    struct logring *r;
+
+    pthread_once(&ringkeyonce, createringkey);
+    if (!ringkeyok)
+	return NULL;
+    r = (struct logring *)pthread_getspecific(ringkey);
+    if (r)
+	return r;
+    r = malloc(sizeof(struct logring));
+    if (!r)
+	return NULL;
+    memset(r, 0, offsetof(struct logring, buf));
+    if (pthread_setspecific(ringkey, r)) {
+	free(r);
+	return NULL;
+    }
+    pthread_mutex_lock(&ringslock);
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&ringslock);
+    return r;
+}
+
+/* puts a line in the ring of the calling thread, returns 0 if there
+ * is no ring */
+static int ringput(uint8_t kind, uint8_t level, const char *msg, size_t len) {
+    struct logring *r;
+    struct logrec *rec;
+    uint32_t head, tail, pos, need, skip;
+
+    r = getring();
+    if (!r)
+	return 0;
+    need = (sizeof(struct logrec) + len + 1 + 7) & ~7;
+    tail = r->tail;
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    pos = tail % LOGRING_SIZE;
+    skip = LOGRING_SIZE - pos < need ? LOGRING_SIZE - pos : 0;
+    if (LOGRING_SIZE - (tail - head) < skip + need) {
+	__atomic_add_fetch(&logdropped, 1, __ATOMIC_RELAXED);
+	return 1;
+    }
+    if (skip) {
+	if (skip >= sizeof(struct logrec)) {
+	    rec = (struct logrec *)(r->buf + pos);
+	    rec->len = skip;
+	    rec->kind = LOGREC_PAD;
 	}
-	vsyslog(priority, format, ap);
-    } else {
-	if (debug_timestamp && (timebuf = malloc(256))) {
-	    gettimeofday(&now, NULL);
-	    ctime_r(&now.tv_sec, timebuf);
-	    timebuf[strlen(timebuf) - 1] = '\0';
-	    fprintf(debug_file, "%s: ", timebuf + 4);
-	    free(timebuf);
+	pos = 0;
+    }
+    rec = (struct logrec *)(r->buf + pos);
+    rec->len = need;
+    rec->kind = kind;
+    rec->level = level;
+    rec->seq = __atomic_add_fetch(&logseq, 1, __ATOMIC_RELAXED);
+    rec->sec = time(NULL);
+    memcpy(rec->msg, msg, len);
+    rec->msg[len] = '\0';
+    __atomic_store_n(&r->tail, tail + skip + need, __ATOMIC_RELEASE);
+    /* signalled without the mutex, a lost wakeup just waits 20 ms */
+    if ((tail - head) < LOGRING_SIZE / 2 && (tail + skip + need - head) >= LOGRING_SIZE / 2)
+	pthread_cond_signal(&flushercond);
+    return 1;
+}
+
+/* returns the next record of r, or NULL if r is empty; skips padding */
+static struct logrec *ringpeek(struct logring *r) {
+    struct logrec *rec;
+    uint32_t pos;
+
+    while (r->head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+	pos = r->head % LOGRING_SIZE;
+	if (LOGRING_SIZE - pos < sizeof(struct logrec)) {
+	    __atomic_store_n(&r->head, r->head + LOGRING_SIZE - pos, __ATOMIC_RELEASE);
+	    continue;
 	}
-	vfprintf(debug_file, format, ap);
-	fprintf(debug_file, "\n");
+	rec = (struct logrec *)(r->buf + pos);
+	if (rec->kind != LOGREC_PAD)
+	    return rec;
+	__atomic_store_n(&r->head, r->head + rec->len, __ATOMIC_RELEASE);
     }
+    return NULL;
 }
 
-void debug(uint8_t level, char *format, ...) {
-    va_list ap;
-    if (level < debug_level)
+/* writes the lines of all rings in the order they were logged, and
+ * frees the rings of exited threads; returns the number of lines
+ * written; must hold writelock */
+static int drainrings() {
+    static uint64_t reported;
+    struct logring *r, **prev, *pending[64], *best;
+    struct logrec *rec, *bestrec;
+    uint64_t dropped;
+    char msg[64];
+    int n, i, lines = 0;
+
+    /* merge the rings with lines pending, up to 64 at a time */
+    pthread_mutex_lock(&ringslock);
+    n = 0;
+    for (r = rings; r && n < 64; r = r->next)
+	if (ringpeek(r))
+	    pending[n++] = r;
+    pthread_mutex_unlock(&ringslock);
+
+    for (;;) {
+	best = NULL;
+	bestrec = NULL;
+	for (i = 0; i < n; i++) {
+	    rec = ringpeek(pending[i]);
+	    if (rec && (!bestrec || rec->seq < bestrec->seq)) {
+		best = pending[i];
+		bestrec = rec;
+	    }
+	}
+	if (!best)
+	    break;
+	logline(bestrec->kind, bestrec->level, bestrec->sec, bestrec->msg, strlen(bestrec->msg));
+	__atomic_store_n(&best->head, best->head + bestrec->len, __ATOMIC_RELEASE);
+	lines++;
+    }
+
+    dropped = __atomic_load_n(&logdropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+	n = snprintf(msg, sizeof(msg), "debug: dropped %llu log messages", (unsigned long long)(dropped - reported));
+	logline(LOGREC_DEBUG, DBG_WARN, time(NULL), msg, n);
+	reported = dropped;
+    }
+    flushlogout();
+
+    pthread_mutex_lock(&ringslock);
+    for (prev = &rings; (r = *prev);) {
+	if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) && !ringpeek(r)) {
+	    *prev = r->next;
+	    free(r);
+	} else
+	    prev = &r->next;
+    }
+    pthread_mutex_unlock(&ringslock);
+    return lines;
+}
+
+static void *flusher(void *arg) {
+    struct timeval now;
+    struct timespec wait;
+    int lines;
+
+    for (;;) {
+	pthread_mutex_lock(&writelock);
+	lines = drainrings();
+	pthread_mutex_unlock(&writelock);
+	if (lines)
+	    continue;
+	gettimeofday(&now, NULL);
+	wait.tv_sec = now.tv_sec;
+	wait.tv_nsec = (now.tv_usec + 20000) * 1000;
+	if (wait.tv_nsec >= 1000000000) {
+	    wait.tv_sec++;
+	    wait.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&flushermutex);
+	pthread_cond_timedwait(&flushercond, &flushermutex, &wait);
+	pthread_mutex_unlock(&flushermutex);
+    }
+    return NULL;
+}
+
+/* writes what is in the rings, for when exiting */
+static void debug_flush() {
+    if (!debug_async)
+	return;
+    pthread_mutex_lock(&writelock);
+    drainrings();
+    pthread_mutex_unlock(&writelock);
+}
+
+int debug_async_on() {
+    pthread_t th;
+
+    if (pthread_create(&th, NULL, flusher, NULL))
+	return 0;
+    pthread_detach(th);
+    atexit(debug_flush);
+    debug_async = 1;
+    return 1;
+}
+
+void debug_forked() {
+    /* the flusher and the threads owning the rings are gone, and
+     * writelock may have been held by one of them */
+    pthread_mutex_init(&writelock, NULL);
+    debug_async = 0;
+    logoutlen = 0;
+}
+
+uint64_t debug_get_dropped() {
+    return __atomic_load_n(&logdropped, __ATOMIC_RELAXED);
+}
+
+/* logs a formatted line, synchronously if sync is set or async
+ * logging is off */
+static void debug_logit(uint8_t kind, uint8_t level, int sync, const char *format, va_list ap) {
+    char msg[LOGLINE_MAX];
+    int len;
+
+    len = vsnprintf(msg, sizeof(msg), format, ap);
+    if (len < 0)
 	return;
+    if ((size_t)len >= sizeof(msg))
+	len = sizeof(msg) - 1;
+    if (!sync && debug_async && ringput(kind, level, msg, len))
+	return;
+    pthread_mutex_lock(&writelock);
+    if (debug_async)
+	drainrings();
+    logline(kind, level, time(NULL), msg, len);
+    flushlogout();
+    pthread_mutex_unlock(&writelock);
+}
+
+/* as debug_logit() with ": " and the error string appended */
+static void debug_logiterrno(int err, uint8_t level, int sync, const char *format, va_list ap) {
+    char fmt[LOGLINE_MAX], errstr[256], *p;
+    const char *s;
+
+    s = strerror_r(err, errstr, sizeof(errstr)) ? "Unknown error" : errstr;
+    if ((size_t)snprintf(fmt, sizeof(fmt), "%s: %s", format, s) >= sizeof(fmt)) {
+	debug_logit(LOGREC_DEBUG, level, sync, format, ap);
+	return;
+    }
+    /* the error string must not be taken for a format */
+    for (p = fmt + strlen(format) + 2; *p; p++)
+	if (*p == '%')
+	    *p = '_';
+    debug_logit(LOGREC_DEBUG, level, sync, fmt, ap);
+}
+
+void debuglog(uint8_t level, char *format, ...) {
+    va_list ap;
     va_start(ap, format);
-    debug_logit(level, format, ap);
+    debug_logit(LOGREC_DEBUG, level, 0, format, ap);
     va_end(ap);
 }
 
-void debugx(int status, uint8_t level, char *format, ...) {
-    if (level >= debug_level) {
-	va_list ap;
-	va_start(ap, format);
-	debug_logit(level, format, ap);
-	va_end(ap);
-    }
+void debug_catchexit(jmp_buf *env) {
+    exitcatcher = pthread_self();
+    exitcatch = env;
+}
+
+/* exits, or jumps back to where the thread asked to catch it */
+static void debug_exit(int status) {
+    if (exitcatch && pthread_equal(exitcatcher, pthread_self()))
+	longjmp(*exitcatch, 1);
     exit(status);
 }
 
-void debugerrno(int err, uint8_t level, char *format, ...) {
+void debugx(int status, uint8_t level, char *format, ...) {
     if (level >= debug_level) {
 	va_list ap;
-	size_t len = strlen(format);
-	char *tmp = malloc(len + 1024 + 2);
-	assert(tmp);
-	strcpy(tmp, format);
-	tmp[len++] = ':';
-	tmp[len++] = ' ';
-	if (strerror_r(err, tmp + len, 1024))
-	    tmp = format;
 	va_start(ap, format);
-	debug_logit(level, tmp, ap);
+	debug_logit(LOGREC_DEBUG, level, 1, format, ap);
 	va_end(ap);
     }
+    debug_exit(status);
+}
+
+void debuglogerrno(int err, uint8_t level, char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    debug_logiterrno(err, level, 0, format, ap);
+    va_end(ap);
 }
 
 void debugerrnox(int err, uint8_t level, char *format, ...) {
     if (level >= debug_level) {
 	va_list ap;
 	va_start(ap, format);
-	debugerrno(err, level, format, ap);
+	debug_logiterrno(err, level, 1, format, ap);
 	va_end(ap);
     }
-    exit(err);
+    debug_exit(err);
 }
 
 void fticks_debug(const char *format, ...) {
-    int priority;
     va_list ap;
     va_start(ap, format);
-    if (!debug_syslogfacility && !fticks_syslogfacility)
-    	debug_logit(0xff, format, ap);
-    else {
-    	priority = LOG_DEBUG | fticks_syslogfacility;
-    	vsyslog(priority, format, ap);
-    	va_end(ap);
-    }
+    debug_logit(LOGREC_FTICKS, 0xff, 0, format, ap);
+    va_end(ap);
 }
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
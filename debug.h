@@ -5,6 +5,7 @@
 #ifndef SYS_SOLARIS9
 #include <stdint.h>
 #endif
+#include <setjmp.h>
 
 #define DBG_DBG 8
 #define DBG_INFO 16
@@ -15,18 +16,46 @@
 #define LOG_TYPE_DEBUG 0
 #define LOG_TYPE_FTICKS 1
 
+/* the lowest level logged, use debug_set_level() to change it */
+extern uint8_t debug_level;
+
+/* debug() and debugerrno() check the level before the arguments are
+ * evaluated. With NO_DEBUGLOG (configure --disable-debuglog) messages
+ * at level DBG_DBG are compiled out altogether. */
+#ifdef NO_DEBUGLOG
+#define DEBUG_ENABLED(level) ((level) != DBG_DBG && (level) >= debug_level)
+#else
+#define DEBUG_ENABLED(level) ((level) >= debug_level)
+#endif
+
+#define debug(level, ...) \
+    do { if (DEBUG_ENABLED(level)) debuglog(level, __VA_ARGS__); } while (0)
+#define debugerrno(err, level, ...) \
+    do { if (DEBUG_ENABLED(level)) debuglogerrno(err, level, __VA_ARGS__); } while (0)
+
 void debug_init(char *ident);
 void debug_set_level(uint8_t level);
 void debug_timestamp_on();
 uint8_t debug_get_level();
-void debug(uint8_t level, char *format, ...);
+void debuglog(uint8_t level, char *format, ...);
 void debugx(int status, uint8_t level, char *format, ...);
-void debugerrno(int err, uint8_t level, char *format, ...);
+void debuglogerrno(int err, uint8_t level, char *format, ...);
 void debugerrnox(int err, uint8_t level, char *format, ...);
 int debug_set_destination(char *dest, int log_type);
 void debug_reopen_log();
 void fticks_debug(const char *format, ...);
 
+/* starts a thread writing the log, after which logging never waits
+ * for the log destination; returns 1 if ok, 0 if the thread can't be
+ * created. Lines that can't be buffered are dropped and counted. */
+int debug_async_on();
+/* to be called in the child after fork(), logs synchronously */
+void debug_forked();
+uint64_t debug_get_dropped();
+/* makes debugx() and debugerrnox() called by this thread longjmp() to
+ * env instead of exiting, until called again with NULL */
+void debug_catchexit(jmp_buf *env);
+
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
 /* End: */
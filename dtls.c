@@ -28,7 +28,9 @@
 #ifdef RADPROT_DTLS
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
 #include "hostport.h"
+#include "affinity.h"
 
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
@@ -36,7 +38,7 @@ void *udpdtlsserverrd(void *arg);
 int dtlsconnect(struct server *server, struct timeval *when, int timeout, char *text);
 void *dtlsclientrd(void *arg);
 int clientradputdtls(struct server *server, unsigned char *rad);
-void addserverextradtls(struct clsrvconf *conf);
+void addserverextradtls(struct server *server);
 void dtlssetsrcres();
 void initextradtls();
 
@@ -59,7 +61,12 @@ static const struct protodefs protodefs = {
     NULL, /* addclient */
     addserverextradtls, /* addserverextra */
     dtlssetsrcres, /* setsrcres */
-    initextradtls /* initextra */
+    initextradtls, /* initextra */
+    NULL, /* serverconnread */
+    NULL, /* serverconnwrite */
+    NULL, /* serverconnclose */
+    NULL, /* clientradflush */
+    NULL /* clientradprobe */
 };
 
 static int client4_sock = -1;
@@ -91,6 +98,7 @@ struct dtlsservernewparams {
     struct sessioncacheentry *sesscache;
     int sock;
     struct sockaddr_storage addr;
+    SSL *ssl;
 };
 
 void dtlssetsrcres() {
@@ -100,30 +108,47 @@ void dtlssetsrcres() {
                                    AF_UNSPEC, NULL, protodefs.socktype);
 }
 
-int udp2bio(int s, struct gqueue *q, int cnt) {
+/* reads the next datagram of cnt bytes into a memory BIO */
+static BIO *udp2membio(int s, int cnt) {
     unsigned char *buf;
-    BIO *rbio;
+    BIO *rbio = NULL;
 
     if (cnt < 1)
-	return 0;
+	return NULL;
 
     buf = malloc(cnt);
     if (!buf) {
 	unsigned char err;
 	debug(DBG_ERR, "udp2bio: malloc failed");
 	recv(s, &err, 1, 0);
-	return 0;
+	return NULL;
     }
 
     cnt = recv(s, buf, cnt, 0);
     if (cnt < 1) {
 	debug(DBG_WARN, "udp2bio: recv failed");
 	free(buf);
-	return 0;
+	return NULL;
+    }
+
+    rbio = BIO_new(BIO_s_mem());
+    if (rbio) {
+	BIO_set_mem_eof_return(rbio, -1);
+	if (BIO_write(rbio, buf, cnt) != cnt) {
+	    BIO_free(rbio);
+	    rbio = NULL;
+	}
     }
+    free(buf);
+    return rbio;
+}
+
+int udp2bio(int s, struct gqueue *q, int cnt) {
+    BIO *rbio;
 
-    rbio = BIO_new_mem_buf(buf, cnt);
-    BIO_set_mem_eof_return(rbio, -1);
+    rbio = udp2membio(s, cnt);
+    if (!rbio)
+	return 0;
 
     pthread_mutex_lock(&q->mutex);
     if (!list_push(q->entries, rbio)) {
@@ -168,7 +193,7 @@ int dtlsread(SSL *ssl, struct gqueue *q, unsigned char *buf, int num, int timeou
 		rbio = getrbio(ssl, q, timeout);
 		if (!rbio)
 		    return 0;
-		BIO_free(SSL_get_rbio(ssl));
+		/* frees the previous rbio */
 		SSL_set_bio(ssl, rbio, SSL_get_wbio(ssl));
 		cnt = 0;
 		continue;
@@ -186,11 +211,9 @@ int dtlsread(SSL *ssl, struct gqueue *q, unsigned char *buf, int num, int timeou
     return num;
 }
 
-/* accept if acc == 1, else connect */
-SSL *dtlsacccon(uint8_t acc, SSL_CTX *ctx, int s, struct sockaddr *addr, struct gqueue *rbios) {
+/* a new SSL talking to addr over s, reading datagrams from memory BIOs */
+static SSL *dtlsnewssl(SSL_CTX *ctx, int s, struct sockaddr *addr) {
     SSL *ssl;
-    int i, res;
-    unsigned long error;
     BIO *mem0bio, *wbio;
 
     ssl = SSL_new(ctx);
@@ -198,27 +221,58 @@ SSL *dtlsacccon(uint8_t acc, SSL_CTX *ctx, int s, struct sockaddr *addr, struct
 	return NULL;
 
     mem0bio = BIO_new(BIO_s_mem());
-    BIO_set_mem_eof_return(mem0bio, -1);
     wbio = BIO_new_dgram(s, BIO_NOCLOSE);
-    i = BIO_dgram_set_peer(wbio, addr); /* i just to avoid warning */
+    if (!mem0bio || !wbio) {
+	BIO_free(mem0bio);
+	BIO_free(wbio);
+	SSL_free(ssl);
+	return NULL;
+    }
+    BIO_set_mem_eof_return(mem0bio, -1);
+    BIO_dgram_set_peer(wbio, addr);
     SSL_set_bio(ssl, mem0bio, wbio);
+    return ssl;
+}
 
-    for (i = 0; i < 5; i++) {
-        res = acc ? SSL_accept(ssl) : SSL_connect(ssl);
-        if (res > 0)
-            return ssl;
-        if (res == 0)
-            break;
-        if (SSL_get_error(ssl, res) == SSL_ERROR_WANT_READ) {
-            BIO_free(SSL_get_rbio(ssl));
-            SSL_set_bio(ssl, getrbio(ssl, rbios, 5), SSL_get_wbio(ssl));
-            if (!SSL_get_rbio(ssl))
-                break;
-        }
-        while ((error = ERR_get_error()))
-            debug(DBG_ERR, "dtls%st: DTLS: %s", acc ? "accep" : "connec", ERR_error_string(error, NULL));
+/* accept if acc == 1, else connect, with the datagrams from rbios,
+ * giving up after HANDSHAKE_TIMEOUT seconds */
+static int dtlshandshake(uint8_t acc, SSL *ssl, struct gqueue *rbios) {
+    int res;
+    unsigned long error;
+    BIO *rbio;
+    struct timeval start, now;
+
+    gettimeofday(&start, NULL);
+    for (now = start; now.tv_sec - start.tv_sec < HANDSHAKE_TIMEOUT; gettimeofday(&now, NULL)) {
+	res = acc ? SSL_accept(ssl) : SSL_connect(ssl);
+	if (res > 0)
+	    return 1;
+	if (res == 0)
+	    break;
+	if (SSL_get_error(ssl, res) == SSL_ERROR_WANT_READ) {
+	    rbio = getrbio(ssl, rbios, 5);
+	    if (!rbio)
+		break;
+	    /* frees the previous rbio */
+	    SSL_set_bio(ssl, rbio, SSL_get_wbio(ssl));
+	}
+	while ((error = ERR_get_error()))
+	    debug(DBG_ERR, "dtls%st: DTLS: %s", acc ? "accep" : "connec", ERR_error_string(error, NULL));
     }
+    return 0;
+}
 
+/* accept if acc == 1, else connect, resuming a session with server */
+SSL *dtlsacccon(uint8_t acc, SSL_CTX *ctx, int s, struct sockaddr *addr, struct gqueue *rbios, struct server *server) {
+    SSL *ssl;
+
+    ssl = dtlsnewssl(ctx, s, addr);
+    if (!ssl)
+	return NULL;
+    if (server)
+	tlssetsession(ssl, server);
+    if (dtlshandshake(acc, ssl, rbios))
+	return ssl;
     SSL_free(ssl);
     return NULL;
 }
@@ -239,7 +293,7 @@ unsigned char *raddtlsget(SSL *ssl, struct gqueue *rbios, int timeout) {
 	    debug(DBG_ERR, "raddtlsget: length too small");
 	    continue;
 	}
-	rad = malloc(len);
+	rad = radbuf_alloc(len);
 	if (!rad) {
 	    debug(DBG_ERR, "raddtlsget: malloc failed");
 	    continue;
@@ -249,14 +303,14 @@ unsigned char *raddtlsget(SSL *ssl, struct gqueue *rbios, int timeout) {
 	cnt = dtlsread(ssl, rbios, rad + 4, len - 4, timeout);
         if (cnt < 1) {
             debug(DBG_DBG, cnt ? "raddtlsget: connection lost" : "raddtlsget: timeout");
-            free(rad);
+            radbuf_free(rad);
             return NULL;
         }
 
         if (len >= 20)
             break;
 
-        free(rad);
+        radbuf_free(rad);
         debug(DBG_WARN, "raddtlsget: packet smaller than minimum radius size");
     }
 
@@ -297,6 +351,7 @@ void *dtlsserverwr(void *arg) {
 	else
 	    while ((error = ERR_get_error()))
 		debug(DBG_ERR, "dtlsserverwr: SSL: %s", ERR_error_string(error, NULL));
+	TRACE(reply, TRACE_WRITTEN);
 	freerq(reply);
     }
 }
@@ -322,7 +377,7 @@ void dtlsserverrd(struct client *client) {
 	debug(DBG_DBG, "dtlsserverrd: got Radius message from %s", addr2string(client->addr));
 	rq = newrequest();
 	if (!rq) {
-	    free(buf);
+	    radbuf_free(buf);
 	    continue;
 	}
 	rq->buf = buf;
@@ -344,27 +399,55 @@ void dtlsserverrd(struct client *client) {
     debug(DBG_DBG, "dtlsserverrd: reader for %s exiting", addr2string(client->addr));
 }
 
-void *dtlsservernew(void *arg) {
+/* done with the session of params; the source is ignored for delay seconds */
+static void dtlsserverdone(struct dtlsservernewparams *params, uint8_t delay) {
+    if (params->ssl) {
+	SSL_shutdown(params->ssl);
+	SSL_free(params->ssl);
+    }
+    pthread_mutex_lock(&params->sesscache->mutex);
+    freebios(params->sesscache->rbios);
+    params->sesscache->rbios = NULL;
+    gettimeofday(&params->sesscache->expiry, NULL);
+    params->sesscache->expiry.tv_sec += delay;
+    pthread_mutex_unlock(&params->sesscache->mutex);
+    free(params);
+}
+
+struct dtlsserverconnparams {
+    struct dtlsservernewparams *params;
+    struct client *client;
+};
+
+/* serves a client whose handshake is done */
+void *dtlsserverconn(void *arg) {
+    struct dtlsserverconnparams *conn = (struct dtlsserverconnparams *)arg;
+
+    dtlsserverrd(conn->client);
+    removeclient(conn->client);
+    dtlsserverdone(conn->params, 0);
+    free(conn);
+    debug(DBG_DBG, "dtlsserverconn: exiting");
+    return NULL;
+}
+
+/* run by a handshake worker for each source that has sent a valid cookie */
+static void dtlsservernew(void *arg) {
     struct dtlsservernewparams *params = (struct dtlsservernewparams *)arg;
+    struct dtlsserverconnparams *conn;
     struct client *client;
     struct clsrvconf *conf;
     struct list_node *cur = NULL;
-    SSL *ssl = NULL;
     X509 *cert = NULL;
-    SSL_CTX *ctx = NULL;
-    uint8_t delay = 60;
     struct tls *accepted_tls = NULL;
+    pthread_t th;
 
     debug(DBG_DBG, "dtlsservernew: starting");
     conf = find_clconf(handle, (struct sockaddr *)&params->addr, NULL);
     if (conf) {
-	ctx = tlsgetctx(handle, conf->tlsconf);
-	if (!ctx)
-	    goto exit;
-	ssl = dtlsacccon(1, ctx, params->sock, (struct sockaddr *)&params->addr, params->sesscache->rbios);
-	if (!ssl)
+	if (!dtlshandshake(1, params->ssl, params->sesscache->rbios))
 	    goto exit;
-	cert = verifytlscert(ssl);
+	cert = verifytlscert(params->ssl);
         if (!cert)
             goto exit;
         accepted_tls = conf->tlsconf;
@@ -373,53 +456,88 @@ void *dtlsservernew(void *arg) {
     while (conf) {
 	if (accepted_tls == conf->tlsconf && verifyconfcert(cert, conf)) {
 	    X509_free(cert);
-	    client = addclient(conf, 1);
-	    if (client) {
-		client->sock = params->sock;
-		client->addr = addr_copy((struct sockaddr *)&params->addr);
-		client->rbios = params->sesscache->rbios;
-		client->ssl = ssl;
-		dtlsserverrd(client);
-		removeclient(client);
-		delay = 0;
-	    } else {
+	    tlscounthandshake(params->ssl, conf);
+	    client = addclient(conf, 1, params->sock);
+	    if (!client) {
 		debug(DBG_WARN, "dtlsservernew: failed to create new client instance");
+		goto exit;
+	    }
+	    client->addr = addr_copy((struct sockaddr *)&params->addr);
+	    client->rbios = params->sesscache->rbios;
+	    client->ssl = params->ssl;
+	    conn = malloc(sizeof(struct dtlsserverconnparams));
+	    if (conn) {
+		conn->params = params;
+		conn->client = client;
+		if (!pthread_create(&th, &pthread_attr, dtlsserverconn, (void *)conn)) {
+		    pthread_detach(th);
+		    return;
+		}
+		debug(DBG_ERR, "dtlsservernew: pthread_create failed");
+		free(conn);
 	    }
+	    removeclient(client);
 	    goto exit;
 	}
 	conf = find_clconf(handle, (struct sockaddr *)&params->addr, &cur);
     }
     debug(DBG_WARN, "dtlsservernew: ignoring request, no matching TLS client");
+    STATS_INC(stats_unknownpeers);
 
     if (cert)
 	X509_free(cert);
 
 exit:
-    if (ssl) {
-	SSL_shutdown(ssl);
-	SSL_free(ssl);
+    dtlsserverdone(params, 60);
+}
+
+/* Does the cookie exchange with a new source from the listener, so that
+ * spoofed sources cost us nothing but one reply. Returns the SSL with
+ * the ClientHello taken when the source had a valid cookie, else NULL,
+ * and in either case the datagram is read. */
+static SSL *dtlslisten(int s, int cnt, struct sockaddr *from) {
+    struct clsrvconf *conf;
+    SSL_CTX *ctx;
+    SSL *ssl;
+    BIO *rbio;
+
+    rbio = udp2membio(s, cnt);
+    if (!rbio)
+	return NULL;
+    conf = find_clconf(handle, from, NULL);
+    if (!conf) {
+	debug(DBG_WARN, "udpdtlsserverrd: got DTLS from unknown client %s, ignoring", addr2string(from));
+	STATS_INC(stats_unknownpeers);
+	BIO_free(rbio);
+	return NULL;
     }
-    pthread_mutex_lock(&params->sesscache->mutex);
-    freebios(params->sesscache->rbios);
-    params->sesscache->rbios = NULL;
-    gettimeofday(&params->sesscache->expiry, NULL);
-    params->sesscache->expiry.tv_sec += delay;
-    pthread_mutex_unlock(&params->sesscache->mutex);
-    free(params);
-    pthread_exit(NULL);
-    debug(DBG_DBG, "dtlsservernew: exiting");
+    ctx = tlsgetctx(handle, conf->tlsconf);
+    ssl = ctx ? dtlsnewssl(ctx, s, from) : NULL;
+    if (!ssl) {
+	BIO_free(rbio);
+	return NULL;
+    }
+    SSL_set_bio(ssl, rbio, SSL_get_wbio(ssl));
+    if (dtlscheckcookie(ssl))
+	return ssl;
+    debug(DBG_DBG, "udpdtlsserverrd: sent cookie to %s", addr2string(from));
+    ERR_clear_error();
+    SSL_free(ssl);
+    return NULL;
 }
 
 void cacheexpire(struct hash *cache, struct timeval *last) {
     struct timeval now;
-    struct hash_entry *he;
+    struct hash_entry *he, *next;
     struct sessioncacheentry *e;
 
     gettimeofday(&now, NULL);
     if (now.tv_sec - last->tv_sec < 19)
 	return;
 
-    for (he = hash_first(cache); he; he = hash_next(he)) {
+    for (he = hash_first(cache); he; he = next) {
+	/* he is freed when extracted */
+	next = hash_next(he);
 	e = (struct sessioncacheentry *)he->data;
 	pthread_mutex_lock(&e->mutex);
 	if (!e->expiry.tv_sec || e->expiry.tv_sec > now.tv_sec) {
@@ -444,9 +562,9 @@ void *udpdtlsserverrd(void *arg) {
     struct sockaddr_storage from;
     socklen_t fromlen = sizeof(from);
     struct dtlsservernewparams *params;
+    SSL *ssl;
     fd_set readfds;
     struct timeval timeout, lastexpiry;
-    pthread_t dtlsserverth;
     struct hash *sessioncache;
     struct sessioncacheentry *cacheentry;
 
@@ -485,43 +603,46 @@ void *udpdtlsserverrd(void *arg) {
 	    continue;
 	}
 
-	/* from new source */
+	/* from new source, nothing is kept until it has answered a cookie */
 	debug(DBG_DBG, "udpdtlsserverrd: cache miss");
+	ssl = dtlslisten(s, cnt, (struct sockaddr *)&from);
+	if (!ssl) {
+	    cacheexpire(sessioncache, &lastexpiry);
+	    continue;
+	}
 	params = malloc(sizeof(struct dtlsservernewparams));
 	if (!params) {
+	    SSL_free(ssl);
 	    cacheexpire(sessioncache, &lastexpiry);
-	    recv(s, buf, 1, 0);
 	    continue;
 	}
 	memset(params, 0, sizeof(struct dtlsservernewparams));
+	params->ssl = ssl;
 	params->sesscache = malloc(sizeof(struct sessioncacheentry));
 	if (!params->sesscache) {
+	    SSL_free(ssl);
 	    free(params);
 	    cacheexpire(sessioncache, &lastexpiry);
-	    recv(s, buf, 1, 0);
 	    continue;
 	}
 	memset(params->sesscache, 0, sizeof(struct sessioncacheentry));
 	pthread_mutex_init(&params->sesscache->mutex, NULL);
 	params->sesscache->rbios = newqueue();
-	if (hash_insert(sessioncache, &from, fromlen, params->sesscache)) {
+	if (params->sesscache->rbios && hash_insert(sessioncache, &from, fromlen, params->sesscache)) {
 	    params->sock = s;
 	    memcpy(&params->addr, &from, fromlen);
-
-	    if (udp2bio(s, params->sesscache->rbios, cnt)) {
-		debug(DBG_DBG, "udpdtlsserverrd: got DTLS in UDP from %s", addr2string((struct sockaddr *)&from));
-		if (!pthread_create(&dtlsserverth, &pthread_attr, dtlsservernew, (void *)params)) {
-		    pthread_detach(dtlsserverth);
-		    cacheexpire(sessioncache, &lastexpiry);
-		    continue;
-		}
-		debug(DBG_ERR, "udpdtlsserverrd: pthread_create failed");
+	    debug(DBG_DBG, "udpdtlsserverrd: got DTLS in UDP from %s", addr2string((struct sockaddr *)&from));
+	    if (tlsaddhandshake(dtlsservernew, params)) {
+		cacheexpire(sessioncache, &lastexpiry);
+		continue;
 	    }
 	    hash_extract(sessioncache, &from, fromlen);
 	}
-	freebios(params->sesscache->rbios);
+	if (params->sesscache->rbios)
+	    freebios(params->sesscache->rbios);
 	pthread_mutex_destroy(&params->sesscache->mutex);
 	free(params->sesscache);
+	SSL_free(ssl);
 	free(params);
 	cacheexpire(sessioncache, &lastexpiry);
     }
@@ -548,8 +669,9 @@ int dtlsconnect(struct server *server, struct timeval *when, int timeout, char *
 	gettimeofday(&now, NULL);
 	elapsed = now.tv_sec - server->lastconnecttry.tv_sec;
 
-	if (timeout && server->lastconnecttry.tv_sec && elapsed > timeout) {
-	    debug(DBG_DBG, "dtlsconnect: timeout");
+	if (server->conf->retiredgen ||
+	    (timeout && server->lastconnecttry.tv_sec && elapsed > timeout)) {
+	    debug(DBG_DBG, "dtlsconnect: timeout, or server removed by a reload");
 	    SSL_free(server->ssl);
 	    server->ssl = NULL;
 	    pthread_mutex_unlock(&server->lock);
@@ -576,10 +698,11 @@ int dtlsconnect(struct server *server, struct timeval *when, int timeout, char *
 	ctx = tlsgetctx(handle, server->conf->tlsconf);
 	if (!ctx)
 	    continue;
-	server->ssl = dtlsacccon(0, ctx, server->sock, hp->addrinfo->ai_addr, server->rbios);
+	server->ssl = dtlsacccon(0, ctx, server->sock, hp->addrinfo->ai_addr, server->rbios, server);
 	if (!server->ssl)
 	    continue;
 	debug(DBG_DBG, "dtlsconnect: DTLS: ok");
+	tlscounthandshake(server->ssl, server->conf);
 
 	cert = verifytlscert(server->ssl);
 	if (!cert)
@@ -638,6 +761,7 @@ void *udpdtlsclientrd(void *arg) {
 	conf = find_srvconf(handle, (struct sockaddr *)&from, NULL);
 	if (!conf) {
 	    debug(DBG_WARN, "udpdtlsclientrd: got packet from wrong or unknown DTLS peer %s, ignoring", addr2string((struct sockaddr *)&from));
+	    STATS_INC(stats_unknownpeers);
 	    recv(s, buf, 4, 0);
 	    continue;
 	}
@@ -655,34 +779,49 @@ void *dtlsclientrd(void *arg) {
     for (;;) {
 	/* yes, lastconnecttry is really necessary */
 	lastconnecttry = server->lastconnecttry;
-	for (secs = 0; !(buf = raddtlsget(server->ssl, server->rbios, 10)) && !server->lostrqs && secs < IDLE_TIMEOUT; secs += 10);
+	for (secs = 0; !(buf = raddtlsget(server->ssl, server->rbios, 10)) && !server->lostrqs && secs < IDLE_TIMEOUT && !server->conf->retiredgen; secs += 10);
 	if (!buf) {
+	    if (server->conf->retiredgen)
+		break;
 	    dtlsconnect(server, &lastconnecttry, 0, "dtlsclientrd");
 	    continue;
 	}
 	replyh(server, buf);
     }
+    /* Wake up clientwr(). */
     server->clientrdgone = 1;
+    pthread_mutex_lock(&server->newrq_mutex);
+    pthread_cond_signal(&server->newrq_cond);
+    pthread_mutex_unlock(&server->newrq_mutex);
     return NULL;
 }
 
-void addserverextradtls(struct clsrvconf *conf) {
+void addserverextradtls(struct server *server) {
+    struct clsrvconf *conf = server->conf;
+    pthread_t th;
+
+    /* the socket of the family, and its reader, are made for the first
+     * server of it, which may be added by a reload */
     switch (((struct hostportres *)list_first(conf->hostports)->data)->addrinfo->ai_family) {
     case AF_INET:
 	if (client4_sock < 0) {
 	    client4_sock = bindtoaddr(srcres, AF_INET, 0);
 	    if (client4_sock < 0)
 		debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
+	    if (affinity_create(&th, AFFINITY_UPSTREAM, udpdtlsclientrd, (void *)&client4_sock))
+		debugx(1, DBG_ERR, "pthread_create failed");
 	}
-	conf->servers->sock = client4_sock;
+	server->sock = client4_sock;
 	break;
     case AF_INET6:
 	if (client6_sock < 0) {
 	    client6_sock = bindtoaddr(srcres, AF_INET6, 0);
 	    if (client6_sock < 0)
 		debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
+	    if (affinity_create(&th, AFFINITY_UPSTREAM, udpdtlsclientrd, (void *)&client6_sock))
+		debugx(1, DBG_ERR, "pthread_create failed");
 	}
-	conf->servers->sock = client6_sock;
+	server->sock = client6_sock;
 	break;
     default:
 	debugx(1, DBG_ERR, "addserver: unsupported address family");
@@ -690,19 +829,10 @@ void addserverextradtls(struct clsrvconf *conf) {
 }
 
 void initextradtls() {
-    pthread_t cl4th, cl6th;
-
     if (srcres) {
 	freeaddrinfo(srcres);
 	srcres = NULL;
     }
-
-    if (client4_sock >= 0)
-	if (pthread_create(&cl4th, &pthread_attr, udpdtlsclientrd, (void *)&client4_sock))
-	    debugx(1, DBG_ERR, "pthread_create failed");
-    if (client6_sock >= 0)
-	if (pthread_create(&cl6th, &pthread_attr, udpdtlsclientrd, (void *)&client6_sock))
-	    debugx(1, DBG_ERR, "pthread_create failed");
 }
 #else
 const struct protodefs *dtlsinit(uint8_t h) {
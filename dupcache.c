@@ -0,0 +1,162 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include "timewheel.h"
+#include "dupcache.h"
+
+#define DUPCACHE_MINBUCKETS 16
+/* grow when the average chain is longer than this */
+#define DUPCACHE_MAXLOAD 2
+
+/* FNV-1a, as in hash.c */
+static uint32_t hashkey(uint32_t seed, const uint8_t *key) {
+    uint32_t h = 2166136261u ^ seed;
+    int i;
+
+    for (i = 0; i < DUPCACHE_KEYLEN; i++) {
+	h ^= key[i];
+	h *= 16777619u;
+    }
+    return h;
+}
+
+int dupcache_init(struct dupcache *cache, uint8_t interval, uint32_t max, void (*expired)(struct dupcache_node *), time_t now) {
+    static uint32_t seed;
+
+    memset(cache, 0, sizeof(struct dupcache));
+    cache->buckets = calloc(DUPCACHE_MINBUCKETS, sizeof(struct dupcache_node *));
+    if (!cache->buckets)
+	return 0;
+    /* entries are due at most interval + 1 seconds ahead */
+    if (!timewheel_init(&cache->wheel, interval + 2, now)) {
+	free(cache->buckets);
+	cache->buckets = NULL;
+	return 0;
+    }
+    cache->nbuckets = DUPCACHE_MINBUCKETS;
+    cache->max = max;
+    /* racy, but any value will do */
+    seed = seed * 1103515245u + (uint32_t)now + (uint32_t)(uintptr_t)cache;
+    cache->seed = seed;
+    cache->interval = interval;
+    cache->expired = expired;
+    return 1;
+}
+
+void dupcache_free(struct dupcache *cache, void (*cb)(struct dupcache_node *, void *), void *arg) {
+    struct dupcache_node *node, *next;
+    uint32_t i;
+
+    if (!cache->buckets)
+	return;
+    for (i = 0; i < cache->nbuckets; i++)
+	for (node = cache->buckets[i]; node; node = next) {
+	    next = node->next;
+	    timewheel_del(&node->timer);
+	    node->next = NULL;
+	    if (cb)
+		cb(node, arg);
+	}
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->count = 0;
+    timewheel_free(&cache->wheel);
+}
+
+void dupcache_key(uint8_t *key, uint16_t port, uint8_t id, const uint8_t *auth) {
+    key[0] = port >> 8;
+    key[1] = port & 0xff;
+    key[2] = id;
+    memcpy(key + 3, auth, 16);
+}
+
+struct dupcache_node *dupcache_find(struct dupcache *cache, const uint8_t *key) {
+    struct dupcache_node *node;
+    uint32_t h = hashkey(cache->seed, key);
+
+    for (node = cache->buckets[h & (cache->nbuckets - 1)]; node; node = node->next)
+	if (node->hashval == h && !memcmp(node->key, key, DUPCACHE_KEYLEN))
+	    return node;
+    return NULL;
+}
+
+/* doubles the number of buckets, keeping the old ones if malloc fails */
+static void grow(struct dupcache *cache) {
+    struct dupcache_node **buckets, *node, *next;
+    uint32_t i, n = cache->nbuckets * 2;
+
+    buckets = calloc(n, sizeof(struct dupcache_node *));
+    if (!buckets)
+	return;
+    for (i = 0; i < cache->nbuckets; i++)
+	for (node = cache->buckets[i]; node; node = next) {
+	    next = node->next;
+	    node->next = buckets[node->hashval & (n - 1)];
+	    buckets[node->hashval & (n - 1)] = node;
+	}
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = n;
+}
+
+static void removenode(struct dupcache *cache, struct dupcache_node *node) {
+    struct dupcache_node **p;
+
+    for (p = &cache->buckets[node->hashval & (cache->nbuckets - 1)]; *p; p = &(*p)->next)
+	if (*p == node) {
+	    *p = node->next;
+	    break;
+	}
+    node->next = NULL;
+    cache->count--;
+}
+
+static void expirenode(struct timewheel_node *timer, void *arg) {
+    struct dupcache *cache = (struct dupcache *)arg;
+    struct dupcache_node *node = (struct dupcache_node *)((char *)timer - offsetof(struct dupcache_node, timer));
+
+    removenode(cache, node);
+    cache->expired(node);
+}
+
+void dupcache_add(struct dupcache *cache, struct dupcache_node *node, time_t now) {
+    uint32_t b;
+    time_t first;
+
+    if (cache->count >= cache->max) {
+	/* evicts the nodes due first */
+	first = timewheel_next(&cache->wheel);
+	if (first)
+	    timewheel_expire(&cache->wheel, first, expirenode, cache);
+    }
+    if (cache->count >= DUPCACHE_MAXLOAD * cache->nbuckets)
+	grow(cache);
+
+    node->hashval = hashkey(cache->seed, node->key);
+    b = node->hashval & (cache->nbuckets - 1);
+    node->next = cache->buckets[b];
+    cache->buckets[b] = node;
+    cache->count++;
+    /* kept until more than interval seconds old */
+    timewheel_add(&cache->wheel, &node->timer, now + cache->interval + 1);
+}
+
+void dupcache_del(struct dupcache *cache, struct dupcache_node *node) {
+    timewheel_del(&node->timer);
+    removenode(cache, node);
+}
+
+int dupcache_pending(struct dupcache_node *node) {
+    return timewheel_pending(&node->timer);
+}
+
+void dupcache_expire(struct dupcache *cache, time_t now) {
+    timewheel_expire(&cache->wheel, now, expirenode, cache);
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
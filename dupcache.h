@@ -0,0 +1,68 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <time.h>
+
+/* A cache of the requests recently received from a client, for telling
+ * duplicates. Entries are keyed by the UDP source port, the RADIUS id
+ * and the request authenticator, and expire once more than interval
+ * seconds old, driven by a timer wheel. The number of entries is
+ * bounded; when full, those closest to expiring are evicted early.
+ * Nodes are embedded in the structures being cached, and like the
+ * wheel the cache does no locking of its own. timewheel.h must be included first. */
+
+#define DUPCACHE_KEYLEN 19
+
+struct dupcache_node {
+    struct dupcache_node *next; /* in bucket */
+    struct timewheel_node timer;
+    uint32_t hashval;
+    uint8_t key[DUPCACHE_KEYLEN];
+};
+
+struct dupcache {
+    struct dupcache_node **buckets;
+    uint32_t nbuckets; /* always a power of two */
+    uint32_t count, max;
+    uint32_t seed;
+    uint8_t interval;
+    struct timewheel wheel;
+    /* called for the nodes expiring or evicted, after removing them */
+    void (*expired)(struct dupcache_node *);
+};
+
+/* sets up an empty cache of at most max entries; returns 1 if ok, 0
+ * if malloc fails */
+int dupcache_init(struct dupcache *cache, uint8_t interval, uint32_t max, void (*expired)(struct dupcache_node *), time_t now);
+
+/* removes all nodes, calling cb for each unless NULL, and frees the
+ * memory of the cache itself */
+void dupcache_free(struct dupcache *cache, void (*cb)(struct dupcache_node *, void *), void *arg);
+
+/* writes the key of a request to key */
+void dupcache_key(uint8_t *key, uint16_t port, uint8_t id, const uint8_t *auth);
+
+/* returns the node with the given key, or NULL */
+struct dupcache_node *dupcache_find(struct dupcache *cache, const uint8_t *key);
+
+/* adds node with its key set, expiring interval seconds after now;
+ * a node with the same key must not be added already */
+void dupcache_add(struct dupcache *cache, struct dupcache_node *node, time_t now);
+
+/* removes node, which must be added */
+void dupcache_del(struct dupcache *cache, struct dupcache_node *node);
+
+/* returns 1 if node is added, nodes never added must have been zeroed */
+int dupcache_pending(struct dupcache_node *node);
+
+/* removes the nodes that have expired at now */
+void dupcache_expire(struct dupcache *cache, time_t now);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,571 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+/* The event loop is a fixed pool of worker threads, each multiplexing
+ * many non-blocking sockets. Every watch belongs to exactly one worker
+ * and its callback is only ever called from that worker, so protocol
+ * state such as an SSL object needs no locking. Other threads can only
+ * hand over new watches and ask for a callback with evloop_notify().
+ * On top of that is the stream client handling used for incoming TCP
+ * and TLS connections, calling the serverconn callbacks in protodefs. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#if defined(HAVE_EPOLL_CREATE1)
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include <openssl/ssl.h>
+#include "radsecproxy.h"
+#include "debug.h"
+#include "util.h"
+#include "pool.h"
+#include "evloop.h"
+#include "affinity.h"
+
+#define EVLOOP_MAXEVENTS 64
+
+struct evloop {
+    pthread_t thread;
+    int epfd;
+    int wakefd[2];
+    uint8_t woken;
+    pthread_mutex_t mutex; /* protects addq, notifyq and woken */
+    struct evwatch *addq;
+    struct evwatch *notifyq;
+    struct evwatch *watches;
+    uint32_t count;
+};
+
+static struct evloop *loops = NULL;
+static int nloops = 0;
+
+static void wakeup(struct evloop *l) {
+    char c = 0;
+
+    if (l->woken)
+	return;
+    l->woken = 1;
+    if (write(l->wakefd[1], &c, 1) < 0)
+	debug(DBG_ERR, "evloop: wakeup failed");
+}
+
+static void drainwakeup(struct evloop *l) {
+    char buf[64];
+
+    while (read(l->wakefd[0], buf, sizeof(buf)) > 0);
+    pthread_mutex_lock(&l->mutex);
+    l->woken = 0;
+    pthread_mutex_unlock(&l->mutex);
+}
+
+#if defined(HAVE_EPOLL_CREATE1)
+static void epollctl(struct evwatch *w, int op) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    if (w->events & EVLOOP_READ)
+	ev.events |= EPOLLIN;
+    if (w->events & EVLOOP_WRITE)
+	ev.events |= EPOLLOUT;
+    ev.data.ptr = w;
+    if (epoll_ctl(w->loop->epfd, op, w->fd, &ev))
+	debugerrno(errno, DBG_ERR, "evloop: epoll_ctl failed for fd %d", w->fd);
+}
+#endif
+
+/* links in watches handed over from other threads */
+static void takewatches(struct evloop *l) {
+    struct evwatch *w, *next;
+
+    pthread_mutex_lock(&l->mutex);
+    w = l->addq;
+    l->addq = NULL;
+    pthread_mutex_unlock(&l->mutex);
+
+    for (; w; w = next) {
+	next = w->next;
+	w->prev = NULL;
+	w->next = l->watches;
+	if (l->watches)
+	    l->watches->prev = w;
+	l->watches = w;
+#if defined(HAVE_EPOLL_CREATE1)
+	epollctl(w, EPOLL_CTL_ADD);
+#endif
+    }
+}
+
+static void runnotifications(struct evloop *l) {
+    struct evwatch *w, *next;
+
+    pthread_mutex_lock(&l->mutex);
+    w = l->notifyq;
+    l->notifyq = NULL;
+    pthread_mutex_unlock(&l->mutex);
+
+    /* notified is cleared just before each callback, so that entries we
+     * have not got to yet are never relinked by evloop_notify() */
+    for (; w; w = next) {
+	pthread_mutex_lock(&l->mutex);
+	next = w->nextnotify;
+	w->notified = 0;
+	pthread_mutex_unlock(&l->mutex);
+	w->cb(w, EVLOOP_NOTIFY);
+    }
+}
+
+static void checktimeouts(struct evloop *l, time_t now) {
+    struct evwatch *w, *next;
+
+    for (w = l->watches; w; w = next) {
+	next = w->next;
+	if (w->timeout && now - w->lastactive > w->timeout)
+	    w->cb(w, EVLOOP_TIMEOUT);
+    }
+}
+
+static void dispatch(struct evwatch *w, uint8_t events, time_t now) {
+    if (events & EVLOOP_READ)
+	w->lastactive = now;
+    w->cb(w, events);
+}
+
+static void *evloopworker(void *arg) {
+    struct evloop *l = (struct evloop *)arg;
+    time_t now, lastcheck = 0;
+    int i, n;
+    uint8_t events;
+#if defined(HAVE_EPOLL_CREATE1)
+    struct epoll_event evs[EVLOOP_MAXEVENTS];
+    struct evwatch *w;
+#else
+    struct pollfd *fds = NULL, *newfds;
+    struct evwatch **ws = NULL, **newws, *w;
+    int nfds, size = 0;
+#endif
+
+    for (;;) {
+#if defined(HAVE_EPOLL_CREATE1)
+	n = epoll_wait(l->epfd, evs, EVLOOP_MAXEVENTS, 1000);
+	if (n < 0 && errno != EINTR)
+	    debugerrno(errno, DBG_ERR, "evloopworker: epoll_wait failed");
+	now = time(NULL);
+	for (i = 0; i < n; i++) {
+	    if (!evs[i].data.ptr) {
+		drainwakeup(l);
+		continue;
+	    }
+	    w = (struct evwatch *)evs[i].data.ptr;
+	    events = 0;
+	    if (evs[i].events & EPOLLIN)
+		events |= EVLOOP_READ;
+	    if (evs[i].events & EPOLLOUT)
+		events |= EVLOOP_WRITE;
+	    /* reported even when no events are watched for */
+	    if (evs[i].events & (EPOLLERR | EPOLLHUP))
+		events |= EVLOOP_HANGUP | (w->events & EVLOOP_READ);
+	    dispatch(w, events, now);
+	}
+#else
+	if (size < (int)l->count + 1) {
+	    size = l->count + 16;
+	    newfds = realloc(fds, size * sizeof(struct pollfd));
+	    if (newfds)
+		fds = newfds;
+	    newws = realloc(ws, size * sizeof(struct evwatch *));
+	    if (newws)
+		ws = newws;
+	    if (!newfds || !newws)
+		debugx(1, DBG_ERR, "malloc failed");
+	}
+	fds[0].fd = l->wakefd[0];
+	fds[0].events = POLLIN;
+	nfds = 1;
+	for (w = l->watches; w; w = w->next) {
+	    fds[nfds].fd = w->fd;
+	    fds[nfds].events = (w->events & EVLOOP_READ ? POLLIN : 0) | (w->events & EVLOOP_WRITE ? POLLOUT : 0);
+	    ws[nfds++] = w;
+	}
+	n = poll(fds, nfds, 1000);
+	if (n < 0 && errno != EINTR)
+	    debugerrno(errno, DBG_ERR, "evloopworker: poll failed");
+	now = time(NULL);
+	if (n > 0) {
+	    if (fds[0].revents)
+		drainwakeup(l);
+	    for (i = 1; i < nfds; i++) {
+		if (!fds[i].revents)
+		    continue;
+		events = 0;
+		if (fds[i].revents & POLLIN)
+		    events |= EVLOOP_READ;
+		if (fds[i].revents & POLLOUT)
+		    events |= EVLOOP_WRITE;
+		/* reported even when no events are watched for */
+		if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+		    events |= EVLOOP_HANGUP | (ws[i]->events & EVLOOP_READ);
+		/* a callback only ever removes its own watch */
+		dispatch(ws[i], events, now);
+	    }
+	}
+#endif
+	takewatches(l);
+	runnotifications(l);
+	if (now != lastcheck) {
+	    checktimeouts(l, now);
+	    lastcheck = now;
+	}
+    }
+    return NULL;
+}
+
+int evloop_init(int n) {
+    int i;
+    struct evloop *l;
+
+    loops = calloc(n, sizeof(struct evloop));
+    if (!loops) {
+	debug(DBG_ERR, "malloc failed");
+	return 0;
+    }
+    for (i = 0; i < n; i++) {
+	l = &loops[i];
+	pthread_mutex_init(&l->mutex, NULL);
+	if (pipe(l->wakefd)) {
+	    debugerrno(errno, DBG_ERR, "evloop_init: pipe failed");
+	    return 0;
+	}
+	fcntl(l->wakefd[0], F_SETFL, fcntl(l->wakefd[0], F_GETFL, 0) | O_NONBLOCK);
+	fcntl(l->wakefd[1], F_SETFL, fcntl(l->wakefd[1], F_GETFL, 0) | O_NONBLOCK);
+#if defined(HAVE_EPOLL_CREATE1)
+	{
+	    struct epoll_event ev;
+
+	    l->epfd = epoll_create1(0);
+	    if (l->epfd < 0) {
+		debugerrno(errno, DBG_ERR, "evloop_init: epoll_create1 failed");
+		return 0;
+	    }
+	    memset(&ev, 0, sizeof(ev));
+	    ev.events = EPOLLIN;
+	    ev.data.ptr = NULL;
+	    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->wakefd[0], &ev)) {
+		debugerrno(errno, DBG_ERR, "evloop_init: epoll_ctl failed");
+		return 0;
+	    }
+	}
+#else
+	l->epfd = -1;
+#endif
+	if (affinity_create(&l->thread, AFFINITY_WORKER, evloopworker, (void *)l)) {
+	    debug(DBG_ERR, "evloop_init: pthread_create failed");
+	    return 0;
+	}
+	nloops++;
+    }
+    debug(DBG_DBG, "evloop_init: started %d workers", n);
+    return 1;
+}
+
+int evloop_enabled() {
+    return nloops > 0;
+}
+
+int evloop_add(struct evwatch *w) {
+    struct evloop *l;
+    int i;
+
+    if (!nloops)
+	return 0;
+    /* count is read without locking, a stale view will do */
+    l = &loops[0];
+    for (i = 1; i < nloops; i++)
+	if (loops[i].count < l->count)
+	    l = &loops[i];
+
+    w->loop = l;
+    w->notified = 0;
+    w->lastactive = time(NULL);
+    pthread_mutex_lock(&l->mutex);
+    l->count++;
+    w->next = l->addq;
+    l->addq = w;
+    wakeup(l);
+    pthread_mutex_unlock(&l->mutex);
+    return 1;
+}
+
+void evloop_setevents(struct evwatch *w, uint8_t events) {
+    if (w->events == events)
+	return;
+    w->events = events;
+#if defined(HAVE_EPOLL_CREATE1)
+    epollctl(w, EPOLL_CTL_MOD);
+#endif
+}
+
+void evloop_del(struct evwatch *w) {
+    struct evloop *l = w->loop;
+    struct evwatch **p;
+
+#if defined(HAVE_EPOLL_CREATE1)
+    epollctl(w, EPOLL_CTL_DEL);
+#endif
+    if (w->prev)
+	w->prev->next = w->next;
+    else
+	l->watches = w->next;
+    if (w->next)
+	w->next->prev = w->prev;
+
+    pthread_mutex_lock(&l->mutex);
+    if (w->notified)
+	for (p = &l->notifyq; *p; p = &(*p)->nextnotify)
+	    if (*p == w) {
+		*p = w->nextnotify;
+		break;
+	    }
+    /* keeps evloop_notify() from queueing it again */
+    w->notified = 1;
+    l->count--;
+    pthread_mutex_unlock(&l->mutex);
+}
+
+void evloop_notify(struct evwatch *w) {
+    struct evloop *l = w->loop;
+
+    pthread_mutex_lock(&l->mutex);
+    if (!w->notified) {
+	w->notified = 1;
+	w->nextnotify = l->notifyq;
+	l->notifyq = w;
+	wakeup(l);
+    }
+    pthread_mutex_unlock(&l->mutex);
+}
+
+/* A TCP or TLS client connection. Requests are read into rx and
+ * dispatched as soon as complete, replies are moved from the client
+ * reply queue to wbuf when the worker is notified by sendreply(), and
+ * written together. While the client is overloaded, reading is paused
+ * until replies are written or the worker is notified by
+ * clientrqdone(). */
+struct evclient {
+    struct evwatch watch;
+    struct client *client;
+    struct rxbuf rx;
+    uint8_t *wbuf;
+    int wlen, wpos; /* wbuf is written up to wpos */
+    uint8_t paused;
+    uint8_t rdwait, wrwait; /* the events reading and writing wait for */
+};
+
+/* watches for what reading waits for unless paused, and for what
+ * writing waits for if some is left */
+static void evclientevents(struct evclient *ec) {
+    evloop_setevents(&ec->watch, (ec->paused ? 0 : ec->rdwait) | (ec->wpos < ec->wlen ? ec->wrwait : 0));
+}
+
+static void evclientclose(struct evclient *ec) {
+    struct client *client = ec->client;
+
+    debug(DBG_DBG, "evclientclose: closing connection from %s", addr2string(client->addr));
+    evloop_del(&ec->watch);
+    /* a reload may be shutting down client->sock */
+    pthread_mutex_lock(client->conf->lock);
+    client->conf->pdef->serverconnclose(client);
+    client->sock = -1;
+    pthread_mutex_unlock(client->conf->lock);
+    /* sendreply() may notify us until all client requests are removed */
+    removeclient(client);
+    free(ec->rx.buf);
+    free(ec->wbuf);
+    free(ec);
+}
+
+/* returns 1 if ok, 0 if the connection should be closed */
+static int evclientdispatch(struct evclient *ec) {
+    struct client *client = ec->client;
+    struct request *rq;
+    uint8_t *buf;
+
+    while (!ec->paused && (buf = rxbuf_packet(&ec->rx))) {
+	debug(DBG_DBG, "evclientdispatch: got Radius message from %s", addr2string(client->addr));
+	rq = newrequest();
+	if (!rq) {
+	    radbuf_free(buf);
+	    continue;
+	}
+	rq->buf = buf;
+	rq->from = client;
+	if (!radsrv(rq)) {
+	    debug(DBG_ERR, "evclientdispatch: message authentication/validation failed, closing connection from %s", addr2string(client->addr));
+	    return 0;
+	}
+	if (clientoverloaded(client)) {
+	    debug(DBG_DBG, "evclientdispatch: holding back reading from %s", addr2string(client->addr));
+	    STATS_INC(client->conf->stats.paused);
+	    ec->paused = 1;
+	}
+    }
+    return 1;
+}
+
+/* returns 1 if ok, 0 if the connection should be closed */
+static int evclientread(struct evclient *ec) {
+    struct client *client = ec->client;
+    uint8_t *buf;
+    int cnt, room;
+
+    for (;;) {
+	buf = rxbuf_space(&ec->rx, &room);
+	if (!buf) {
+	    debug(DBG_ERR, "evclientread: malloc failed");
+	    return 0;
+	}
+	/* the requests read are left undispatched while paused, so
+	 * the buffer may be full; evclientcb() closes the connection
+	 * then should it hang up */
+	if (!room)
+	    return 1;
+	cnt = client->conf->pdef->serverconnread(client, buf, room, &ec->rdwait);
+	if (cnt < 0) {
+	    debug(DBG_ERR, "evclientread: connection from %s lost", addr2string(client->addr));
+	    return 0;
+	}
+	if (!cnt) {
+	    evclientevents(ec);
+	    return 1;
+	}
+	ec->rx.len += cnt;
+	if (!evclientdispatch(ec))
+	    return 0;
+	if (ec->paused) {
+	    evclientevents(ec);
+	    return 1;
+	}
+    }
+}
+
+/* writes queued replies until done or the socket would block;
+ * returns 1 if ok, 0 if the connection should be closed */
+static int evclientwrite(struct evclient *ec) {
+    struct client *client = ec->client;
+    int cnt;
+
+    for (;;) {
+	if (ec->wpos == ec->wlen) {
+	    ec->wlen = takereplies(client, ec->wbuf, WRITEBUF_SIZE);
+	    ec->wpos = 0;
+	    if (!ec->wlen)
+		break;
+	}
+	/* a TLS write that would block must be retried with the same data */
+	cnt = client->conf->pdef->serverconnwrite(client, ec->wbuf + ec->wpos, ec->wlen - ec->wpos, &ec->wrwait);
+	if (cnt < 0) {
+	    debug(DBG_ERR, "evclientwrite: write error for %s", addr2string(client->addr));
+	    return 0;
+	}
+	if (!cnt) {
+	    evclientevents(ec);
+	    return 1;
+	}
+	ec->wpos += cnt;
+	if (ec->wpos == ec->wlen)
+	    debug(DBG_DBG, "evclientwrite: sent %d bytes of Radius packets to %s",
+		  ec->wlen, addr2string(client->addr));
+    }
+    evclientevents(ec);
+    return 1;
+}
+
+static void evclientcb(struct evwatch *w, uint8_t events) {
+    struct evclient *ec = (struct evclient *)w->arg;
+
+    if (events & EVLOOP_TIMEOUT) {
+	debug(DBG_ERR, "evclientcb: idle timeout for %s", addr2string(ec->client->addr));
+	evclientclose(ec);
+	return;
+    }
+    /* a TLS read may wait for writing, and a write for reading */
+    if ((events & ec->rdwait) && !ec->paused && !evclientread(ec)) {
+	evclientclose(ec);
+	return;
+    }
+    if ((events & (ec->wrwait | EVLOOP_NOTIFY)) && !evclientwrite(ec)) {
+	evclientclose(ec);
+	return;
+    }
+    /* also when paused, else the worker would be woken for it again
+     * and again */
+    if (events & EVLOOP_HANGUP) {
+	debug(DBG_ERR, "evclientcb: connection from %s lost", addr2string(ec->client->addr));
+	evclientclose(ec);
+	return;
+    }
+    /* woken by clientrqdone(), or replies written */
+    if (ec->paused && !clientoverloaded(ec->client)) {
+	debug(DBG_DBG, "evclientcb: reading from %s again", addr2string(ec->client->addr));
+	ec->paused = 0;
+	if (!evclientdispatch(ec) || (!ec->paused && !evclientread(ec))) {
+	    evclientclose(ec);
+	    return;
+	}
+	evclientevents(ec);
+    }
+}
+
+int evloop_addclient(struct client *client, int s) {
+    struct evclient *ec;
+
+    ec = calloc(1, sizeof(struct evclient));
+    if (!ec) {
+	debug(DBG_ERR, "malloc failed");
+	return 0;
+    }
+    ec->wbuf = malloc(WRITEBUF_SIZE);
+    if (!rxbuf_init(&ec->rx) || !ec->wbuf) {
+	debug(DBG_ERR, "malloc failed");
+	free(ec->rx.buf);
+	free(ec->wbuf);
+	free(ec);
+	return 0;
+    }
+    if (fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK)) {
+	debugerrno(errno, DBG_ERR, "evloop_addclient: fcntl failed");
+	free(ec->rx.buf);
+	free(ec->wbuf);
+	free(ec);
+	return 0;
+    }
+    ec->client = client;
+    ec->watch.fd = s;
+    ec->rdwait = EVLOOP_READ;
+    ec->wrwait = EVLOOP_WRITE;
+    ec->watch.events = EVLOOP_READ;
+    ec->watch.timeout = client->conf->type == RAD_TLS ? IDLE_TIMEOUT * 3 : 0;
+    ec->watch.cb = evclientcb;
+    ec->watch.arg = ec;
+    client->evwatch = &ec->watch;
+    if (!evloop_add(&ec->watch)) {
+	client->evwatch = NULL;
+	free(ec->rx.buf);
+	free(ec->wbuf);
+	free(ec);
+	return 0;
+    }
+    debug(DBG_DBG, "evloop_addclient: serving %s from event loop", addr2string(client->addr));
+    return 1;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
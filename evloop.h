@@ -0,0 +1,63 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <time.h>
+
+#define EVLOOP_READ 1
+#define EVLOOP_WRITE 2
+#define EVLOOP_NOTIFY 4
+#define EVLOOP_TIMEOUT 8
+#define EVLOOP_HANGUP 16 /* an error or hang-up, watched for or not */
+
+struct evloop;
+
+/* A file descriptor watched by one event loop worker. The watch is
+ * embedded in a structure owned by the caller, and once added only the
+ * worker it was given to may touch it, except for evloop_notify(). */
+struct evwatch {
+    int fd;
+    uint8_t events; /* EVLOOP_READ and/or EVLOOP_WRITE */
+    uint8_t notified;
+    int timeout; /* idle timeout in seconds, 0 for none */
+    time_t lastactive;
+    void (*cb)(struct evwatch *, uint8_t);
+    void *arg;
+    struct evloop *loop;
+    struct evwatch *prev, *next; /* workers list of watches */
+    struct evwatch *nextnotify;
+};
+
+/* starts n worker threads; returns 1 if ok, 0 on failure */
+int evloop_init(int n);
+
+/* returns 1 if evloop_init() has been called successfully */
+int evloop_enabled();
+
+/* hands watch over to the least loaded worker, the callback will be
+ * called from that worker only; returns 1 if ok, 0 on failure */
+int evloop_add(struct evwatch *w);
+
+/* changes the events watched; only to be called by the owning worker */
+void evloop_setevents(struct evwatch *w, uint8_t events);
+
+/* stops watching; only to be called by the owning worker from the
+ * callback itself, which may free w when this returns */
+void evloop_del(struct evwatch *w);
+
+/* makes the owning worker call the callback with EVLOOP_NOTIFY as
+ * soon as possible; may be called from any thread */
+void evloop_notify(struct evwatch *w);
+
+/* serves a TCP or TLS client on the event loop, the client socket
+ * must already be set up; returns 1 if ok, 0 on failure */
+struct client;
+int evloop_addclient(struct client *client, int s);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
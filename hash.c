@@ -3,129 +3,193 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
-#include "list.h"
 #include "hash.h"
 
+#define HASH_MINBUCKETS 16
+/* grow when the average chain is longer than this */
+#define HASH_MAXLOAD 2
+
+/* FNV-1a, seeded per table so that chains can't be predicted from
+ * the outside */
+static uint32_t hashkey(uint32_t seed, const void *key, uint32_t keylen) {
+    const uint8_t *p = key;
+    uint32_t h = 2166136261u ^ seed;
+
+    while (keylen--) {
+	h ^= *p++;
+	h *= 16777619u;
+    }
+    return h;
+}
+
 /* allocates and initialises hash structure; returns NULL if malloc fails */
 struct hash *hash_create() {
+    static uint32_t seed;
     struct hash *h = malloc(sizeof(struct hash));
     if (!h)
 	return NULL;
-    h->hashlist = list_create();
-    if (!h->hashlist) {
+    h->buckets = calloc(HASH_MINBUCKETS, sizeof(struct hash_entry *));
+    if (!h->buckets) {
 	free(h);
 	return NULL;
     }
-    pthread_mutex_init(&h->mutex, NULL);
+    h->nbuckets = HASH_MINBUCKETS;
+    h->count = 0;
+    /* racy, but any value will do */
+    seed = seed * 1103515245u + (uint32_t)time(NULL) + (uint32_t)(uintptr_t)h;
+    h->seed = seed;
+    pthread_rwlock_init(&h->lock, NULL);
     return h;
 }
 
 /* frees all memory associated with the hash */
 void hash_destroy(struct hash *h) {
-    struct list_node *ln;
+    struct hash_entry *e, *next;
+    uint32_t i;
 
     if (!h)
 	return;
-    for (ln = list_first(h->hashlist); ln; ln = list_next(ln)) {
-	free(((struct hash_entry *)ln->data)->key);
-	free(((struct hash_entry *)ln->data)->data);
+    for (i = 0; i < h->nbuckets; i++)
+	for (e = h->buckets[i]; e; e = next) {
+	    next = e->next;
+	    free(e->data);
+	    free(e);
+	}
+    free(h->buckets);
+    pthread_rwlock_destroy(&h->lock);
+    free(h);
+}
+
+/* doubles the number of buckets, keeping the order of each chain so
+ * that the oldest of equal keys is still found first; must hold write
+ * lock. If malloc fails we just carry on with longer chains */
+static void hash_grow(struct hash *h) {
+    struct hash_entry **buckets, **tails, *e, *next;
+    uint32_t i, n = h->nbuckets * 2;
+
+    buckets = calloc(n, sizeof(struct hash_entry *));
+    tails = calloc(n, sizeof(struct hash_entry *));
+    if (!buckets || !tails) {
+	free(buckets);
+	free(tails);
+	return;
     }
-    list_destroy(h->hashlist);
-    pthread_mutex_destroy(&h->mutex);
+    for (i = 0; i < h->nbuckets; i++)
+	for (e = h->buckets[i]; e; e = next) {
+	    next = e->next;
+	    e->next = NULL;
+	    if (tails[e->hashval & (n - 1)])
+		tails[e->hashval & (n - 1)]->next = e;
+	    else
+		buckets[e->hashval & (n - 1)] = e;
+	    tails[e->hashval & (n - 1)] = e;
+	}
+    free(tails);
+    free(h->buckets);
+    h->buckets = buckets;
+    h->nbuckets = n;
 }
 
 /* insert entry in hash; returns 1 if ok, 0 if malloc fails */
 int hash_insert(struct hash *h, void *key, uint32_t keylen, void *data) {
-    struct hash_entry *e;
+    struct hash_entry *e, **p;
 
     if (!h)
 	return 0;
-    e = malloc(sizeof(struct hash_entry));
+    /* key is stored right after the entry */
+    e = malloc(sizeof(struct hash_entry) + keylen);
     if (!e)
 	return 0;
-    memset(e, 0, sizeof(struct hash_entry));
-    e->key = malloc(keylen);
-    if (!e->key) {
-	free(e);
-	return 0;
-    }
+    e->key = e + 1;
     memcpy(e->key, key, keylen);
     e->keylen = keylen;
     e->data = data;
-    pthread_mutex_lock(&h->mutex);
-    if (!list_push(h->hashlist, e)) {
-	pthread_mutex_unlock(&h->mutex);
-	free(e->key);
-	free(e);
-	return 0;
-    }
-    pthread_mutex_unlock(&h->mutex);
+    e->hashval = hashkey(h->seed, key, keylen);
+    e->next = NULL;
+    e->hash = h;
+    pthread_rwlock_wrlock(&h->lock);
+    if (h->count >= h->nbuckets * HASH_MAXLOAD)
+	hash_grow(h);
+    for (p = &h->buckets[e->hashval & (h->nbuckets - 1)]; *p; p = &(*p)->next);
+    *p = e;
+    h->count++;
+    pthread_rwlock_unlock(&h->lock);
     return 1;
 }
 
+/* returns pointer to the link pointing at the first entry matching
+ * key, or to the final NULL link; must hold lock */
+static struct hash_entry **hash_find(struct hash *h, void *key, uint32_t keylen) {
+    struct hash_entry **p;
+    uint32_t hashval = hashkey(h->seed, key, keylen);
+
+    for (p = &h->buckets[hashval & (h->nbuckets - 1)]; *p; p = &(*p)->next)
+	if ((*p)->hashval == hashval && (*p)->keylen == keylen && !memcmp((*p)->key, key, keylen))
+	    break;
+    return p;
+}
+
 /* reads entry from hash */
 void *hash_read(struct hash *h, void *key, uint32_t keylen) {
-    struct list_node *ln;
     struct hash_entry *e;
+    void *data = NULL;
 
     if (!h)
 	return 0;
-    pthread_mutex_lock(&h->mutex);
-    for (ln = list_first(h->hashlist); ln; ln = list_next(ln)) {
-	e = (struct hash_entry *)ln->data;
-	if (e->keylen == keylen && !memcmp(e->key, key, keylen)) {
-	    pthread_mutex_unlock(&h->mutex);
-	    return e->data;
-	}
-    }
-    pthread_mutex_unlock(&h->mutex);
-    return NULL;
+    pthread_rwlock_rdlock(&h->lock);
+    e = *hash_find(h, key, keylen);
+    if (e)
+	data = e->data;
+    pthread_rwlock_unlock(&h->lock);
+    return data;
 }
 
 /* extracts entry from hash */
 void *hash_extract(struct hash *h, void *key, uint32_t keylen) {
-    struct list_node *ln;
-    struct hash_entry *e;
-    void *data;
+    struct hash_entry **p, *e;
+    void *data = NULL;
 
     if (!h)
 	return 0;
-    pthread_mutex_lock(&h->mutex);
-    for (ln = list_first(h->hashlist); ln; ln = list_next(ln)) {
-	e = (struct hash_entry *)ln->data;
-	if (e->keylen == keylen && !memcmp(e->key, key, keylen)) {
-	    free(e->key);
-	    list_removedata(h->hashlist, e);
-	    data = e->data;
-	    free(e);
-	    pthread_mutex_unlock(&h->mutex);
-	    return data;
-	}
+    pthread_rwlock_wrlock(&h->lock);
+    p = hash_find(h, key, keylen);
+    e = *p;
+    if (e) {
+	*p = e->next;
+	h->count--;
+	data = e->data;
+	free(e);
     }
-    pthread_mutex_unlock(&h->mutex);
-    return NULL;
+    pthread_rwlock_unlock(&h->lock);
+    return data;
+}
+
+/* returns first entry in bucket i or any later bucket */
+static struct hash_entry *hash_firstfrom(struct hash *h, uint32_t i) {
+    struct hash_entry *e = NULL;
+
+    pthread_rwlock_rdlock(&h->lock);
+    for (; i < h->nbuckets && !(e = h->buckets[i]); i++);
+    pthread_rwlock_unlock(&h->lock);
+    return e;
 }
 
 /* returns first entry */
 struct hash_entry *hash_first(struct hash *hash) {
-    struct list_node *ln;
-    struct hash_entry *e;
-    if (!hash || !((ln = list_first(hash->hashlist))))
+    if (!hash)
 	return NULL;
-    e = (struct hash_entry *)ln->data;
-    e->next = ln->next;
-    return e;
+    return hash_firstfrom(hash, 0);
 }
 
 /* returns the next node after the argument */
 struct hash_entry *hash_next(struct hash_entry *entry) {
-    struct hash_entry *e;
-    if (!entry || !entry->next)
+    if (!entry)
 	return NULL;
-    e = (struct hash_entry *)entry->next->data;
-    e->next = (struct list_node *)entry->next->next;
-    return e;
+    if (entry->next)
+	return entry->next;
+    return hash_firstfrom(entry->hash, (entry->hashval & (entry->hash->nbuckets - 1)) + 1);
 }
 
 /* Local Variables: */
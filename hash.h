@@ -5,16 +5,23 @@
 #include <stdint.h>
 #endif
 
+/* A chained hash table, growing as entries are added. Reads take a
+ * shared lock, so lookups from many threads don't serialise. */
 struct hash {
-    struct list *hashlist;
-    pthread_mutex_t mutex;
+    struct hash_entry **buckets;
+    uint32_t nbuckets; /* always a power of two */
+    uint32_t count;
+    uint32_t seed;
+    pthread_rwlock_t lock;
 };
 
 struct hash_entry {
     void *key;
     uint32_t keylen;
     void *data;
-    struct list_node *next; /* used when walking through hash */
+    uint32_t hashval;
+    struct hash_entry *next; /* next in bucket */
+    struct hash *hash; /* used when walking through hash */
 };
 
 /* allocates and initialises hash structure; returns NULL if malloc fails */
@@ -35,7 +42,9 @@ void *hash_extract(struct hash *hash, void *key, uint32_t keylen);
 /* returns first entry */
 struct hash_entry *hash_first(struct hash *hash);
 
-/* returns the next entry after the argument */
+/* returns the next entry after the argument, walking through the hash
+ * is not locked and the hash must not be modified meanwhile, except
+ * for extracting entries already walked past */
 struct hash_entry *hash_next(struct hash_entry *entry);
 
 /* Local Variables: */
@@ -2,22 +2,195 @@
  * Copyright (c) 2012,2016 NORDUnet A/S */
 /* See LICENSE for licensing information. */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
 #include "debug.h"
 #include "util.h"
 #include "list.h"
+#include "hash.h"
 #include "hostport.h"
 
+#define RESOLVE_THREADS 16
+#define ADDRCACHE_TTL 300
+
+/* What a name and port resolved to, shared by the hostports resolved
+ * the same way until ADDRCACHE_TTL seconds later. An entry replaced
+ * in addrcaches is freed with the last hostport holding it. */
+struct addrcache {
+    char *key;
+    uint32_t keylen;
+    char *host, *port;
+    struct addrinfo hints;
+    struct addrinfo *addrinfo;
+    time_t expiry;
+    uint32_t refcount;
+    uint8_t cached; /* in addrcaches */
+};
+
+static struct hash *addrcaches;
+static pthread_mutex_t addrcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* a hostport to resolve, or a cache entry to refresh, in a thread */
+struct resolvejob {
+    struct hostportres *hp;
+    int af, socktype;
+    struct addrcache *cache;
+    int ok; /* for refreshes, if the addresses changed */
+};
+
+struct resolvejobs {
+    struct resolvejob *jobs;
+    int n, next;
+    pthread_mutex_t lock;
+};
+
+/* set while the config is first read, no other threads running */
+static struct resolvejobs *batch;
+
+static void freeaddrcache(struct addrcache *c) {
+    freeaddrinfo(c->addrinfo);
+    free(c->key);
+    free(c->host);
+    free(c->port);
+    free(c);
+}
+
+static void addrcache_release(struct addrcache *c) {
+    pthread_mutex_lock(&addrcache_lock);
+    if (!--c->refcount && !c->cached)
+	freeaddrcache(c);
+    pthread_mutex_unlock(&addrcache_lock);
+}
+
+/* drops the entries expired and not held; called with the lock held */
+static void addrcache_purge(time_t now) {
+    struct hash_entry *e, *next;
+    struct addrcache *c;
+
+    for (e = hash_first(addrcaches); e; e = next) {
+	next = hash_next(e);
+	c = (struct addrcache *)e->data;
+	if (c->refcount || c->expiry > now)
+	    continue;
+	hash_extract(addrcaches, c->key, c->keylen);
+	freeaddrcache(c);
+    }
+}
+
+/* returns a held entry for the lookup, or NULL if there is no fresh one */
+static struct addrcache *addrcache_get(const char *key, uint32_t keylen) {
+    struct addrcache *c;
+
+    pthread_mutex_lock(&addrcache_lock);
+    c = addrcaches ? hash_read(addrcaches, (void *)key, keylen) : NULL;
+    if (c && c->expiry > time(NULL))
+	c->refcount++;
+    else
+	c = NULL;
+    pthread_mutex_unlock(&addrcache_lock);
+    return c;
+}
+
+/* Adds what the lookup resolved to, replacing any entry for it, and
+ * returns the new entry held, or NULL, with res left to the caller,
+ * if malloc fails. Takes over key. */
+static struct addrcache *addrcache_put(char *key, uint32_t keylen, const char *host, const char *port, const struct addrinfo *hints, struct addrinfo *res) {
+    static time_t nextpurge;
+    struct addrcache *c, *old;
+    time_t now = time(NULL);
+
+    c = calloc(1, sizeof(struct addrcache));
+    if (!c || (host && !(c->host = stringcopy(host, 0))) ||
+	(port && !(c->port = stringcopy(port, 0)))) {
+	if (c) {
+	    free(c->host);
+	    free(c);
+	}
+	free(key);
+	return NULL;
+    }
+    c->key = key;
+    c->keylen = keylen;
+    c->hints = *hints;
+    c->addrinfo = res;
+    c->expiry = now + ADDRCACHE_TTL;
+    c->refcount = 1;
+
+    pthread_mutex_lock(&addrcache_lock);
+    if (!addrcaches)
+	addrcaches = hash_create();
+    old = addrcaches ? hash_extract(addrcaches, key, keylen) : NULL;
+    if (old) {
+	old->cached = 0;
+	if (!old->refcount)
+	    freeaddrcache(old);
+    }
+    if (addrcaches && now >= nextpurge) {
+	addrcache_purge(now);
+	nextpurge = now + ADDRCACHE_TTL;
+    }
+    c->cached = hash_insert(addrcaches, key, keylen, c);
+    pthread_mutex_unlock(&addrcache_lock);
+    return c;
+}
+
+static char *addrcachekey(const char *host, const char *port, const struct addrinfo *hints, uint32_t *keylen) {
+    size_t size = strlen(host) + (port ? strlen(port) : 0) + 40;
+    char *key;
+
+    key = malloc(size);
+    if (key)
+	*keylen = snprintf(key, size, "%d %d %d %s %s", hints->ai_family, hints->ai_socktype,
+			   hints->ai_flags, host, port ? port : "");
+    return key;
+}
+
+/* getaddrinfo() into hp->addrinfo, through the address cache */
+static int getaddrinfocached(struct hostportres *hp, const struct addrinfo *hints) {
+    struct addrinfo *res;
+    uint32_t keylen;
+    char *key;
+    int r;
+
+    key = addrcachekey(hp->host, hp->port, hints, &keylen);
+    if (!key)
+	return getaddrinfo(hp->host, hp->port, hints, &hp->addrinfo);
+    hp->cache = addrcache_get(key, keylen);
+    if (hp->cache) {
+	free(key);
+	hp->addrinfo = hp->cache->addrinfo;
+	return 0;
+    }
+    r = getaddrinfo(hp->host, hp->port, hints, &res);
+    if (r) {
+	free(key);
+	return r;
+    }
+    hp->addrinfo = res;
+    hp->cache = addrcache_put(key, keylen, hp->host, hp->port, hints, res);
+    return 0;
+}
+
+static void releaseaddrinfo(struct hostportres *hp) {
+    if (hp->cache)
+	addrcache_release(hp->cache);
+    else if (hp->addrinfo)
+	freeaddrinfo(hp->addrinfo);
+    hp->cache = NULL;
+    hp->addrinfo = NULL;
+}
+
 void freehostport(struct hostportres *hp) {
     if (hp) {
 	free(hp->host);
 	free(hp->port);
-	if (hp->addrinfo)
-	    freeaddrinfo(hp->addrinfo);
+	releaseaddrinfo(hp);
 	free(hp);
     }
 }
@@ -143,7 +316,9 @@ int resolvehostport(struct hostportres *hp, int af, int socktype, uint8_t passiv
     } else {
 	if (hp->prefixlen != 255)
 	    hints.ai_flags |= AI_NUMERICHOST;
-	if (getaddrinfo(hp->host, hp->port, &hints, &hp->addrinfo)) {
+	if (passive || !hp->host
+	    ? getaddrinfo(hp->host, hp->port, &hints, &hp->addrinfo)
+	    : getaddrinfocached(hp, &hints)) {
 	    debug(DBG_WARN, "resolvehostport: can't resolve %s port %s", hp->host ? hp->host : "(null)", hp->port ? hp->port : "(null)");
 	    goto errexit;
 	}
@@ -170,8 +345,7 @@ int resolvehostport(struct hostportres *hp, int af, int socktype, uint8_t passiv
     return 1;
 
 errexit:
-    if (hp->addrinfo)
-	freeaddrinfo(hp->addrinfo);
+    releaseaddrinfo(hp);
     return 0;
 }
 
@@ -211,15 +385,176 @@ void freehostports(struct list *hostports) {
 int resolvehostports(struct list *hostports, int af, int socktype) {
     struct list_node *entry;
     struct hostportres *hp;
+    struct resolvejob *jobs;
 
     for (entry = list_first(hostports); entry; entry = list_next(entry)) {
 	hp = (struct hostportres *)entry->data;
-	if (!hp->addrinfo && !resolvehostport(hp, af, socktype, 0))
+	if (hp->addrinfo)
+	    continue;
+	if (batch) {
+	    jobs = realloc(batch->jobs, (batch->n + 1) * sizeof(struct resolvejob));
+	    if (!jobs) {
+		debug(DBG_ERR, "resolvehostports: malloc failed");
+		return 0;
+	    }
+	    memset(&jobs[batch->n], 0, sizeof(struct resolvejob));
+	    jobs[batch->n].hp = hp;
+	    jobs[batch->n].af = af;
+	    jobs[batch->n].socktype = socktype;
+	    batch->jobs = jobs;
+	    batch->n++;
+	} else if (!resolvehostport(hp, af, socktype, 0))
 	    return 0;
     }
     return 1;
 }
 
+/* returns 1 if a and b have the same addresses, in any order */
+static int sameaddrinfo(struct addrinfo *a, struct addrinfo *b) {
+    struct addrinfo *x, *y, *l[2] = { a, b };
+    int i;
+
+    for (i = 0; i < 2; i++)
+	for (x = l[i]; x; x = x->ai_next) {
+	    for (y = l[!i]; y; y = y->ai_next)
+		if (x->ai_addrlen == y->ai_addrlen && !memcmp(x->ai_addr, y->ai_addr, x->ai_addrlen))
+		    break;
+	    if (!y)
+		return 0;
+	}
+    return 1;
+}
+
+int sameaddresses(struct list *a, struct list *b) {
+    struct list_node *x, *y;
+    struct hostportres *hpa, *hpb;
+
+    for (x = list_first(a), y = list_first(b); x && y; x = list_next(x), y = list_next(y)) {
+	hpa = (struct hostportres *)x->data;
+	hpb = (struct hostportres *)y->data;
+	if (hpa->addrinfo != hpb->addrinfo && !sameaddrinfo(hpa->addrinfo, hpb->addrinfo))
+	    return 0;
+    }
+    return !x && !y;
+}
+
+/* looks up what a cache entry is for again, replacing it if the
+ * addresses changed and else keeping it for longer */
+static void refreshaddrcache(struct resolvejob *job) {
+    struct addrcache *c = job->cache, *new;
+    struct addrinfo *res;
+    char *key;
+
+    if (getaddrinfo(c->host, c->port, &c->hints, &res)) {
+	debug(DBG_WARN, "refreshaddrcache: can't resolve %s port %s, keeping its addresses",
+	      c->host, c->port ? c->port : "(null)");
+	return;
+    }
+    if (sameaddrinfo(c->addrinfo, res)) {
+	freeaddrinfo(res);
+	pthread_mutex_lock(&addrcache_lock);
+	c->expiry = time(NULL) + ADDRCACHE_TTL;
+	pthread_mutex_unlock(&addrcache_lock);
+	return;
+    }
+    debug(DBG_INFO, "refreshaddrcache: %s port %s now resolves to %s",
+	  c->host, c->port ? c->port : "(null)", addr2string(res->ai_addr));
+    job->ok = 1;
+    key = stringcopy(c->key, c->keylen);
+    new = key ? addrcache_put(key, c->keylen, c->host, c->port, &c->hints, res) : NULL;
+    if (new)
+	addrcache_release(new);
+    else
+	freeaddrinfo(res);
+}
+
+static void *resolveworker(void *arg) {
+    struct resolvejobs *jobs = (struct resolvejobs *)arg;
+    struct resolvejob *job;
+
+    for (;;) {
+	pthread_mutex_lock(&jobs->lock);
+	job = jobs->next < jobs->n ? &jobs->jobs[jobs->next++] : NULL;
+	pthread_mutex_unlock(&jobs->lock);
+	if (!job)
+	    return NULL;
+	if (job->cache)
+	    refreshaddrcache(job);
+	else
+	    job->ok = resolvehostport(job->hp, job->af, job->socktype, 0);
+    }
+}
+
+/* runs the jobs in up to RESOLVE_THREADS threads, this one included */
+static void runresolvejobs(struct resolvejobs *jobs) {
+    pthread_t threads[RESOLVE_THREADS - 1];
+    int i, n;
+
+    jobs->next = 0;
+    pthread_mutex_init(&jobs->lock, NULL);
+    for (n = 0; n < RESOLVE_THREADS - 1 && n < jobs->n - 1; n++)
+	if (pthread_create(&threads[n], NULL, resolveworker, jobs))
+	    break;
+    resolveworker(jobs);
+    for (i = 0; i < n; i++)
+	pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&jobs->lock);
+}
+
+void resolvebatch_open() {
+    batch = calloc(1, sizeof(struct resolvejobs));
+    if (!batch)
+	debug(DBG_ERR, "resolvebatch_open: malloc failed, resolving one by one");
+}
+
+int resolvebatch_close() {
+    struct resolvejobs *jobs = batch;
+    int i, ok = 1;
+
+    if (!jobs)
+	return 1;
+    batch = NULL;
+    runresolvejobs(jobs);
+    for (i = 0; i < jobs->n; i++)
+	ok &= jobs->jobs[i].ok;
+    free(jobs->jobs);
+    free(jobs);
+    return ok;
+}
+
+int addrcache_refresh(uint8_t all) {
+    struct resolvejobs jobs;
+    struct hash_entry *e;
+    struct addrcache *c;
+    int i, changed = 0;
+    time_t now = time(NULL);
+
+    memset(&jobs, 0, sizeof(jobs));
+    pthread_mutex_lock(&addrcache_lock);
+    if (addrcaches) {
+	addrcache_purge(now);
+	for (i = 0, e = hash_first(addrcaches); e; e = hash_next(e))
+	    i++;
+	jobs.jobs = i ? calloc(i, sizeof(struct resolvejob)) : NULL;
+	for (e = jobs.jobs ? hash_first(addrcaches) : NULL; e; e = hash_next(e)) {
+	    c = (struct addrcache *)e->data;
+	    if (!all && c->expiry > now)
+		continue;
+	    c->refcount++;
+	    jobs.jobs[jobs.n++].cache = c;
+	}
+    }
+    pthread_mutex_unlock(&addrcache_lock);
+
+    runresolvejobs(&jobs);
+    for (i = 0; i < jobs.n; i++) {
+	changed += jobs.jobs[i].ok;
+	addrcache_release(jobs.jobs[i].cache);
+    }
+    free(jobs.jobs);
+    return changed;
+}
+
 struct addrinfo *resolvepassiveaddrinfo(char *hostport, int af, char *default_port, int socktype) {
     struct addrinfo *ai = NULL;
     struct hostportres *hp = newhostport(hostport, default_port, 0);
@@ -284,6 +619,140 @@ int addressmatches(struct list *hostports, struct sockaddr *addr, uint8_t checkp
     return 0;
 }
 
+struct addrtrie_entry {
+    uint32_t order;
+    void *data;
+};
+
+struct addrtrie_node {
+    struct addrtrie_node *child[2];
+    struct addrtrie_entry *entries; /* sorted by order */
+    uint32_t nentries;
+};
+
+/* one binary trie per address family, one level per address bit */
+struct addrtrie {
+    struct addrtrie_node *root4, *root6;
+};
+
+struct addrtrie *addrtrie_create() {
+    return calloc(1, sizeof(struct addrtrie));
+}
+
+static void freetrienode(struct addrtrie_node *node) {
+    if (node) {
+	freetrienode(node->child[0]);
+	freetrienode(node->child[1]);
+	free(node->entries);
+	free(node);
+    }
+}
+
+void addrtrie_free(struct addrtrie *trie) {
+    if (trie) {
+	freetrienode(trie->root4);
+	freetrienode(trie->root6);
+	free(trie);
+    }
+}
+
+#define ADDRBIT(a, i) ((((uint8_t *)(a))[(i) / 8] >> (7 - (i) % 8)) & 1)
+
+static int trieinsert(struct addrtrie_node **root, uint8_t *a, uint8_t bits, uint32_t order, void *data) {
+    struct addrtrie_node *node;
+    struct addrtrie_entry *entries;
+    uint32_t i;
+    uint8_t b;
+
+    for (b = 0;; b++) {
+	if (!*root) {
+	    *root = calloc(1, sizeof(struct addrtrie_node));
+	    if (!*root)
+		return 0;
+	}
+	node = *root;
+	if (b == bits)
+	    break;
+	root = &node->child[ADDRBIT(a, b)];
+    }
+
+    for (i = 0; i < node->nentries; i++)
+	if (node->entries[i].data == data)
+	    return 1;
+    entries = realloc(node->entries, (node->nentries + 1) * sizeof(struct addrtrie_entry));
+    if (!entries)
+	return 0;
+    node->entries = entries;
+    for (i = node->nentries; i > 0 && entries[i - 1].order > order; i--)
+	entries[i] = entries[i - 1];
+    entries[i].order = order;
+    entries[i].data = data;
+    node->nentries++;
+    return 1;
+}
+
+int addrtrie_addhostports(struct addrtrie *trie, struct list *hostports, uint32_t order, void *data) {
+    struct list_node *entry;
+    struct hostportres *hp;
+    struct addrinfo *res;
+    uint8_t bits;
+
+    for (entry = list_first(hostports); entry; entry = list_next(entry)) {
+	hp = (struct hostportres *)entry->data;
+	for (res = hp->addrinfo; res; res = res->ai_next)
+	    switch (res->ai_family) {
+	    case AF_INET:
+		bits = hp->prefixlen == 255 || hp->prefixlen > 32 ? 32 : hp->prefixlen;
+		if (!trieinsert(&trie->root4, (uint8_t *)&((struct sockaddr_in *)res->ai_addr)->sin_addr, bits, order, data))
+		    return 0;
+		break;
+	    case AF_INET6:
+		bits = hp->prefixlen == 255 || hp->prefixlen > 128 ? 128 : hp->prefixlen;
+		if (!trieinsert(&trie->root6, (uint8_t *)&((struct sockaddr_in6 *)res->ai_addr)->sin6_addr, bits, order, data))
+		    return 0;
+		break;
+	    }
+    }
+    return 1;
+}
+
+void *addrtrie_lookup(struct addrtrie *trie, struct sockaddr *addr, int (*accept)(void *data, void *arg), void *arg) {
+    struct addrtrie_node *node;
+    struct addrtrie_entry *best = NULL;
+    struct sockaddr_in6 *sa6;
+    uint8_t *a, b, bits;
+    uint32_t i;
+
+    if (addr->sa_family == AF_INET6) {
+	sa6 = (struct sockaddr_in6 *)addr;
+	if (IN6_IS_ADDR_V4MAPPED(&sa6->sin6_addr)) {
+	    a = &sa6->sin6_addr.s6_addr[12];
+	    node = trie->root4;
+	    bits = 32;
+	} else {
+	    a = (uint8_t *)&sa6->sin6_addr;
+	    node = trie->root6;
+	    bits = 128;
+	}
+    } else {
+	a = (uint8_t *)&((struct sockaddr_in *)addr)->sin_addr;
+	node = trie->root4;
+	bits = 32;
+    }
+
+    for (b = 0; node; b++) {
+	for (i = 0; i < node->nentries && (!best || node->entries[i].order < best->order); i++)
+	    if (accept(node->entries[i].data, arg)) {
+		best = &node->entries[i];
+		break;
+	    }
+	if (b == bits)
+	    break;
+	node = node->child[ADDRBIT(a, b)];
+    }
+    return best ? best->data : NULL;
+}
+
 int connecttcphostlist(struct list *hostports,  struct addrinfo *src) {
     int s;
     struct list_node *entry;
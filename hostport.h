@@ -7,6 +7,7 @@ struct hostportres {
     char *port;
     uint8_t prefixlen;
     struct addrinfo *addrinfo;
+    struct addrcache *cache; /* holding addrinfo, unless NULL */
 };
 
 struct hostportres *newhostport(char *hostport, char *default_port, uint8_t prefixok);
@@ -18,6 +19,33 @@ int resolvehostports(struct list *hostports, int af, int socktype);
 struct addrinfo *resolvepassiveaddrinfo(char *hostport, int af, char *default_port, int socktype);
 int addressmatches(struct list *hostports, struct sockaddr *addr, uint8_t checkport);
 int connecttcphostlist(struct list *hostports,  struct addrinfo *src);
+/* returns 1 if the hostports, parsed from the same hosts, resolved to
+ * the same addresses */
+int sameaddresses(struct list *a, struct list *b);
+
+/* While a batch is open, resolvehostports() only queues what is to be
+ * resolved, and closing the batch resolves all of it in parallel,
+ * returning 0 if anything failed. Only for reading the config before
+ * other threads are started. */
+void resolvebatch_open();
+int resolvebatch_close();
+/* looks up again, in parallel, the names in the address cache that
+ * expired, or all of them; returns how many now resolve to other
+ * addresses than those held */
+int addrcache_refresh(uint8_t all);
+
+/* An index from addresses and prefixes to data, for finding the first
+ * of many hostport lists matching an address without trying them all.
+ * It is not locked and must not be modified while being looked up. */
+struct addrtrie;
+struct addrtrie *addrtrie_create();
+void addrtrie_free(struct addrtrie *trie);
+/* adds data under all addresses and prefixes in hostports; returns 1
+ * if ok, 0 if malloc fails */
+int addrtrie_addhostports(struct addrtrie *trie, struct list *hostports, uint32_t order, void *data);
+/* returns the data with the lowest order among those added for an
+ * address or prefix covering addr and for which accept returns 1 */
+void *addrtrie_lookup(struct addrtrie *trie, struct sockaddr *addr, int (*accept)(void *data, void *arg), void *arg);
 
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
@@ -4,6 +4,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include "list.h"
+#include "pool.h"
+
+/* lists come and go with every message */
+static struct pool listpool = POOL_INITIALIZER("list", sizeof(struct list), 32, 64);
+static struct pool nodepool = POOL_INITIALIZER("list node", sizeof(struct list_node), 64, 64);
 
 /* Private helper functions. */
 static void list_free_helper_(struct list *list, int free_data_flag) {
@@ -16,16 +21,16 @@ static void list_free_helper_(struct list *list, int free_data_flag) {
         if (free_data_flag)
             free(node->data);
 	next = node->next;
-	free(node);
+	pool_put(&nodepool, node);
     }
-    free(list);
+    pool_put(&listpool, list);
 }
 
 /* Public functions. */
 
 /* allocates and initialises list structure; returns NULL if malloc fails */
 struct list *list_create() {
-    struct list *list = malloc(sizeof(struct list));
+    struct list *list = pool_get(&listpool);
     if (list)
 	memset(list, 0, sizeof(struct list));
     return list;
@@ -49,7 +54,7 @@ void list_free(struct list *list) {
 int list_push(struct list *list, void *data) {
     struct list_node *node;
 
-    node = malloc(sizeof(struct list_node));
+    node = pool_get(&nodepool);
     if (!node)
 	return 0;
 
@@ -79,7 +84,7 @@ void *list_shift(struct list *list) {
     if (!list->first)
 	list->last = NULL;
     data = node->data;
-    free(node);
+    pool_put(&nodepool, node);
     list->count--;
     return data;
 }
@@ -94,7 +99,7 @@ void list_removedata(struct list *list, void *data) {
     node = list->first;
     while (node->data == data) {
 	list->first = node->next;
-	free(node);
+	pool_put(&nodepool, node);
 	list->count--;
 	node = list->first;
 	if (!node) {
@@ -106,7 +111,7 @@ void list_removedata(struct list *list, void *data) {
 	if (node->next->data == data) {
 	    t = node->next;
 	    node->next = t->next;
-	    free(t);
+	    pool_put(&nodepool, t);
 	    list->count--;
 	    if (!node->next) { /* we removed the last one */
 		list->last = node;
@@ -115,6 +120,22 @@ void list_removedata(struct list *list, void *data) {
 	}
 }
 
+/* removes the node after prev, or the first if prev is NULL, and
+ * returns the node that then follows prev */
+struct list_node *list_removenext(struct list *list, struct list_node *prev) {
+    struct list_node *node = prev ? prev->next : list->first;
+
+    if (prev)
+	prev->next = node->next;
+    else
+	list->first = node->next;
+    if (list->last == node)
+	list->last = prev;
+    list->count--;
+    pool_put(&nodepool, node);
+    return prev ? prev->next : list->first;
+}
+
 /* returns first node */
 struct list_node *list_first(struct list *list) {
     return list ? list->first : NULL;
@@ -35,6 +35,10 @@ void *list_shift(struct list *list);
 /* removes first entry with matching data pointer */
 void list_removedata(struct list *list, void *data);
 
+/* removes the node after prev, or the first if prev is NULL, and
+ * returns the node that then follows prev */
+struct list_node *list_removenext(struct list *list, struct list_node *prev);
+
 /* returns first node */
 struct list_node *list_first(struct list *list);
 
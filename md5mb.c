@@ -0,0 +1,259 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <string.h>
+#include <stdint.h>
+#include <nettle/md5.h>
+#include "md5mb.h"
+
+typedef uint32_t md5v __attribute__ ((vector_size (MD5MB_LANES * 4)));
+
+static const uint8_t zeroblock[64];
+
+#define F1(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define F2(x, y, z) F1(z, x, y)
+#define F3(x, y, z) ((x) ^ (y) ^ (z))
+#define F4(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f, a, b, c, d, k, s, t) do {		\
+	a += f(b, c, d) + w[k] + (uint32_t)(t);		\
+	a = ((a << s) | (a >> (32 - s))) + b;		\
+    } while (0)
+
+/* the MD5 compression function, on one block per lane */
+static void compress(md5v *state, const md5v *w) {
+    md5v a = state[0], b = state[1], c = state[2], d = state[3];
+
+    STEP(F1, a, b, c, d, 0, 7, 0xd76aa478);
+    STEP(F1, d, a, b, c, 1, 12, 0xe8c7b756);
+    STEP(F1, c, d, a, b, 2, 17, 0x242070db);
+    STEP(F1, b, c, d, a, 3, 22, 0xc1bdceee);
+    STEP(F1, a, b, c, d, 4, 7, 0xf57c0faf);
+    STEP(F1, d, a, b, c, 5, 12, 0x4787c62a);
+    STEP(F1, c, d, a, b, 6, 17, 0xa8304613);
+    STEP(F1, b, c, d, a, 7, 22, 0xfd469501);
+    STEP(F1, a, b, c, d, 8, 7, 0x698098d8);
+    STEP(F1, d, a, b, c, 9, 12, 0x8b44f7af);
+    STEP(F1, c, d, a, b, 10, 17, 0xffff5bb1);
+    STEP(F1, b, c, d, a, 11, 22, 0x895cd7be);
+    STEP(F1, a, b, c, d, 12, 7, 0x6b901122);
+    STEP(F1, d, a, b, c, 13, 12, 0xfd987193);
+    STEP(F1, c, d, a, b, 14, 17, 0xa679438e);
+    STEP(F1, b, c, d, a, 15, 22, 0x49b40821);
+
+    STEP(F2, a, b, c, d, 1, 5, 0xf61e2562);
+    STEP(F2, d, a, b, c, 6, 9, 0xc040b340);
+    STEP(F2, c, d, a, b, 11, 14, 0x265e5a51);
+    STEP(F2, b, c, d, a, 0, 20, 0xe9b6c7aa);
+    STEP(F2, a, b, c, d, 5, 5, 0xd62f105d);
+    STEP(F2, d, a, b, c, 10, 9, 0x02441453);
+    STEP(F2, c, d, a, b, 15, 14, 0xd8a1e681);
+    STEP(F2, b, c, d, a, 4, 20, 0xe7d3fbc8);
+    STEP(F2, a, b, c, d, 9, 5, 0x21e1cde6);
+    STEP(F2, d, a, b, c, 14, 9, 0xc33707d6);
+    STEP(F2, c, d, a, b, 3, 14, 0xf4d50d87);
+    STEP(F2, b, c, d, a, 8, 20, 0x455a14ed);
+    STEP(F2, a, b, c, d, 13, 5, 0xa9e3e905);
+    STEP(F2, d, a, b, c, 2, 9, 0xfcefa3f8);
+    STEP(F2, c, d, a, b, 7, 14, 0x676f02d9);
+    STEP(F2, b, c, d, a, 12, 20, 0x8d2a4c8a);
+
+    STEP(F3, a, b, c, d, 5, 4, 0xfffa3942);
+    STEP(F3, d, a, b, c, 8, 11, 0x8771f681);
+    STEP(F3, c, d, a, b, 11, 16, 0x6d9d6122);
+    STEP(F3, b, c, d, a, 14, 23, 0xfde5380c);
+    STEP(F3, a, b, c, d, 1, 4, 0xa4beea44);
+    STEP(F3, d, a, b, c, 4, 11, 0x4bdecfa9);
+    STEP(F3, c, d, a, b, 7, 16, 0xf6bb4b60);
+    STEP(F3, b, c, d, a, 10, 23, 0xbebfbc70);
+    STEP(F3, a, b, c, d, 13, 4, 0x289b7ec6);
+    STEP(F3, d, a, b, c, 0, 11, 0xeaa127fa);
+    STEP(F3, c, d, a, b, 3, 16, 0xd4ef3085);
+    STEP(F3, b, c, d, a, 6, 23, 0x04881d05);
+    STEP(F3, a, b, c, d, 9, 4, 0xd9d4d039);
+    STEP(F3, d, a, b, c, 12, 11, 0xe6db99e5);
+    STEP(F3, c, d, a, b, 15, 16, 0x1fa27cf8);
+    STEP(F3, b, c, d, a, 2, 23, 0xc4ac5665);
+
+    STEP(F4, a, b, c, d, 0, 6, 0xf4292244);
+    STEP(F4, d, a, b, c, 7, 10, 0x432aff97);
+    STEP(F4, c, d, a, b, 14, 15, 0xab9423a7);
+    STEP(F4, b, c, d, a, 5, 21, 0xfc93a039);
+    STEP(F4, a, b, c, d, 12, 6, 0x655b59c3);
+    STEP(F4, d, a, b, c, 3, 10, 0x8f0ccc92);
+    STEP(F4, c, d, a, b, 10, 15, 0xffeff47d);
+    STEP(F4, b, c, d, a, 1, 21, 0x85845dd1);
+    STEP(F4, a, b, c, d, 8, 6, 0x6fa87e4f);
+    STEP(F4, d, a, b, c, 15, 10, 0xfe2ce6e0);
+    STEP(F4, c, d, a, b, 6, 15, 0xa3014314);
+    STEP(F4, b, c, d, a, 13, 21, 0x4e0811a1);
+    STEP(F4, a, b, c, d, 4, 6, 0xf7537e82);
+    STEP(F4, d, a, b, c, 11, 10, 0xbd3af235);
+    STEP(F4, c, d, a, b, 2, 15, 0x2ad7d2bb);
+    STEP(F4, b, c, d, a, 9, 21, 0xeb86d391);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+/* transposes the blocks, one per lane, into words across the lanes */
+static void load(md5v *w, const uint8_t *const *blocks) {
+    const uint8_t *p;
+    int j, l;
+
+    for (l = 0; l < MD5MB_LANES; l++)
+	for (j = 0, p = blocks[l]; j < 16; j++, p += 4)
+	    w[j][l] = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store(uint8_t *digest, const md5v *state, int l) {
+    uint32_t v;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+	v = state[i][l];
+	digest[4 * i] = v;
+	digest[4 * i + 1] = v >> 8;
+	digest[4 * i + 2] = v >> 16;
+	digest[4 * i + 3] = v >> 24;
+    }
+}
+
+/* writes count bytes of padding, ending in the bit length of what was
+ * hashed, after len bytes of block */
+static void pad(uint8_t *block, size_t len, size_t count, uint64_t hashed) {
+    int i;
+
+    block[len] = 0x80;
+    memset(block + len + 1, 0, count - len - 9);
+    for (i = 0; i < 8; i++)
+	block[count - 8 + i] = hashed * 8 >> 8 * i;
+}
+
+void md5mb_hmackey(struct md5mb_hmackey *key, const uint8_t *secret, size_t len) {
+    static const uint32_t iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    const uint8_t *blocks[MD5MB_LANES];
+    uint8_t k[64], block[64];
+    struct md5_ctx mdctx;
+    md5v state[4], w[16];
+    int i, l;
+
+    memset(k, 0, sizeof(k));
+    if (len > sizeof(k)) {
+	md5_init(&mdctx);
+	md5_update(&mdctx, len, secret);
+	md5_digest(&mdctx, MD5_DIGEST_SIZE, k);
+    } else
+	memcpy(k, secret, len);
+
+    for (l = 0; l < MD5MB_LANES; l++)
+	blocks[l] = block;
+    for (i = 0; i < 64; i++)
+	block[i] = k[i] ^ 0x36;
+    load(w, blocks);
+    for (i = 0; i < 4; i++)
+	state[i] = iv[i] + (md5v){ 0 };
+    compress(state, w);
+    for (i = 0; i < 4; i++)
+	key->inner[i] = state[i][0];
+
+    for (i = 0; i < 64; i++)
+	block[i] = k[i] ^ 0x5c;
+    load(w, blocks);
+    for (i = 0; i < 4; i++)
+	state[i] = iv[i] + (md5v){ 0 };
+    compress(state, w);
+    for (i = 0; i < 4; i++)
+	key->outer[i] = state[i][0];
+}
+
+/* a message being hashed in a lane: its whole blocks, read where they
+ * are, and then the last bytes with the padding copied into tail */
+struct lane {
+    int msg; /* -1 while idle */
+    const uint8_t *p; /* next block */
+    size_t full; /* whole blocks of the message left */
+    size_t left; /* blocks left, including the tail */
+    uint8_t tail[128];
+};
+
+static void startlane(struct lane *lane, md5v *state, int l, int msg, const struct md5mb_hmackey *key, const uint8_t *msgp, size_t len) {
+    size_t rem = len % 64, ntail = rem + 9 > 64 ? 2 : 1;
+    int i;
+
+    lane->msg = msg;
+    lane->full = len / 64;
+    lane->left = lane->full + ntail;
+    lane->p = lane->full ? msgp : lane->tail;
+    memcpy(lane->tail, msgp + len - rem, rem);
+    pad(lane->tail, rem, ntail * 64, 64 + len);
+    for (i = 0; i < 4; i++)
+	state[i][l] = key->inner[i];
+}
+
+void md5mb_hmac(int n, const struct md5mb_hmackey *const *keys, const uint8_t *const *msgs, const size_t *lens, uint8_t (*macs)[16]) {
+    struct lane lanes[MD5MB_LANES];
+    const uint8_t *blocks[MD5MB_LANES];
+    uint8_t outer[MD5MB_LANES][64];
+    md5v state[4], w[16];
+    int next, active, i, j, l, m;
+
+    /* the inner hashes, of the messages, into macs */
+    next = active = 0;
+    for (l = 0; l < MD5MB_LANES; l++) {
+	lanes[l].msg = -1;
+	if (next < n) {
+	    startlane(&lanes[l], state, l, next, keys[next], msgs[next], lens[next]);
+	    next++;
+	    active++;
+	}
+    }
+    while (active) {
+	for (l = 0; l < MD5MB_LANES; l++)
+	    blocks[l] = lanes[l].msg < 0 ? zeroblock : lanes[l].p;
+	load(w, blocks);
+	compress(state, w);
+	for (l = 0; l < MD5MB_LANES; l++) {
+	    struct lane *lane = &lanes[l];
+
+	    if (lane->msg < 0)
+		continue;
+	    if (--lane->left) {
+		if (lane->full && !--lane->full)
+		    lane->p = lane->tail;
+		else
+		    lane->p += 64;
+		continue;
+	    }
+	    store(macs[lane->msg], state, l);
+	    lane->msg = -1;
+	    if (next < n) {
+		startlane(lane, state, l, next, keys[next], msgs[next], lens[next]);
+		next++;
+	    } else
+		active--;
+	}
+    }
+
+    /* the outer hashes, of the inner ones, are a block each */
+    for (i = 0; i < n; i += MD5MB_LANES) {
+	for (l = 0; l < MD5MB_LANES; l++) {
+	    m = i + l < n ? i + l : i;
+	    memcpy(outer[l], macs[m], 16);
+	    pad(outer[l], 16, 64, 64 + 16);
+	    blocks[l] = outer[l];
+	    for (j = 0; j < 4; j++)
+		state[j][l] = keys[m]->outer[j];
+	}
+	load(w, blocks);
+	compress(state, w);
+	for (l = 0; l < MD5MB_LANES && i + l < n; l++)
+	    store(macs[i + l], state, l);
+    }
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
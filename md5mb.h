@@ -0,0 +1,33 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <stddef.h>
+
+/* Multi-buffer HMAC-MD5: MD5MB_LANES messages are hashed side by side,
+ * word j of each lane's block sharing one vector. The vectors are GCC
+ * vector extensions, compiled to SSE2, AVX2 or NEON where the target
+ * has them and to plain scalar code elsewhere. A lane whose message is
+ * done takes the next one, so messages of different lengths keep all
+ * lanes busy. */
+
+#define MD5MB_LANES 8
+
+/* the MD5 states after hashing the key xor ipad and xor opad */
+struct md5mb_hmackey {
+    uint32_t inner[4], outer[4];
+};
+
+void md5mb_hmackey(struct md5mb_hmackey *key, const uint8_t *secret, size_t len);
+
+/* computes the HMAC-MD5 of msgs[i], lens[i] bytes long, with keys[i]
+ * into macs[i], for i below n */
+void md5mb_hmac(int n, const struct md5mb_hmackey *const *keys, const uint8_t *const *msgs, const size_t *lens, uint8_t (*macs)[16]);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,265 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+struct poolmagazine {
+    struct poolmagazine *next;
+    uint32_t n;
+    void *objs[1]; /* magsize entries */
+};
+
+/* the magazines of one thread for one pool */
+struct poolcache {
+    struct pool *pool;
+    struct poolcache *next; /* other pools used by the thread */
+    struct poolmagazine *loaded, *prev;
+    uint64_t hits, misses, releases;
+};
+
+static pthread_once_t keyonce = PTHREAD_ONCE_INIT;
+static pthread_key_t cachekey;
+static uint8_t keyok;
+static pthread_mutex_t poolslock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *pools;
+
+/* must hold pool lock */
+static void foldstats(struct pool *pool, struct poolcache *c) {
+    pool->hits += c->hits;
+    pool->misses += c->misses;
+    pool->releases += c->releases;
+    c->hits = c->misses = c->releases = 0;
+}
+
+static void freemagazineobjs(struct poolmagazine *m) {
+    while (m->n)
+	free(m->objs[--m->n]);
+}
+
+/* gives the magazines of an exiting thread to the depot */
+static void freecaches(void *arg) {
+    struct poolcache *c, *next;
+    struct poolmagazine *ms[2];
+    struct pool *pool;
+    int i;
+
+    for (c = (struct poolcache *)arg; c; c = next) {
+	next = c->next;
+	pool = c->pool;
+	ms[0] = c->loaded;
+	ms[1] = c->prev;
+	pthread_mutex_lock(&pool->lock);
+	foldstats(pool, c);
+	for (i = 0; i < 2; i++) {
+	    if (ms[i]->n && pool->nfull < pool->maxfull) {
+		ms[i]->next = pool->full;
+		pool->full = ms[i];
+		pool->nfull++;
+	    } else {
+		pool->releases += ms[i]->n;
+		freemagazineobjs(ms[i]);
+		ms[i]->next = pool->empty;
+		pool->empty = ms[i];
+	    }
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(c);
+    }
+}
+
+static void createkey() {
+    keyok = !pthread_key_create(&cachekey, freecaches);
+}
+
+static struct poolmagazine *newmagazine(struct pool *pool) {
+    struct poolmagazine *m;
+
+    m = malloc(sizeof(struct poolmagazine) + (pool->magsize - 1) * sizeof(void *));
+    if (m) {
+	m->next = NULL;
+	m->n = 0;
+    }
+    return m;
+}
+
+/* returns the cache of the calling thread for pool, or NULL if it
+ * can't be had */
+static struct poolcache *getcache(struct pool *pool) {
+    struct poolcache *first, *c;
+
+    pthread_once(&keyonce, createkey);
+    if (!keyok)
+	return NULL;
+    first = (struct poolcache *)pthread_getspecific(cachekey);
+    for (c = first; c; c = c->next)
+	if (c->pool == pool)
+	    return c;
+
+    c = malloc(sizeof(struct poolcache));
+    if (!c)
+	return NULL;
+    memset(c, 0, sizeof(struct poolcache));
+    c->pool = pool;
+    c->loaded = newmagazine(pool);
+    c->prev = newmagazine(pool);
+    if (!c->loaded || !c->prev) {
+	free(c->loaded);
+	free(c->prev);
+	free(c);
+	return NULL;
+    }
+    c->next = first;
+    if (pthread_setspecific(cachekey, c)) {
+	free(c->loaded);
+	free(c->prev);
+	free(c);
+	return NULL;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->registered) {
+	pool->registered = 1;
+	pthread_mutex_lock(&poolslock);
+	pool->next = pools;
+	pools = pool;
+	pthread_mutex_unlock(&poolslock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return c;
+}
+
+void *pool_get(struct pool *pool) {
+    struct poolcache *c;
+    struct poolmagazine *m;
+
+    c = getcache(pool);
+    if (!c)
+	return malloc(pool->size);
+    if (!c->loaded->n) {
+	m = c->loaded;
+	c->loaded = c->prev;
+	c->prev = m;
+    }
+    if (!c->loaded->n) {
+	/* both empty, swap one for a full one from the depot */
+	pthread_mutex_lock(&pool->lock);
+	foldstats(pool, c);
+	if (pool->full) {
+	    m = pool->full;
+	    pool->full = m->next;
+	    pool->nfull--;
+	    c->loaded->next = pool->empty;
+	    pool->empty = c->loaded;
+	    c->loaded = m;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (!c->loaded->n) {
+	    c->misses++;
+	    return malloc(pool->size);
+	}
+    }
+    c->hits++;
+    return c->loaded->objs[--c->loaded->n];
+}
+
+void pool_put(struct pool *pool, void *obj) {
+    struct poolcache *c;
+    struct poolmagazine *m;
+
+    if (!obj)
+	return;
+    c = getcache(pool);
+    if (!c) {
+	free(obj);
+	return;
+    }
+    if (c->loaded->n == pool->magsize) {
+	m = c->loaded;
+	c->loaded = c->prev;
+	c->prev = m;
+    }
+    if (c->loaded->n == pool->magsize) {
+	/* both full, give one to the depot for an empty one */
+	m = NULL;
+	pthread_mutex_lock(&pool->lock);
+	foldstats(pool, c);
+	if (pool->nfull < pool->maxfull) {
+	    m = pool->empty;
+	    if (m)
+		pool->empty = m->next;
+	    else
+		m = newmagazine(pool);
+	    if (m) {
+		c->loaded->next = pool->full;
+		pool->full = c->loaded;
+		pool->nfull++;
+		c->loaded = m;
+	    }
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if (!m) {
+	    c->releases++;
+	    free(obj);
+	    return;
+	}
+    }
+    c->loaded->objs[c->loaded->n++] = obj;
+}
+
+struct pool *pool_next(struct pool *pool) {
+    struct pool *next;
+
+    pthread_mutex_lock(&poolslock);
+    next = pool ? pool->next : pools;
+    pthread_mutex_unlock(&poolslock);
+    return next;
+}
+
+void pool_getstats(struct pool *pool, uint64_t *hits, uint64_t *misses, uint64_t *releases) {
+    pthread_mutex_lock(&pool->lock);
+    *hits = pool->hits;
+    *misses = pool->misses;
+    *releases = pool->releases;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Packet buffers have a header in front telling whether they are from
+ * the pool. The header is kept at 16 bytes so that the buffer is as
+ * well aligned as malloc would have it. */
+#define RADBUF_SIZE 4096
+#define RADBUF_HDR 16
+
+static struct pool radbufpool = POOL_INITIALIZER("packet buffer", RADBUF_HDR + RADBUF_SIZE, 4, 64);
+
+uint8_t *radbuf_alloc(size_t len) {
+    uint8_t *p;
+
+    if (len <= RADBUF_SIZE) {
+	p = pool_get(&radbufpool);
+	if (p)
+	    *p = 1;
+    } else {
+	p = malloc(RADBUF_HDR + len);
+	if (p)
+	    *p = 0;
+    }
+    return p ? p + RADBUF_HDR : NULL;
+}
+
+void radbuf_free(uint8_t *buf) {
+    uint8_t *p;
+
+    if (!buf)
+	return;
+    p = buf - RADBUF_HDR;
+    if (*p)
+	pool_put(&radbufpool, p);
+    else
+	free(p);
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,64 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <stddef.h>
+#include <pthread.h>
+
+/* A cache of free objects of one size, so that the objects allocated
+ * and freed for every packet don't go through malloc. Every thread
+ * keeps up to two magazines of free objects of its own, and full
+ * magazines are exchanged through a depot shared by all threads, so
+ * objects freed by one thread are reused by another. The pool never
+ * gives memory back, except that objects freed when the depot is full
+ * go to free(). Objects are plain malloc'ed memory of the given size,
+ * so the pool also takes objects allocated elsewhere with malloc. */
+
+struct poolmagazine;
+
+struct pool {
+    const char *name;
+    size_t size;
+    uint32_t magsize; /* objects per magazine */
+    uint32_t maxfull; /* full magazines kept in the depot */
+    pthread_mutex_t lock;
+    struct poolmagazine *full, *empty;
+    uint32_t nfull;
+    uint8_t registered;
+    struct pool *next; /* list of all pools used so far */
+    /* counters, folded in from the threads now and then */
+    uint64_t hits, misses, releases;
+};
+
+#define POOL_INITIALIZER(name, size, magsize, maxfull) \
+    { name, size, magsize, maxfull, PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0, NULL, 0, 0, 0 }
+
+/* returns an object from the pool, or from malloc if the pool is
+ * empty; returns NULL if malloc fails */
+void *pool_get(struct pool *pool);
+
+/* puts obj back in the pool, obj may be NULL */
+void pool_put(struct pool *pool, void *obj);
+
+/* returns the pool used after pool, or the first if pool is NULL, for
+ * walking through all pools used so far */
+struct pool *pool_next(struct pool *pool);
+
+/* gets the counters of objects taken from the pool, from malloc and
+ * given back to free; the counters of each thread are only added to
+ * these when the thread exchanges a magazine with the depot or exits */
+void pool_getstats(struct pool *pool, uint64_t *hits, uint64_t *misses, uint64_t *releases);
+
+/* Packet buffers. These are allocated from a pool of 4096 byte
+ * buffers, the maximum size of a RADIUS packet, or with malloc when
+ * larger, and must be freed with radbuf_free(). */
+uint8_t *radbuf_alloc(size_t len);
+void radbuf_free(uint8_t *buf);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
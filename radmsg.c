@@ -13,37 +13,41 @@
 #include "tlv11.h"
 #include "radmsg.h"
 #include "debug.h"
+#include "pool.h"
 #include <pthread.h>
 #include <nettle/hmac.h>
 #include <openssl/rand.h>
 
 #define RADLEN(x) ntohs(((uint16_t *)(x))[1])
 
+static struct pool msgpool = POOL_INITIALIZER("radmsg", sizeof(struct radmsg), 32, 64);
+
 void radmsg_free(struct radmsg *msg) {
     if (msg) {
-        freetlvlist(msg->attrs);
-        free(msg);
+	freetlvlist(msg->attrs);
+	radbuf_free(msg->wire);
+	pool_put(&msgpool, msg);
     }
 }
 
 struct radmsg *radmsg_init(uint8_t code, uint8_t id, uint8_t *auth) {
     struct radmsg *msg;
 
-    msg = malloc(sizeof(struct radmsg));
+    msg = pool_get(&msgpool);
     if (!msg)
-        return NULL;
+	return NULL;
     memset(msg, 0, sizeof(struct radmsg));
     msg->attrs = list_create();
     if (!msg->attrs) {
-	free(msg);
-        return NULL;
+	pool_put(&msgpool, msg);
+	return NULL;
     }
     msg->code = code;
     msg->id = id;
     if (auth)
 	memcpy(msg->auth, auth, 16);
     else if (!RAND_bytes(msg->auth, 16)) {
-	free(msg);
+	radmsg_free(msg);
 	return NULL;
     }
     return msg;
@@ -121,19 +125,34 @@ int radmsg_copy_attrs(struct radmsg *dst,
     return n;
 }
 
-int _checkmsgauth(unsigned char *rad, uint8_t *authattr, uint8_t *secret) {
-    int result = 0;             /* Fail. */
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    struct hmac_md5_ctx hmacctx;
-    uint8_t auth[16], hash[MD5_DIGEST_SIZE];
+void radsecret_init(struct radsecret *s, const char *secret) {
+    s->secret = (const uint8_t *)secret;
+    s->len = strlen(secret);
+    hmac_md5_set_key(&s->hmac, s->len, s->secret);
+    md5_init(&s->md5);
+    md5_update(&s->md5, s->len, s->secret);
+    md5mb_hmackey(&s->mbkey, s->secret, s->len);
+}
 
-    pthread_mutex_lock(&lock);
+void radsecret_md5(const struct radsecret *s, const uint8_t *a, size_t alen, const uint8_t *b, size_t blen, uint8_t *hash) {
+    struct md5_ctx mdctx = s->md5;
+
+    md5_update(&mdctx, alen, a);
+    if (blen)
+	md5_update(&mdctx, blen, b);
+    md5_digest(&mdctx, MD5_DIGEST_SIZE, hash);
+}
+
+/* hashes with a copy on the stack of the context keyed once in the
+ * radsecret, so that threads don't share it */
+int _checkmsgauth(unsigned char *rad, uint8_t *authattr, const struct radsecret *secret) {
+    struct hmac_md5_ctx hmacctx = secret->hmac;
+    uint8_t auth[16], hash[MD5_DIGEST_SIZE];
 
    /* FIXME: Why clearing authattr during hashing? */
     memcpy(auth, authattr, 16);
     memset(authattr, 0, 16);
 
-    hmac_md5_set_key(&hmacctx, strlen((char *) secret), secret);
     hmac_md5_update(&hmacctx, RADLEN(rad), rad);
     hmac_md5_digest(&hmacctx, sizeof(hash), hash);
 
@@ -141,87 +160,91 @@ int _checkmsgauth(unsigned char *rad, uint8_t *authattr, uint8_t *secret) {
 
     if (memcmp(auth, hash, 16)) {
 	debug(DBG_WARN, "message authenticator, wrong value");
-        goto out;
+	return 0;
     }
-    result = 1;                 /* Success. */
-
-out:
-    pthread_mutex_unlock(&lock);
-    return result;
+    return 1;
 }
 
-int _validauth(unsigned char *rad, unsigned char *reqauth, unsigned char *sec) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int _validauth(unsigned char *rad, unsigned char *reqauth, const struct radsecret *sec) {
     struct md5_ctx mdctx;
     unsigned char hash[MD5_DIGEST_SIZE];
     const unsigned int len = RADLEN(rad);
-    int result = 0;             /* Fail. */
 
-    pthread_mutex_lock(&lock);
+    /* the secret comes last, so there is no state to start from */
     md5_init(&mdctx);
-
     md5_update(&mdctx, 4, rad);
     md5_update(&mdctx, 16, reqauth);
     if (len > 20)
         md5_update(&mdctx, len - 20, rad + 20);
-    md5_update(&mdctx, strlen((char *) sec), sec);
+    md5_update(&mdctx, sec->len, sec->secret);
     md5_digest(&mdctx, sizeof(hash), hash);
 
-    result = !memcmp(hash, rad + 4, 16);
-
-    pthread_mutex_unlock(&lock);
-    return result;
+    return !memcmp(hash, rad + 4, 16);
 }
 
-int _createmessageauth(unsigned char *rad, unsigned char *authattrval, uint8_t *secret) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    struct hmac_md5_ctx hmacctx;
+int _createmessageauth(unsigned char *rad, unsigned char *authattrval, const struct radsecret *secret) {
+    struct hmac_md5_ctx hmacctx = secret->hmac;
 
     if (!authattrval)
 	return 1;
 
-    pthread_mutex_lock(&lock);
-
     memset(authattrval, 0, 16);
-    hmac_md5_set_key(&hmacctx, strlen((char *) secret), secret);
     hmac_md5_update(&hmacctx, RADLEN(rad), rad);
     hmac_md5_digest(&hmacctx, MD5_DIGEST_SIZE, authattrval);
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-int _radsign(unsigned char *rad, unsigned char *sec) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+int _radsign(unsigned char *rad, const struct radsecret *sec) {
     struct md5_ctx mdctx;
 
-    pthread_mutex_lock(&lock);
-
     md5_init(&mdctx);
     md5_update(&mdctx, RADLEN(rad), rad);
-    md5_update(&mdctx, strlen((char *) sec), sec);
+    md5_update(&mdctx, sec->len, sec->secret);
     md5_digest(&mdctx, MD5_DIGEST_SIZE, rad + 4);
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *secret) {
-    struct list_node *node;
+/* returns 1 if tlv is still as it was in the packet msg was parsed
+ * from, so it can be copied from there as it is */
+static int tlvinwire(struct radmsg *msg, struct tlv *tlv) {
+    return msg->wire && tlv->borrowed && tlv->v &&
+	tlv->v - 2 >= msg->wire + 20 && tlv->v + tlv->l <= msg->wire + RADLEN(msg->wire) &&
+	tlv->v[-2] == tlv->t && tlv->v[-1] == tlv->l + 2;
+}
+
+uint8_t *radmsg2buf(struct radmsg *msg, const struct radsecret *secret) {
+    struct list_node *node, *next;
     struct tlv *tlv;
     int size;
-    uint8_t *buf, *p, *msgauth = NULL;
+    uint8_t *buf, *p, *msgauth = NULL, *start, *end;
 
     if (!msg || !msg->attrs)
         return NULL;
+    if (msg->picked) {
+	/* the attributes are all in the packet, as they are to be sent */
+	size = RADLEN(msg->wire);
+	buf = radbuf_alloc(size);
+	if (!buf)
+	    return NULL;
+	memcpy(buf, msg->wire, size);
+	buf[0] = msg->code;
+	buf[1] = msg->id;
+	memcpy(buf + 4, msg->auth, 16);
+	for (node = list_first(msg->attrs); node; node = list_next(node)) {
+	    tlv = (struct tlv *)node->data;
+	    if (tlv->t == RAD_Attr_Message_Authenticator && secret && tlvinwire(msg, tlv))
+		msgauth = buf + (tlv->v - msg->wire);
+	}
+	goto signbuf;
+    }
     size = 20;
     for (node = list_first(msg->attrs); node; node = list_next(node))
         size += 2 + ((struct tlv *)node->data)->l;
     if (size > 65535)
         return NULL;
-    buf = malloc(size);
+    buf = radbuf_alloc(size);
     if (!buf)
-        return NULL;
+	return NULL;
 
     p = buf;
     *p++ = msg->code;
@@ -232,20 +255,41 @@ uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *secret) {
     p += 16;
 
     for (node = list_first(msg->attrs); node; node = list_next(node)) {
-        tlv = (struct tlv *)node->data;
-        p = tlv2buf(p, tlv);
+	tlv = (struct tlv *)node->data;
+	if (tlvinwire(msg, tlv)) {
+	    /* copy a run of attributes following each other in the
+	     * packet in one go */
+	    start = tlv->v - 2;
+	    for (;;) {
+		if (tlv->t == RAD_Attr_Message_Authenticator && secret)
+		    msgauth = p + (tlv->v - start);
+		end = tlv->v + tlv->l;
+		next = list_next(node);
+		if (!next)
+		    break;
+		tlv = (struct tlv *)next->data;
+		if (!tlvinwire(msg, tlv) || tlv->v - 2 != end)
+		    break;
+		node = next;
+	    }
+	    memcpy(p, start, end - start);
+	    p += end - start;
+	    continue;
+	}
+	p = tlv2buf(p, tlv);
 	p[-1] += 2;
 	if (tlv->t == RAD_Attr_Message_Authenticator && secret)
 	    msgauth = p;
         p += tlv->l;
     }
+signbuf:
     if (msgauth && !_createmessageauth(buf, msgauth, secret)) {
-	free(buf);
+	radbuf_free(buf);
 	return NULL;
     }
     if (secret) {
 	if ((msg->code == RAD_Access_Accept || msg->code == RAD_Access_Reject || msg->code == RAD_Access_Challenge || msg->code == RAD_Accounting_Response || msg->code == RAD_Accounting_Request) && !_radsign(buf, secret)) {
-	    free(buf);
+	    radbuf_free(buf);
 	    return NULL;
 	}
 	if (msg->code == RAD_Accounting_Request)
@@ -254,8 +298,63 @@ uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *secret) {
     return buf;
 }
 
-/* if secret set we also validate message authenticator if present */
-struct radmsg *buf2radmsg(uint8_t *buf, uint8_t *secret, uint8_t *rqauth) {
+/* returns the value of the Message-Authenticator of the packet if it
+ * has exactly one and of the right length, else NULL; or if the
+ * attributes don't add up */
+static uint8_t *findmsgauth(uint8_t *buf) {
+    uint16_t len = RADLEN(buf);
+    uint8_t *p, *v = NULL;
+
+    for (p = buf + 20; p - buf + 2 <= len; p += p[1]) {
+	if (p[1] < 2 || p - buf + p[1] > len)
+	    return NULL;
+	if (p[0] == RAD_Attr_Message_Authenticator) {
+	    if (v || p[1] != 18)
+		return NULL;
+	    v = p + 2;
+	}
+    }
+    return v;
+}
+
+void radmsg_checkmsgauths(int n, uint8_t *const *bufs, const struct radsecret *const *secrets, uint8_t *ok) {
+    struct hmac_md5_ctx hmacctx;
+    const struct md5mb_hmackey *keys[MD5MB_LANES * 4];
+    const uint8_t *msgs[MD5MB_LANES * 4];
+    uint8_t *vals[MD5MB_LANES * 4], auths[MD5MB_LANES * 4][16], macs[MD5MB_LANES * 4][16];
+    size_t lens[MD5MB_LANES * 4];
+    int idx[MD5MB_LANES * 4];
+    int i, j, m;
+
+    memset(ok, 0, n);
+    for (i = 0; i < n; i = j) {
+	for (j = i, m = 0; j < n && m < MD5MB_LANES * 4; j++) {
+	    if (!secrets[j] || bufs[j][0] == RAD_Accounting_Request || !(vals[m] = findmsgauth(bufs[j])))
+		continue;
+	    memcpy(auths[m], vals[m], 16);
+	    memset(vals[m], 0, 16);
+	    keys[m] = &secrets[j]->mbkey;
+	    msgs[m] = bufs[j];
+	    lens[m] = RADLEN(bufs[j]);
+	    idx[m++] = j;
+	}
+	/* a lone packet is done faster by nettle than in a lane */
+	if (m == 1) {
+	    hmacctx = secrets[idx[0]]->hmac;
+	    hmac_md5_update(&hmacctx, lens[0], msgs[0]);
+	    hmac_md5_digest(&hmacctx, 16, macs[0]);
+	} else
+	    md5mb_hmac(m, keys, msgs, lens, macs);
+	while (m--) {
+	    memcpy(vals[m], auths[m], 16);
+	    if (!memcmp(auths[m], macs[m], 16))
+		ok[idx[m]] = 1;
+	}
+    }
+}
+
+static struct radmsg *_buf2radmsg(uint8_t *buf, const struct radsecret *secret, uint8_t *rqauth, int msgauthok,
+				  const uint32_t *pick, const uint32_t *refuse) {
     struct radmsg *msg;
     uint8_t t, l, *v = NULL, *p, auth[16];
     uint16_t len;
@@ -302,7 +401,12 @@ struct radmsg *buf2radmsg(uint8_t *buf, uint8_t *secret, uint8_t *rqauth) {
             p += l;
         }
 
-	if (t == RAD_Attr_Message_Authenticator && secret) {
+	if (refuse && ATTRMAP_ISSET(refuse, t)) {
+	    radmsg_free(msg);
+	    return NULL;
+	}
+
+	if (t == RAD_Attr_Message_Authenticator && secret && !msgauthok) {
 	    if (rqauth)
 		memcpy(buf + 4, rqauth, 16);
 	    if (l != 16 || !_checkmsgauth(buf, v, secret)) {
@@ -316,17 +420,61 @@ struct radmsg *buf2radmsg(uint8_t *buf, uint8_t *secret, uint8_t *rqauth) {
 		memcpy(buf + 4, msg->auth, 16);
 	    debug(DBG_DBG, "buf2radmsg: message auth ok");
 	}
+	/* radmsg2buf() needs to find the Message-Authenticator */
+	if (pick && !ATTRMAP_ISSET(pick, t) && t != RAD_Attr_Message_Authenticator)
+	    continue;
 
-        attr = maketlv(t, l, v);
-        if (!attr || !radmsg_add(msg, attr)) {
-            freetlv(attr);
+	attr = maketlvref(t, l, v);
+	if (!attr || !radmsg_add(msg, attr)) {
+	    freetlv(attr);
 	    radmsg_free(msg);
 	    return NULL;
-        }
+	}
     }
+    msg->wire = buf;
+    msg->picked = pick != NULL;
     return msg;
 }
 
+/* if secret set we also validate message authenticator if present */
+struct radmsg *buf2radmsg(uint8_t *buf, const struct radsecret *secret, uint8_t *rqauth) {
+    return _buf2radmsg(buf, secret, rqauth, 0, NULL, NULL);
+}
+
+struct radmsg *buf2radmsgchecked(uint8_t *buf, const struct radsecret *secret) {
+    return _buf2radmsg(buf, secret, NULL, 1, NULL, NULL);
+}
+
+struct radmsg *buf2radmsgpicked(uint8_t *buf, const struct radsecret *secret, const uint32_t *pick, const uint32_t *refuse) {
+    return _buf2radmsg(buf, secret, NULL, 0, pick, refuse);
+}
+
+int radmsg_unpick(struct radmsg *msg) {
+    struct list *attrs;
+    struct tlv *attr;
+    uint8_t *p, *end;
+
+    if (!msg->picked)
+	return 1;
+    attrs = list_create();
+    if (!attrs)
+	return 0;
+    /* the packet was checked to add up when parsed */
+    end = msg->wire + RADLEN(msg->wire);
+    for (p = msg->wire + 20; end - p >= 2; p += p[1]) {
+	attr = maketlvref(p[0], p[1] - 2, p + 2);
+	if (!attr || !list_push(attrs, attr)) {
+	    freetlv(attr);
+	    freetlvlist(attrs);
+	    return 0;
+	}
+    }
+    freetlvlist(msg->attrs);
+    msg->attrs = attrs;
+    msg->picked = 0;
+    return 1;
+}
+
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
 /* End: */
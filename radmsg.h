@@ -22,14 +22,29 @@
 #define RAD_Attr_Tunnel_Password 69
 #define RAD_Attr_Message_Authenticator 80
 
+#include <nettle/md5.h>
+#include <nettle/hmac.h>
+#include "md5mb.h"
+
 #define RAD_VS_ATTR_MS_MPPE_Send_Key 16
 #define RAD_VS_ATTR_MS_MPPE_Recv_Key 17
 
+/* maps of attribute types, 256 bits */
+#define ATTRMAP_SET(map, t) ((map)[(t) >> 5] |= (uint32_t)1 << ((t) & 31))
+#define ATTRMAP_ISSET(map, t) ((map)[(t) >> 5] & (uint32_t)1 << ((t) & 31))
+
 struct radmsg {
     uint8_t code;
     uint8_t id;
     uint8_t auth[20];
     struct list *attrs;
+    /* the packet the message was parsed from; attribute values point
+     * into it until changed, and radmsg2buf() copies the attributes
+     * still as in the packet straight from it */
+    uint8_t *wire;
+    /* only some of the attributes of wire are in attrs, the others
+     * are copied from wire by radmsg2buf() as they are */
+    uint8_t picked;
 };
 
 void radmsg_free(struct radmsg *);
@@ -40,8 +55,44 @@ struct list *radmsg_getalltype(const struct radmsg *msg, uint8_t type);
 int radmsg_copy_attrs(struct radmsg *dst,
                       const struct radmsg *src,
                       uint8_t type);
-uint8_t *radmsg2buf(struct radmsg *msg, uint8_t *);
-struct radmsg *buf2radmsg(uint8_t *, uint8_t *, uint8_t *);
+/* A shared secret, with what only depends on it hashed once rather
+ * than for every packet */
+struct radsecret {
+    const uint8_t *secret;
+    size_t len;
+    struct hmac_md5_ctx hmac; /* keyed, for Message-Authenticator */
+    struct md5_ctx md5; /* having hashed the secret */
+    struct md5mb_hmackey mbkey; /* the same as hmac, for md5mb_hmac() */
+};
+
+/* sets up s for secret, which must be kept as long as s is used */
+void radsecret_init(struct radsecret *s, const char *secret);
+/* writes MD5(secret | a | b) to hash, b may be NULL if blen is 0 */
+void radsecret_md5(const struct radsecret *s, const uint8_t *a, size_t alen, const uint8_t *b, size_t blen, uint8_t *hash);
+
+uint8_t *radmsg2buf(struct radmsg *msg, const struct radsecret *);
+/* on success, the buffer is owned by the message returned and freed
+ * with it */
+struct radmsg *buf2radmsg(uint8_t *, const struct radsecret *, uint8_t *);
+
+/* checks the Message-Authenticators of n requests, whole packets, at
+ * once, skipping those whose secret is NULL. Sets ok[i] if bufs[i] has
+ * one and it is right, else clears it for buf2radmsg() to find out why.
+ * The packets are left as they were */
+void radmsg_checkmsgauths(int n, uint8_t *const *bufs, const struct radsecret *const *secrets, uint8_t *ok);
+/* as buf2radmsg() for a request radmsg_checkmsgauths() found ok */
+struct radmsg *buf2radmsgchecked(uint8_t *, const struct radsecret *);
+/* As buf2radmsg() for a request, but only the attributes whose types
+ * are set in the map pick are put in the message, saving the work of
+ * the others when they are to be passed on as they are. A
+ * Message-Authenticator is always put in. Returns NULL, leaving buf
+ * as it was, if an attribute has a type set in refuse.
+ * Attributes of a picked message may be changed in place, but not
+ * added, removed or resized until radmsg_unpick() is called. */
+struct radmsg *buf2radmsgpicked(uint8_t *buf, const struct radsecret *secret, const uint32_t *pick, const uint32_t *refuse);
+/* puts all the attributes of its packet in a picked message; returns
+ * 0 if malloc fails */
+int radmsg_unpick(struct radmsg *msg);
 
 /* Local Variables: */
 /* c-file-style: "stroustrup" */
@@ -34,17 +34,17 @@
 
 #include <signal.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <stddef.h>
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
 #if defined(HAVE_MALLOPT)
 #include <malloc.h>
 #endif
-#ifdef SYS_SOLARIS9
 #include <fcntl.h>
-#endif
 #include <sys/time.h>
 #include <sys/types.h>
 #include <ctype.h>
@@ -62,18 +62,45 @@
 #include "debug.h"
 #include "hash.h"
 #include "util.h"
-#include "hostport.h"
+#include "brlock.h"
 #include "radsecproxy.h"
+#include "hostport.h"
+#include "pool.h"
 #include "udp.h"
 #include "tcp.h"
 #include "tls.h"
 #include "dtls.h"
 #include "fticks.h"
+#include "evloop.h"
+#include "affinity.h"
 
 static struct options options;
-static struct list *clconfs, *srvconfs;
-static struct list *realms;
-static struct hash *rewriteconfs;
+static struct commonprotoopts *protoopts[RAD_PROTOCOUNT];
+static struct pool rqpool = POOL_INITIALIZER("request", sizeof(struct request), 32, 64);
+
+/* What is read from the config file, replaced as a whole when the file
+ * is read again on SIGHUP. Lookups use the current generation without
+ * locking. The blocks of a replaced one that did not carry over into
+ * the new one are retired, and it is freed once the clients and server
+ * channels of those are gone, which refcount counts. */
+struct confgen {
+    struct list *clconfs, *srvconfs;
+    struct addrtrie *clconfindex, *srvconfindex;
+    struct list *realms;
+    struct realmindex *realmindex;
+    struct hash *rewriteconfs;
+    struct hash *tlsconfs; /* set when replaced */
+    struct list *retiredclconfs, *retiredsrvconfs, *retiredrealms;
+    struct list *carried; /* blocks carrying over, each followed by the one read */
+    uint32_t refcount;
+};
+
+static struct confgen *curgen;
+static struct confgen *readgen; /* being read, for the config callbacks */
+static struct gconffile *readcfs; /* the files being read */
+static struct confgen *gracegen; /* replaced, its servers still answering */
+static const char *mainconfigfile;
+static uint8_t cmdloglevel; /* given with -d, kept over reloads */
 
 extern int optind;
 extern char *optarg;
@@ -87,7 +114,15 @@ void freerealm(struct realm *realm);
 void freeclsrvconf(struct clsrvconf *conf);
 void freerq(struct request *rq);
 void freerqoutdata(struct rqout *rqout);
-void rmclientrq(struct request *rq, uint8_t id);
+void rmclientrq(struct request *rq);
+
+static struct confgen *getgen() {
+    return __atomic_load_n(&curgen, __ATOMIC_ACQUIRE);
+}
+
+static void releasegen(struct confgen *gen) {
+    __atomic_sub_fetch(&gen->refcount, 1, __ATOMIC_RELEASE);
+}
 
 static const struct protodefs *(*protoinits[])(uint8_t) = { udpinit, tlsinit, tcpinit, dtlsinit };
 
@@ -128,12 +163,70 @@ struct clsrvconf *find_conf(uint8_t type, struct sockaddr *addr, struct list *co
     return NULL;
 }
 
+struct confmatch {
+    uint8_t type;
+    struct sockaddr *addr;
+    uint8_t server_p;
+};
+
+static int confmatches(void *data, void *arg) {
+    struct clsrvconf *conf = (struct clsrvconf *)((struct list_node *)data)->data;
+    struct confmatch *m = (struct confmatch *)arg;
+
+    return conf->type == m->type && addressmatches(conf->hostports, m->addr, m->server_p);
+}
+
+/* same as find_conf(), but using index to look up the first match */
+static struct clsrvconf *find_conf_indexed(uint8_t type, struct sockaddr *addr, struct list *confs, struct addrtrie *index, struct list_node **cur, uint8_t server_p) {
+    struct confmatch m;
+    struct list_node *entry;
+
+    if (!index || (cur && *cur))
+	return find_conf(type, addr, confs, cur, server_p);
+    m.type = type;
+    m.addr = addr;
+    m.server_p = server_p;
+    entry = (struct list_node *)addrtrie_lookup(index, addr, confmatches, &m);
+    if (!entry)
+	return NULL;
+    if (cur)
+	*cur = entry;
+    return (struct clsrvconf *)entry->data;
+}
+
 struct clsrvconf *find_clconf(uint8_t type, struct sockaddr *addr, struct list_node **cur) {
-    return find_conf(type, addr, clconfs, cur, 0);
+    struct confgen *gen = getgen();
+
+    return find_conf_indexed(type, addr, gen->clconfs, gen->clconfindex, cur, 0);
 }
 
 struct clsrvconf *find_srvconf(uint8_t type, struct sockaddr *addr, struct list_node **cur) {
-    return find_conf(type, addr, srvconfs, cur, 1);
+    struct confgen *gen = getgen();
+    struct clsrvconf *conf;
+
+    conf = find_conf_indexed(type, addr, gen->srvconfs, gen->srvconfindex, cur, 1);
+    if (conf || cur)
+	return conf;
+    /* replies to what was sent to servers dropped by a reload */
+    gen = __atomic_load_n(&gracegen, __ATOMIC_ACQUIRE);
+    return gen ? find_conf(type, addr, gen->retiredsrvconfs, NULL, 1) : NULL;
+}
+
+/* indexes confs by the addresses and prefixes of their hostports */
+static struct addrtrie *indexconfs(struct list *confs) {
+    struct addrtrie *index;
+    struct list_node *entry;
+    uint32_t order = 0;
+
+    index = addrtrie_create();
+    if (!index)
+	return NULL;
+    for (entry = list_first(confs); entry; entry = list_next(entry))
+	if (!addrtrie_addhostports(index, ((struct clsrvconf *)entry->data)->hostports, order++, entry)) {
+	    addrtrie_free(index);
+	    return NULL;
+	}
+    return index;
 }
 
 /* returns next config of given type, or NULL */
@@ -141,7 +234,7 @@ struct clsrvconf *find_clconf_type(uint8_t type, struct list_node **cur) {
     struct list_node *entry;
     struct clsrvconf *conf;
 
-    for (entry = (cur && *cur ? list_next(*cur) : list_first(clconfs)); entry; entry = list_next(entry)) {
+    for (entry = (cur && *cur ? list_next(*cur) : list_first(getgen()->clconfs)); entry; entry = list_next(entry)) {
 	conf = (struct clsrvconf *)entry->data;
 	if (conf->type == type) {
 	    if (cur)
@@ -191,11 +284,46 @@ void freebios(struct gqueue *q) {
     removequeue(q);
 }
 
-struct client *addclient(struct clsrvconf *conf, uint8_t lock) {
+/* Keeps a request the dupcache lets go of on the lingering list of
+ * its client while a server may still reply to it, so that
+ * removeclientrqs() finds it. Those done by now are dropped from the
+ * head of the list meanwhile; rq->to once cleared is not set again. */
+static void lingerrq(struct request *rq) {
+    struct client *client = rq->from;
+    struct request *head;
+
+    while ((head = client->lingerhead) && !head->to) {
+	client->lingerhead = head->nextlinger;
+	freerq(head);
+    }
+    if (!rq->to) {
+	freerq(rq);
+	return;
+    }
+    rq->nextlinger = NULL;
+    if (client->lingerhead)
+	client->lingertail->nextlinger = rq;
+    else
+	client->lingerhead = rq;
+    client->lingertail = rq;
+}
+
+static void dupexpired(struct dupcache_node *node) {
+    lingerrq((struct request *)((char *)node - offsetof(struct request, dupnode)));
+}
+
+struct client *addclient(struct clsrvconf *conf, uint8_t lock, int sock) {
     struct client *new = NULL;
 
     if (lock)
 	pthread_mutex_lock(conf->lock);
+    if (conf->retiredgen) {
+	/* found just before a reload dropped the block */
+	if (lock)
+	    pthread_mutex_unlock(conf->lock);
+	debug(DBG_INFO, "addclient: client block %s was removed by a reload", conf->name);
+	return NULL;
+    }
     if (!conf->clients) {
 	conf->clients = list_create();
 	if (!conf->clients) {
@@ -212,6 +340,15 @@ struct client *addclient(struct clsrvconf *conf, uint8_t lock) {
 	return NULL;
     }
     new->conf = conf;
+    new->sock = sock;
+    pthread_cond_init(&new->resume, NULL);
+    if (!dupcache_init(&new->dupcache, conf->dupinterval, DUPCACHE_SIZE, dupexpired, time(NULL))) {
+	if (lock)
+	    pthread_mutex_unlock(conf->lock);
+	free(new);
+	debug(DBG_ERR, "malloc failed");
+	return NULL;
+    }
     if (conf->pdef->addclient)
 	conf->pdef->addclient(new);
     else
@@ -222,35 +359,39 @@ struct client *addclient(struct clsrvconf *conf, uint8_t lock) {
     return new;
 }
 
-void removeclientrqs_sendrq_freeserver_lock(uint8_t wantlock) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Taken for reading by sendrq() and removeclientrqs() while they use
+ * the server a request goes to, and for writing by freeserver(), so
+ * servers are not freed under them. Forwarding to different servers
+ * from many threads thus doesn't serialise. */
+static struct brlock serverslock = BRLOCK_INITIALIZER;
 
-    if (wantlock)
-	pthread_mutex_lock(&lock);
-    else
-	pthread_mutex_unlock(&lock);
+static void dropclientrq(struct request *rq) {
+    struct rqout *rqout;
+
+    if (rq->to) {
+	rqout = rq->to->requests + rq->newid;
+	pthread_mutex_lock(rqout->lock);
+	if (rqout->rq == rq) /* still pointing to our request */
+	    freerqoutdata(rqout);
+	pthread_mutex_unlock(rqout->lock);
+    }
+    freerq(rq);
+}
+
+static void removeclientrq(struct dupcache_node *node, void *arg) {
+    dropclientrq((struct request *)((char *)node - offsetof(struct request, dupnode)));
 }
 
 void removeclientrqs(struct client *client) {
     struct request *rq;
-    struct rqout *rqout;
-    int i;
 
-    removeclientrqs_sendrq_freeserver_lock(1);
-    for (i = 0; i < MAX_REQUESTS; i++) {
-	rq = client->rqs[i];
-	if (!rq)
-	    continue;
-	if (rq->to) {
-	    rqout = rq->to->requests + rq->newid;
-	    pthread_mutex_lock(rqout->lock);
-	    if (rqout->rq == rq) /* still pointing to our request */
-		freerqoutdata(rqout);
-	    pthread_mutex_unlock(rqout->lock);
-	}
-	freerq(rq);
+    brlock_rdlock(&serverslock);
+    dupcache_free(&client->dupcache, removeclientrq, NULL);
+    while ((rq = client->lingerhead)) {
+	client->lingerhead = rq->nextlinger;
+	dropclientrq(rq);
     }
-    removeclientrqs_sendrq_freeserver_lock(0);
+    brlock_rdunlock(&serverslock);
 }
 
 void removelockedclient(struct client *client) {
@@ -261,8 +402,11 @@ void removelockedclient(struct client *client) {
 	removeclientrqs(client);
 	removequeue(client->replyq);
 	list_removedata(conf->clients, client);
+	pthread_cond_destroy(&client->resume);
 	free(client->addr);
 	free(client);
+	if (conf->retiredgen)
+	    releasegen(conf->retiredgen);
     }
 }
 
@@ -284,7 +428,7 @@ void freeserver(struct server *server, uint8_t destroymutex) {
     if (!server)
 	return;
 
-    removeclientrqs_sendrq_freeserver_lock(1);
+    brlock_wrlock(&serverslock);
     if (server->requests) {
 	rqout = server->requests;
 	for (end = rqout + MAX_REQUESTS; rqout < end; rqout++) {
@@ -294,87 +438,132 @@ void freeserver(struct server *server, uint8_t destroymutex) {
 	}
 	free(server->requests);
     }
+    timewheel_free(&server->rqtimers);
     if (server->rbios)
 	freebios(server->rbios);
     free(server->dynamiclookuparg);
     if (server->ssl) {
-        SSL_free(server->ssl);
+	SSL_free(server->ssl);
     }
+    if (server->tlssession)
+	SSL_SESSION_free(server->tlssession);
+    free(server->wbuf);
     if (destroymutex) {
+	pthread_mutex_destroy(&server->rqlock);
 	pthread_mutex_destroy(&server->lock);
 	pthread_cond_destroy(&server->newrq_cond);
 	pthread_mutex_destroy(&server->newrq_mutex);
     }
-    removeclientrqs_sendrq_freeserver_lock(0);
+    brlock_wrunlock(&serverslock);
     free(server);
 }
 
-int addserver(struct clsrvconf *conf) {
+/* creates one channel to the server of conf, with a socket or
+ * connection and ids of its own */
+static struct server *newserver(struct clsrvconf *conf, uint8_t channel) {
+    struct server *server;
     int i;
 
-    if (conf->servers) {
-	debug(DBG_ERR, "addserver: currently works with just one server per conf");
-	return 0;
-    }
-    conf->servers = malloc(sizeof(struct server));
-    if (!conf->servers) {
+    server = malloc(sizeof(struct server));
+    if (!server) {
 	debug(DBG_ERR, "malloc failed");
-	return 0;
+	return NULL;
     }
-    memset(conf->servers, 0, sizeof(struct server));
-    conf->servers->conf = conf;
+    memset(server, 0, sizeof(struct server));
+    server->conf = conf;
+    server->channel = channel;
 
 #ifdef RADPROT_DTLS
     if (conf->type == RAD_DTLS)
-	conf->servers->rbios = newqueue();
+	server->rbios = newqueue();
 #endif
     conf->pdef->setsrcres();
 
-    conf->servers->sock = -1;
+    server->sock = -1;
     if (conf->pdef->addserverextra)
-	conf->pdef->addserverextra(conf);
+	conf->pdef->addserverextra(server);
 
-    conf->servers->requests = calloc(MAX_REQUESTS, sizeof(struct rqout));
-    if (!conf->servers->requests) {
+    server->requests = calloc(MAX_REQUESTS, sizeof(struct rqout));
+    if (!server->requests) {
 	debug(DBG_ERR, "malloc failed");
 	goto errexit;
     }
     for (i = 0; i < MAX_REQUESTS; i++) {
-	conf->servers->requests[i].lock = malloc(sizeof(pthread_mutex_t));
-	if (!conf->servers->requests[i].lock) {
+	server->requests[i].lock = malloc(sizeof(pthread_mutex_t));
+	if (!server->requests[i].lock) {
 	    debug(DBG_ERR, "malloc failed");
 	    goto errexit;
 	}
-	if (pthread_mutex_init(conf->servers->requests[i].lock, NULL)) {
+	if (pthread_mutex_init(server->requests[i].lock, NULL)) {
 	    debugerrno(errno, DBG_ERR, "mutex init failed");
-	    free(conf->servers->requests[i].lock);
-	    conf->servers->requests[i].lock = NULL;
+	    free(server->requests[i].lock);
+	    server->requests[i].lock = NULL;
 	    goto errexit;
 	}
     }
-    if (pthread_mutex_init(&conf->servers->lock, NULL)) {
+    if (pthread_mutex_init(&server->lock, NULL)) {
 	debugerrno(errno, DBG_ERR, "mutex init failed");
 	goto errexit;
     }
-    conf->servers->newrq = 0;
-    if (pthread_mutex_init(&conf->servers->newrq_mutex, NULL)) {
+    server->newrq = 0;
+    if (pthread_mutex_init(&server->newrq_mutex, NULL)) {
 	debugerrno(errno, DBG_ERR, "mutex init failed");
-	pthread_mutex_destroy(&conf->servers->lock);
+	pthread_mutex_destroy(&server->lock);
+	goto errexit;
+    }
+    if (pthread_cond_init(&server->newrq_cond, NULL)) {
+	debugerrno(errno, DBG_ERR, "mutex init failed");
+	pthread_mutex_destroy(&server->newrq_mutex);
+	pthread_mutex_destroy(&server->lock);
 	goto errexit;
     }
-    if (pthread_cond_init(&conf->servers->newrq_cond, NULL)) {
+    if (pthread_mutex_init(&server->rqlock, NULL)) {
 	debugerrno(errno, DBG_ERR, "mutex init failed");
-	pthread_mutex_destroy(&conf->servers->newrq_mutex);
-	pthread_mutex_destroy(&conf->servers->lock);
+	pthread_cond_destroy(&server->newrq_cond);
+	pthread_mutex_destroy(&server->newrq_mutex);
+	pthread_mutex_destroy(&server->lock);
+	goto errexit;
+    }
+    if (!timewheel_init(&server->rqtimers, 64, time(NULL))) {
+	debug(DBG_ERR, "malloc failed");
+	pthread_mutex_destroy(&server->rqlock);
+	pthread_cond_destroy(&server->newrq_cond);
+	pthread_mutex_destroy(&server->newrq_mutex);
+	pthread_mutex_destroy(&server->lock);
 	goto errexit;
     }
+    /* id 0 is kept for status server if enabled */
+    for (i = conf->statusserver ? 1 : 0; i < MAX_REQUESTS; i++)
+	server->freeids[server->nfree++] = (uint8_t)i;
 
-    return 1;
+    return server;
 
 errexit:
-    freeserver(conf->servers, 0);
-    conf->servers = NULL;
-    return 0;
+    freeserver(server, 0);
+    return NULL;
+}
+
+int addserver(struct clsrvconf *conf) {
+    struct server *server, **last = &conf->servers;
+    int i;
+
+    if (conf->servers) {
+	debug(DBG_ERR, "addserver: currently works with just one server per conf");
+	return 0;
+    }
+    for (i = 0; i < (conf->channels ? conf->channels : 1); i++) {
+	server = newserver(conf, (uint8_t)i);
+	if (!server) {
+	    while ((server = conf->servers)) {
+		conf->servers = server->nextchannel;
+		freeserver(server, 1);
+	    }
+	    return 0;
+	}
+	*last = server;
+	last = &server->nextchannel;
+    }
+    return 1;
 }
 
 unsigned char *attrget(unsigned char *attrs, int length, uint8_t type) {
@@ -402,22 +591,123 @@ void freerq(struct request *rq) {
     if (rq->origusername)
 	free(rq->origusername);
     if (rq->buf)
-	free(rq->buf);
+	radbuf_free(rq->buf);
     if (rq->replybuf)
-	free(rq->replybuf);
+	radbuf_free(rq->replybuf);
     if (rq->msg)
 	radmsg_free(rq->msg);
-    free(rq);
+    free(rq->trace);
+    pool_put(&rqpool, rq);
+}
+
+/* returns an id no longer in use to those free for new requests; must
+ * hold rqlock */
+static void putfreeid(struct server *server, uint8_t id) {
+    if (!id && server->conf->statusserver)
+	return;
+    server->freeids[(server->freehead + server->nfree) % MAX_REQUESTS] = id;
+    server->nfree++;
+}
+
+/* returns the id free the longest, so that ids are not reused sooner
+ * than need be, or -1 if all are in use */
+static int getfreeid(struct server *server) {
+    int id = -1;
+
+    pthread_mutex_lock(&server->rqlock);
+    if (server->nfree) {
+	id = server->freeids[server->freehead];
+	server->freehead = (server->freehead + 1) % MAX_REQUESTS;
+	server->nfree--;
+    }
+    pthread_mutex_unlock(&server->rqlock);
+    return id;
+}
+
+/* returns 1 if n requests outstanding reach limit, 0 meaning none;
+ * accounting is held to three quarters of it, keeping the rest for
+ * authentication */
+static int overlimit(uint32_t n, uint32_t limit, uint8_t code) {
+    return limit && n >= (code == RAD_Accounting_Request ? limit - limit / 4 : limit);
+}
+
+/* returns 1 if the client has as many requests in server queues, or
+ * replies queued, as its QueueLimit allows; must hold the replyq lock */
+static int clientbusy(struct client *client) {
+    return overlimit(__atomic_load_n(&client->pending, __ATOMIC_RELAXED), client->conf->queuelimit, 0) ||
+	overlimit(list_count(client->replyq->entries), client->conf->queuelimit, 0);
+}
+
+/* returns 1 if the reader of the TCP or TLS client should hold back */
+int clientoverloaded(struct client *client) {
+    int busy;
+
+    if (!client->conf->queuelimit)
+	return 0;
+    pthread_mutex_lock(&client->replyq->mutex);
+    busy = clientbusy(client);
+    pthread_mutex_unlock(&client->replyq->mutex);
+    return busy;
+}
+
+/* holds back the reader thread of a TCP or TLS client while it is
+ * overloaded, until clientrqdone() or the writer taking replies wakes
+ * it */
+void clientwaitload(struct client *client) {
+    if (!client->conf->queuelimit)
+	return;
+    pthread_mutex_lock(&client->replyq->mutex);
+    if (clientbusy(client)) {
+	debug(DBG_DBG, "clientwaitload: holding back reading from %s", addr2string(client->addr));
+	STATS_INC(client->conf->stats.paused);
+	while (clientbusy(client))
+	    pthread_cond_wait(&client->resume, &client->replyq->mutex);
+    }
+    pthread_mutex_unlock(&client->replyq->mutex);
+}
+
+/* counts a request of client as out of the server queues, waking its
+ * reader if that brings it below the limit; must hold the rqout lock */
+static void clientrqdone(struct client *client) {
+    if (__atomic_sub_fetch(&client->pending, 1, __ATOMIC_RELAXED) + 1 != client->conf->queuelimit)
+	return;
+    if (client->evwatch)
+	evloop_notify(client->evwatch);
+    else if (client->conf->type == RAD_TCP || client->conf->type == RAD_TLS) {
+	pthread_mutex_lock(&client->replyq->mutex);
+	pthread_cond_signal(&client->resume);
+	pthread_mutex_unlock(&client->replyq->mutex);
+    }
+}
+
+/* returns 1 if the queue to server to is bounded and the client of rq
+ * will have sent it again by now, or given up on it; a request sent
+ * again after its DuplicateInterval is forwarded anew, so this one is
+ * no longer worth sending */
+static int rqexpired(struct request *rq, struct server *to, time_t now) {
+    return to->conf->queuelimit && rq->from && rq->from->conf->dupinterval &&
+	now - rq->created.tv_sec >= rq->from->conf->dupinterval;
 }
 
 void freerqoutdata(struct rqout *rqout) {
+    struct server *to;
+
     if (!rqout)
 	return;
     if (rqout->rq) {
+	to = rqout->rq->to;
+	if (to) {
+	    pthread_mutex_lock(&to->rqlock);
+	    timewheel_del(&rqout->timer);
+	    putfreeid(to, (uint8_t)(rqout - to->requests));
+	    pthread_mutex_unlock(&to->rqlock);
+	}
 	if (rqout->rq->buf) {
-	    free(rqout->rq->buf);
+	    radbuf_free(rqout->rq->buf);
 	    rqout->rq->buf = NULL;
 	}
+	if (rqout->rq->from)
+	    clientrqdone(rqout->rq->from);
 	rqout->rq->to = NULL;
 	freerq(rqout->rq);
 	rqout->rq = NULL;
@@ -427,15 +717,33 @@ void freerqoutdata(struct rqout *rqout) {
 }
 
 void sendrq(struct request *rq) {
-    int i, start;
+    int i, start, n;
     struct server *to;
+    struct rqout *rqout;
 
-    removeclientrqs_sendrq_freeserver_lock(1);
+    brlock_rdlock(&serverslock);
     to = rq->to;
     if (!to)
 	goto errexit;
 
     start = to->conf->statusserver ? 1 : 0;
+    if (rq->from) {
+	pthread_mutex_lock(&to->rqlock);
+	n = MAX_REQUESTS - start - to->nfree;
+	pthread_mutex_unlock(&to->rqlock);
+	if (overlimit(n, to->conf->queuelimit, rq->msg->code)) {
+	    debug(DBG_INFO, "sendrq: %d requests outstanding to %s, shedding %s", n, to->conf->name, radmsgtype2string(rq->msg->code));
+	    STATS_INC(to->conf->stats.shed);
+	    to = NULL;
+	    goto errexit;
+	}
+	if (rqexpired(rq, to, time(NULL))) {
+	    debug(DBG_INFO, "sendrq: request from %s too old, dropping it", rq->from->conf->name);
+	    STATS_INC(to->conf->stats.shed);
+	    to = NULL;
+	    goto errexit;
+	}
+    }
     pthread_mutex_lock(&to->newrq_mutex);
     if (start && rq->msg->code == RAD_Status_Server) {
 	pthread_mutex_lock(to->requests[0].lock);
@@ -446,46 +754,46 @@ void sendrq(struct request *rq) {
 	}
 	i = 0;
     } else {
-	if (!to->nextid)
-	    to->nextid = start;
-	/* might simplify if only try nextid, might be ok */
-	for (i = to->nextid; i < MAX_REQUESTS; i++) {
-	    if (!to->requests[i].rq) {
-		pthread_mutex_lock(to->requests[i].lock);
-		if (!to->requests[i].rq)
-		    break;
-		pthread_mutex_unlock(to->requests[i].lock);
-	    }
-	}
-	if (i == MAX_REQUESTS) {
-	    for (i = start; i < to->nextid; i++) {
-		if (!to->requests[i].rq) {
-		    pthread_mutex_lock(to->requests[i].lock);
-		    if (!to->requests[i].rq)
-			break;
-		    pthread_mutex_unlock(to->requests[i].lock);
-		}
-	    }
-	    if (i == to->nextid) {
-		debug(DBG_INFO, "sendrq: no room in queue, dropping request");
-		goto errexit;
-	    }
+	i = getfreeid(to);
+	if (i < 0) {
+	    debug(DBG_INFO, "sendrq: no room in queue, dropping request");
+	    STATS_INC(to->conf->stats.dropped);
+	    goto errexit;
 	}
+	/* the id is ours, so the slot is free */
+	pthread_mutex_lock(to->requests[i].lock);
     }
+    rqout = to->requests + i;
     rq->newid = (uint8_t)i;
     rq->msg->id = (uint8_t)i;
-    rq->buf = radmsg2buf(rq->msg, (uint8_t *)to->conf->secret);
+    rq->buf = radmsg2buf(rq->msg, &to->conf->radsecret);
     if (!rq->buf) {
-	pthread_mutex_unlock(to->requests[i].lock);
+	pthread_mutex_lock(&to->rqlock);
+	putfreeid(to, (uint8_t)i);
+	pthread_mutex_unlock(&to->rqlock);
+	pthread_mutex_unlock(rqout->lock);
 	debug(DBG_ERR, "sendrq: radmsg2buf failed");
 	goto errexit;
     }
 
     debug(DBG_DBG, "sendrq: inserting packet with id %d in queue for %s", i, to->conf->name);
-    to->requests[i].rq = rq;
-    pthread_mutex_unlock(to->requests[i].lock);
-    if (i >= start) /* i is not reserved for statusserver */
-	to->nextid = i + 1;
+    if (rq->trace) {
+	rq->trace->code = rq->msg->code;
+	snprintf(rq->trace->server, sizeof(rq->trace->server), "%s", to->conf->name);
+    }
+    /* rq may be gone as soon as it is in the queue */
+    TRACE(rq, TRACE_QUEUED);
+    rqout->rq = rq;
+    if (rq->from)
+	__atomic_add_fetch(&rq->from->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&to->rqlock);
+    if (!rqout->queued) {
+	rqout->queued = 1;
+	to->newids[(to->newhead + to->nnew) % MAX_REQUESTS] = (uint8_t)i;
+	to->nnew++;
+    }
+    pthread_mutex_unlock(&to->rqlock);
+    pthread_mutex_unlock(rqout->lock);
 
     if (!to->newrq) {
 	to->newrq = 1;
@@ -494,16 +802,16 @@ void sendrq(struct request *rq) {
     }
 
     pthread_mutex_unlock(&to->newrq_mutex);
-    removeclientrqs_sendrq_freeserver_lock(0);
+    brlock_rdunlock(&serverslock);
     return;
 
 errexit:
     if (rq->from)
-	rmclientrq(rq, rq->msg->id);
+	rmclientrq(rq);
     freerq(rq);
     if (to)
         pthread_mutex_unlock(&to->newrq_mutex);
-    removeclientrqs_sendrq_freeserver_lock(0);
+    brlock_rdunlock(&serverslock);
 }
 
 void sendreply(struct request *rq) {
@@ -511,7 +819,7 @@ void sendreply(struct request *rq) {
     struct client *to = rq->from;
 
     if (!rq->replybuf)
-	rq->replybuf = radmsg2buf(rq->msg, (uint8_t *)to->conf->secret);
+	rq->replybuf = radmsg2buf(rq->msg, &to->conf->radsecret);
     radmsg_free(rq->msg);
     rq->msg = NULL;
     if (!rq->replybuf) {
@@ -521,7 +829,18 @@ void sendreply(struct request *rq) {
     }
 
     pthread_mutex_lock(&to->replyq->mutex);
+    /* TCP and TLS readers hold back instead, UDP clients share the
+     * queue of their listener */
+    if (to->conf->type == RAD_DTLS && to->conf->queuelimit &&
+	list_count(to->replyq->entries) >= to->conf->queuelimit) {
+	pthread_mutex_unlock(&to->replyq->mutex);
+	freerq(rq);
+	debug(DBG_INFO, "sendreply: reply queue of %s full, dropping reply", to->conf->name);
+	STATS_INC(to->conf->stats.shed);
+	return;
+    }
     first = list_first(to->replyq->entries) == NULL;
+    TRACE(rq, TRACE_REPLYQUEUED);
 
     if (!list_push(to->replyq->entries, rq)) {
 	pthread_mutex_unlock(&to->replyq->mutex);
@@ -529,28 +848,123 @@ void sendreply(struct request *rq) {
 	debug(DBG_ERR, "sendreply: malloc failed");
 	return;
     }
+    STATS_INC(to->conf->stats.replies);
 
     if (first) {
 	debug(DBG_DBG, "signalling server writer");
-	pthread_cond_signal(&to->replyq->cond);
+	if (to->evwatch)
+	    evloop_notify(to->evwatch);
+	else
+	    pthread_cond_signal(&to->replyq->cond);
     }
     pthread_mutex_unlock(&to->replyq->mutex);
 }
 
-static int pwdcrypt(char encrypt_flag, uint8_t *in, uint8_t len, char *shared, uint8_t sharedlen, uint8_t *auth) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    struct md5_ctx mdctx;
+/* Moves replies from the reply queue of client to buf, as many as fit
+ * in size bytes, taking the queue lock once, so that they can be
+ * written together. Returns the number of bytes, 0 if none. */
+int takereplies(struct client *client, uint8_t *buf, int size) {
+    struct gqueue *replyq = client->replyq;
+    struct list_node *entry;
+    struct request *rq, *done[64];
+    int len = 0, rlen, n = 0, i;
+
+    pthread_mutex_lock(&replyq->mutex);
+    while (n < 64 && (entry = list_first(replyq->entries))) {
+	rq = (struct request *)entry->data;
+	rlen = RADLEN(rq->replybuf);
+	if (len + rlen > size && rlen <= size)
+	    break;
+	list_shift(replyq->entries);
+	done[n++] = rq;
+	if (rlen > size) {
+	    debug(DBG_ERR, "takereplies: reply of length %d too long, dropping", rlen);
+	    continue;
+	}
+	memcpy(buf + len, rq->replybuf, rlen);
+	len += rlen;
+    }
+    if (n && client->conf->queuelimit && !client->evwatch)
+	pthread_cond_signal(&client->resume);
+    pthread_mutex_unlock(&replyq->mutex);
+
+    for (i = 0; i < n; i++) {
+	TRACE(done[i], TRACE_WRITTEN);
+	freerq(done[i]);
+    }
+    return len;
+}
+
+int rxbuf_init(struct rxbuf *rx) {
+    rx->pos = rx->len = 0;
+    rx->size = 4096;
+    rx->buf = malloc(rx->size);
+    return rx->buf != NULL;
+}
+
+/* returns where to read to, with room set to how much, making room
+ * for at least the rest of the packet being read; NULL if malloc fails */
+uint8_t *rxbuf_space(struct rxbuf *rx, int *room) {
+    uint8_t *newbuf;
+
+    if (rx->pos) {
+	rx->len -= rx->pos;
+	memmove(rx->buf, rx->buf + rx->pos, rx->len);
+	rx->pos = 0;
+    }
+    if (rx->len >= 4 && RADLEN(rx->buf) > rx->size) {
+	newbuf = realloc(rx->buf, RADLEN(rx->buf));
+	if (!newbuf)
+	    return NULL;
+	rx->buf = newbuf;
+	rx->size = RADLEN(rx->buf);
+    }
+    *room = rx->size - rx->len;
+    return rx->buf + rx->len;
+}
+
+/* returns the next whole packet in a buffer of its own, or NULL if
+ * more must be read first; packets too short are skipped */
+uint8_t *rxbuf_packet(struct rxbuf *rx) {
+    uint8_t *rad;
+    int len;
+
+    while (rx->len - rx->pos >= 4) {
+	len = RADLEN(rx->buf + rx->pos);
+	if (len < 4) {
+	    debug(DBG_ERR, "rxbuf_packet: length too small");
+	    rx->pos += 4;
+	    continue;
+	}
+	if (rx->len - rx->pos < len)
+	    break;
+	if (len < 20) {
+	    debug(DBG_WARN, "rxbuf_packet: packet smaller than minimum radius size");
+	    rx->pos += len;
+	    continue;
+	}
+	rad = radbuf_alloc(len);
+	if (!rad) {
+	    debug(DBG_ERR, "rxbuf_packet: malloc failed");
+	    rx->pos += len;
+	    continue;
+	}
+	memcpy(rad, rx->buf + rx->pos, len);
+	rx->pos += len;
+	if (rx->pos == rx->len)
+	    rx->pos = rx->len = 0;
+	return rad;
+    }
+    return NULL;
+}
+
+static int pwdcrypt(char encrypt_flag, uint8_t *in, uint8_t len, const struct radsecret *shared, uint8_t *auth) {
     unsigned char hash[MD5_DIGEST_SIZE], *input;
     uint8_t i, offset = 0, out[128];
 
-    pthread_mutex_lock(&lock);
-
-    md5_init(&mdctx);
     input = auth;
     for (;;) {
-	md5_update(&mdctx, sharedlen, (uint8_t *) shared);
-        md5_update(&mdctx, 16, input);
-        md5_digest(&mdctx, sizeof(hash), hash);
+	radsecret_md5(shared, input, 16, NULL, 0, hash);
 	for (i = 0; i < 16; i++)
 	    out[offset + i] = hash[i] ^ in[offset + i];
 	if (encrypt_flag)
@@ -562,30 +976,20 @@ static int pwdcrypt(char encrypt_flag, uint8_t *in, uint8_t len, char *shared, u
 	    break;
     }
     memcpy(in, out, len);
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-static int msmppencrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sharedlen, uint8_t *auth, uint8_t *salt) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    struct md5_ctx mdctx;
+static int msmppencrypt(uint8_t *text, uint8_t len, const struct radsecret *shared, uint8_t *auth, uint8_t *salt) {
     unsigned char hash[MD5_DIGEST_SIZE];
     uint8_t i, offset;
 
-    pthread_mutex_lock(&lock);
-    md5_init(&mdctx);
-
 #if 0
     printfchars(NULL, "msppencrypt auth in", "%02x ", auth, 16);
     printfchars(NULL, "msppencrypt salt in", "%02x ", salt, 2);
     printfchars(NULL, "msppencrypt in", "%02x ", text, len);
 #endif
 
-    md5_update(&mdctx, sharedlen, shared);
-    md5_update(&mdctx, 16, auth);
-    md5_update(&mdctx, 2, salt);
-    md5_digest(&mdctx, sizeof(hash), hash);
+    radsecret_md5(shared, auth, 16, salt, 2, hash);
 
 #if 0
     printfchars(NULL, "msppencrypt hash", "%02x ", hash, 16);
@@ -599,9 +1003,7 @@ static int msmppencrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
 	printf("text + offset - 16 c(%d): ", offset / 16);
 	printfchars(NULL, NULL, "%02x ", text + offset - 16, 16);
 #endif
-        md5_update(&mdctx, sharedlen, shared);
-        md5_update(&mdctx, 16, text + offset - 16);
-        md5_digest(&mdctx, sizeof(hash), hash);
+	radsecret_md5(shared, text + offset - 16, 16, NULL, 0, hash);
 #if 0
 	printfchars(NULL, "msppencrypt hash", "%02x ", hash, 16);
 #endif
@@ -613,31 +1015,21 @@ static int msmppencrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
 #if 0
     printfchars(NULL, "msppencrypt out", "%02x ", text, len);
 #endif
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
-static int msmppdecrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sharedlen, uint8_t *auth, uint8_t *salt) {
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    struct md5_ctx mdctx;
+static int msmppdecrypt(uint8_t *text, uint8_t len, const struct radsecret *shared, uint8_t *auth, uint8_t *salt) {
     unsigned char hash[MD5_DIGEST_SIZE];
     uint8_t i, offset;
     char plain[255];
 
-    pthread_mutex_lock(&lock);
-    md5_init(&mdctx);
-
 #if 0
     printfchars(NULL, "msppdecrypt auth in", "%02x ", auth, 16);
     printfchars(NULL, "msppdecrypt salt in", "%02x ", salt, 2);
     printfchars(NULL, "msppdecrypt in", "%02x ", text, len);
 #endif
 
-    md5_update(&mdctx, sharedlen, shared);
-    md5_update(&mdctx, 16, auth);
-    md5_update(&mdctx, 2, salt);
-    md5_digest(&mdctx, sizeof(hash), hash);
+    radsecret_md5(shared, auth, 16, salt, 2, hash);
 
 #if 0
     printfchars(NULL, "msppdecrypt hash", "%02x ", hash, 16);
@@ -651,9 +1043,7 @@ static int msmppdecrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
 	printf("text + offset - 16 c(%d): ", offset / 16);
 	printfchars(NULL, NULL, "%02x ", text + offset - 16, 16);
 #endif
-        md5_update(&mdctx, sharedlen, shared);
-        md5_update(&mdctx, 16, text + offset - 16);
-        md5_digest(&mdctx, sizeof(hash), hash);
+	radsecret_md5(shared, text + offset - 16, 16, NULL, 0, hash);
 #if 0
 	printfchars(NULL, "msppdecrypt hash", "%02x ", hash, 16);
 #endif
@@ -666,8 +1056,6 @@ static int msmppdecrypt(uint8_t *text, uint8_t len, uint8_t *shared, uint8_t sha
 #if 0
     printfchars(NULL, "msppdecrypt out", "%02x ", text, len);
 #endif
-
-    pthread_mutex_unlock(&lock);
     return 1;
 }
 
@@ -680,29 +1068,183 @@ struct realm *newrealmref(struct realm *r) {
     return r;
 }
 
+struct realm *id2realm(struct list *realmlist, char *id);
+
+/* locks the matching realm, or the subrealm of it matching id if any,
+ * and returns it with a reference */
+static struct realm *lockrealm(struct realm *realm, char *id) {
+    struct realm *subrealm;
+
+    /* need to do locking for subrealms and check subrealm timers */
+    pthread_mutex_lock(&realm->mutex);
+    if (realm->subrealms) {
+	subrealm = id2realm(realm->subrealms, id);
+	if (subrealm) {
+	    pthread_mutex_unlock(&realm->mutex);
+	    return subrealm;
+	}
+    }
+    return newrealmref(realm);
+}
+
 /* returns with lock on realm */
 struct realm *id2realm(struct list *realmlist, char *id) {
     struct list_node *entry;
-    struct realm *realm, *subrealm;
+    struct realm *realm;
 
-    /* need to do locking for subrealms and check subrealm timers */
     for (entry = list_first(realmlist); entry; entry = list_next(entry)) {
 	realm = (struct realm *)entry->data;
-	if (!regexec(&realm->regex, id, 0, NULL, 0)) {
-	    pthread_mutex_lock(&realm->mutex);
-	    if (realm->subrealms) {
-		subrealm = id2realm(realm->subrealms, id);
-		if (subrealm) {
-		    pthread_mutex_unlock(&realm->mutex);
-		    return subrealm;
-		}
-	    }
-	    return newrealmref(realm);
+	if (!regexec(&realm->regex, id, 0, NULL, 0))
+	    return lockrealm(realm, id);
+    }
+    return NULL;
+}
+
+/* The top level realms that just match a literal suffix of the
+ * identity, as realms not given as a regexp and regexps like
+ * /@example\.org$/ do, are indexed by that suffix in lower case, and
+ * looked up for each @ in the identity. The other realms are still
+ * matched with regexec(), but only those configured before the best
+ * literal match, so that the first matching realm is the one found. */
+struct realmref {
+    struct realm *realm;
+    uint32_t order;
+};
+
+struct realmindex {
+    struct hash *literals; /* suffix -> struct realmref */
+    struct realmref *regexps; /* the other realms in config order */
+    uint32_t nregexps;
+};
+
+static int suffixchar(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '_';
+}
+
+/* returns the length of the literal suffix the realm with this name
+ * matches, putting it in suffix in lower case, or -1 if not literal */
+static int realmsuffix(const char *name, char *suffix, int size) {
+    const char *s;
+    int n = 0;
+
+    if (*name != '/') {
+	suffix[n++] = '@';
+	for (s = name; *s; s++) {
+	    if (n == size || (!suffixchar(*s) && *s != '.'))
+		return -1;
+	    suffix[n++] = tolower((unsigned char)*s);
+	}
+	return n;
+    }
+
+    if (name[1] != '@')
+	return -1;
+    for (s = name + 1; *s; s++) {
+	if (n == size)
+	    return -1;
+	if (*s == '$')
+	    return s[1] ? -1 : n;
+	if (*s == '\\' && s[1] == '.')
+	    suffix[n++] = *++s;
+	else if (*s == '@' || suffixchar(*s))
+	    suffix[n++] = tolower((unsigned char)*s);
+	else
+	    return -1;
+    }
+    return -1;
+}
+
+static void freerealmindex(struct realmindex *index) {
+    if (!index)
+	return;
+    hash_destroy(index->literals);
+    free(index->regexps);
+    free(index);
+}
+
+static struct realmindex *indexrealms(struct list *realmlist) {
+    struct realmindex *index;
+    struct list_node *entry;
+    struct realmref *ref;
+    struct realm *realm;
+    char suffix[256];
+    uint32_t order, n = 0;
+    int len;
+
+    index = malloc(sizeof(struct realmindex));
+    if (!index)
+	return NULL;
+    memset(index, 0, sizeof(struct realmindex));
+    for (entry = list_first(realmlist); entry; entry = list_next(entry))
+	n++;
+    index->literals = hash_create();
+    index->regexps = malloc((n ? n : 1) * sizeof(struct realmref));
+    if (!index->literals || !index->regexps)
+	goto errexit;
+
+    for (order = 0, entry = list_first(realmlist); entry; order++, entry = list_next(entry)) {
+	realm = (struct realm *)entry->data;
+	len = realmsuffix(realm->name, suffix, sizeof(suffix));
+	if (len < 0) {
+	    ref = &index->regexps[index->nregexps++];
+	    ref->realm = realm;
+	    ref->order = order;
+	    continue;
+	}
+	/* of realms with the same suffix, the first one is always found */
+	if (hash_read(index->literals, suffix, len))
+	    continue;
+	ref = malloc(sizeof(struct realmref));
+	if (!ref)
+	    goto errexit;
+	ref->realm = realm;
+	ref->order = order;
+	if (!hash_insert(index->literals, suffix, len, ref)) {
+	    free(ref);
+	    goto errexit;
 	}
     }
+    debug(DBG_DBG, "indexrealms: %u of %u realms are literal suffixes", n - index->nregexps, n);
+    return index;
+
+errexit:
+    freerealmindex(index);
     return NULL;
 }
 
+/* returns with lock on realm, like id2realm() on the top level realms */
+static struct realm *findrealm(char *id) {
+    struct confgen *gen = getgen();
+    struct realmindex *realmindex = gen->realmindex;
+    struct realmref *ref, *best = NULL;
+    char lower[256];
+    size_t len, i;
+
+    len = strlen(id);
+    if (!realmindex || len >= sizeof(lower))
+	return id2realm(gen->realms, id);
+
+    for (i = 0; i < len; i++)
+	lower[i] = tolower((unsigned char)id[i]);
+    for (i = 0; i < len; i++) {
+	if (lower[i] != '@')
+	    continue;
+	ref = (struct realmref *)hash_read(realmindex->literals, lower + i, len - i);
+	if (ref && (!best || ref->order < best->order))
+	    best = ref;
+    }
+    for (i = 0; i < realmindex->nregexps; i++) {
+	ref = &realmindex->regexps[i];
+	if (best && ref->order > best->order)
+	    break;
+	if (!regexec(&ref->realm->regex, id, 0, NULL, 0)) {
+	    best = ref;
+	    break;
+	}
+    }
+    return best ? lockrealm(best->realm, id) : NULL;
+}
+
 int hasdynamicserver(struct list *srvconfs) {
     struct list_node *entry;
 
@@ -755,22 +1297,17 @@ void _internal_removeserversubrealms(struct list *realmlist, struct clsrvconf *s
     }
 }
 
-void removeserversubrealms(struct list *realmlist, struct clsrvconf *srv) {
-    struct list_node *entry;
-    struct realm *realm;
-
-    for (entry = list_first(realmlist); entry; entry = list_next(entry)) {
-	realm = (struct realm *)entry->data;
-	pthread_mutex_lock(&realm->mutex);
-	if (realm->subrealms) {
-	    _internal_removeserversubrealms(realm->subrealms, srv);
-	    if (!list_first(realm->subrealms)) {
-		list_destroy(realm->subrealms);
-		realm->subrealms = NULL;
-	    }
+/* removes the dynamic server srv from the subrealms of realm */
+void removeserversubrealms(struct realm *realm, struct clsrvconf *srv) {
+    pthread_mutex_lock(&realm->mutex);
+    if (realm->subrealms) {
+	_internal_removeserversubrealms(realm->subrealms, srv);
+	if (!list_first(realm->subrealms)) {
+	    list_destroy(realm->subrealms);
+	    realm->subrealms = NULL;
 	}
-	pthread_mutex_unlock(&realm->mutex);
     }
+    pthread_mutex_unlock(&realm->mutex);
 }
 
 int attrvalidate(unsigned char *attrs, int length) {
@@ -791,34 +1328,34 @@ int attrvalidate(unsigned char *attrs, int length) {
     return 1;
 }
 
-int pwdrecrypt(uint8_t *pwd, uint8_t len, char *oldsecret, char *newsecret, uint8_t *oldauth, uint8_t *newauth) {
+int pwdrecrypt(uint8_t *pwd, uint8_t len, const struct radsecret *oldsecret, const struct radsecret *newsecret, uint8_t *oldauth, uint8_t *newauth) {
     if (len < 16 || len > 128 || len % 16) {
 	debug(DBG_WARN, "pwdrecrypt: invalid password length");
 	return 0;
     }
 
-    if (!pwdcrypt(0, pwd, len, oldsecret, strlen(oldsecret), oldauth)) {
+    if (!pwdcrypt(0, pwd, len, oldsecret, oldauth)) {
 	debug(DBG_WARN, "pwdrecrypt: cannot decrypt password");
 	return 0;
     }
 #ifdef DEBUG
     printfchars(NULL, "pwdrecrypt: password", "%02x ", pwd, len);
 #endif
-    if (!pwdcrypt(1, pwd, len, newsecret, strlen(newsecret), newauth)) {
+    if (!pwdcrypt(1, pwd, len, newsecret, newauth)) {
 	debug(DBG_WARN, "pwdrecrypt: cannot encrypt password");
 	return 0;
     }
     return 1;
 }
 
-int msmpprecrypt(uint8_t *msmpp, uint8_t len, char *oldsecret, char *newsecret, uint8_t *oldauth, uint8_t *newauth) {
+int msmpprecrypt(uint8_t *msmpp, uint8_t len, const struct radsecret *oldsecret, const struct radsecret *newsecret, uint8_t *oldauth, uint8_t *newauth) {
     if (len < 18)
 	return 0;
-    if (!msmppdecrypt(msmpp + 2, len - 2, (uint8_t *)oldsecret, strlen(oldsecret), oldauth, msmpp)) {
+    if (!msmppdecrypt(msmpp + 2, len - 2, oldsecret, oldauth, msmpp)) {
 	debug(DBG_WARN, "msmpprecrypt: failed to decrypt msppe key");
 	return 0;
     }
-    if (!msmppencrypt(msmpp + 2, len - 2, (uint8_t *)newsecret, strlen(newsecret), newauth, msmpp)) {
+    if (!msmppencrypt(msmpp + 2, len - 2, newsecret, newauth, msmpp)) {
 	debug(DBG_WARN, "msmpprecrypt: failed to encrypt msppe key");
 	return 0;
     }
@@ -826,7 +1363,7 @@ int msmpprecrypt(uint8_t *msmpp, uint8_t len, char *oldsecret, char *newsecret,
 }
 
 int msmppe(unsigned char *attrs, int length, uint8_t type, char *attrtxt, struct request *rq,
-	   char *oldsecret, char *newsecret) {
+	   const struct radsecret *oldsecret, const struct radsecret *newsecret) {
     unsigned char *attr;
 
     for (attr = attrs; (attr = attrget(attr, length - (attr - attrs), type)); attr += ATTRLEN(attr)) {
@@ -837,33 +1374,48 @@ int msmppe(unsigned char *attrs, int length, uint8_t type, char *attrtxt, struct
     return 1;
 }
 
-int findvendorsubattr(uint32_t *attrs, uint32_t vendor, uint32_t subattr) {
-    if (!attrs)
-	return 0;
+/* returns the index of the first pair in the sorted table not less
+ * than vendor and subattr, n if none */
+static uint32_t findvendorsubattr(const uint32_t *attrs, uint32_t n, uint32_t vendor, uint32_t subattr) {
+    uint32_t lo = 0, mid;
 
-    for (; attrs[0]; attrs += 2)
-	if (attrs[0] == vendor && attrs[1] == subattr)
-	    return 1;
-    return 0;
+    while (lo < n) {
+	mid = (lo + n) / 2;
+	if (attrs[2 * mid] < vendor || (attrs[2 * mid] == vendor && attrs[2 * mid + 1] < subattr))
+	    lo = mid + 1;
+	else
+	    n = mid;
+    }
+    return lo;
+}
+
+static int hasvendorsubattr(const uint32_t *attrs, uint32_t n, uint32_t vendor, uint32_t subattr) {
+    uint32_t i = findvendorsubattr(attrs, n, vendor, subattr);
+
+    return i < n && attrs[2 * i] == vendor && attrs[2 * i + 1] == subattr;
 }
 
 /* returns 1 if entire element is to be removed, else 0 */
-int dovendorrewriterm(struct tlv *attr, uint32_t *removevendorattrs) {
+int dovendorrewriterm(struct tlv *attr, struct rewrite *rewrite) {
     uint8_t alen, sublen;
-    uint32_t vendor;
+    uint32_t vendor, *attrs, n;
     uint8_t *subattrs;
 
-    if (!removevendorattrs || attr->l <= 4)
+    if (!rewrite->nremovevendorattrs || attr->l <= 4)
 	return 0;
 
     memcpy(&vendor, attr->v, 4);
     vendor = ntohl(vendor);
-    while (*removevendorattrs && *removevendorattrs != vendor)
-	removevendorattrs += 2;
-    if (!*removevendorattrs)
+    /* narrowed down to the pairs of the vendor */
+    n = rewrite->nremovevendorattrs;
+    attrs = rewrite->removevendorattrs;
+    n -= findvendorsubattr(attrs, n, vendor, 0);
+    attrs += 2 * (rewrite->nremovevendorattrs - n);
+    n = findvendorsubattr(attrs, n, vendor, 257);
+    if (!n)
 	return 0;
 
-    if (findvendorsubattr(removevendorattrs, vendor, 256))
+    if (attrs[2 * n - 1] == 256)
 	return 1; /* remove entire vendor attribute */
 
     sublen = attr->l - 4;
@@ -877,7 +1429,7 @@ int dovendorrewriterm(struct tlv *attr, uint32_t *removevendorattrs) {
     while (sublen > 1) {
 	alen = ATTRLEN(subattrs);
 	sublen -= alen;
-	if (findvendorsubattr(removevendorattrs, vendor, ATTRTYPE(subattrs))) {
+	if (hasvendorsubattr(attrs, n, vendor, ATTRTYPE(subattrs))) {
 	    memmove(subattrs, subattrs + alen, sublen);
 	    attr->l -= alen;
 	} else
@@ -886,29 +1438,9 @@ int dovendorrewriterm(struct tlv *attr, uint32_t *removevendorattrs) {
     return 0;
 }
 
-void dorewriterm(struct radmsg *msg, uint8_t *rmattrs, uint32_t *rmvattrs) {
-    struct list_node *n, *p;
-    struct tlv *attr;
-
-    p = NULL;
-    n = list_first(msg->attrs);
-    while (n) {
-	attr = (struct tlv *)n->data;
-	if ((rmattrs && strchr((char *)rmattrs, attr->t)) ||
-	    (rmvattrs && attr->t == RAD_Attr_Vendor_Specific && dovendorrewriterm(attr, rmvattrs))) {
-	    list_removedata(msg->attrs, attr);
-	    freetlv(attr);
-	    n = p ? list_next(p) : list_first(msg->attrs);
-	} else {
-	    p = n;
-	    n = list_next(n);
-	}
-    }
-}
-
-int dorewriteadd(struct radmsg *msg, struct list *addattrs) {
-    struct list_node *n;
-    struct tlv *a;
+int dorewriteadd(struct radmsg *msg, struct list *addattrs) {
+    struct list_node *n;
+    struct tlv *a;
 
     for (n = list_first(addattrs); n; n = list_next(n)) {
 	a = copytlv((struct tlv *)n->data);
@@ -926,112 +1458,142 @@ int resizeattr(struct tlv *attr, uint8_t newlen) {
     uint8_t *newv;
 
     if (newlen != attr->l) {
-	newv = realloc(attr->v, newlen);
-	if (!newv)
-	    return 0;
+	if (attr->borrowed) {
+	    newv = malloc(newlen);
+	    if (!newv)
+		return 0;
+	    memcpy(newv, attr->v, newlen < attr->l ? newlen : attr->l);
+	    attr->borrowed = 0;
+	} else {
+	    newv = realloc(attr->v, newlen);
+	    if (!newv)
+		return 0;
+	}
 	attr->v = newv;
 	attr->l = newlen;
     }
     return 1;
 }
 
-int dorewritemodattr(struct tlv *attr, struct modattr *modattr) {
-    size_t nmatch = 10, reslen = 0, start = 0;
-    regmatch_t pmatch[10], *pfield;
-    int i;
-    char *in, *out;
+/* splits the replacement at the \1 to \9 in it, once */
+static int compilemodattr(struct modattr *m) {
+    const char *out = m->replacement;
+    int i, start = 0;
 
-    in = stringcopy((char *)attr->v, attr->l);
-    if (!in)
+    m->nparts = 0;
+    m->parts = calloc(strlen(out) + 1, sizeof(struct modpart));
+    if (!m->parts)
 	return 0;
-
-    if (regexec(modattr->regex, in, nmatch, pmatch, 0)) {
-	free(in);
-	return 1;
-    }
-
-    out = modattr->replacement;
-
-    for (i = start; out[i]; i++) {
+    for (i = 0; out[i]; i++) {
 	if (out[i] == '\\' && out[i + 1] >= '1' && out[i + 1] <= '9') {
-	    pfield = &pmatch[out[i + 1] - '0'];
-	    if (pfield->rm_so >= 0) {
-		reslen += i - start + pfield->rm_eo - pfield->rm_so;
-		start = i + 2;
+	    if (i > start) {
+		m->parts[m->nparts].text = out + start;
+		m->parts[m->nparts++].len = i - start;
 	    }
+	    m->parts[m->nparts].field = out[i + 1] - '0';
+	    m->parts[m->nparts].text = out + i;
+	    m->parts[m->nparts++].len = 2;
+	    start = i + 2;
 	    i++;
 	}
     }
-    reslen += i - start;
-    if (reslen > 253) {
-	debug(DBG_INFO, "rewritten attribute length would be %d, max possible is 253, discarding message", reslen);
-	free(in);
-	return 0;
+    if (i > start) {
+	m->parts[m->nparts].text = out + start;
+	m->parts[m->nparts++].len = i - start;
     }
+    return 1;
+}
 
-    if (!resizeattr(attr, reslen)) {
-	free(in);
-	return 0;
+/* returns the piece of the replacement to write, a match or text */
+static const char *modpart(struct modpart *part, const char *in, regmatch_t *pmatch, size_t *len) {
+    if (part->field && pmatch[part->field].rm_so >= 0) {
+	*len = pmatch[part->field].rm_eo - pmatch[part->field].rm_so;
+	return in + pmatch[part->field].rm_so;
     }
+    *len = part->len;
+    return part->text;
+}
 
-    start = 0;
-    reslen = 0;
-    for (i = start; out[i]; i++) {
-	if (out[i] == '\\' && out[i + 1] >= '1' && out[i + 1] <= '9') {
-	    pfield = &pmatch[out[i + 1] - '0'];
-	    if (pfield->rm_so >= 0) {
-		memcpy(attr->v + reslen, out + start, i - start);
-		reslen += i - start;
-		memcpy(attr->v + reslen, in + pfield->rm_so, pfield->rm_eo - pfield->rm_so);
-		reslen += pfield->rm_eo - pfield->rm_so;
-		start = i + 2;
-	    }
-	    i++;
-	}
-    }
-    free(in);
+/* rewrites attr, leaving it as is if the result is the same */
+int dorewritemodattr(struct tlv *attr, struct modattr *modattr) {
+    regmatch_t pmatch[10];
+    char in[256], out[253];
+    const char *p;
+    size_t reslen = 0, len;
+    int i;
 
-    memcpy(attr->v + reslen, out + start, i - start);
-    return 1;
-}
+    memcpy(in, attr->v, attr->l);
+    in[attr->l] = '\0';
+    if (regexec(modattr->regex, in, 10, pmatch, 0))
+	return 1;
 
-int dorewritemod(struct radmsg *msg, struct list *modattrs) {
-    struct list_node *n, *m;
+    for (i = 0; i < modattr->nparts; i++) {
+	modpart(&modattr->parts[i], in, pmatch, &len);
+	reslen += len;
+    }
+    if (reslen > 253) {
+	debug(DBG_INFO, "rewritten attribute length would be %d, max possible is 253, discarding message", reslen);
+	return 0;
+    }
 
-    for (n = list_first(msg->attrs); n; n = list_next(n))
-	for (m = list_first(modattrs); m; m = list_next(m))
-	    if (((struct tlv *)n->data)->t == ((struct modattr *)m->data)->t &&
-		!dorewritemodattr((struct tlv *)n->data, (struct modattr *)m->data))
-		return 0;
+    reslen = 0;
+    for (i = 0; i < modattr->nparts; i++) {
+	p = modpart(&modattr->parts[i], in, pmatch, &len);
+	memcpy(out + reslen, p, len);
+	reslen += len;
+    }
+    if (reslen == attr->l && !memcmp(out, in, reslen))
+	return 1;
+    if (!resizeattr(attr, reslen))
+	return 0;
+    memcpy(attr->v, out, reslen);
     return 1;
 }
 
+/* removes and modifies the attributes in one pass, then adds */
 int dorewrite(struct radmsg *msg, struct rewrite *rewrite) {
-    int rv = 1;			/* Success.  */
+    struct list_node *n, *p, *m;
+    struct tlv *attr;
 
-    if (rewrite) {
-	if (rewrite->removeattrs || rewrite->removevendorattrs)
-	    dorewriterm(msg, rewrite->removeattrs, rewrite->removevendorattrs);
-	if (rewrite->modattrs)
-	    if (!dorewritemod(msg, rewrite->modattrs))
-		rv = 0;
-	if (rewrite->addattrs)
-	    if (!dorewriteadd(msg, rewrite->addattrs))
-		rv = 0;
-    }
-    return rv;
+    if (!rewrite)
+	return 1;
+
+    p = NULL;
+    n = list_first(msg->attrs);
+    while (n) {
+	attr = (struct tlv *)n->data;
+	if (ATTRMAP_ISSET(rewrite->removeattrs, attr->t) ||
+	    (attr->t == RAD_Attr_Vendor_Specific && dovendorrewriterm(attr, rewrite))) {
+	    n = list_removenext(msg->attrs, p);
+	    freetlv(attr);
+	    continue;
+	}
+	if (ATTRMAP_ISSET(rewrite->modattrtypes, attr->t))
+	    for (m = list_first(rewrite->modattrs); m; m = list_next(m))
+		if (attr->t == ((struct modattr *)m->data)->t &&
+		    !dorewritemodattr(attr, (struct modattr *)m->data))
+		    return 0;
+	p = n;
+	n = list_next(n);
+    }
+    if (rewrite->addattrs && !dorewriteadd(msg, rewrite->addattrs))
+	return 0;
+    return 1;
 }
 
 int rewriteusername(struct request *rq, struct tlv *attr) {
-    char *orig = (char *)tlv2str(attr);
-    if (!dorewritemodattr(attr, rq->from->conf->rewriteusername)) {
-	free(orig);
+    uint8_t orig[256];
+    uint8_t origlen = attr->l;
+
+    memcpy(orig, attr->v, origlen);
+    orig[origlen] = '\0';
+    if (!dorewritemodattr(attr, rq->from->conf->rewriteusername))
 	return 0;
+    if (origlen != attr->l || memcmp(orig, attr->v, attr->l)) {
+	rq->origusername = stringcopy((char *)orig, origlen);
+	if (!rq->origusername)
+	    return 0;
     }
-    if (strlen(orig) != attr->l || memcmp(orig, attr->v, attr->l))
-	rq->origusername = (char *)orig;
-    else
-	free(orig);
     return 1;
 }
 
@@ -1252,10 +1814,111 @@ void respond(struct request *rq, uint8_t code, char *message,
     sendreply(newrqref(rq));
 }
 
-struct clsrvconf *choosesrvconf(struct list *srvconfs) {
+/* returns the number of requests outstanding to all channels of conf */
+static int outstandingrqs(struct clsrvconf *conf) {
+    struct server *server;
+    int n = 0;
+
+    for (server = conf->servers; server; server = server->nextchannel) {
+	pthread_mutex_lock(&server->rqlock);
+	n += MAX_REQUESTS - (conf->statusserver ? 1 : 0) - server->nfree;
+	pthread_mutex_unlock(&server->rqlock);
+    }
+    return n;
+}
+
+/* returns the lowest response time of the channels of conf */
+static uint32_t responsetime(struct clsrvconf *conf) {
+    struct server *server;
+    uint32_t t, best = UINT32_MAX;
+
+    for (server = conf->servers; server; server = server->nextchannel) {
+	pthread_mutex_lock(&server->rqlock);
+	t = server->responsetime;
+	pthread_mutex_unlock(&server->rqlock);
+	if (t < best)
+	    best = t;
+    }
+    return best;
+}
+
+/* adds a sample to the moving average of response times of server,
+ * weighing it by 1/8 like the TCP round trip time estimator; returns
+ * the sample in ms */
+static uint32_t addresponsetime(struct server *server, struct timeval *since) {
+    struct timeval now;
+    uint32_t ms;
+
+    gettimeofday(&now, NULL);
+    ms = (now.tv_sec - since->tv_sec) * 1000 + (now.tv_usec - since->tv_usec) / 1000;
+    pthread_mutex_lock(&server->rqlock);
+    if (!server->responsetime)
+	server->responsetime = ms ? ms : 1;
+    else
+	server->responsetime = (7 * server->responsetime + ms) / 8;
+    pthread_mutex_unlock(&server->rqlock);
+    return ms;
+}
+
+static int balancecandidate(struct clsrvconf *conf) {
+    return conf->servers && conf->servers->state == RSP_SERVER_STATE_CONNECTED && !conf->servers->lostrqs;
+}
+
+/* chooses among the servers that are up and not losing requests by
+ * the balancing policy of realm, returns NULL if there are none; must
+ * hold realm mutex */
+static struct clsrvconf *balancesrvconf(struct realm *realm, struct list *srvconfs) {
+    struct list_node *entry;
+    struct clsrvconf *conf, *best = NULL;
+    uint32_t total = 0, pick, value, bestvalue = 0;
+
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (balancecandidate(conf))
+	    total += conf->weight ? conf->weight : 1;
+    }
+    if (!total)
+	return NULL;
+    pick = realm->rrcount++ % total;
+
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (!balancecandidate(conf))
+	    continue;
+	switch (realm->balance) {
+	case RSP_BALANCE_ROUNDROBIN:
+	    value = conf->weight ? conf->weight : 1;
+	    if (pick < value)
+		return conf;
+	    pick -= value;
+	    continue;
+	case RSP_BALANCE_LEASTOUTSTANDING:
+	    value = outstandingrqs(conf);
+	    break;
+	case RSP_BALANCE_RESPONSETIME:
+	    value = responsetime(conf);
+	    break;
+	default:
+	    return conf;
+	}
+	if (!best || value < bestvalue) {
+	    best = conf;
+	    bestvalue = value;
+	}
+    }
+    return best;
+}
+
+/* must hold realm mutex */
+struct clsrvconf *choosesrvconf(struct realm *realm, struct list *srvconfs) {
     struct list_node *entry;
     struct clsrvconf *server, *best = NULL, *first = NULL;
 
+    if (realm->balance != RSP_BALANCE_FIRST) {
+	server = balancesrvconf(realm, srvconfs);
+	if (server)
+	    return server;
+    }
     for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
 	server = (struct clsrvconf *)entry->data;
 	if (!server->servers)
@@ -1278,21 +1941,44 @@ struct clsrvconf *choosesrvconf(struct list *srvconfs) {
     return best ? best : first;
 }
 
+/* returns the connected channel with the most free ids, so that the
+ * requests in flight are spread evenly over the channels */
+static struct server *choosechannel(struct server *server) {
+    struct server *best = server;
+    uint16_t nfree, bestfree = 0;
+
+    if (!server || !server->nextchannel)
+	return server;
+    for (; server; server = server->nextchannel) {
+	if (server->state != RSP_SERVER_STATE_CONNECTED)
+	    continue;
+	pthread_mutex_lock(&server->rqlock);
+	nfree = server->nfree;
+	pthread_mutex_unlock(&server->rqlock);
+	if (nfree > bestfree) {
+	    best = server;
+	    bestfree = nfree;
+	}
+    }
+    return best;
+}
+
 /* returns with lock on realm, protects from server changes while in use by radsrv/sendrq */
 struct server *findserver(struct realm **realm, struct tlv *username, uint8_t acc) {
     struct clsrvconf *srvconf;
     struct realm *subrealm;
     struct server *server = NULL;
-    char *id = (char *)tlv2str(username);
+    char id[256]; /* attribute value is at most 253 bytes */
 
-    if (!id)
-	return NULL;
+    if (username->l)
+	memcpy(id, username->v, username->l);
+    id[username->l] = '\0';
     /* returns with lock on realm */
-    *realm = id2realm(realms, id);
+    *realm = findrealm(id);
     if (!*realm)
-	goto exit;
+	return NULL;
     debug(DBG_DBG, "found matching realm: %s", (*realm)->name);
-    srvconf = choosesrvconf(acc ? (*realm)->accsrvconfs : (*realm)->srvconfs);
+    srvconf = choosesrvconf(*realm, acc ? (*realm)->accsrvconfs : (*realm)->srvconfs);
     if (srvconf && !(*realm)->parent && !srvconf->servers && srvconf->dynamiclookupcommand) {
 	subrealm = adddynamicrealmserver(*realm, id);
 	if (subrealm) {
@@ -1301,17 +1987,14 @@ struct server *findserver(struct realm **realm, struct tlv *username, uint8_t ac
 	    freerealm(*realm);
 	    *realm = subrealm;
             debug(DBG_DBG, "added realm: %s", (*realm)->name);
-	    srvconf = choosesrvconf(acc ? (*realm)->accsrvconfs : (*realm)->srvconfs);
+	    srvconf = choosesrvconf(*realm, acc ? (*realm)->accsrvconfs : (*realm)->srvconfs);
             debug(DBG_DBG, "found conf for new realm: %s", srvconf->name);
 	}
     }
     if (srvconf) {
-        debug(DBG_DBG, "found matching conf: %s", srvconf->name);
-	server = srvconf->servers;
+	debug(DBG_DBG, "found matching conf: %s", srvconf->name);
+	server = choosechannel(srvconf->servers);
     }
-
-exit:
-    free(id);
     return server;
 }
 
@@ -1319,7 +2002,7 @@ exit:
 struct request *newrequest() {
     struct request *rq;
 
-    rq = malloc(sizeof(struct request));
+    rq = pool_get(&rqpool);
     if (!rq) {
 	debug(DBG_ERR, "newrequest: malloc failed");
 	return NULL;
@@ -1327,58 +2010,63 @@ struct request *newrequest() {
     memset(rq, 0, sizeof(struct request));
     rq->refcount = 1;
     gettimeofday(&rq->created, NULL);
+    rq->trace = trace_start();
+    TRACE_PROBE(rq, TRACE_RECEIVED);
     return rq;
 }
 
-static void
-purgedupcache(struct client *client) {
-    struct request *r;
-    struct timeval now;
-    int i;
-
-    gettimeofday(&now, NULL);
-    for (i = 0; i < MAX_REQUESTS; i++) {
-	r = client->rqs[i];
-	if (r && now.tv_sec - r->created.tv_sec > r->from->conf->dupinterval) {
-	    freerq(r);
-	    client->rqs[i] = NULL;
-	}
-    }
-}
-
+/* returns 0 if rq is a duplicate of a request already received, else
+ * keeps a reference to it in the dupcache of the client */
 int addclientrq(struct request *rq) {
+    struct dupcache *cache = &rq->from->dupcache;
+    struct dupcache_node *node;
     struct request *r;
-    struct timeval now;
 
-    r = rq->from->rqs[rq->rqid];
-    if (r) {
-	if (rq->udpport == r->udpport && !memcmp(rq->rqauth, r->rqauth, 16)) {
-	    gettimeofday(&now, NULL);
-	    if (now.tv_sec - r->created.tv_sec < r->from->conf->dupinterval) {
-		if (r->replybuf) {
-		    debug(DBG_INFO, "addclientrq: already sent reply to request with id %d from %s, resending", rq->rqid, addr2string(r->from->addr));
-		    sendreply(newrqref(r));
-		} else
-		    debug(DBG_INFO, "addclientrq: already got request with id %d from %s, ignoring", rq->rqid, addr2string(r->from->addr));
-		return 0;
-	    }
+    dupcache_expire(cache, rq->created.tv_sec);
+    dupcache_key(rq->dupnode.key, rq->udpport, rq->rqid, rq->rqauth);
+    node = dupcache_find(cache, rq->dupnode.key);
+    if (node) {
+	r = (struct request *)((char *)node - offsetof(struct request, dupnode));
+	if (rq->created.tv_sec - r->created.tv_sec < rq->from->conf->dupinterval) {
+	    STATS_INC(rq->from->conf->stats.duplicates);
+	    if (r->replybuf) {
+		debug(DBG_INFO, "addclientrq: already sent reply to request with id %d from %s, resending", rq->rqid, addr2string(r->from->addr));
+		sendreply(newrqref(r));
+	    } else
+		debug(DBG_INFO, "addclientrq: already got request with id %d from %s, ignoring", rq->rqid, addr2string(r->from->addr));
+	    return 0;
 	}
-	freerq(r);
+	dupcache_del(cache, node);
+	lingerrq(r);
     }
-    rq->from->rqs[rq->rqid] = newrqref(rq);
+    dupcache_add(cache, &newrqref(rq)->dupnode, rq->created.tv_sec);
     return 1;
 }
 
-void rmclientrq(struct request *rq, uint8_t id) {
-    struct request *r;
-
-    r = rq->from->rqs[id];
-    if (r) {
-	freerq(r);
-	rq->from->rqs[id] = NULL;
+void rmclientrq(struct request *rq) {
+    if (dupcache_pending(&rq->dupnode)) {
+	dupcache_del(&rq->from->dupcache, &rq->dupnode);
+	freerq(rq);
     }
 }
 
+/* The attributes of an Accounting-Request radsrv() looks at, for
+ * those from clients with no rewrites to do, and those it can't pass
+ * on without decoding. The rest are sent on as they are. */
+static uint32_t acctpick[8], acctrefuse[8];
+
+static void setacctattrs(struct options *o) {
+    memset(acctpick, 0, sizeof(acctpick));
+    memset(acctrefuse, 0, sizeof(acctrefuse));
+    ATTRMAP_SET(acctpick, RAD_Attr_User_Name);
+    ATTRMAP_SET(acctpick, RAD_Attr_Calling_Station_Id);
+    ATTRMAP_SET(acctpick, RAD_Attr_Proxy_State);
+    ATTRMAP_SET(acctpick, o->ttlattrtype[1] == 256 ? o->ttlattrtype[0] : RAD_Attr_Vendor_Specific);
+    ATTRMAP_SET(acctrefuse, RAD_Attr_User_Password);
+    ATTRMAP_SET(acctrefuse, RAD_Attr_CHAP_Password);
+    ATTRMAP_SET(acctrefuse, RAD_Attr_Tunnel_Password);
+}
+
 /* Called from server readers, handling incoming requests from
  * clients. */
 /* returns 0 if validation/authentication fails, else 1 */
@@ -1391,12 +2079,38 @@ int radsrv(struct request *rq) {
     struct client *from = rq->from;
     int ttlres;
 
-    msg = buf2radmsg(rq->buf, (uint8_t *)from->conf->secret, NULL);
-    free(rq->buf);
+    if (from->conf->retiredgen) {
+	debug(DBG_INFO, "radsrv: client block %s was removed by a reload, dropping the client", from->conf->name);
+	radbuf_free(rq->buf);
+	rq->buf = NULL;
+	freerq(rq);
+	return 0;
+    }
+    STATS_INC(from->conf->stats.requests);
+    /* over the limit of the client, accounting is shed; requests from
+     * TCP and TLS clients are otherwise held back by their reader */
+    if (overlimit(__atomic_load_n(&from->pending, __ATOMIC_RELAXED), from->conf->queuelimit, *rq->buf) &&
+	(*rq->buf == RAD_Accounting_Request || (from->conf->type != RAD_TCP && from->conf->type != RAD_TLS))) {
+	debug(DBG_INFO, "radsrv: too many requests from %s outstanding, shedding %s", from->conf->name, radmsgtype2string(*rq->buf));
+	STATS_INC(from->conf->stats.shed);
+	radbuf_free(rq->buf);
+	rq->buf = NULL;
+	freerq(rq);
+	return 1;
+    }
+    /* failing that, decoded in full to find out why */
+    if (*rq->buf == RAD_Accounting_Request && !from->conf->rewritein && !from->conf->rewriteusername)
+	msg = buf2radmsgpicked(rq->buf, &from->conf->radsecret, acctpick, acctrefuse);
+    if (!msg)
+	msg = rq->msgauthok ? buf2radmsgchecked(rq->buf, &from->conf->radsecret) :
+	    buf2radmsg(rq->buf, &from->conf->radsecret, NULL);
+    if (!msg)
+	radbuf_free(rq->buf);
     rq->buf = NULL;
 
     if (!msg) {
 	debug(DBG_INFO, "radsrv: message validation failed, ignoring packet");
+	STATS_INC(from->conf->stats.invalid);
 	freerq(rq);
 	return 0;
     }
@@ -1404,14 +2118,19 @@ int radsrv(struct request *rq) {
     rq->msg = msg;
     rq->rqid = msg->id;
     memcpy(rq->rqauth, msg->auth, 16);
+    TRACE(rq, TRACE_PARSED);
+    if (rq->trace) {
+	rq->trace->code = msg->code;
+	snprintf(rq->trace->client, sizeof(rq->trace->client), "%s", from->conf->name);
+    }
 
     debug(DBG_DBG, "radsrv: code %d, id %d", msg->code, msg->id);
     if (msg->code != RAD_Access_Request && msg->code != RAD_Status_Server && msg->code != RAD_Accounting_Request) {
 	debug(DBG_INFO, "radsrv: server currently accepts only access-requests, accounting-requests and status-server, ignoring");
+	STATS_INC(from->conf->stats.dropped);
 	goto exit;
     }
 
-    purgedupcache(from);
     if (!addclientrq(rq))
 	goto exit;
 
@@ -1428,6 +2147,7 @@ int radsrv(struct request *rq) {
     ttlres = checkttl(msg, options.ttlattrtype);
     if (!ttlres) {
 	debug(DBG_INFO, "radsrv: ignoring request from client %s (%s), ttl exceeded", from->conf->name, addr2string(from->addr));
+	STATS_INC(from->conf->stats.dropped);
 	goto exit;
     }
 
@@ -1455,6 +2175,7 @@ int radsrv(struct request *rq) {
     to = findserver(&realm, attr, msg->code == RAD_Accounting_Request);
     if (!realm) {
 	debug(DBG_INFO, "radsrv: ignoring request, don't know where to send it");
+	STATS_INC(from->conf->stats.dropped);
 	goto exit;
     }
 
@@ -1474,6 +2195,7 @@ int radsrv(struct request *rq) {
 	&& !strcmp(from->conf->name, to->conf->name)) {
 	debug(DBG_INFO, "radsrv: Loop prevented, not forwarding request from client %s (%s) to server %s, discarding",
 	      from->conf->name, addr2string(from->addr), to->conf->name);
+	STATS_INC(from->conf->stats.dropped);
 	goto exit;
     }
 
@@ -1513,17 +2235,21 @@ int radsrv(struct request *rq) {
     attr = radmsg_gettype(msg, RAD_Attr_User_Password);
     if (attr) {
 	debug(DBG_DBG, "radsrv: found userpwdattr with value length %d", attr->l);
-	if (!pwdrecrypt(attr->v, attr->l, from->conf->secret, to->conf->secret, rq->rqauth, msg->auth))
+	if (!pwdrecrypt(attr->v, attr->l, &from->conf->radsecret, &to->conf->radsecret, rq->rqauth, msg->auth))
 	    goto rmclrqexit;
     }
 
     attr = radmsg_gettype(msg, RAD_Attr_Tunnel_Password);
     if (attr) {
 	debug(DBG_DBG, "radsrv: found tunnelpwdattr with value length %d", attr->l);
-	if (!pwdrecrypt(attr->v, attr->l, from->conf->secret, to->conf->secret, rq->rqauth, msg->auth))
+	if (!pwdrecrypt(attr->v, attr->l, &from->conf->radsecret, &to->conf->radsecret, rq->rqauth, msg->auth))
 	    goto rmclrqexit;
     }
 
+    if (msg->picked && (to->conf->rewriteout || (ttlres == -1 && (options.addttl || to->conf->addttl))) &&
+	!radmsg_unpick(msg))
+	goto rmclrqexit;
+
     if (to->conf->rewriteout && !dorewrite(msg, to->conf->rewriteout))
 	goto rmclrqexit;
 
@@ -1532,13 +2258,14 @@ int radsrv(struct request *rq) {
 
     free(userascii);
     rq->to = to;
+    TRACE(rq, TRACE_ROUTED);
     sendrq(rq);
     pthread_mutex_unlock(&realm->mutex);
     freerealm(realm);
     return 1;
 
 rmclrqexit:
-    rmclientrq(rq, msg->id);
+    rmclientrq(rq);
 exit:
     freerq(rq);
     free(userascii);
@@ -1565,20 +2292,22 @@ void replyh(struct server *server, unsigned char *buf) {
     rqout = server->requests + buf[1];
     pthread_mutex_lock(rqout->lock);
     if (!rqout->tries) {
-	free(buf);
+	radbuf_free(buf);
 	buf = NULL;
 	debug(DBG_INFO, "replyh: no outstanding request with this id, ignoring reply");
 	goto errunlock;
     }
 
-    msg = buf2radmsg(buf, (uint8_t *)server->conf->secret, rqout->rq->msg->auth);
+    msg = buf2radmsg(buf, &server->conf->radsecret, rqout->rq->msg->auth);
 #ifdef DEBUG
     printfchars(NULL, "origauth/buf+4", "%02x ", buf + 4, 16);
 #endif
-    free(buf);
+    if (!msg)
+	radbuf_free(buf);
     buf = NULL;
     if (!msg) {
-        debug(DBG_INFO, "replyh: message validation failed, ignoring packet");
+	debug(DBG_INFO, "replyh: message validation failed, ignoring packet");
+	STATS_INC(server->conf->stats.invalid);
 	goto errunlock;
     }
     if (msg->code != RAD_Access_Accept && msg->code != RAD_Access_Reject && msg->code != RAD_Access_Challenge
@@ -1589,6 +2318,9 @@ void replyh(struct server *server, unsigned char *buf) {
     debug(DBG_DBG, "got %s message with id %d", radmsgtype2string(msg->code), msg->id);
 
     gettimeofday(&server->lastrcv, NULL);
+    STATS_INC(server->conf->stats.replies);
+    TRACE(rqout->rq, TRACE_REPLIED);
+    stats_latency(&server->conf->stats, addresponsetime(server, &rqout->sent));
 
     if (rqout->rq->msg->code == RAD_Status_Server) {
 	freerqoutdata(rqout);
@@ -1625,9 +2357,9 @@ void replyh(struct server *server, unsigned char *buf) {
 	subattrs = attr->v + 4;
 	if (!attrvalidate(subattrs, sublen) ||
 	    !msmppe(subattrs, sublen, RAD_VS_ATTR_MS_MPPE_Send_Key, "MS MPPE Send Key",
-		    rqout->rq, server->conf->secret, from->conf->secret) ||
+		    rqout->rq, &server->conf->radsecret, &from->conf->radsecret) ||
 	    !msmppe(subattrs, sublen, RAD_VS_ATTR_MS_MPPE_Recv_Key, "MS MPPE Recv Key",
-		    rqout->rq, server->conf->secret, from->conf->secret))
+		    rqout->rq, &server->conf->radsecret, &from->conf->radsecret))
 	    break;
     }
     if (node) {
@@ -1735,155 +2467,469 @@ exit:
 }
 
 /* code for removing state not finished */
-void *clientwr(void *arg) {
-    struct server *server = (struct server *)arg;
-    struct rqout *rqout = NULL;
-    pthread_t clientrdth;
-    int i, dynconffail = 0;
-    time_t secs;
-    uint8_t rnd;
-    struct timeval now, laststatsrv;
-    struct timespec timeout;
-    struct request *statsrvrq;
-    struct clsrvconf *conf;
-
-    assert(server);
-    conf = server->conf;
-
-#define ZZZ 900
+/* sends the request for the first time, or again, or gives up on it;
+ * must hold rqout lock */
+static void clientwrrqout(struct server *server, struct rqout *rqout, time_t now) {
+    struct clsrvconf *conf = server->conf;
 
-    server->state = RSP_SERVER_STATE_STARTUP;
-    if (server->dynamiclookuparg && !dynamicconfig(server)) {
-	dynconffail = 1;
-	server->state = RSP_SERVER_STATE_FAILING;
-	debug(DBG_WARN, "%s: dynamicconfig(%s: %s) failed, sleeping %ds",
-              __func__, server->conf->name, server->dynamiclookuparg, ZZZ);
-	sleep(ZZZ);
-	goto errexit;
-    }
-    /* FIXME: Is resolving not always done by compileserverconfig(),
-     * either as part of static configuration setup or by
-     * dynamicconfig() above?  */
-    if (!resolvehostports(conf->hostports, conf->hostaf, conf->pdef->socktype)) {
-        debug(DBG_WARN, "%s: resolve failed, sleeping %ds", __func__, ZZZ);
-	server->state = RSP_SERVER_STATE_FAILING;
-        sleep(ZZZ);
-        goto errexit;
+    if (rqout->tries == (*rqout->rq->buf == RAD_Status_Server ? 1 : conf->retrycount + 1)) {
+	debug(DBG_DBG, "clientwr: removing expired packet from queue");
+	if (conf->statusserver) {
+	    if (*rqout->rq->buf == RAD_Status_Server) {
+		debug(DBG_WARN, "clientwr: no status server response, %s dead?", conf->name);
+		if (server->lostrqs < 255)
+		    server->lostrqs++;
+	    }
+	} else {
+	    debug(DBG_WARN, "clientwr: no server response, %s dead?", conf->name);
+	    if (server->lostrqs < 255)
+		server->lostrqs++;
+	}
+	/* count the time given up after as its response time */
+	addresponsetime(server, &rqout->sent);
+	STATS_INC(conf->stats.timeouts);
+	freerqoutdata(rqout);
+	return;
     }
 
-    memset(&timeout, 0, sizeof(struct timespec));
+    if (!rqout->tries) {
+	gettimeofday(&rqout->sent, NULL);
+	STATS_INC(conf->stats.requests);
+	TRACE(rqout->rq, TRACE_SENT);
+    } else
+	STATS_INC(conf->stats.retransmits);
+    rqout->expiry.tv_sec = now + conf->retryinterval;
+    rqout->tries++;
+    pthread_mutex_lock(&server->rqlock);
+    timewheel_add(&server->rqtimers, &rqout->timer, rqout->expiry.tv_sec);
+    pthread_mutex_unlock(&server->rqlock);
+    conf->pdef->clientradput(server, rqout->rq->buf);
+}
 
-    if (conf->statusserver) {
-	gettimeofday(&server->lastrcv, NULL);
-	gettimeofday(&laststatsrv, NULL);
-    }
+/* sends the requests queued by sendrq() */
+static void clientwrnew(struct server *server) {
+    struct rqout *rqout;
+    struct timeval now;
 
-    if (conf->pdef->connecter) {
-	if (!conf->pdef->connecter(server, NULL, server->dynamiclookuparg ? 5 : 0, "clientwr")) {
-	    server->state = RSP_SERVER_STATE_FAILING;
-	    if (server->dynamiclookuparg) {
-                debug(DBG_WARN, "%s: connect failed, sleeping %ds",
-                      __func__, ZZZ);
-		sleep(ZZZ);
-	    }
-	    goto errexit;
+    for (;;) {
+	pthread_mutex_lock(&server->rqlock);
+	if (!server->nnew) {
+	    pthread_mutex_unlock(&server->rqlock);
+	    return;
 	}
-	if (pthread_create(&clientrdth, &pthread_attr, conf->pdef->clientconnreader, (void *)server)) {
-	    debugerrno(errno, DBG_ERR, "clientwr: pthread_create failed");
-	    server->state = RSP_SERVER_STATE_FAILING;
-	    goto errexit;
+	rqout = server->requests + server->newids[server->newhead];
+	server->newhead = (server->newhead + 1) % MAX_REQUESTS;
+	server->nnew--;
+	rqout->queued = 0;
+	pthread_mutex_unlock(&server->rqlock);
+
+	/* the request may have been removed, and the id reused since */
+	pthread_mutex_lock(rqout->lock);
+	if (rqout->rq && !rqout->tries) {
+	    gettimeofday(&now, NULL);
+	    if (rqexpired(rqout->rq, server, now.tv_sec)) {
+		debug(DBG_INFO, "clientwr: request from %s too old, dropping it", rqout->rq->from->conf->name);
+		STATS_INC(server->conf->stats.shed);
+		freerqoutdata(rqout);
+	    } else
+		clientwrrqout(server, rqout, now.tv_sec);
 	}
+	pthread_mutex_unlock(rqout->lock);
     }
-    server->state = RSP_SERVER_STATE_CONNECTED;
+}
 
-    for (;;) {
-	pthread_mutex_lock(&server->newrq_mutex);
-	if (!server->newrq) {
-	    gettimeofday(&now, NULL);
-	    /* random 0-7 seconds */
-	    RAND_bytes(&rnd, 1);
-	    rnd /= 32;
-	    if (conf->statusserver) {
-		secs = server->lastrcv.tv_sec > laststatsrv.tv_sec ? server->lastrcv.tv_sec : laststatsrv.tv_sec;
-		if (now.tv_sec - secs > STATUS_SERVER_PERIOD)
-		    secs = now.tv_sec;
-		if (!timeout.tv_sec || timeout.tv_sec > secs + STATUS_SERVER_PERIOD + rnd)
-		    timeout.tv_sec = secs + STATUS_SERVER_PERIOD + rnd;
-	    } else {
-		if (!timeout.tv_sec || timeout.tv_sec > now.tv_sec + STATUS_SERVER_PERIOD + rnd)
-		    timeout.tv_sec = now.tv_sec + STATUS_SERVER_PERIOD + rnd;
-	    }
-#if 0
-	    if (timeout.tv_sec > now.tv_sec)
-		debug(DBG_DBG, "clientwr: waiting up to %ld secs for new request", timeout.tv_sec - now.tv_sec);
-#endif
-	    pthread_cond_timedwait(&server->newrq_cond, &server->newrq_mutex, &timeout);
-	    timeout.tv_sec = 0;
-	}
-	if (server->newrq) {
-	    debug(DBG_DBG, "clientwr: got new request");
-	    server->newrq = 0;
-	}
-#if 0
-	else
-	    debug(DBG_DBG, "clientwr: request timer expired, processing request queue");
-#endif
-	pthread_mutex_unlock(&server->newrq_mutex);
+struct duerqouts {
+    struct server *server;
+    uint8_t ids[MAX_REQUESTS];
+    int n;
+};
 
-	for (i = 0; i < MAX_REQUESTS; i++) {
-	    if (server->clientrdgone) {
-		server->state = RSP_SERVER_STATE_FAILING;
-                if (conf->pdef->connecter)
-                    pthread_join(clientrdth, NULL);
-		goto errexit;
-	    }
+static void duerqout(struct timewheel_node *node, void *arg) {
+    struct duerqouts *due = (struct duerqouts *)arg;
+    struct rqout *rqout = (struct rqout *)((char *)node - offsetof(struct rqout, timer));
 
-	    for (; i < MAX_REQUESTS; i++) {
-		rqout = server->requests + i;
-		if (rqout->rq) {
-		    pthread_mutex_lock(rqout->lock);
-		    if (rqout->rq)
-			break;
-		    pthread_mutex_unlock(rqout->lock);
-		}
-	    }
+    due->ids[due->n++] = (uint8_t)(rqout - due->server->requests);
+}
 
-	    if (i == MAX_REQUESTS)
-		break;
+/* retransmits or removes the requests whose timers have expired */
+static void clientwrdue(struct server *server) {
+    struct duerqouts due;
+    struct rqout *rqout;
+    struct timeval now;
+    int i;
 
-	    gettimeofday(&now, NULL);
-            if (now.tv_sec < rqout->expiry.tv_sec) {
-		if (!timeout.tv_sec || rqout->expiry.tv_sec < timeout.tv_sec)
-		    timeout.tv_sec = rqout->expiry.tv_sec;
-                pthread_mutex_unlock(rqout->lock);
-		continue;
+    gettimeofday(&now, NULL);
+    due.server = server;
+    due.n = 0;
+    pthread_mutex_lock(&server->rqlock);
+    timewheel_expire(&server->rqtimers, now.tv_sec, duerqout, &due);
+    pthread_mutex_unlock(&server->rqlock);
+
+    for (i = 0; i < due.n; i++) {
+	rqout = server->requests + due.ids[i];
+	pthread_mutex_lock(rqout->lock);
+	if (rqout->rq && rqout->tries && rqout->expiry.tv_sec <= now.tv_sec)
+	    clientwrrqout(server, rqout, now.tv_sec);
+	pthread_mutex_unlock(rqout->lock);
+    }
+}
+
+/* writes what clientradput has buffered, unless the flush interval of
+ * the transport allows waiting for more; returns 1 if some is left,
+ * with flushby set to when it must be written */
+static int clientwrflush(struct server *server, struct timeval *flushby) {
+    struct clsrvconf *conf = server->conf;
+    struct commonprotoopts *opts = protoopts[conf->type];
+    struct timeval now;
+
+    if (!conf->pdef->clientradflush || !server->wlen) {
+	timerclear(flushby);
+	return 0;
+    }
+    if (opts && opts->flushinterval) {
+	gettimeofday(&now, NULL);
+	if (!timerisset(flushby)) {
+	    flushby->tv_sec = now.tv_sec + opts->flushinterval / 1000;
+	    flushby->tv_usec = now.tv_usec + opts->flushinterval % 1000 * 1000;
+	    if (flushby->tv_usec >= 1000000) {
+		flushby->tv_sec++;
+		flushby->tv_usec -= 1000000;
 	    }
+	}
+	if (timercmp(&now, flushby, <))
+	    return 1;
+    }
+    conf->pdef->clientradflush(server);
+    timerclear(flushby);
+    return 0;
+}
 
-	    if (rqout->tries == (*rqout->rq->buf == RAD_Status_Server ? 1 : conf->retrycount + 1)) {
-		debug(DBG_DBG, "clientwr: removing expired packet from queue");
-		if (conf->statusserver) {
-		    if (*rqout->rq->buf == RAD_Status_Server) {
-			debug(DBG_WARN, "clientwr: no status server response, %s dead?", conf->name);
-			if (server->lostrqs < 255)
-			    server->lostrqs++;
-		    }
-                } else {
-		    debug(DBG_WARN, "clientwr: no server response, %s dead?", conf->name);
-		    if (server->lostrqs < 255)
-			server->lostrqs++;
-		}
-		freerqoutdata(rqout);
-                pthread_mutex_unlock(rqout->lock);
-		continue;
+/* sends the requests outstanding again, once the connection they were
+ * sent on is replaced by the standby one */
+static void clientwrresend(struct server *server) {
+    struct rqout *rqout;
+    int i;
+
+    for (i = 0; i < MAX_REQUESTS; i++) {
+	rqout = server->requests + i;
+	pthread_mutex_lock(rqout->lock);
+	if (rqout->rq && rqout->tries) {
+	    STATS_INC(server->conf->stats.retransmits);
+	    server->conf->pdef->clientradput(server, rqout->rq->buf);
+	}
+	pthread_mutex_unlock(rqout->lock);
+    }
+}
+
+/* returns 0 if the peer closed the connection of server; for TLS it
+ * is looked at through SSL, which reads the records sent unasked, as
+ * session tickets, so that only a close_notify or the end counts */
+static int connalive(struct server *server) {
+    char c;
+    int n, flags, alive;
+
+    if (!server->ssl) {
+	n = recv(server->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+    flags = fcntl(server->sock, F_GETFL);
+    if (flags < 0 || fcntl(server->sock, F_SETFL, flags | O_NONBLOCK) < 0)
+	return 0;
+    ERR_clear_error();
+    n = SSL_peek(server->ssl, &c, 1);
+    if (n > 0)
+	alive = 1;
+    else
+	switch (SSL_get_error(server->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    alive = 1;
+	    break;
+	default:
+	    alive = 0;
+	}
+    fcntl(server->sock, F_SETFL, flags);
+    return alive;
+}
+
+/* moves the standby connection of the server block to server, a
+ * channel that lost its connection, and has clientwr send what was
+ * outstanding on it again; must hold the lock on server, returns 1
+ * if the connection was taken over */
+int takestandby(struct server *server) {
+    struct server *standby;
+    int taken = 0;
+
+    brlock_rdlock(&serverslock);
+    standby = server->conf->standby;
+    if (!standby || standby == server || pthread_mutex_trylock(&standby->lock)) {
+	brlock_rdunlock(&serverslock);
+	return 0;
+    }
+    if (standby->state == RSP_SERVER_STATE_CONNECTED) {
+	if (connalive(standby)) {
+	    if (server->sock >= 0)
+		close(server->sock);
+	    SSL_free(server->ssl);
+	    server->sock = standby->sock;
+	    server->ssl = standby->ssl;
+	    standby->sock = -1;
+	    standby->ssl = NULL;
+#ifdef RADPROT_TLS
+	    /* new tickets are for server now, the standby may be freed */
+	    if (server->ssl)
+		tlsmovesession(server->ssl, server);
+#endif
+	    /* before clientwr is woken to resend */
+	    server->state = RSP_SERVER_STATE_CONNECTED;
+	    taken = 1;
+	}
+	/* for standbykeeper() to connect again right away */
+	standby->state = RSP_SERVER_STATE_FAILING;
+	timerclear(&standby->lastconnecttry);
+	pthread_mutex_lock(&standby->newrq_mutex);
+	pthread_cond_signal(&standby->newrq_cond);
+	pthread_mutex_unlock(&standby->newrq_mutex);
+    }
+    pthread_mutex_unlock(&standby->lock);
+    brlock_rdunlock(&serverslock);
+    if (!taken)
+	return 0;
+
+    debug(DBG_WARN, "takestandby: connection to %s lost, using the standby connection", server->conf->name);
+    STATS_INC(server->conf->stats.takeovers);
+    pthread_mutex_lock(&server->newrq_mutex);
+    server->newrq = 1;
+    server->resend = 1;
+    pthread_cond_signal(&server->newrq_cond);
+    pthread_mutex_unlock(&server->newrq_mutex);
+    return 1;
+}
+
+/* sends a Status-Server on the standby connection, returns 1 if it
+ * was answered. Must hold the lock on standby. */
+static int probestandby(struct server *standby) {
+    struct clsrvconf *conf = standby->conf;
+    struct request *rq;
+    struct radmsg *msg = NULL;
+    uint8_t *reply = NULL;
+
+    rq = createstatsrvrq();
+    if (!rq)
+	return 1;
+    rq->buf = radmsg2buf(rq->msg, &conf->radsecret);
+    if (rq->buf)
+	reply = conf->pdef->clientradprobe(standby, rq->buf, conf->retryinterval);
+    if (reply) {
+	msg = buf2radmsg(reply, &conf->radsecret, rq->msg->auth);
+	if (!msg)
+	    radbuf_free(reply);
+    }
+    freerq(rq);
+    if (!msg)
+	return 0;
+    radmsg_free(msg);
+    return 1;
+}
+
+/* keeps the standby connection of a server block open, for a channel
+ * losing its connection to take over at once instead of reconnecting.
+ * It is probed every STATUS_SERVER_PERIOD, well within the IDLE_TIMEOUT
+ * after which peers may close an idle connection. */
+static void *standbykeeper(void *arg) {
+    struct server *standby = (struct server *)arg;
+    struct clsrvconf *conf = standby->conf;
+    struct confgen *gen;
+    struct timespec timeout;
+    struct timeval now;
+    int r;
+
+    for (;;) {
+	if (conf->retiredgen) {
+	    if (standby->sock >= 0)
+		close(standby->sock);
+	    break;
+	}
+	/* gives up, having closed the connection, once retired */
+	if (standby->state != RSP_SERVER_STATE_CONNECTED) {
+	    if (!conf->pdef->connecter(standby, NULL, 0, "standbykeeper"))
+		break;
+	    debug(DBG_INFO, "standbykeeper: standby connection to %s up", conf->name);
+	}
+
+	gettimeofday(&now, NULL);
+	timeout.tv_sec = now.tv_sec + STATUS_SERVER_PERIOD;
+	timeout.tv_nsec = 0;
+	r = 0;
+	pthread_mutex_lock(&standby->newrq_mutex);
+	while (standby->state == RSP_SERVER_STATE_CONNECTED && !conf->retiredgen && r != ETIMEDOUT)
+	    r = pthread_cond_timedwait(&standby->newrq_cond, &standby->newrq_mutex, &timeout);
+	pthread_mutex_unlock(&standby->newrq_mutex);
+	if (r != ETIMEDOUT)
+	    continue;
+
+	pthread_mutex_lock(&standby->lock);
+	if (standby->state == RSP_SERVER_STATE_CONNECTED && !probestandby(standby)) {
+	    debug(DBG_WARN, "standbykeeper: standby connection to %s lost", conf->name);
+	    standby->state = RSP_SERVER_STATE_FAILING;
+	    timerclear(&standby->lastconnecttry);
+	}
+	pthread_mutex_unlock(&standby->lock);
+    }
+
+    gen = conf->retiredgen;
+    brlock_wrlock(&serverslock);
+    conf->standby = NULL;
+    brlock_wrunlock(&serverslock);
+    freeserver(standby, 1);
+    if (gen)
+	releasegen(gen);
+    return NULL;
+}
+
+/* creates the standby connection of conf, kept by a thread of its own */
+static void addstandby(struct clsrvconf *conf) {
+    conf->standby = newserver(conf, 0);
+    if (!conf->standby)
+	debugx(1, DBG_ERR, "failed to add server");
+    if (affinity_create(&conf->standby->clientth, AFFINITY_UPSTREAM, standbykeeper,
+			(void *)conf->standby))
+	debugx(1, DBG_ERR, "pthread_create failed");
+    pthread_detach(conf->standby->clientth);
+}
+
+void *clientwr(void *arg) {
+    struct server *server = (struct server *)arg;
+    pthread_t clientrdth;
+    int dynconffail = 0;
+    time_t secs, next;
+    uint8_t rnd, resend, reader = 0;
+    struct timeval now, laststatsrv, flushby;
+    struct timespec timeout, wait;
+    struct request *statsrvrq;
+    struct clsrvconf *conf;
+    struct confgen *gen;
+
+    assert(server);
+    conf = server->conf;
+
+#define ZZZ 900
+
+    server->state = RSP_SERVER_STATE_STARTUP;
+    if (server->dynamiclookuparg && !dynamicconfig(server)) {
+	dynconffail = 1;
+	server->state = RSP_SERVER_STATE_FAILING;
+	debug(DBG_WARN, "%s: dynamicconfig(%s: %s) failed, sleeping %ds",
+              __func__, server->conf->name, server->dynamiclookuparg, ZZZ);
+	sleep(ZZZ);
+	goto errexit;
+    }
+    /* FIXME: Is resolving not always done by compileserverconfig(),
+     * either as part of static configuration setup or by
+     * dynamicconfig() above?  */
+    if (!resolvehostports(conf->hostports, conf->hostaf, conf->pdef->socktype)) {
+        debug(DBG_WARN, "%s: resolve failed, sleeping %ds", __func__, ZZZ);
+	server->state = RSP_SERVER_STATE_FAILING;
+        sleep(ZZZ);
+        goto errexit;
+    }
+
+    memset(&timeout, 0, sizeof(struct timespec));
+    timerclear(&flushby);
+
+    if (conf->statusserver) {
+	gettimeofday(&server->lastrcv, NULL);
+	gettimeofday(&laststatsrv, NULL);
+    }
+
+    if (conf->pdef->connecter) {
+	if (!conf->pdef->connecter(server, NULL, server->dynamiclookuparg ? 5 : 0, "clientwr")) {
+	    server->state = RSP_SERVER_STATE_FAILING;
+	    if (server->dynamiclookuparg && !conf->retiredgen) {
+                debug(DBG_WARN, "%s: connect failed, sleeping %ds",
+                      __func__, ZZZ);
+		sleep(ZZZ);
+	    }
+	    goto errexit;
+	}
+	if (pthread_create(&clientrdth, &pthread_attr, conf->pdef->clientconnreader, (void *)server)) {
+	    debugerrno(errno, DBG_ERR, "clientwr: pthread_create failed");
+	    server->state = RSP_SERVER_STATE_FAILING;
+	    goto errexit;
+	}
+	reader = 1;
+    } else if (server->channel && conf->pdef->clientconnreader) {
+	/* the further UDP channels read from sockets of their own */
+	if (pthread_create(&clientrdth, &pthread_attr, conf->pdef->clientconnreader, (void *)server)) {
+	    debugerrno(errno, DBG_ERR, "clientwr: pthread_create failed");
+	    server->state = RSP_SERVER_STATE_FAILING;
+	    goto errexit;
+	}
+	reader = 1;
+    }
+    server->state = RSP_SERVER_STATE_CONNECTED;
+
+    for (;;) {
+	pthread_mutex_lock(&server->newrq_mutex);
+	if (!server->newrq) {
+	    gettimeofday(&now, NULL);
+	    /* random 0-7 seconds */
+	    RAND_bytes(&rnd, 1);
+	    rnd /= 32;
+	    if (conf->statusserver) {
+		secs = server->lastrcv.tv_sec > laststatsrv.tv_sec ? server->lastrcv.tv_sec : laststatsrv.tv_sec;
+		if (now.tv_sec - secs > STATUS_SERVER_PERIOD)
+		    secs = now.tv_sec;
+		if (!timeout.tv_sec || timeout.tv_sec > secs + STATUS_SERVER_PERIOD + rnd)
+		    timeout.tv_sec = secs + STATUS_SERVER_PERIOD + rnd;
+	    } else {
+		if (!timeout.tv_sec || timeout.tv_sec > now.tv_sec + STATUS_SERVER_PERIOD + rnd)
+		    timeout.tv_sec = now.tv_sec + STATUS_SERVER_PERIOD + rnd;
+	    }
+	    pthread_mutex_lock(&server->rqlock);
+	    next = timewheel_next(&server->rqtimers);
+	    pthread_mutex_unlock(&server->rqlock);
+	    if (next && next < timeout.tv_sec)
+		timeout.tv_sec = next;
+#if 0
+	    if (timeout.tv_sec > now.tv_sec)
+		debug(DBG_DBG, "clientwr: waiting up to %ld secs for new request", timeout.tv_sec - now.tv_sec);
+#endif
+	    wait = timeout;
+	    if (timerisset(&flushby) && (flushby.tv_sec < timeout.tv_sec ||
+					 (flushby.tv_sec == timeout.tv_sec && flushby.tv_usec * 1000 < timeout.tv_nsec))) {
+		wait.tv_sec = flushby.tv_sec;
+		wait.tv_nsec = flushby.tv_usec * 1000;
 	    }
+	    pthread_cond_timedwait(&server->newrq_cond, &server->newrq_mutex, &wait);
+	    timeout.tv_sec = 0;
+	}
+	if (server->newrq) {
+	    debug(DBG_DBG, "clientwr: got new request");
+	    server->newrq = 0;
+	}
+#if 0
+	else
+	    debug(DBG_DBG, "clientwr: request timer expired, processing request queue");
+#endif
+	resend = server->resend;
+	server->resend = 0;
+	pthread_mutex_unlock(&server->newrq_mutex);
 
-	    rqout->expiry.tv_sec = now.tv_sec + conf->retryinterval;
-	    if (!timeout.tv_sec || rqout->expiry.tv_sec < timeout.tv_sec)
-		timeout.tv_sec = rqout->expiry.tv_sec;
-	    rqout->tries++;
-	    conf->pdef->clientradput(server, rqout->rq->buf);
-	    pthread_mutex_unlock(rqout->lock);
+	if (server->clientrdgone) {
+	    server->state = RSP_SERVER_STATE_FAILING;
+	    if (reader)
+		pthread_join(clientrdth, NULL);
+	    goto errexit;
 	}
+	/* dropped by a reload, if there is a reader it exits first */
+	if (conf->retiredgen && !reader)
+	    goto errexit;
+	if (resend)
+	    clientwrresend(server);
+	clientwrnew(server);
+	clientwrdue(server);
+
 	if (conf->statusserver && server->state == RSP_SERVER_STATE_CONNECTED) {
 	    secs = server->lastrcv.tv_sec > laststatsrv.tv_sec ? server->lastrcv.tv_sec : laststatsrv.tv_sec;
 	    gettimeofday(&now, NULL);
@@ -1897,76 +2943,110 @@ void *clientwr(void *arg) {
 		}
 	    }
 	}
+	clientwrflush(server, &flushby);
     }
 errexit:
+    if (server->dynamiclookuparg)
+	removeserversubrealms(server->dynamicrealm, conf);
+    /* read once out of the subrealms, see retiregen() */
+    gen = conf->retiredgen;
     if (server->dynamiclookuparg) {
-	removeserversubrealms(realms, conf);
 	if (dynconffail)
 	    free(conf);
 	else
 	    freeclsrvconf(conf);
     }
     freeserver(server, 1);
+    if (gen)
+	releasegen(gen);
     return NULL;
 }
 
-void createlistener(uint8_t type, char *arg) {
+/* returns bound socket, or -1 on failure; with reuseport, several
+ * sockets can be bound to the same address and the kernel spreads
+ * the incoming flows over them */
+static int createlistensocket(struct addrinfo *res, uint8_t reuseport) {
+    int s, on = 1;
+
+    s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (s < 0) {
+	debugerrno(errno, DBG_WARN, "createlistener: socket failed");
+	return -1;
+    }
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
+	debugerrno(errno, DBG_WARN, "createlistener: SO_REUSEADDR");
+#ifdef SO_REUSEPORT
+    if (reuseport)
+	if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1)
+	    debugerrno(errno, DBG_WARN, "createlistener: SO_REUSEPORT");
+#endif
+
+    disable_DF_bit(s, res);
+
+#ifdef IPV6_V6ONLY
+    if (res->ai_family == AF_INET6)
+	if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) == -1)
+	    debugerrno(errno, DBG_WARN, "createlistener: IPV6_V6ONLY");
+#endif
+    if (bind(s, res->ai_addr, res->ai_addrlen)) {
+	debugerrno(errno, DBG_WARN, "createlistener: bind failed");
+	close(s);
+	return -1;
+    }
+    return s;
+}
+
+void createlistener(uint8_t type, char *arg, uint8_t workers) {
     pthread_t th;
     struct addrinfo *res;
-    int s = -1, on = 1, *sp = NULL;
+    int s, i, *sp = NULL;
     struct hostportres *hp = newhostport(arg, protodefs[type]->portdefault, 0);
 
     if (!hp || !resolvehostport(hp, AF_UNSPEC, protodefs[type]->socktype, 1))
 	debugx(1, DBG_ERR, "createlistener: failed to resolve %s", arg);
 
     for (res = hp->addrinfo; res; res = res->ai_next) {
-        s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (s < 0) {
-            debugerrno(errno, DBG_WARN, "createlistener: socket failed");
-            continue;
-        }
-	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1)
-            debugerrno(errno, DBG_WARN, "createlistener: SO_REUSEADDR");
-
-	disable_DF_bit(s, res);
-
-#ifdef IPV6_V6ONLY
-	if (res->ai_family == AF_INET6)
-	    if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) == -1)
-                debugerrno(errno, DBG_WARN, "createlistener: IPV6_V6ONLY");
-#endif
-	if (bind(s, res->ai_addr, res->ai_addrlen)) {
-	    debugerrno(errno, DBG_WARN, "createlistener: bind failed");
-	    close(s);
-	    s = -1;
-	    continue;
+	for (i = 0; i < workers; i++) {
+	    s = createlistensocket(res, workers > 1);
+	    if (s < 0)
+		break;
+	    sp = malloc(sizeof(int));
+	    if (!sp)
+		debugx(1, DBG_ERR, "malloc failed");
+	    *sp = s;
+	    if (affinity_create(&th, AFFINITY_LISTENER, protodefs[type]->listener, (void *)sp))
+		debugerrnox(errno, DBG_ERR, "pthread_create failed");
+	    pthread_detach(th);
 	}
-
-	sp = malloc(sizeof(int));
-        if (!sp)
-            debugx(1, DBG_ERR, "malloc failed");
-	*sp = s;
-	if (pthread_create(&th, &pthread_attr, protodefs[type]->listener, (void *)sp))
-            debugerrnox(errno, DBG_ERR, "pthread_create failed");
-	pthread_detach(th);
     }
     if (!sp)
 	debugx(1, DBG_ERR, "createlistener: socket/bind failed");
 
-    debug(DBG_WARN, "createlistener: listening for %s on %s:%s", protodefs[type]->name, hp->host ? hp->host : "*", hp->port);
+    if (workers > 1)
+	debug(DBG_WARN, "createlistener: listening for %s on %s:%s with %d sockets", protodefs[type]->name, hp->host ? hp->host : "*", hp->port, workers);
+    else
+	debug(DBG_WARN, "createlistener: listening for %s on %s:%s", protodefs[type]->name, hp->host ? hp->host : "*", hp->port);
     freehostport(hp);
 }
 
 void createlisteners(uint8_t type) {
     int i;
     char **args;
+    uint8_t workers = 1;
 
+    if (protoopts[type] && protoopts[type]->listenworkers > 1) {
+#ifdef SO_REUSEPORT
+	workers = protoopts[type]->listenworkers;
+#else
+	debug(DBG_WARN, "createlisteners: SO_REUSEPORT not supported, using one %s socket per listen address", protodefs[type]->name);
+#endif
+    }
     args = protodefs[type]->getlistenerargs();
     if (args)
 	for (i = 0; args[i]; i++)
-	    createlistener(type, args[i]);
+	    createlistener(type, args[i], workers);
     else
-	createlistener(type, NULL);
+	createlistener(type, NULL, workers);
 }
 
 void sslinit() {
@@ -2000,7 +3080,7 @@ struct list *addsrvconfs(char *value, char **names) {
     }
 
     for (n = 0; names[n]; n++) {
-	for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	for (entry = list_first(readgen->srvconfs); entry; entry = list_next(entry)) {
 	    conf = (struct clsrvconf *)entry->data;
 	    if (!strcasecmp(names[n], conf->name))
 		break;
@@ -2045,6 +3125,16 @@ void freerealm(struct realm *realm) {
     free(realm);
 }
 
+/* drops a realm of a config generation with its references, the
+ * last of dynamic subrealms free it when gone */
+static void droprealm(struct realm *realm) {
+    while (list_shift(realm->srvconfs))
+	freerealm(realm);
+    while (list_shift(realm->accsrvconfs))
+	freerealm(realm);
+    freerealm(realm);
+}
+
 struct realm *addrealm(struct list *realmlist, char *value, char **servers, char **accservers, char *message, uint8_t accresp) {
     int n;
     struct realm *realm;
@@ -2180,16 +3270,21 @@ struct list *createsubrealmservers(struct realm *realm, struct list *srvconfs) {
 	    }
             debug(DBG_DBG, "%s: copying config %s", __func__, conf->name);
 	    *srvconf = *conf;
-            /* Shallow copy -- sharing all the pointers.  addserver()
-             * will take care of servers (which btw has to be NUL) but
-             * the rest of them are shared with the config found in
-             * the srvconfs list.  */
+	    /* Shallow copy -- sharing all the pointers.  addserver()
+	     * will take care of servers (which btw has to be NUL) but
+	     * the rest of them are shared with the config found in
+	     * the srvconfs list.  */
+	    /* clientwr() frees a dynamic server when done with it, that
+	     * only works with a single channel */
+	    srvconf->channels = 1;
 	    if (addserver(srvconf)) {
 		srvconf->servers->dynamiclookuparg = stringcopy(realm->name, 0);
+		/* kept by the subrealm while the server is in it */
+		srvconf->servers->dynamicrealm = realm->parent;
 		srvconf->servers->state = RSP_SERVER_STATE_STARTUP;
                 debug(DBG_DBG, "%s: new client writer for %s",
                       __func__, srvconf->servers->conf->name);
-		if (pthread_create(&clientth, &pthread_attr, clientwr, (void *)(srvconf->servers))) {
+		if (affinity_create(&clientth, AFFINITY_UPSTREAM, clientwr, (void *)(srvconf->servers))) {
 		    debugerrno(errno, DBG_ERR, "pthread_create failed");
 		    freeserver(srvconf->servers, 1);
 		    srvconf->servers = NULL;
@@ -2243,53 +3338,200 @@ struct realm *adddynamicrealmserver(struct realm *realm, char *id) {
     return newrealm;
 }
 
-int dynamicconfig(struct server *server) {
-    int ok, fd[2], status;
+/* The output of DynamicLookupCommand for a realm, kept for
+ * DynamicLookupTTL seconds after the command succeeds and for ZZZ
+ * seconds, as long as clientwr() sleeps, after it fails. Servers
+ * needing a realm that is being looked up wait for that lookup. */
+struct dynlookup {
+    char *output; /* NULL if the command failed */
+    time_t expiry;
+    uint8_t running;
+};
+
+#define DYNLOOKUP_MAXOUTPUT 65536
+#define DYNLOOKUP_PURGEINTERVAL 60
+
+static struct hash *dynlookups;
+static time_t dynlookups_nextpurge;
+static pthread_mutex_t dynlookups_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dynlookups_cond = PTHREAD_COND_INITIALIZER;
+
+/* runs command with realm as argument, returning what it printed, or
+ * NULL if it could not be run or exited with a non-zero status */
+static char *rundynlookup(const char *command, const char *realm) {
+    int fd[2], status;
     pid_t pid;
-    struct clsrvconf *conf = server->conf;
-    struct gconffile *cf = NULL;
-
-    /* for now we only learn hostname/address */
-    debug(DBG_DBG, "dynamicconfig: need dynamic server config for %s", server->dynamiclookuparg);
+    char *output, *newoutput;
+    size_t len = 0, size = 1024;
+    ssize_t n = -1;
 
-    if (pipe(fd) > 0) {
+    output = malloc(size);
+    if (!output) {
+	debug(DBG_ERR, "malloc failed");
+	return NULL;
+    }
+    if (pipe(fd) < 0) {
 	debugerrno(errno, DBG_ERR, "dynamicconfig: pipe error");
-	goto errexit;
+	free(output);
+	return NULL;
     }
     pid = fork();
     if (pid < 0) {
 	debugerrno(errno, DBG_ERR, "dynamicconfig: fork error");
 	close(fd[0]);
 	close(fd[1]);
-	goto errexit;
+	free(output);
+	return NULL;
     } else if (pid == 0) {
 	/* child */
 	close(fd[0]);
 	if (fd[1] != STDOUT_FILENO) {
 	    if (dup2(fd[1], STDOUT_FILENO) != STDOUT_FILENO)
-		debugx(1, DBG_ERR, "dynamicconfig: dup2 error for command %s", conf->dynamiclookupcommand);
+		debugx(1, DBG_ERR, "dynamicconfig: dup2 error for command %s", command);
 	    close(fd[1]);
 	}
-	if (execlp(conf->dynamiclookupcommand, conf->dynamiclookupcommand, server->dynamiclookuparg, NULL) < 0)
-	    debugx(1, DBG_ERR, "dynamicconfig: exec error for command %s", conf->dynamiclookupcommand);
+	if (execlp(command, command, realm, NULL) < 0)
+	    debugx(1, DBG_ERR, "dynamicconfig: exec error for command %s", command);
     }
 
     close(fd[1]);
-    pushgconffile(&cf, fdopen(fd[0], "r"), conf->dynamiclookupcommand);
-    ok = getgenericconfig(&cf, NULL, "Server", CONF_CBK, confserver_cb,
-			  (void *) conf, NULL);
-    freegconf(&cf);
+    for (;;) {
+	if (len + 1 == size) {
+	    if (size >= DYNLOOKUP_MAXOUTPUT) {
+		debug(DBG_ERR, "dynamicconfig: output of command %s too long", command);
+		break;
+	    }
+	    newoutput = realloc(output, size * 2);
+	    if (!newoutput) {
+		debug(DBG_ERR, "malloc failed");
+		break;
+	    }
+	    output = newoutput;
+	    size *= 2;
+	}
+	n = read(fd[0], output + len, size - len - 1);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	len += n;
+    }
+    close(fd[0]);
+    output[len] = '\0';
 
     if (waitpid(pid, &status, 0) < 0) {
 	debugerrno(errno, DBG_ERR, "dynamicconfig: wait error");
-	goto errexit;
+	free(output);
+	return NULL;
     }
+    if (status || n) {
+	if (status)
+	    debug(DBG_INFO, "dynamicconfig: command exited with status %d",
+		  WEXITSTATUS(status));
+	free(output);
+	return NULL;
+    }
+    return output;
+}
 
-    if (status) {
-        debug(DBG_INFO, "dynamicconfig: command exited with status %d",
-              WEXITSTATUS(status));
-        goto errexit;
+static void purgedynlookups(time_t now) {
+    struct hash_entry *e, *next;
+    struct dynlookup *lookup;
+
+    for (e = hash_first(dynlookups); e; e = next) {
+	next = hash_next(e);
+	lookup = e->data;
+	if (lookup->running || lookup->expiry > now)
+	    continue;
+	hash_extract(dynlookups, e->key, e->keylen);
+	free(lookup->output);
+	free(lookup);
     }
+}
+
+/* returns a copy of the output of the lookup command of conf for
+ * realm, from the cache or by running the command; NULL on failure */
+static char *dynlookup(struct clsrvconf *conf, const char *realm) {
+    struct dynlookup *lookup;
+    size_t cmdlen = strlen(conf->dynamiclookupcommand) + 1, keylen = cmdlen + strlen(realm);
+    char *key, *output;
+    uint8_t waited = 0;
+    time_t now;
+
+    key = malloc(keylen);
+    if (!key) {
+	debug(DBG_ERR, "malloc failed");
+	return NULL;
+    }
+    memcpy(key, conf->dynamiclookupcommand, cmdlen);
+    memcpy(key + cmdlen, realm, keylen - cmdlen);
+
+    pthread_mutex_lock(&dynlookups_lock);
+    if (!dynlookups && !(dynlookups = hash_create())) {
+	pthread_mutex_unlock(&dynlookups_lock);
+	free(key);
+	debug(DBG_ERR, "malloc failed");
+	return NULL;
+    }
+    while ((lookup = hash_read(dynlookups, key, keylen)) && lookup->running) {
+	pthread_cond_wait(&dynlookups_cond, &dynlookups_lock);
+	waited = 1;
+    }
+    now = time(NULL);
+    if (lookup && (waited || lookup->expiry > now)) {
+	debug(DBG_DBG, "dynamicconfig: using cached lookup for %s", realm);
+	output = stringcopy(lookup->output, 0);
+	pthread_mutex_unlock(&dynlookups_lock);
+	free(key);
+	return output;
+    }
+    if (!lookup) {
+	if (now >= dynlookups_nextpurge) {
+	    purgedynlookups(now);
+	    dynlookups_nextpurge = now + DYNLOOKUP_PURGEINTERVAL;
+	}
+	lookup = calloc(1, sizeof(struct dynlookup));
+	if (!lookup || !hash_insert(dynlookups, key, keylen, lookup)) {
+	    pthread_mutex_unlock(&dynlookups_lock);
+	    free(lookup);
+	    free(key);
+	    debug(DBG_ERR, "malloc failed");
+	    return NULL;
+	}
+    }
+    lookup->running = 1;
+    pthread_mutex_unlock(&dynlookups_lock);
+    free(key);
+
+    output = rundynlookup(conf->dynamiclookupcommand, realm);
+
+    pthread_mutex_lock(&dynlookups_lock);
+    free(lookup->output);
+    lookup->output = stringcopy(output, 0);
+    lookup->expiry = time(NULL) + (output ? conf->dynamiclookupttl : ZZZ);
+    lookup->running = 0;
+    pthread_cond_broadcast(&dynlookups_cond);
+    pthread_mutex_unlock(&dynlookups_lock);
+    return output;
+}
+
+int dynamicconfig(struct server *server) {
+    int ok;
+    struct clsrvconf *conf = server->conf;
+    struct gconffile *cf = NULL;
+    char *output;
+
+    /* for now we only learn hostname/address */
+    debug(DBG_DBG, "dynamicconfig: need dynamic server config for %s", server->dynamiclookuparg);
+
+    output = dynlookup(conf, server->dynamiclookuparg);
+    if (!output)
+	goto errexit;
+    ok = pushgconfdata(&cf, output) &&
+	getgenericconfig(&cf, NULL, "Server", CONF_CBK, confserver_cb,
+			 (void *) conf, NULL);
+    freegconf(&cf);
+    free(output);
 
     if (ok)
 	return 1;
@@ -2361,6 +3603,7 @@ struct tlv *extractattr(char *nameval, char vendor_flag) {
     a = malloc(sizeof(struct tlv));
     if (!a)
 	return NULL;
+    a->borrowed = 0;
 
     a->v = (uint8_t *)stringcopy(s + 1, 0);
     if (!a->v) {
@@ -2434,10 +3677,20 @@ struct modattr *extractmodattr(char *nameval) {
 	return NULL;
     }
 
+    if (!compilemodattr(m)) {
+	regfree(m->regex);
+	free(m->regex);
+	free(m->replacement);
+	free(m);
+	debug(DBG_ERR, "malloc failed");
+	return NULL;
+    }
+
     return m;
 }
 
 struct rewrite *getrewrite(char *alt1, char *alt2) {
+    struct hash *rewriteconfs = (readgen ? readgen : getgen())->rewriteconfs;
     struct rewrite *r;
 
     if (alt1)
@@ -2449,32 +3702,68 @@ struct rewrite *getrewrite(char *alt1, char *alt2) {
     return NULL;
 }
 
+static void freemodattr(struct modattr *m) {
+    regfree(m->regex);
+    free(m->regex);
+    free(m->replacement);
+    free(m->parts);
+    free(m);
+}
+
+static int cmpvendorsubattr(const void *a, const void *b) {
+    const uint32_t *x = a, *y = b;
+
+    if (x[0] != y[0])
+	return x[0] < y[0] ? -1 : 1;
+    return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+static void freerewrites(struct hash *rewriteconfs) {
+    struct hash_entry *entry;
+    struct rewrite *r;
+    struct tlv *a;
+    struct modattr *m;
+
+    for (entry = hash_first(rewriteconfs); entry; entry = hash_next(entry)) {
+	r = (struct rewrite *)entry->data;
+	if (!r)
+	    continue;
+	free(r->removevendorattrs);
+	while ((a = (struct tlv *)list_shift(r->addattrs)))
+	    freetlv(a);
+	list_destroy(r->addattrs);
+	while ((m = (struct modattr *)list_shift(r->modattrs)))
+	    freemodattr(m);
+	list_destroy(r->modattrs);
+    }
+    hash_destroy(rewriteconfs);
+}
+
 void addrewrite(char *value, char **rmattrs, char **rmvattrs, char **addattrs, char **addvattrs, char **modattrs)
 {
     struct rewrite *rewrite = NULL;
-    int i, n;
-    uint8_t *rma = NULL;
-    uint32_t *p, *rmva = NULL;
+    int i, n, nrmva = 0;
+    uint8_t t, rm = 0;
+    uint32_t rma[8], *p, *rmva = NULL;
     struct list *adda = NULL, *moda = NULL;
+    struct list_node *node;
     struct tlv *a;
     struct modattr *m;
 
+    memset(rma, 0, sizeof(rma));
     if (rmattrs) {
-	for (n = 0; rmattrs[n]; n++);
-	rma = calloc(n + 1, sizeof(uint8_t));
-	if (!rma)
-	    debugx(1, DBG_ERR, "malloc failed");
-
-	for (i = 0; i < n; i++)
-	    if (!(rma[i] = attrname2val(rmattrs[i])))
+	for (i = 0; rmattrs[i]; i++) {
+	    if (!(t = attrname2val(rmattrs[i])))
 		debugx(1, DBG_ERR, "addrewrite: removing invalid attribute %s", rmattrs[i]);
+	    ATTRMAP_SET(rma, t);
+	}
+	rm = 1;
 	freegconfmstr(rmattrs);
-	rma[i] = 0;
     }
 
     if (rmvattrs) {
 	for (n = 0; rmvattrs[n]; n++);
-	rmva = calloc(2 * n + 1, sizeof(uint32_t));
+	rmva = calloc(2 * n, sizeof(uint32_t));
 	if (!rmva)
 	    debugx(1, DBG_ERR, "malloc failed");
 
@@ -2482,7 +3771,9 @@ void addrewrite(char *value, char **rmattrs, char **rmvattrs, char **addattrs, c
 	    if (!vattrname2val(rmvattrs[i], p, p + 1))
 		debugx(1, DBG_ERR, "addrewrite: removing invalid vendor attribute %s", rmvattrs[i]);
 	freegconfmstr(rmvattrs);
-	*p = 0;
+	/* sorted for a binary search */
+	qsort(rmva, n, 2 * sizeof(uint32_t), cmpvendorsubattr);
+	nrmva = n;
     }
 
     if (addattrs) {
@@ -2528,17 +3819,21 @@ void addrewrite(char *value, char **rmattrs, char **rmvattrs, char **addattrs, c
 	freegconfmstr(modattrs);
     }
 
-    if (rma || rmva || adda || moda) {
+    if (rm || rmva || adda || moda) {
 	rewrite = malloc(sizeof(struct rewrite));
 	if (!rewrite)
 	    debugx(1, DBG_ERR, "malloc failed");
-	rewrite->removeattrs = rma;
+	memset(rewrite, 0, sizeof(struct rewrite));
+	memcpy(rewrite->removeattrs, rma, sizeof(rma));
 	rewrite->removevendorattrs = rmva;
+	rewrite->nremovevendorattrs = nrmva;
 	rewrite->addattrs = adda;
 	rewrite->modattrs = moda;
+	for (node = list_first(moda); node; node = list_next(node))
+	    ATTRMAP_SET(rewrite->modattrtypes, ((struct modattr *)node->data)->t);
     }
 
-    if (!hash_insert(rewriteconfs, value, strlen(value), rewrite))
+    if (!hash_insert(readgen->rewriteconfs, value, strlen(value), rewrite))
 	debugx(1, DBG_ERR, "malloc failed");
     debug(DBG_DBG, "addrewrite: added rewrite block %s", value);
 }
@@ -2570,12 +3865,8 @@ void freeclsrvconf(struct clsrvconf *conf) {
 	regfree(conf->certuriregex);
     free(conf->confrewritein);
     free(conf->confrewriteout);
-    if (conf->rewriteusername) {
-	if (conf->rewriteusername->regex)
-	    regfree(conf->rewriteusername->regex);
-	free(conf->rewriteusername->replacement);
-	free(conf->rewriteusername);
-    }
+    if (conf->rewriteusername)
+	freemodattr(conf->rewriteusername);
     free(conf->dynamiclookupcommand);
     conf->rewritein=NULL;
     conf->rewriteout=NULL;
@@ -2672,6 +3963,8 @@ int mergesrvconf(struct clsrvconf *dst, struct clsrvconf *src) {
 	dst->retryinterval = src->retryinterval;
     if (src->retrycount != 255)
 	dst->retrycount = src->retrycount;
+    if (src->queuelimit)
+	dst->queuelimit = src->queuelimit;
     return 1;
 }
 
@@ -2688,17 +3981,134 @@ int config_hostaf(const char *desc, int ipv4only, int ipv6only, int *af) {
               "IPv6Only can be enabled", desc);
         return -1;
     }
-    if (ipv4only)
-        *af = AF_INET;
-    if (ipv6only)
-        *af = AF_INET6;
-    return 0;
+    if (ipv4only)
+        *af = AF_INET;
+    if (ipv6only)
+        *af = AF_INET6;
+    return 0;
+}
+
+static int samestr(const char *a, const char *b) {
+    return a ? b && !strcmp(a, b) : !b;
+}
+
+static int samemstr(char **a, char **b) {
+    if (!a || !b)
+	return a == b;
+    for (; *a && *b; a++, b++)
+	if (strcmp(*a, *b))
+	    return 0;
+    return !*a && !*b;
+}
+
+/* returns 1 if client or server blocks a and b have the same options */
+static int sameconf(struct clsrvconf *a, struct clsrvconf *b) {
+    return a->type == b->type && a->hostaf == b->hostaf &&
+	samestr(a->name, b->name) && samemstr(a->hostsrc, b->hostsrc) &&
+	samestr(a->portsrc, b->portsrc) && samestr(a->secret, b->secret) &&
+	samestr(a->tls, b->tls) && samestr(a->matchcertattr, b->matchcertattr) &&
+	samestr(a->confrewritein, b->confrewritein) &&
+	samestr(a->confrewriteout, b->confrewriteout) &&
+	samestr(a->confrewriteusername, b->confrewriteusername) &&
+	samestr(a->dynamiclookupcommand, b->dynamiclookupcommand) &&
+	a->dynamiclookupttl == b->dynamiclookupttl &&
+	a->statusserver == b->statusserver && a->retryinterval == b->retryinterval &&
+	a->retrycount == b->retrycount && a->dupinterval == b->dupinterval &&
+	a->certnamecheck == b->certnamecheck && a->addttl == b->addttl &&
+	a->keepalive == b->keepalive && a->loopprevention == b->loopprevention &&
+	a->channels == b->channels && a->standbyconn == b->standbyconn &&
+	a->weight == b->weight &&
+	a->queuelimit == b->queuelimit &&
+	sameaddresses(a->hostports, b->hostports) &&
+	samestr(a->fticks_viscountry, b->fticks_viscountry) &&
+	samestr(a->fticks_visinst, b->fticks_visinst);
+}
+
+static int inlist(struct list *list, void *data) {
+    struct list_node *entry;
+
+    for (entry = list_first(list); entry; entry = list_next(entry))
+	if (entry->data == data)
+	    return 1;
+    return 0;
+}
+
+/* When reloading, a block that did not change carries over from the
+ * current generation, so that its clients, connections and requests
+ * stay. It is given the rewrite and TLS blocks just read, and conf,
+ * the one just read, is freed. Returns the block to use. */
+static struct clsrvconf *carryconf(struct list *confs, struct list *newconfs, struct clsrvconf *conf) {
+    struct list_node *entry;
+    struct clsrvconf *old;
+
+    for (entry = list_first(confs); entry; entry = list_next(entry)) {
+	old = (struct clsrvconf *)entry->data;
+	if (sameconf(old, conf) && !inlist(newconfs, old))
+	    break;
+    }
+    if (!entry)
+	return conf;
+    /* old is in use, it is updated by carryover() once all is read */
+    if (!list_push(readgen->carried, old) || !list_push(readgen->carried, conf))
+	debugx(1, DBG_ERR, "malloc failed");
+    debug(DBG_DBG, "carryconf: %s did not change", old->name);
+    return old;
+}
+
+/* updates the blocks of gen that carried over with what was read for
+ * them, and frees that */
+static void carryover(struct confgen *gen) {
+    struct clsrvconf *old, *conf;
+
+    while ((old = (struct clsrvconf *)list_shift(gen->carried))) {
+	conf = (struct clsrvconf *)list_shift(gen->carried);
+	old->tlsconf = conf->tlsconf;
+	old->rewritein = conf->rewritein;
+	old->rewriteout = conf->rewriteout;
+	freeclsrvconf(conf);
+    }
+    list_free(gen->carried);
+    gen->carried = NULL;
+}
+
+static int samelist(struct list *a, struct list *b) {
+    struct list_node *x, *y;
+
+    for (x = list_first(a), y = list_first(b); x && y; x = list_next(x), y = list_next(y))
+	if (x->data != y->data)
+	    return 0;
+    return !x && !y;
+}
+
+/* as carryconf() for the realm just read, which has to have the same
+ * servers, those having carried over already */
+static struct realm *carryrealm(struct list *realms, struct list *newrealms, struct realm *realm) {
+    struct list_node *entry;
+    struct realm *old;
+
+    for (entry = list_first(realms); entry; entry = list_next(entry)) {
+	old = (struct realm *)entry->data;
+	if (samestr(old->name, realm->name) && samestr(old->message, realm->message) &&
+	    old->accresp == realm->accresp && old->balance == realm->balance &&
+	    samelist(old->srvconfs, realm->srvconfs) &&
+	    samelist(old->accsrvconfs, realm->accsrvconfs) &&
+	    !inlist(newrealms, old))
+	    break;
+    }
+    if (!entry)
+	return realm;
+    list_removedata(newrealms, realm);
+    droprealm(realm);
+    if (!list_push(newrealms, old))
+	debugx(1, DBG_ERR, "malloc failed");
+    debug(DBG_DBG, "carryrealm: %s did not change", old->name);
+    return old;
 }
 
 int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
     struct clsrvconf *conf;
     char *conftype = NULL, *rewriteinalias = NULL;
-    long int dupinterval = LONG_MIN, addttl = LONG_MIN;
+    long int dupinterval = LONG_MIN, addttl = LONG_MIN, queuelimit = LONG_MIN;
     uint8_t ipv4only = 0, ipv6only = 0;
 
     debug(DBG_DBG, "confclient_cb called for %s", block);
@@ -2723,6 +4133,7 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 #endif
 	    "DuplicateInterval", CONF_LINT, &dupinterval,
 	    "addTTL", CONF_LINT, &addttl,
+	    "QueueLimit", CONF_LINT, &queuelimit,
         "tcpKeepalive", CONF_BLN, &conf->keepalive,
 	    "rewrite", CONF_STR, &rewriteinalias,
 	    "rewriteIn", CONF_STR, &conf->confrewritein,
@@ -2784,6 +4195,12 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	conf->addttl = (uint8_t)addttl;
     }
 
+    if (queuelimit != LONG_MIN) {
+	if (queuelimit < 1 || queuelimit > 65535)
+	    debugx(1, DBG_ERR, "error in block %s, value of option QueueLimit is %d, must be 1-65535", block, queuelimit);
+	conf->queuelimit = (uint16_t)queuelimit;
+    }
+
     if (!conf->confrewritein)
 	conf->confrewritein = rewriteinalias;
     else
@@ -2811,13 +4228,16 @@ int confclient_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	if (!conf->secret)
 	    debugx(1, DBG_ERR, "malloc failed");
     }
+    radsecret_init(&conf->radsecret, conf->secret);
 
     conf->lock = malloc(sizeof(pthread_mutex_t));
     if (!conf->lock)
 	debugx(1, DBG_ERR, "malloc failed");
 
     pthread_mutex_init(conf->lock, NULL);
-    if (!list_push(clconfs, conf))
+    if (getgen())
+	conf = carryconf(getgen()->clconfs, readgen->clconfs, conf);
+    if (!list_push(readgen->clconfs, conf))
 	debugx(1, DBG_ERR, "malloc failed");
     return 1;
 }
@@ -2875,7 +4295,7 @@ int compileserverconfig(struct clsrvconf *conf, const char *block) {
 int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
     struct clsrvconf *conf, *resconf;
     char *conftype = NULL, *rewriteinalias = NULL;
-    long int retryinterval = LONG_MIN, retrycount = LONG_MIN, addttl = LONG_MIN;
+    long int retryinterval = LONG_MIN, retrycount = LONG_MIN, addttl = LONG_MIN, channels = LONG_MIN, weight = LONG_MIN, dynamiclookupttl = LONG_MIN, queuelimit = LONG_MIN;
     uint8_t ipv4only = 0, ipv6only = 0;
 
     debug(DBG_DBG, "confserver_cb called for %s", block);
@@ -2914,7 +4334,12 @@ int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 			  "StatusServer", CONF_BLN, &conf->statusserver,
 			  "RetryInterval", CONF_LINT, &retryinterval,
 			  "RetryCount", CONF_LINT, &retrycount,
+			  "Channels", CONF_LINT, &channels,
+			  "StandbyConnection", CONF_BLN, &conf->standbyconn,
+			  "Weight", CONF_LINT, &weight,
+			  "QueueLimit", CONF_LINT, &queuelimit,
 			  "DynamicLookupCommand", CONF_STR, &conf->dynamiclookupcommand,
+			  "DynamicLookupTTL", CONF_LINT, &dynamiclookupttl,
 			  "LoopPrevention", CONF_BLN, &conf->loopprevention,
 			  NULL
 	    )) {
@@ -2987,6 +4412,56 @@ int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	conf->addttl = (uint8_t)addttl;
     }
 
+    if (channels != LONG_MIN) {
+	if (channels < 1 || channels > 32) {
+	    debug(DBG_ERR, "error in block %s, value of option Channels is %d, must be 1-32", block, channels);
+	    goto errexit;
+	}
+	if (conf->type == RAD_DTLS && channels > 1) {
+	    debug(DBG_ERR, "error in block %s, option Channels is not supported for transport type %s", block, conf->pdef->name);
+	    goto errexit;
+	}
+	conf->channels = (uint8_t)channels;
+    }
+
+    if (conf->standbyconn && conf->type != RAD_TCP && conf->type != RAD_TLS) {
+	debug(DBG_ERR, "error in block %s, option StandbyConnection is not supported for transport type %s", block, conf->pdef->name);
+	goto errexit;
+    }
+    if (conf->standbyconn && conf->dynamiclookupcommand) {
+	debug(DBG_ERR, "error in block %s, option StandbyConnection can't be used with DynamicLookupCommand", block);
+	goto errexit;
+    }
+    /* nothing else is sent on it to keep it from being idle */
+    if (conf->standbyconn && !conf->statusserver) {
+	debug(DBG_ERR, "error in block %s, option StandbyConnection needs StatusServer", block);
+	goto errexit;
+    }
+
+    if (weight != LONG_MIN) {
+	if (weight < 1 || weight > 255) {
+	    debug(DBG_ERR, "error in block %s, value of option Weight is %d, must be 1-255", block, weight);
+	    goto errexit;
+	}
+	conf->weight = (uint8_t)weight;
+    }
+
+    if (queuelimit != LONG_MIN) {
+	if (queuelimit < 1 || queuelimit > MAX_REQUESTS) {
+	    debug(DBG_ERR, "error in block %s, value of option QueueLimit is %d, must be 1-%d", block, queuelimit, MAX_REQUESTS);
+	    goto errexit;
+	}
+	conf->queuelimit = (uint16_t)queuelimit;
+    }
+
+    if (dynamiclookupttl != LONG_MIN) {
+	if (dynamiclookupttl < 0 || dynamiclookupttl > 86400) {
+	    debug(DBG_ERR, "error in block %s, value of option DynamicLookupTTL is %d, must be 0-86400", block, dynamiclookupttl);
+	    goto errexit;
+	}
+	conf->dynamiclookupttl = (uint32_t)dynamiclookupttl;
+    }
+
     if (resconf) {
 	if (!mergesrvconf(resconf, conf))
 	    goto errexit;
@@ -3014,11 +4489,14 @@ int confserver_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 	    return 0;
 	}
     }
+    radsecret_init(&conf->radsecret, conf->secret);
 
     if (resconf)
 	return 1;
 
-    if (!list_push(srvconfs, conf)) {
+    if (getgen())
+	conf = carryconf(getgen()->srvconfs, readgen->srvconfs, conf);
+    if (!list_push(readgen->srvconfs, conf)) {
 	debug(DBG_ERR, "malloc failed");
 	goto errexit;
     }
@@ -3032,8 +4510,9 @@ errexit:
 }
 
 int confrealm_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
-    char **servers = NULL, **accservers = NULL, *msg = NULL;
+    char **servers = NULL, **accservers = NULL, *msg = NULL, *balance = NULL;
     uint8_t accresp = 0;
+    struct realm *realm;
 
     debug(DBG_DBG, "confrealm_cb called for %s", block);
 
@@ -3042,11 +4521,27 @@ int confrealm_cb(struct gconffile **cf, void *arg, char *block, char *opt, char
 			  "accountingServer", CONF_MSTR, &accservers,
 			  "ReplyMessage", CONF_STR, &msg,
 			  "AccountingResponse", CONF_BLN, &accresp,
+			  "LoadBalance", CONF_STR, &balance,
 			  NULL
 	    ))
 	debugx(1, DBG_ERR, "configuration error");
 
-    addrealm(realms, val, servers, accservers, msg, accresp);
+    realm = addrealm(readgen->realms, val, servers, accservers, msg, accresp);
+    if (realm && balance) {
+	if (!strcasecmp(balance, "first"))
+	    realm->balance = RSP_BALANCE_FIRST;
+	else if (!strcasecmp(balance, "roundRobin"))
+	    realm->balance = RSP_BALANCE_ROUNDROBIN;
+	else if (!strcasecmp(balance, "leastOutstanding"))
+	    realm->balance = RSP_BALANCE_LEASTOUTSTANDING;
+	else if (!strcasecmp(balance, "responseTime"))
+	    realm->balance = RSP_BALANCE_RESPONSETIME;
+	else
+	    debugx(1, DBG_ERR, "error in block %s, value of option LoadBalance is %s, must be first, roundRobin, leastOutstanding or responseTime", block, balance);
+    }
+    free(balance);
+    if (realm && getgen())
+	carryrealm(getgen()->realms, readgen->realms, realm);
     return 1;
 }
 
@@ -3070,74 +4565,105 @@ int confrewrite_cb(struct gconffile **cf, void *arg, char *block, char *opt, cha
     return 1;
 }
 
-int setprotoopts(uint8_t type, char **listenargs, char *sourcearg) {
-    struct commonprotoopts *protoopts;
+int setprotoopts(uint8_t type, struct commonprotoopts *opts) {
+    struct commonprotoopts *new;
 
-    protoopts = malloc(sizeof(struct commonprotoopts));
-    if (!protoopts)
+    new = malloc(sizeof(struct commonprotoopts));
+    if (!new)
 	return 0;
-    memset(protoopts, 0, sizeof(struct commonprotoopts));
-    protoopts->listenargs = listenargs;
-    protoopts->sourcearg = sourcearg;
-    protodefs[type]->setprotoopts(protoopts);
+    memcpy(new, opts, sizeof(struct commonprotoopts));
+    protoopts[type] = new;
+    protodefs[type]->setprotoopts(new);
     return 1;
 }
 
-void getmainconfig(const char *configfile) {
-    long int addttl = LONG_MIN, loglevel = LONG_MIN;
-    struct gconffile *cfs;
-    char **listenargs[RAD_PROTOCOUNT];
-    char *sourcearg[RAD_PROTOCOUNT];
+/* frees what a reload read of the top level options, as those only
+ * take effect when restarting */
+static void freereloadoptions(struct options *o, struct commonprotoopts *opts) {
+    int i;
+
+    free(o->pidfile);
+    free(o->ttlattr);
+    free(o->logdestination);
+    free(o->ftickssyslogfacility);
+    free(o->statslisten);
+    for (i = 0; i < RAD_PROTOCOUNT; i++) {
+	freegconfmstr(opts[i].listenargs);
+	free(opts[i].sourcearg);
+    }
+}
+
+/* the options for the CPUs of each affinity class */
+static const char *affinityoptions[AFFINITY_CLASSES] = {
+    "ListenerCPUs", "UpstreamCPUs", "WorkerCPUs"
+};
+
+/* reads the config file into a new generation; when reloading, only
+ * the blocks, LogLevel and TraceSampleRate are used */
+static struct confgen *readconfig(const char *configfile, uint8_t reload) {
+    long int addttl = LONG_MIN, loglevel = LONG_MIN, ioworkers = LONG_MIN;
+    long int handshakeworkers = LONG_MIN, resolveinterval = LONG_MIN, crlreloadinterval = LONG_MIN;
+    long int tracesamplerate = LONG_MIN;
+    char *cpus[AFFINITY_CLASSES];
+    long int batchsize[RAD_PROTOCOUNT], listenworkers[RAD_PROTOCOUNT], flushinterval[RAD_PROTOCOUNT];
+    struct commonprotoopts opts[RAD_PROTOCOUNT];
+    struct options reloadoptions, *o = reload ? &reloadoptions : &options;
+    struct confgen *gen;
     uint8_t *fticks_reporting_str = NULL;
     uint8_t *fticks_mac_str = NULL;
     uint8_t *fticks_key_str = NULL;
     int i;
 
-    cfs = openconfigfile(configfile);
-    memset(&options, 0, sizeof(options));
-    memset(&listenargs, 0, sizeof(listenargs));
-    memset(&sourcearg, 0, sizeof(sourcearg));
-
-    clconfs = list_create();
-    if (!clconfs)
-	debugx(1, DBG_ERR, "malloc failed");
-
-    srvconfs = list_create();
-    if (!srvconfs)
-	debugx(1, DBG_ERR, "malloc failed");
+    readcfs = openconfigfile(configfile);
+    memset(o, 0, sizeof(struct options));
+    memset(&opts, 0, sizeof(opts));
+    memset(cpus, 0, sizeof(cpus));
+    for (i = 0; i < RAD_PROTOCOUNT; i++)
+	batchsize[i] = listenworkers[i] = flushinterval[i] = LONG_MIN;
 
-    realms = list_create();
-    if (!realms)
+    gen = calloc(1, sizeof(struct confgen));
+    if (!gen)
 	debugx(1, DBG_ERR, "malloc failed");
-
-    rewriteconfs = hash_create();
-    if (!rewriteconfs)
+    gen->clconfs = list_create();
+    gen->srvconfs = list_create();
+    gen->realms = list_create();
+    gen->rewriteconfs = hash_create();
+    gen->carried = list_create();
+    if (!gen->clconfs || !gen->srvconfs || !gen->realms || !gen->rewriteconfs || !gen->carried)
 	debugx(1, DBG_ERR, "malloc failed");
+    readgen = gen;
+    /* at startup the hosts are resolved once all blocks are read */
+    if (!reload)
+	resolvebatch_open();
 
     if (!getgenericconfig(
-	    &cfs, NULL,
+	    &readcfs, NULL,
 #ifdef RADPROT_UDP
-	    "ListenUDP", CONF_MSTR, &listenargs[RAD_UDP],
-	    "SourceUDP", CONF_STR, &sourcearg[RAD_UDP],
+	    "ListenUDP", CONF_MSTR, &opts[RAD_UDP].listenargs,
+	    "SourceUDP", CONF_STR, &opts[RAD_UDP].sourcearg,
+	    "BatchSizeUDP", CONF_LINT, &batchsize[RAD_UDP],
+	    "ListenWorkersUDP", CONF_LINT, &listenworkers[RAD_UDP],
 #endif
 #ifdef RADPROT_TCP
-	    "ListenTCP", CONF_MSTR, &listenargs[RAD_TCP],
-	    "SourceTCP", CONF_STR, &sourcearg[RAD_TCP],
+	    "ListenTCP", CONF_MSTR, &opts[RAD_TCP].listenargs,
+	    "SourceTCP", CONF_STR, &opts[RAD_TCP].sourcearg,
 #endif
 #ifdef RADPROT_TLS
-	    "ListenTLS", CONF_MSTR, &listenargs[RAD_TLS],
-	    "SourceTLS", CONF_STR, &sourcearg[RAD_TLS],
+	    "ListenTLS", CONF_MSTR, &opts[RAD_TLS].listenargs,
+	    "SourceTLS", CONF_STR, &opts[RAD_TLS].sourcearg,
+	    "FlushIntervalTLS", CONF_LINT, &flushinterval[RAD_TLS],
 #endif
 #ifdef RADPROT_DTLS
-	    "ListenDTLS", CONF_MSTR, &listenargs[RAD_DTLS],
-	    "SourceDTLS", CONF_STR, &sourcearg[RAD_DTLS],
+	    "ListenDTLS", CONF_MSTR, &opts[RAD_DTLS].listenargs,
+	    "SourceDTLS", CONF_STR, &opts[RAD_DTLS].sourcearg,
+	    "ListenWorkersDTLS", CONF_LINT, &listenworkers[RAD_DTLS],
 #endif
-            "PidFile", CONF_STR, &options.pidfile,
-	    "TTLAttribute", CONF_STR, &options.ttlattr,
+            "PidFile", CONF_STR, &o->pidfile,
+	    "TTLAttribute", CONF_STR, &o->ttlattr,
 	    "addTTL", CONF_LINT, &addttl,
 	    "LogLevel", CONF_LINT, &loglevel,
-	    "LogDestination", CONF_STR, &options.logdestination,
-	    "LoopPrevention", CONF_BLN, &options.loopprevention,
+	    "LogDestination", CONF_STR, &o->logdestination,
+	    "LoopPrevention", CONF_BLN, &o->loopprevention,
 	    "Client", CONF_CBK, confclient_cb, NULL,
 	    "Server", CONF_CBK, confserver_cb, NULL,
 	    "Realm", CONF_CBK, confrealm_cb, NULL,
@@ -3148,32 +4674,379 @@ void getmainconfig(const char *configfile) {
 	    "FTicksReporting", CONF_STR, &fticks_reporting_str,
 	    "FTicksMAC", CONF_STR, &fticks_mac_str,
 	    "FTicksKey", CONF_STR, &fticks_key_str,
-	    "FTicksSyslogFacility", CONF_STR, &options.ftickssyslogfacility,
-            "IPv4Only", CONF_BLN, &options.ipv4only,
-            "IPv6Only", CONF_BLN, &options.ipv6only,
+	    "FTicksSyslogFacility", CONF_STR, &o->ftickssyslogfacility,
+            "IPv4Only", CONF_BLN, &o->ipv4only,
+            "IPv6Only", CONF_BLN, &o->ipv6only,
+	    "IOWorkers", CONF_LINT, &ioworkers,
+	    "HandshakeWorkers", CONF_LINT, &handshakeworkers,
+	    "StatsListen", CONF_STR, &o->statslisten,
+	    "ResolveInterval", CONF_LINT, &resolveinterval,
+	    "CRLReloadInterval", CONF_LINT, &crlreloadinterval,
+	    "TraceSampleRate", CONF_LINT, &tracesamplerate,
+	    "ListenerCPUs", CONF_STR, &cpus[AFFINITY_LISTENER],
+	    "UpstreamCPUs", CONF_STR, &cpus[AFFINITY_UPSTREAM],
+	    "WorkerCPUs", CONF_STR, &cpus[AFFINITY_WORKER],
 	    NULL
 	    ))
 	debugx(1, DBG_ERR, "configuration error");
+    readgen = NULL;
+    if (!reload && !resolvebatch_close())
+	debugx(1, DBG_ERR, "resolve failed, exiting");
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    tlscreatectxs();
+#endif
 
     if (loglevel != LONG_MIN) {
 	if (loglevel < 1 || loglevel > 5)
 	    debugx(1, DBG_ERR, "error in %s, value of option LogLevel is %d, must be 1, 2, 3, 4 or 5", configfile, loglevel);
-	options.loglevel = (uint8_t)loglevel;
+	o->loglevel = (uint8_t)loglevel;
     }
     if (addttl != LONG_MIN) {
 	if (addttl < 1 || addttl > 255)
 	    debugx(1, DBG_ERR, "error in %s, value of option addTTL is %d, must be 1-255", configfile, addttl);
-	options.addttl = (uint8_t)addttl;
-    }
-    if (!setttlattr(&options, DEFAULT_TTL_ATTR))
+	o->addttl = (uint8_t)addttl;
+    }
+    if (ioworkers != LONG_MIN) {
+	if (ioworkers < 0 || ioworkers > 255)
+	    debugx(1, DBG_ERR, "error in %s, value of option IOWorkers is %d, must be 0-255", configfile, ioworkers);
+	o->ioworkers = (uint8_t)ioworkers;
+    }
+    if (handshakeworkers != LONG_MIN) {
+	if (handshakeworkers < 1 || handshakeworkers > 255)
+	    debugx(1, DBG_ERR, "error in %s, value of option HandshakeWorkers is %d, must be 1-255", configfile, handshakeworkers);
+	o->handshakeworkers = (uint8_t)handshakeworkers;
+    }
+    if (resolveinterval != LONG_MIN) {
+	if (resolveinterval < 0 || resolveinterval > 86400)
+	    debugx(1, DBG_ERR, "error in %s, value of option ResolveInterval is %d, must be 0-86400", configfile, resolveinterval);
+	o->resolveinterval = (uint32_t)resolveinterval;
+    }
+    if (crlreloadinterval != LONG_MIN) {
+	if (crlreloadinterval < 0 || crlreloadinterval > 86400)
+	    debugx(1, DBG_ERR, "error in %s, value of option CRLReloadInterval is %d, must be 0-86400", configfile, crlreloadinterval);
+	o->crlreloadinterval = (uint32_t)crlreloadinterval;
+    }
+    if (tracesamplerate != LONG_MIN) {
+	if (tracesamplerate < 0 || tracesamplerate > 1000000)
+	    debugx(1, DBG_ERR, "error in %s, value of option TraceSampleRate is %d, must be 0-1000000", configfile, tracesamplerate);
+	o->tracesamplerate = (uint32_t)tracesamplerate;
+    }
+    /* like LogLevel, this is also changed by reloading */
+    trace_setrate(o->tracesamplerate);
+    for (i = 0; i < AFFINITY_CLASSES; i++) {
+	if (cpus[i] && !reload && !affinity_set(i, cpus[i]))
+	    debugx(1, DBG_ERR, "error in %s, value of option %s is %s, must be a list of CPUs like 0-3,8", configfile, affinityoptions[i], cpus[i]);
+	free(cpus[i]);
+    }
+    if (!setttlattr(o, DEFAULT_TTL_ATTR))
     	debugx(1, DBG_ERR, "Failed to set TTLAttribute, exiting");
+    if (!reload)
+	setacctattrs(o);
 
-    fticks_configure(&options, &fticks_reporting_str, &fticks_mac_str,
-		     &fticks_key_str);
+    if (reload) {
+	free(fticks_reporting_str);
+	free(fticks_mac_str);
+	free(fticks_key_str);
+    } else
+	fticks_configure(&options, &fticks_reporting_str, &fticks_mac_str,
+			 &fticks_key_str);
 
-    for (i = 0; i < RAD_PROTOCOUNT; i++)
-	if (listenargs[i] || sourcearg[i])
-	    setprotoopts(i, listenargs[i], sourcearg[i]);
+    for (i = 0; i < RAD_PROTOCOUNT; i++) {
+	if (batchsize[i] != LONG_MIN) {
+	    if (batchsize[i] < 1 || batchsize[i] > 1024)
+		debugx(1, DBG_ERR, "error in %s, value of option BatchSizeUDP is %d, must be 1-1024", configfile, batchsize[i]);
+	    opts[i].batchsize = (uint16_t)batchsize[i];
+	}
+	if (listenworkers[i] != LONG_MIN) {
+	    if (listenworkers[i] < 1 || listenworkers[i] > 255)
+		debugx(1, DBG_ERR, "error in %s, value of option ListenWorkers%s is %d, must be 1-255", configfile, i == RAD_UDP ? "UDP" : "DTLS", listenworkers[i]);
+	    opts[i].listenworkers = (uint8_t)listenworkers[i];
+	}
+	if (flushinterval[i] != LONG_MIN) {
+	    if (flushinterval[i] < 0 || flushinterval[i] > 1000)
+		debugx(1, DBG_ERR, "error in %s, value of option FlushIntervalTLS is %d, must be 0-1000", configfile, flushinterval[i]);
+	    opts[i].flushinterval = (uint16_t)flushinterval[i];
+	}
+	if (reload)
+	    continue;
+	if (opts[i].listenargs || opts[i].sourcearg || opts[i].batchsize || opts[i].listenworkers || opts[i].flushinterval)
+	    if (!setprotoopts(i, &opts[i]))
+		debugx(1, DBG_ERR, "malloc failed");
+    }
+
+    if (reload) {
+	if (o->loglevel && !cmdloglevel)
+	    debug_set_level(o->loglevel);
+	freereloadoptions(o, opts);
+	if (!list_first(gen->clconfs))
+	    debugx(1, DBG_ERR, "No clients configured in %s", configfile);
+	if (!list_first(gen->realms))
+	    debugx(1, DBG_ERR, "No realms configured in %s", configfile);
+    }
+
+    gen->clconfindex = indexconfs(gen->clconfs);
+    gen->srvconfindex = indexconfs(gen->srvconfs);
+    gen->realmindex = indexrealms(gen->realms);
+    if (!gen->clconfindex || !gen->srvconfindex || !gen->realmindex)
+	debugx(1, DBG_ERR, "malloc failed");
+    carryover(gen);
+    return gen;
+}
+
+/* starts the servers of srvconfs not already running */
+static void startservers(struct list *srvconfs) {
+    struct list_node *entry;
+    struct clsrvconf *srvconf;
+    struct server *server;
+
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	srvconf = (struct clsrvconf *)entry->data;
+	if (srvconf->servers || srvconf->dynamiclookupcommand)
+	    continue;
+	if (!addserver(srvconf))
+	    debugx(1, DBG_ERR, "failed to add server");
+	for (server = srvconf->servers; server; server = server->nextchannel)
+	    if (affinity_create(&server->clientth, AFFINITY_UPSTREAM, clientwr,
+				(void *)server))
+		debugx(1, DBG_ERR, "pthread_create failed");
+	if (srvconf->standbyconn)
+	    addstandby(srvconf);
+    }
+}
+
+/* returns the entries of a not in b */
+static struct list *notinlist(struct list *a, struct list *b) {
+    struct list *l;
+    struct list_node *entry;
+
+    l = list_create();
+    if (!l)
+	debugx(1, DBG_ERR, "malloc failed");
+    for (entry = list_first(a); entry; entry = list_next(entry))
+	if (!inlist(b, entry->data) && !list_push(l, entry->data))
+	    debugx(1, DBG_ERR, "malloc failed");
+    return l;
+}
+
+/* wakes a channel, or the standby connection, of a retired server block */
+static void wakeretired(struct server *server) {
+    pthread_mutex_lock(&server->newrq_mutex);
+    pthread_cond_signal(&server->newrq_cond);
+    pthread_mutex_unlock(&server->newrq_mutex);
+    /* wakes the reader, dynamic servers time out by themselves;
+     * a channel holding the lock is connecting and sees retiredgen */
+    if (!server->dynamiclookuparg && (server->conf->type == RAD_TCP || server->conf->type == RAD_TLS) &&
+	!pthread_mutex_trylock(&server->lock)) {
+	if (server->sock >= 0)
+	    shutdown(server->sock, SHUT_RDWR);
+	pthread_mutex_unlock(&server->lock);
+    }
+}
+
+/* makes the channels of a server block of gen exit, counting them */
+static void retireserver(struct confgen *gen, struct clsrvconf *conf) {
+    struct server *server;
+
+    /* the channels free themselves once they see retiredgen, which
+     * freeserver() can't do while this is held */
+    brlock_wrlock(&serverslock);
+    for (server = conf->servers; server; server = server->nextchannel)
+	__atomic_add_fetch(&gen->refcount, 1, __ATOMIC_RELAXED);
+    if (conf->standby)
+	__atomic_add_fetch(&gen->refcount, 1, __ATOMIC_RELAXED);
+    conf->retiredgen = gen;
+    for (server = conf->servers; server; server = server->nextchannel)
+	wakeretired(server);
+    if (conf->standby)
+	wakeretired(conf->standby);
+    brlock_wrunlock(&serverslock);
+}
+
+static void retiredynamicservers(struct confgen *gen, struct list *srvconfs) {
+    struct list_node *entry;
+    struct clsrvconf *conf;
+
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	if (conf->servers && conf->servers->dynamiclookuparg)
+	    retireserver(gen, conf);
+    }
+}
+
+static void freegen(struct confgen *gen) {
+    struct clsrvconf *conf;
+    struct realm *realm;
+
+    while ((conf = (struct clsrvconf *)list_shift(gen->retiredclconfs))) {
+	list_free(conf->clients);
+	freeclsrvconf(conf);
+    }
+    while ((conf = (struct clsrvconf *)list_shift(gen->retiredsrvconfs)))
+	freeclsrvconf(conf);
+    while ((realm = (struct realm *)list_shift(gen->retiredrealms)))
+	droprealm(realm);
+    list_free(gen->retiredclconfs);
+    list_free(gen->retiredsrvconfs);
+    list_free(gen->retiredrealms);
+    list_free(gen->clconfs);
+    list_free(gen->srvconfs);
+    list_free(gen->realms);
+    addrtrie_free(gen->clconfindex);
+    addrtrie_free(gen->srvconfindex);
+    freerealmindex(gen->realmindex);
+    freerewrites(gen->rewriteconfs);
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    tlsfreeconfs(gen->tlsconfs);
+#endif
+    free(gen);
+}
+
+/* Stops what is left of a replaced generation and frees it. Lookups
+ * made before the swap may still be using its servers for a while,
+ * so those are only stopped after RELOAD_GRACE. */
+static void *retiregen(void *arg) {
+    struct confgen *gen = (struct confgen *)arg, *expected = gen;
+    struct list_node *entry, *node;
+    struct clsrvconf *conf;
+    struct realm *realm, *subrealm;
+
+    sleep(RELOAD_GRACE);
+    /* a failed exchange stores the newer gracegen into expected */
+    __atomic_compare_exchange_n(&gracegen, &expected, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    for (entry = list_first(gen->retiredsrvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	debug(DBG_INFO, "retiregen: stopping server %s", conf->name);
+	retireserver(gen, conf);
+    }
+    /* the dynamic servers of dropped realms leave their subrealms
+     * under the realm lock before looking at retiredgen */
+    for (entry = list_first(gen->retiredrealms); entry; entry = list_next(entry)) {
+	realm = (struct realm *)entry->data;
+	pthread_mutex_lock(&realm->mutex);
+	for (node = list_first(realm->subrealms); node; node = list_next(node)) {
+	    subrealm = (struct realm *)node->data;
+	    retiredynamicservers(gen, subrealm->srvconfs);
+	    retiredynamicservers(gen, subrealm->accsrvconfs);
+	}
+	pthread_mutex_unlock(&realm->mutex);
+    }
+    while (__atomic_load_n(&gen->refcount, __ATOMIC_ACQUIRE))
+	sleep(1);
+    freegen(gen);
+    debug(DBG_INFO, "retiregen: replaced configuration freed");
+    return NULL;
+}
+
+/* Makes gen the current generation. The blocks of the old one that
+ * did not carry over are retired: new clients are refused, TCP and
+ * TLS connections are closed, and the other clients are dropped with
+ * their next request, or for UDP looked up again. */
+static void swapgen(struct confgen *gen) {
+    struct confgen *old = getgen();
+    struct list_node *entry, *node;
+    struct clsrvconf *conf;
+    pthread_t th;
+
+    old->retiredclconfs = notinlist(old->clconfs, gen->clconfs);
+    old->retiredsrvconfs = notinlist(old->srvconfs, gen->srvconfs);
+    old->retiredrealms = notinlist(old->realms, gen->realms);
+    __atomic_store_n(&gracegen, old, __ATOMIC_RELEASE);
+    __atomic_store_n(&curgen, gen, __ATOMIC_RELEASE);
+    startservers(gen->srvconfs);
+
+    for (entry = list_first(old->retiredclconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	pthread_mutex_lock(conf->lock);
+	if (conf->clients)
+	    __atomic_add_fetch(&old->refcount, list_count(conf->clients), __ATOMIC_RELAXED);
+	conf->retiredgen = old;
+	/* an idle connection would hold on to old, so it is closed; the
+	 * sockets are closed only once the clients are removed */
+	if (conf->type == RAD_TCP || conf->type == RAD_TLS)
+	    for (node = list_first(conf->clients); node; node = list_next(node))
+		shutdown(((struct client *)node->data)->sock, SHUT_RDWR);
+	pthread_mutex_unlock(conf->lock);
+    }
+    debug(DBG_INFO, "swapgen: %d of %d clients, %d of %d servers and %d of %d realms carried over",
+	  list_count(old->clconfs) - list_count(old->retiredclconfs), list_count(gen->clconfs),
+	  list_count(old->srvconfs) - list_count(old->retiredsrvconfs), list_count(gen->srvconfs),
+	  list_count(old->realms) - list_count(old->retiredrealms), list_count(gen->realms));
+    if (pthread_create(&th, &pthread_attr, retiregen, (void *)old)) {
+	debugerrno(errno, DBG_ERR, "swapgen: pthread_create failed, keeping the replaced configuration");
+	return;
+    }
+    pthread_detach(th);
+}
+
+/* held while reading the configuration or reloading the CRLs */
+static pthread_mutex_t reloadlock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads the config file again, first in a child process, so that the
+ * errors that make reading it exit leave the running config as is.
+ * Should reading it fail in the parent still, as when the file was
+ * changed in between, what was read is left behind. */
+static void reloadconfig() {
+    static jmp_buf readfailed;
+    pid_t pid;
+    int status;
+    struct confgen *gen;
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    struct hash *tlsconfs;
+#endif
+
+    pthread_mutex_lock(&reloadlock);
+    /* so that reading it, twice, finds what expired resolved again */
+    addrcache_refresh(0);
+    pid = fork();
+    if (pid < 0) {
+	debugerrno(errno, DBG_ERR, "reloadconfig: fork failed");
+	goto exit;
+    }
+    if (!pid) {
+	debug_forked();
+	/* the parent logs the rest when reading it again */
+	debug_set_level(1);
+	cmdloglevel = 1;
+	/* in case a lock held by another thread at fork() is needed */
+	alarm(RELOAD_CHECK_TIMEOUT);
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+	tlsnewconfs();
+#endif
+	readconfig(mainconfigfile, 1);
+	_exit(0);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+	debugerrno(errno, DBG_ERR, "reloadconfig: wait failed");
+	goto exit;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+	debug(DBG_ERR, "reloadconfig: failed to read %s, keeping the running configuration", mainconfigfile);
+	goto exit;
+    }
+
+    debug(DBG_INFO, "reloadconfig: reading %s", mainconfigfile);
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    tlsconfs = tlsnewconfs();
+#endif
+    if (setjmp(readfailed)) {
+	debug_catchexit(NULL);
+	debug(DBG_ERR, "reloadconfig: failed to read %s again, keeping the running configuration", mainconfigfile);
+	freegconf(&readcfs);
+	readgen = NULL;
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+	tlskeepconfs(tlsconfs);
+#endif
+	goto exit;
+    }
+    debug_catchexit(&readfailed);
+    gen = readconfig(mainconfigfile, 1);
+    debug_catchexit(NULL);
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    getgen()->tlsconfs = tlsconfs;
+#endif
+    swapgen(gen);
+exit:
+    pthread_mutex_unlock(&reloadlock);
 }
 
 void getargs(int argc, char **argv, uint8_t *foreground, uint8_t *pretend, uint8_t *loglevel, char **configfile, char **pidfile) {
@@ -3242,6 +5115,197 @@ int daemon(int a, int b) {
 }
 #endif
 
+void logpoolstats() {
+    struct pool *pool;
+    uint64_t hits, misses, releases;
+
+    for (pool = pool_next(NULL); pool; pool = pool_next(pool)) {
+	pool_getstats(pool, &hits, &misses, &releases);
+	debug(DBG_INFO, "pool %s: %llu from pool, %llu from malloc (%d%% hits), %llu freed", pool->name,
+	      (unsigned long long)hits, (unsigned long long)misses,
+	      hits + misses ? (int)(hits * 100 / (hits + misses)) : 0, (unsigned long long)releases);
+    }
+}
+
+struct statscounter {
+    const char *name, *help;
+    size_t offset;
+};
+
+static const struct statscounter clientcounters[] = {
+    { "radsecproxy_client_requests_total", "Requests received from the client.", offsetof(struct stats, requests) },
+    { "radsecproxy_client_replies_total", "Replies sent to the client.", offsetof(struct stats, replies) },
+    { "radsecproxy_client_duplicates_total", "Duplicate requests received from the client.", offsetof(struct stats, duplicates) },
+    { "radsecproxy_client_invalid_total", "Requests from the client failing validation.", offsetof(struct stats, invalid) },
+    { "radsecproxy_client_dropped_total", "Requests from the client not forwarded.", offsetof(struct stats, dropped) },
+    { "radsecproxy_client_shed_total", "Requests and replies of the client shed by its QueueLimit.", offsetof(struct stats, shed) },
+    { "radsecproxy_client_paused_total", "Times reading from the client was held back by its QueueLimit.", offsetof(struct stats, paused) },
+    { "radsecproxy_client_tls_handshakes_total", "TLS and DTLS handshakes with the client.", offsetof(struct stats, tlshandshakes) },
+    { "radsecproxy_client_tls_resumed_total", "Handshakes with the client resuming a session.", offsetof(struct stats, tlsresumed) },
+    { NULL, NULL, 0 }
+};
+
+static const struct statscounter servercounters[] = {
+    { "radsecproxy_server_requests_total", "Requests sent to the server.", offsetof(struct stats, requests) },
+    { "radsecproxy_server_replies_total", "Replies received from the server.", offsetof(struct stats, replies) },
+    { "radsecproxy_server_invalid_total", "Replies from the server failing validation.", offsetof(struct stats, invalid) },
+    { "radsecproxy_server_dropped_total", "Requests dropped for lack of a free id.", offsetof(struct stats, dropped) },
+    { "radsecproxy_server_shed_total", "Requests shed by the QueueLimit or as too old to send.", offsetof(struct stats, shed) },
+    { "radsecproxy_server_retransmits_total", "Requests sent to the server again.", offsetof(struct stats, retransmits) },
+    { "radsecproxy_server_timeouts_total", "Requests given up on without a reply.", offsetof(struct stats, timeouts) },
+    { "radsecproxy_server_standby_takeovers_total", "Lost connections replaced by the standby connection.", offsetof(struct stats, takeovers) },
+    { "radsecproxy_server_tls_handshakes_total", "TLS and DTLS handshakes with the server.", offsetof(struct stats, tlshandshakes) },
+    { "radsecproxy_server_tls_resumed_total", "Handshakes with the server resuming a session.", offsetof(struct stats, tlsresumed) },
+    { NULL, NULL, 0 }
+};
+
+static void collectcounters(struct statsbuf *sb, const struct statscounter *counters, const char *label, struct list *confs) {
+    const struct statscounter *c;
+    struct list_node *entry;
+    struct clsrvconf *conf;
+
+    for (c = counters; c->name; c++) {
+	stats_header(sb, c->name, "counter", c->help);
+	for (entry = list_first(confs); entry; entry = list_next(entry)) {
+	    conf = (struct clsrvconf *)entry->data;
+	    stats_sample(sb, c->name, label, conf->name, STATS_GET(*(uint64_t *)((char *)&conf->stats + c->offset)));
+	}
+    }
+}
+
+/* writes all statistics, called from the statistics listener */
+static void collectstats(struct statsbuf *sb) {
+    struct list_node *entry, *node;
+    struct clsrvconf *conf;
+    struct server *server;
+    struct client *client;
+    struct gqueue *replyqs[16];
+    struct pool *pool;
+    uint64_t hits, misses, releases, queued = 0;
+    int n, lost, up, nreplyqs = 0, i;
+    struct list *clconfs = getgen()->clconfs, *srvconfs = getgen()->srvconfs;
+
+    collectcounters(sb, clientcounters, "client", clconfs);
+    stats_header(sb, "radsecproxy_client_connections", "gauge", "Clients currently known for the client block.");
+    for (entry = list_first(clconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	pthread_mutex_lock(conf->lock);
+	n = conf->clients ? list_count(conf->clients) : 0;
+	pthread_mutex_unlock(conf->lock);
+	stats_sample(sb, "radsecproxy_client_connections", "client", conf->name, n);
+    }
+
+    collectcounters(sb, servercounters, "server", srvconfs);
+    stats_header(sb, "radsecproxy_server_response_seconds", "histogram", "Time taken by the server to reply.");
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	stats_histogram(sb, "radsecproxy_server_response_seconds", "server", conf->name, &conf->stats);
+    }
+    stats_header(sb, "radsecproxy_server_outstanding_requests", "gauge", "Requests sent to the server awaiting a reply.");
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	stats_sample(sb, "radsecproxy_server_outstanding_requests", "server", conf->name, conf->servers ? outstandingrqs(conf) : 0);
+    }
+    /* the samples of a family have to follow its header */
+    stats_header(sb, "radsecproxy_server_lost_requests", "gauge", "Requests in a row the server has not replied to.");
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	lost = 0;
+	for (server = conf->servers; server; server = server->nextchannel)
+	    lost += server->lostrqs;
+	stats_sample(sb, "radsecproxy_server_lost_requests", "server", conf->name, lost);
+    }
+    stats_header(sb, "radsecproxy_server_channels_up", "gauge", "Channels to the server currently connected.");
+    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	up = 0;
+	for (server = conf->servers; server; server = server->nextchannel)
+	    if (server->state == RSP_SERVER_STATE_CONNECTED)
+		up++;
+	stats_sample(sb, "radsecproxy_server_channels_up", "server", conf->name, up);
+    }
+
+    /* the UDP clients share the reply queue of their listener, so
+     * queues are summed rather than reported per client */
+    for (entry = list_first(clconfs); entry; entry = list_next(entry)) {
+	conf = (struct clsrvconf *)entry->data;
+	pthread_mutex_lock(conf->lock);
+	for (node = conf->clients ? list_first(conf->clients) : NULL; node; node = list_next(node)) {
+	    client = (struct client *)node->data;
+	    for (i = 0; i < nreplyqs && replyqs[i] != client->replyq; i++);
+	    if (i < nreplyqs)
+		continue;
+	    if (nreplyqs < (int)(sizeof(replyqs) / sizeof(replyqs[0])))
+		replyqs[nreplyqs++] = client->replyq;
+	    pthread_mutex_lock(&client->replyq->mutex);
+	    queued += list_count(client->replyq->entries);
+	    pthread_mutex_unlock(&client->replyq->mutex);
+	}
+	pthread_mutex_unlock(conf->lock);
+    }
+    stats_header(sb, "radsecproxy_reply_queue_length", "gauge", "Replies waiting to be sent to clients.");
+    stats_sample(sb, "radsecproxy_reply_queue_length", NULL, NULL, queued);
+    stats_header(sb, "radsecproxy_unknown_peer_packets_total", "counter", "Packets and connections from peers not configured.");
+    stats_sample(sb, "radsecproxy_unknown_peer_packets_total", NULL, NULL, STATS_GET(stats_unknownpeers));
+
+    stats_header(sb, "radsecproxy_log_dropped_total", "counter", "Log messages dropped as the log writer fell behind.");
+    stats_sample(sb, "radsecproxy_log_dropped_total", NULL, NULL, debug_get_dropped());
+
+    stats_header(sb, "radsecproxy_pool_hits_total", "counter", "Objects taken from the pool.");
+    for (pool = pool_next(NULL); pool; pool = pool_next(pool)) {
+	pool_getstats(pool, &hits, &misses, &releases);
+	stats_sample(sb, "radsecproxy_pool_hits_total", "pool", pool->name, hits);
+    }
+    stats_header(sb, "radsecproxy_pool_misses_total", "counter", "Objects allocated with malloc as the pool was empty.");
+    for (pool = pool_next(NULL); pool; pool = pool_next(pool)) {
+	pool_getstats(pool, &hits, &misses, &releases);
+	stats_sample(sb, "radsecproxy_pool_misses_total", "pool", pool->name, misses);
+    }
+
+    trace_collect(sb);
+}
+
+/* listens for statistics requests on arg, the path of a unix socket
+ * or a host and port */
+static void createstatslistener(char *arg) {
+    struct hostportres *hp;
+    struct addrinfo *res;
+    struct sockaddr_un sockun;
+    int s, n = 0;
+
+    if (*arg == '/') {
+	if (strlen(arg) >= sizeof(sockun.sun_path))
+	    debugx(1, DBG_ERR, "createstatslistener: path %s is too long", arg);
+	memset(&sockun, 0, sizeof(sockun));
+	sockun.sun_family = AF_UNIX;
+	strcpy(sockun.sun_path, arg);
+	unlink(arg);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s < 0 || bind(s, (struct sockaddr *)&sockun, sizeof(sockun)) || listen(s, 16))
+	    debugx(1, DBG_ERR, "createstatslistener: failed to listen on %s: %s", arg, strerror(errno));
+	if (!stats_serve(s, collectstats))
+	    debugx(1, DBG_ERR, "createstatslistener: pthread_create failed");
+	return;
+    }
+
+    hp = newhostport(arg, NULL, 0);
+    if (!hp || !hp->port || !resolvehostport(hp, AF_UNSPEC, SOCK_STREAM, 1))
+	debugx(1, DBG_ERR, "createstatslistener: failed to resolve %s, a host and port are needed", arg);
+    for (res = hp->addrinfo; res; res = res->ai_next) {
+	s = createlistensocket(res, 0);
+	if (s < 0)
+	    continue;
+	if (listen(s, 16))
+	    debugx(1, DBG_ERR, "createstatslistener: listen failed: %s", strerror(errno));
+	if (!stats_serve(s, collectstats))
+	    debugx(1, DBG_ERR, "createstatslistener: pthread_create failed");
+	n++;
+    }
+    freehostport(hp);
+    if (!n)
+	debugx(1, DBG_ERR, "createstatslistener: failed to listen on %s", arg);
+}
+
 void *sighandler(void *arg) {
     sigset_t sigset;
     int sig;
@@ -3258,11 +5322,15 @@ void *sighandler(void *arg) {
         case SIGHUP:
             debug(DBG_INFO, "sighandler: got SIGHUP");
 	    debug_reopen_log();
+	    reloadconfig();
 #if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+	    pthread_mutex_lock(&reloadlock);
 	    tlsreloadcrls();
+	    pthread_mutex_unlock(&reloadlock);
 #endif
-            break;
-        case SIGPIPE:
+	    logpoolstats();
+	    break;
+	case SIGPIPE:
             debug(DBG_WARN, "sighandler: got SIGPIPE, TLS write error?");
             break;
         default:
@@ -3271,6 +5339,33 @@ void *sighandler(void *arg) {
     }
 }
 
+/* Resolves the hosts of the configuration again every ResolveInterval
+ * seconds. If some resolve to other addresses, the configuration is
+ * read again, replacing the blocks of those only. */
+static void *resolverefresher(void *arg) {
+    for (;;) {
+	sleep(options.resolveinterval);
+	if (addrcache_refresh(1)) {
+	    debug(DBG_INFO, "resolverefresher: addresses changed, reloading %s", mainconfigfile);
+	    reloadconfig();
+	}
+    }
+    return NULL;
+}
+
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+/* Reloads the CRLs every CRLReloadInterval seconds, as on SIGHUP */
+static void *crlrefresher(void *arg) {
+    for (;;) {
+	sleep(options.crlreloadinterval);
+	pthread_mutex_lock(&reloadlock);
+	tlsreloadcrls();
+	pthread_mutex_unlock(&reloadlock);
+    }
+    return NULL;
+}
+#endif
+
 int createpidfile(const char *pidfile) {
     int r = 0;
     FILE *f = fopen(pidfile, "w");
@@ -3280,12 +5375,13 @@ int createpidfile(const char *pidfile) {
 }
 
 int radsecproxy_main(int argc, char **argv) {
-    pthread_t sigth;
+    pthread_t sigth, resolveth;
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    pthread_t crlth;
+#endif
     sigset_t sigset;
-    struct list_node *entry;
     uint8_t foreground = 0, pretend = 0, loglevel = 0;
     char *configfile = NULL, *pidfile = NULL;
-    struct clsrvconf *srvconf;
     int i;
 
     debug_init("radsecproxy");
@@ -3296,7 +5392,10 @@ int radsecproxy_main(int argc, char **argv) {
     if (pthread_attr_setstacksize(&pthread_attr, PTHREAD_STACK_SIZE))
 	debugx(1, DBG_ERR, "pthread_attr_setstacksize failed");
 #if defined(HAVE_MALLOPT)
-    if (mallopt(M_TRIM_THRESHOLD, 4 * 1024) != 1)
+    /* per packet memory is pooled, trimming as soon as 4k was free
+     * at the top of the heap made it shrink and grow with the
+     * traffic */
+    if (mallopt(M_TRIM_THRESHOLD, 128 * 1024) != 1)
 	debugx(1, DBG_ERR, "mallopt failed");
 #endif
 
@@ -3309,7 +5408,9 @@ int radsecproxy_main(int argc, char **argv) {
     getargs(argc, argv, &foreground, &pretend, &loglevel, &configfile, &pidfile);
     if (loglevel)
 	debug_set_level(loglevel);
-    getmainconfig(configfile ? configfile : CONFIG_MAIN);
+    cmdloglevel = loglevel;
+    mainconfigfile = configfile ? configfile : CONFIG_MAIN;
+    curgen = readconfig(mainconfigfile, 0);
     if (loglevel)
 	options.loglevel = loglevel;
     else if (options.loglevel)
@@ -3326,9 +5427,9 @@ int radsecproxy_main(int argc, char **argv) {
     }
     free(options.logdestination);
 
-    if (!list_first(clconfs))
+    if (!list_first(curgen->clconfs))
 	debugx(1, DBG_ERR, "No clients configured, nothing to do, exiting");
-    if (!list_first(realms))
+    if (!list_first(curgen->realms))
 	debugx(1, DBG_ERR, "No realms configured, nothing to do, exiting");
 
     if (pretend)
@@ -3337,30 +5438,41 @@ int radsecproxy_main(int argc, char **argv) {
     if (!foreground && (daemon(0, 0) < 0))
 	debugx(1, DBG_ERR, "daemon() failed: %s", strerror(errno));
 
+    sigemptyset(&sigset);
+    /* exit on all but SIGHUP|SIGPIPE, ignore more? before any thread
+     * is started, so that they all inherit the mask */
+    sigaddset(&sigset, SIGHUP);
+    sigaddset(&sigset, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
     debug_timestamp_on();
+    if (!debug_async_on())
+	debugx(1, DBG_ERR, "failed to start log writer");
     debug(DBG_INFO, "radsecproxy revision %s starting", PACKAGE_VERSION);
     if (!pidfile)
         pidfile = options.pidfile;
     if (pidfile && !createpidfile(pidfile))
 	debugx(1, DBG_ERR, "failed to create pidfile %s: %s", pidfile, strerror(errno));
 
-    sigemptyset(&sigset);
-    /* exit on all but SIGHUP|SIGPIPE, ignore more? */
-    sigaddset(&sigset, SIGHUP);
-    sigaddset(&sigset, SIGPIPE);
-    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
     pthread_create(&sigth, &pthread_attr, sighandler, NULL);
+    if (options.resolveinterval &&
+	pthread_create(&resolveth, &pthread_attr, resolverefresher, NULL))
+	debugx(1, DBG_ERR, "pthread_create failed");
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    if (options.crlreloadinterval &&
+	pthread_create(&crlth, &pthread_attr, crlrefresher, NULL))
+	debugx(1, DBG_ERR, "pthread_create failed");
+#endif
 
-    for (entry = list_first(srvconfs); entry; entry = list_next(entry)) {
-	srvconf = (struct clsrvconf *)entry->data;
-	if (srvconf->dynamiclookupcommand)
-	    continue;
-	if (!addserver(srvconf))
-	    debugx(1, DBG_ERR, "failed to add server");
-	if (pthread_create(&srvconf->servers->clientth, &pthread_attr, clientwr,
-			   (void *)(srvconf->servers)))
-	    debugx(1, DBG_ERR, "pthread_create failed");
-    }
+    startservers(curgen->srvconfs);
+
+    if (options.ioworkers && !evloop_init(options.ioworkers))
+	debugx(1, DBG_ERR, "failed to start event loop workers");
+#if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
+    if ((find_clconf_type(RAD_TLS, NULL) || find_clconf_type(RAD_DTLS, NULL)) &&
+	!tlshandshakeinit(options.handshakeworkers ? options.handshakeworkers : HANDSHAKE_WORKERS))
+	debugx(1, DBG_ERR, "failed to start handshake workers");
+#endif
 
     for (i = 0; i < RAD_PROTOCOUNT; i++) {
 	if (!protodefs[i])
@@ -3371,6 +5483,9 @@ int radsecproxy_main(int argc, char **argv) {
 	    createlisteners(i);
     }
 
+    if (options.statslisten)
+	createstatslistener(options.statslisten);
+
     /* just hang around doing nothing, anything to do here? */
     for (;;)
 	sleep(1000);
@@ -10,6 +10,10 @@
 #include "tlv11.h"
 #include "radmsg.h"
 #include "gconfig.h"
+#include "timewheel.h"
+#include "dupcache.h"
+#include "stats.h"
+#include "trace.h"
 
 #define DEBUG_LEVEL 2
 
@@ -20,18 +24,24 @@
 #define REQUEST_RETRY_INTERVAL 5
 #define REQUEST_RETRY_COUNT 2
 #define DUPLICATE_INTERVAL REQUEST_RETRY_INTERVAL * REQUEST_RETRY_COUNT
+#define DUPCACHE_SIZE 4096 /* requests kept per client for telling duplicates */
 #define MAX_CERT_DEPTH 5
 #define STATUS_SERVER_PERIOD 25
 #define IDLE_TIMEOUT 300
+#define RELOAD_GRACE 10 /* secs lookups may still use a replaced config */
+#define RELOAD_CHECK_TIMEOUT 60 /* secs a new config may take to check */
+#define HANDSHAKE_WORKERS 8
+#define HANDSHAKE_BACKLOG 256
+#define HANDSHAKE_TIMEOUT 10
+#define WRITEBUF_SIZE 16384 /* the most a TLS record holds */
 
 /* We want PTHREAD_STACK_SIZE to be 32768, but some platforms
- * have a higher minimum value defined in PTHREAD_STACK_MIN. */
-#define PTHREAD_STACK_SIZE 32768
+ * have a higher minimum value defined in PTHREAD_STACK_MIN, which
+ * need not be a constant (glibc with _GNU_SOURCE). */
 #if defined(PTHREAD_STACK_MIN)
-#if PTHREAD_STACK_MIN > PTHREAD_STACK_SIZE
-#undef PTHREAD_STACK_SIZE
-#define PTHREAD_STACK_SIZE PTHREAD_STACK_MIN
-#endif
+#define PTHREAD_STACK_SIZE (PTHREAD_STACK_MIN > 32768 ? PTHREAD_STACK_MIN : 32768)
+#else
+#define PTHREAD_STACK_SIZE 32768
 #endif
 
 /* 27262 is vendor DANTE Ltd. */
@@ -65,6 +75,13 @@ enum rsp_server_state {
     RSP_SERVER_STATE_FAILING
 };
 
+enum rsp_balance {
+    RSP_BALANCE_FIRST = 0, /* default */
+    RSP_BALANCE_ROUNDROBIN,
+    RSP_BALANCE_LEASTOUTSTANDING,
+    RSP_BALANCE_RESPONSETIME
+};
+
 struct options {
     char *pidfile;
     char *logdestination;
@@ -79,11 +96,20 @@ struct options {
     uint8_t *fticks_key;
     uint8_t ipv4only;
     uint8_t ipv6only;
+    uint8_t ioworkers;
+    uint8_t handshakeworkers;
+    char *statslisten;
+    uint32_t resolveinterval;
+    uint32_t crlreloadinterval;
+    uint32_t tracesamplerate;
 };
 
 struct commonprotoopts {
     char **listenargs;
     char *sourcearg;
+    uint16_t batchsize;
+    uint8_t listenworkers; /* sockets per listen address */
+    uint16_t flushinterval; /* ms a writer may wait to fill a record */
 };
 
 struct request {
@@ -99,6 +125,10 @@ struct request {
     uint8_t newid;
     int udpsock; /* only for UDP */
     uint16_t udpport; /* only for UDP */
+    uint8_t msgauthok; /* Message-Authenticator checked on receipt */
+    struct dupcache_node dupnode; /* in the dupcache of from */
+    struct request *nextlinger; /* in the lingering list of from */
+    struct trace *trace; /* if sampled */
 };
 
 /* requests that our client will send */
@@ -107,6 +137,9 @@ struct rqout {
     struct request *rq;
     uint8_t tries;
     struct timeval expiry;
+    struct timeval sent; /* first sent, for the server response time */
+    struct timewheel_node timer; /* for retransmission, under server rqlock */
+    uint8_t queued; /* id is in server newids, under server rqlock */
 };
 
 struct gqueue {
@@ -124,6 +157,7 @@ struct clsrvconf {
     char *portsrc;
     struct list *hostports;
     char *secret;
+    struct radsecret radsecret; /* secret, hashed ahead for every packet */
     char *tls;
     char *matchcertattr;
     regex_t *certcnregex;
@@ -133,6 +167,7 @@ struct clsrvconf {
     char *confrewriteusername;
     struct modattr *rewriteusername;
     char *dynamiclookupcommand;
+    uint32_t dynamiclookupttl; /* seconds to reuse the command's output */
     uint8_t statusserver;
     uint8_t retryinterval;
     uint8_t retrycount;
@@ -141,14 +176,21 @@ struct clsrvconf {
     uint8_t addttl;
     uint8_t keepalive;
     uint8_t loopprevention;
+    uint8_t channels;
+    uint8_t standbyconn; /* keep a standby connection, for TCP and TLS */
+    uint8_t weight; /* for realms balancing by round robin */
+    uint16_t queuelimit; /* requests outstanding, 0 for no limit */
+    struct stats stats;
     struct rewrite *rewritein;
     struct rewrite *rewriteout;
     pthread_mutex_t *lock; /* only used for updating clients so far */
     struct tls *tlsconf;
     struct list *clients;
     struct server *servers;
+    struct server *standby; /* the connection taken over by a failing channel */
     char *fticks_viscountry;
     char *fticks_visinst;
+    struct confgen *retiredgen; /* once a reload dropped the block */
 };
 
 #include "tlscommon.h"
@@ -157,17 +199,31 @@ struct client {
     struct clsrvconf *conf;
     int sock;
     SSL *ssl;
-    struct request *rqs[MAX_REQUESTS];
+    struct dupcache dupcache; /* requests received, by the reader only */
+    struct request *lingerhead, *lingertail; /* those the dupcache let go
+					       * of still at a server, by
+					       * the reader too */
     struct gqueue *replyq;
     struct gqueue *rbios; /* for dtls */
     struct sockaddr *addr;
     time_t expiry; /* for udp */
+    struct timewheel_node expirynode; /* for udp */
+    struct evwatch *evwatch; /* when served by an event loop worker */
+    uint8_t *wbuf; /* of the writer thread, for tls */
+    uint32_t pending; /* requests in a server queue, atomic */
+    pthread_cond_t resume; /* with the replyq mutex, for a reader
+			    * held back by the queue limit */
 };
 
 struct server {
     struct clsrvconf *conf;
+    uint8_t channel; /* index among the channels to the server */
+    struct server *nextchannel;
     int sock;
     SSL *ssl;
+    SSL_SESSION *tlssession; /* to resume when reconnecting */
+    uint8_t *wbuf; /* requests not yet written, by clientwr only */
+    int wlen;
     pthread_mutex_t lock;
     pthread_t clientth;
     uint8_t clientrdgone;
@@ -176,10 +232,21 @@ struct server {
     enum rsp_server_state state;
     uint8_t lostrqs;
     char *dynamiclookuparg;
-    int nextid;
+    struct realm *dynamicrealm; /* the top level realm, for a dynamic server */
     struct timeval lastrcv;
     struct rqout *requests;
+    /* the ids free for new requests, oldest first, the ids of the
+     * requests that clientwr is yet to send, and the timers of those
+     * sent; rqlock may be taken while holding an rqout lock */
+    pthread_mutex_t rqlock;
+    uint8_t freeids[MAX_REQUESTS];
+    uint16_t freehead, nfree;
+    uint8_t newids[MAX_REQUESTS];
+    uint16_t newhead, nnew;
+    struct timewheel rqtimers;
+    uint32_t responsetime; /* moving average in ms, under rqlock */
     uint8_t newrq;
+    uint8_t resend; /* the connection was replaced, send what is outstanding again */
     pthread_mutex_t newrq_mutex;
     pthread_cond_t newrq_cond;
     struct gqueue *rbios; /* for dtls */
@@ -189,6 +256,8 @@ struct realm {
     char *name;
     char *message;
     uint8_t accresp;
+    enum rsp_balance balance;
+    uint32_t rrcount; /* for round robin, under mutex */
     regex_t regex;
     uint32_t refcount;
     pthread_mutex_t refmutex;
@@ -199,17 +268,29 @@ struct realm {
     struct list *accsrvconfs;
 };
 
+/* a piece of a modattr replacement, text or one of \1 to \9 */
+struct modpart {
+    uint8_t field; /* the subexpression, 0 for text */
+    uint16_t len;
+    const char *text; /* for a field the \N, kept when it doesn't match */
+};
+
 struct modattr {
     uint8_t t;
     char *replacement;
     regex_t *regex;
+    struct modpart *parts; /* replacement split up at config time */
+    int nparts;
 };
 
 struct rewrite {
-    uint8_t *removeattrs;
-    uint32_t *removevendorattrs;
+    uint32_t removeattrs[8]; /* map */
+    uint32_t *removevendorattrs; /* vendor, subattribute pairs, sorted;
+				  * subattribute 256 is all of them */
+    uint32_t nremovevendorattrs;
     struct list *addattrs;
     struct list *modattrs;
+    uint32_t modattrtypes[8]; /* map of the types modattrs are for */
 };
 
 struct protodefs {
@@ -229,9 +310,14 @@ struct protodefs {
     void *(*clientconnreader)(void*);
     int (*clientradput)(struct server *, unsigned char *);
     void (*addclient)(struct client *);
-    void (*addserverextra)(struct clsrvconf *);
+    void (*addserverextra)(struct server *);
     void (*setsrcres)();
     void (*initextra)();
+    int (*serverconnread)(struct client *, uint8_t *, int, uint8_t *);
+    int (*serverconnwrite)(struct client *, uint8_t *, int, uint8_t *);
+    void (*serverconnclose)(struct client *);
+    void (*clientradflush)(struct server *);
+    uint8_t *(*clientradprobe)(struct server *, uint8_t *, int);
 };
 
 #define RADLEN(x) ntohs(((uint16_t *)(x))[1])
@@ -244,13 +330,33 @@ struct protodefs {
 struct clsrvconf *find_clconf(uint8_t type, struct sockaddr *addr, struct list_node **cur);
 struct clsrvconf *find_srvconf(uint8_t type, struct sockaddr *addr, struct list_node **cur);
 struct clsrvconf *find_clconf_type(uint8_t type, struct list_node **cur);
-struct client *addclient(struct clsrvconf *conf, uint8_t lock);
+/* sock is the socket of a TCP, TLS or DTLS client, else -1 */
+struct client *addclient(struct clsrvconf *conf, uint8_t lock, int sock);
 void removelockedclient(struct client *client);
 void removeclient(struct client *client);
 struct gqueue *newqueue();
 void freebios(struct gqueue *q);
 struct request *newrequest();
 void freerq(struct request *rq);
+int takereplies(struct client *client, uint8_t *buf, int size);
+int clientoverloaded(struct client *client);
+int takestandby(struct server *server);
+void clientwaitload(struct client *client);
+struct realm *id2realm(struct list *realmlist, char *id);
+int dorewrite(struct radmsg *msg, struct rewrite *rewrite);
+struct modattr *extractmodattr(char *nameval);
+const char *radmsgtype2string(uint8_t code);
+
+/* A receive buffer for a TCP or TLS connection. Reads take as much as
+ * there is room for, and the packets are then taken out one by one. */
+struct rxbuf {
+    uint8_t *buf;
+    int pos, len, size; /* the bytes from pos to len are not taken yet */
+};
+
+int rxbuf_init(struct rxbuf *rx);
+uint8_t *rxbuf_space(struct rxbuf *rx, int *room);
+uint8_t *rxbuf_packet(struct rxbuf *rx);
 int radsrv(struct request *rq);
 void replyh(struct server *server, unsigned char *buf);
 struct addrinfo *resolve_hostport_addrinfo(uint8_t type, char *hostport);
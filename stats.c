@@ -0,0 +1,218 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "radsecproxy.h"
+#include "debug.h"
+
+uint64_t stats_unknownpeers;
+
+/* upper bounds of the latency buckets in ms, the last one is +Inf */
+static const uint32_t latencybounds[STATS_LATENCY_BUCKETS - 1] = {
+    5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+void stats_latency(struct stats *stats, uint32_t ms) {
+    int i;
+
+    for (i = 0; i < STATS_LATENCY_BUCKETS - 1 && ms > latencybounds[i]; i++);
+    STATS_INC(stats->latency[i]);
+    STATS_ADD(stats->latencyms, ms);
+}
+
+void statsbuf_printf(struct statsbuf *sb, const char *fmt, ...) {
+    va_list ap;
+    size_t size;
+    char *buf;
+    int n;
+
+    if (sb->failed)
+	return;
+    for (;;) {
+	va_start(ap, fmt);
+	n = vsnprintf(sb->buf + sb->len, sb->size - sb->len, fmt, ap);
+	va_end(ap);
+	if (n < 0) {
+	    sb->failed = 1;
+	    return;
+	}
+	if (sb->len + n < sb->size)
+	    break;
+	size = sb->size ? sb->size : 4096;
+	while (size <= sb->len + n)
+	    size *= 2;
+	buf = realloc(sb->buf, size);
+	if (!buf) {
+	    sb->failed = 1;
+	    return;
+	}
+	sb->buf = buf;
+	sb->size = size;
+    }
+    sb->len += n;
+}
+
+void stats_header(struct statsbuf *sb, const char *name, const char *type, const char *help) {
+    statsbuf_printf(sb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* writes a label value with \, " and newline escaped */
+static void labelvalue(struct statsbuf *sb, const char *value) {
+    const char *s;
+
+    for (s = value; *s; s++) {
+	if (*s == '\\' || *s == '"')
+	    statsbuf_printf(sb, "\\%c", *s);
+	else if (*s == '\n')
+	    statsbuf_printf(sb, "\\n");
+	else
+	    statsbuf_printf(sb, "%c", *s);
+    }
+}
+
+void stats_sample(struct statsbuf *sb, const char *name, const char *label, const char *value, uint64_t n) {
+    if (!label) {
+	statsbuf_printf(sb, "%s %llu\n", name, (unsigned long long)n);
+	return;
+    }
+    statsbuf_printf(sb, "%s{%s=\"", name, label);
+    labelvalue(sb, value);
+    statsbuf_printf(sb, "\"} %llu\n", (unsigned long long)n);
+}
+
+void stats_histogram(struct statsbuf *sb, const char *name, const char *label, const char *value, struct stats *stats) {
+    uint64_t count = 0;
+    int i;
+
+    for (i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+	count += STATS_GET(stats->latency[i]);
+	statsbuf_printf(sb, "%s_bucket{%s=\"", name, label);
+	labelvalue(sb, value);
+	if (i < STATS_LATENCY_BUCKETS - 1)
+	    statsbuf_printf(sb, "\",le=\"%g\"} %llu\n", latencybounds[i] / 1000.0, (unsigned long long)count);
+	else
+	    statsbuf_printf(sb, "\",le=\"+Inf\"} %llu\n", (unsigned long long)count);
+    }
+    statsbuf_printf(sb, "%s_sum{%s=\"", name, label);
+    labelvalue(sb, value);
+    statsbuf_printf(sb, "\"} %.3f\n", STATS_GET(stats->latencyms) / 1000.0);
+    statsbuf_printf(sb, "%s_count{%s=\"", name, label);
+    labelvalue(sb, value);
+    statsbuf_printf(sb, "\"} %llu\n", (unsigned long long)count);
+}
+
+struct statsserver {
+    int s;
+    void (*collect)(struct statsbuf *);
+};
+
+static int writeall(int s, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len) {
+	n = write(s, buf, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return 0;
+	}
+	buf += n;
+	len -= n;
+    }
+    return 1;
+}
+
+/* reads the request head, we only care about the method */
+static int readrequest(int s, char *buf, size_t size) {
+    size_t len = 0;
+    ssize_t n;
+
+    while (len < size - 1) {
+	n = read(s, buf + len, size - 1 - len);
+	if (n <= 0)
+	    return 0;
+	len += n;
+	buf[len] = '\0';
+	if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n"))
+	    return 1;
+    }
+    return 1;
+}
+
+static void servestats(struct statsserver *server, int s) {
+    char req[1024], head[256];
+    struct statsbuf sb;
+    struct timeval timeout;
+
+    timeout.tv_sec = 5;
+    timeout.tv_usec = 0;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (!readrequest(s, req, sizeof(req)))
+	return;
+    if (strncasecmp(req, "GET ", 4)) {
+	snprintf(head, sizeof(head), "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\n\r\n");
+	writeall(s, head, strlen(head));
+	return;
+    }
+
+    memset(&sb, 0, sizeof(sb));
+    server->collect(&sb);
+    if (sb.failed) {
+	debug(DBG_ERR, "servestats: malloc failed");
+	snprintf(head, sizeof(head), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n");
+	writeall(s, head, strlen(head));
+    } else {
+	snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n", (unsigned long)sb.len);
+	if (writeall(s, head, strlen(head)))
+	    writeall(s, sb.buf, sb.len);
+    }
+    free(sb.buf);
+}
+
+static void *statslistener(void *arg) {
+    struct statsserver *server = (struct statsserver *)arg;
+    int s;
+
+    for (;;) {
+	s = accept(server->s, NULL, NULL);
+	if (s < 0) {
+	    debugerrno(errno, DBG_WARN, "statslistener: accept failed");
+	    sleep(1);
+	    continue;
+	}
+	servestats(server, s);
+	close(s);
+    }
+    return NULL;
+}
+
+int stats_serve(int s, void (*collect)(struct statsbuf *)) {
+    struct statsserver *server;
+    pthread_t th;
+
+    server = malloc(sizeof(struct statsserver));
+    if (!server)
+	return 0;
+    server->s = s;
+    server->collect = collect;
+    if (pthread_create(&th, &pthread_attr, statslistener, (void *)server)) {
+	free(server);
+	return 0;
+    }
+    pthread_detach(th);
+    return 1;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
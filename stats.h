@@ -0,0 +1,71 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <stddef.h>
+
+/* Counters for a client or server block. They are updated with relaxed
+ * atomic adds from whichever thread handles the packet, so counting
+ * never takes a lock, and they are only read when served. */
+
+#define STATS_LATENCY_BUCKETS 12
+
+struct stats {
+    uint64_t requests; /* received from a client, or sent to a server */
+    uint64_t replies; /* sent to a client, or received from a server */
+    uint64_t duplicates; /* requests from a client already received */
+    uint64_t invalid; /* messages failing validation */
+    uint64_t dropped; /* requests not forwarded, or with no id free */
+    uint64_t shed; /* requests and replies dropped by the queue limits */
+    uint64_t paused; /* times reading from a client was held back */
+    uint64_t retransmits; /* requests sent to a server again */
+    uint64_t timeouts; /* requests to a server given up on */
+    uint64_t takeovers; /* connections replaced by the standby one */
+    uint64_t tlshandshakes; /* TLS and DTLS handshakes completed */
+    uint64_t tlsresumed; /* of which resumed a session */
+    uint64_t latency[STATS_LATENCY_BUCKETS]; /* replies by time taken */
+    uint64_t latencyms; /* total time taken by those replies */
+};
+
+/* packets from peers not configured, for all transports */
+extern uint64_t stats_unknownpeers;
+
+#define STATS_ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+#define STATS_INC(var) STATS_ADD(var, 1)
+#define STATS_GET(var) __atomic_load_n(&(var), __ATOMIC_RELAXED)
+
+/* counts a reply that took ms milliseconds */
+void stats_latency(struct stats *stats, uint32_t ms);
+
+/* A growing buffer the statistics are written to in the Prometheus
+ * text format; failed is set if malloc fails */
+struct statsbuf {
+    char *buf;
+    size_t len, size;
+    uint8_t failed;
+};
+
+void statsbuf_printf(struct statsbuf *sb, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/* writes the HELP and TYPE lines of a metric */
+void stats_header(struct statsbuf *sb, const char *name, const char *type, const char *help);
+
+/* writes a sample of a metric with the label set to value */
+void stats_sample(struct statsbuf *sb, const char *name, const char *label, const char *value, uint64_t n);
+
+/* writes the samples of the latency histogram of stats, in seconds */
+void stats_histogram(struct statsbuf *sb, const char *name, const char *label, const char *value, struct stats *stats);
+
+/* serves the statistics written by collect over HTTP to anyone
+ * connecting to the listening socket s, from a thread of its own;
+ * returns 1 if ok, 0 if the thread can't be created */
+int stats_serve(int s, void (*collect)(struct statsbuf *));
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
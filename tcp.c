@@ -9,6 +9,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
+#include <errno.h>
 #ifdef SYS_SOLARIS9
 #include <fcntl.h>
 #endif
@@ -26,13 +27,20 @@
 #ifdef RADPROT_TCP
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
+#include "evloop.h"
+#include "affinity.h"
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
 void *tcplistener(void *arg);
 int tcpconnect(struct server *server, struct timeval *when, int timeout, char * text);
 void *tcpclientrd(void *arg);
 int clientradputtcp(struct server *server, unsigned char *rad);
+uint8_t *clientradprobetcp(struct server *server, uint8_t *rad, int timeout);
 void tcpsetsrcres();
+int tcpserverconnread(struct client *client, uint8_t *buf, int num, uint8_t *wait);
+int tcpserverconnwrite(struct client *client, uint8_t *buf, int num, uint8_t *wait);
+void tcpserverconnclose(struct client *client);
 
 static const struct protodefs protodefs = {
     "tcp",
@@ -53,7 +61,12 @@ static const struct protodefs protodefs = {
     NULL, /* addclient */
     NULL, /* addserverextra */
     tcpsetsrcres, /* setsrcres */
-    NULL /* initextra */
+    NULL, /* initextra */
+    tcpserverconnread, /* serverconnread */
+    tcpserverconnwrite, /* serverconnwrite */
+    tcpserverconnclose, /* serverconnclose */
+    NULL, /* clientradflush */
+    clientradprobetcp /* clientradprobe */
 };
 
 static struct addrinfo *srcres = NULL;
@@ -95,13 +108,17 @@ int tcpconnect(struct server *server, struct timeval *when, int timeout, char *t
     for (;;) {
 	gettimeofday(&now, NULL);
 	elapsed = now.tv_sec - server->lastconnecttry.tv_sec;
-	if (timeout && server->lastconnecttry.tv_sec && elapsed > timeout) {
-	    debug(DBG_DBG, "tcpconnect: timeout");
+	if (server->conf->retiredgen ||
+	    (timeout && server->lastconnecttry.tv_sec && elapsed > timeout)) {
+	    debug(DBG_DBG, "tcpconnect: timeout, or server removed by a reload");
 	    if (server->sock >= 0)
 		close(server->sock);
+	    server->sock = -1;
 	    pthread_mutex_unlock(&server->lock);
 	    return 0;
 	}
+	if (server->state != RSP_SERVER_STATE_STARTUP && takestandby(server))
+	    break;
 	if (server->state == RSP_SERVER_STATE_CONNECTED) {
 	    server->state = RSP_SERVER_STATE_RECONNECTING;
 	    sleep(2);
@@ -130,73 +147,51 @@ int tcpconnect(struct server *server, struct timeval *when, int timeout, char *t
     return 1;
 }
 
-/* timeout in seconds, 0 means no timeout (blocking), returns when num bytes have been read, or timeout */
-/* returns 0 on timeout, -1 on error and num if ok */
+/* timeout in seconds, 0 means no timeout (blocking), returns when some bytes have been read, or timeout */
+/* returns 0 on timeout, -1 on error and the number of bytes if ok */
 int tcpreadtimeout(int s, unsigned char *buf, int num, int timeout) {
-    int ndesc, cnt, len;
+    int ndesc, cnt;
     fd_set readfds;
     struct timeval timer;
 
     if (s < 0)
 	return -1;
     /* make socket non-blocking? */
-    for (len = 0; len < num; len += cnt) {
-	FD_ZERO(&readfds);
-	FD_SET(s, &readfds);
-	if (timeout) {
-	    timer.tv_sec = timeout;
-	    timer.tv_usec = 0;
-	}
-	ndesc = select(s + 1, &readfds, NULL, NULL, timeout ? &timer : NULL);
-	if (ndesc < 1)
-	    return ndesc;
-
-	cnt = read(s, buf + len, num - len);
-	if (cnt <= 0)
-	    return -1;
+    FD_ZERO(&readfds);
+    FD_SET(s, &readfds);
+    if (timeout) {
+	timer.tv_sec = timeout;
+	timer.tv_usec = 0;
     }
-    return num;
+    ndesc = select(s + 1, &readfds, NULL, NULL, timeout ? &timer : NULL);
+    if (ndesc < 1)
+	return ndesc;
+
+    cnt = read(s, buf, num);
+    return cnt > 0 ? cnt : -1;
 }
 
-/* timeout in seconds, 0 means no timeout (blocking) */
-unsigned char *radtcpget(int s, int timeout) {
-    int cnt, len;
-    unsigned char buf[4], *rad;
+/* timeout in seconds, 0 means no timeout (blocking); rx holds what has
+ * been read of the following packets */
+unsigned char *radtcpget(int s, struct rxbuf *rx, int timeout) {
+    int cnt, room;
+    unsigned char *rad, *buf;
 
-    for (;;) {
-	cnt = tcpreadtimeout(s, buf, 4, timeout);
-	if (cnt < 1) {
-	    debug(DBG_DBG, cnt ? "radtcpget: connection lost" : "radtcpget: timeout");
-	    return NULL;
-	}
-
-	len = RADLEN(buf);
-	if (len < 4) {
-	    debug(DBG_ERR, "radtcpget: length too small");
-	    continue;
-	}
-	rad = malloc(len);
-	if (!rad) {
+    while (!(rad = rxbuf_packet(rx))) {
+	buf = rxbuf_space(rx, &room);
+	if (!buf) {
 	    debug(DBG_ERR, "radtcpget: malloc failed");
-	    continue;
+	    return NULL;
 	}
-	memcpy(rad, buf, 4);
-
-	cnt = tcpreadtimeout(s, rad + 4, len - 4, timeout);
+	cnt = tcpreadtimeout(s, buf, room, timeout);
 	if (cnt < 1) {
 	    debug(DBG_DBG, cnt ? "radtcpget: connection lost" : "radtcpget: timeout");
-	    free(rad);
 	    return NULL;
 	}
-
-	if (len >= 20)
-	    break;
-
-	free(rad);
-	debug(DBG_WARN, "radtcpget: packet smaller than minimum radius size");
+	rx->len += cnt;
     }
 
-    debug(DBG_DBG, "radtcpget: got %d bytes", len);
+    debug(DBG_DBG, "radtcpget: got %d bytes", RADLEN(rad));
     return rad;
 }
 
@@ -216,24 +211,49 @@ int clientradputtcp(struct server *server, unsigned char *rad) {
     return 1;
 }
 
+/* writes rad on the connection of server and returns the reply, or
+ * NULL if there is none within timeout seconds */
+uint8_t *clientradprobetcp(struct server *server, uint8_t *rad, int timeout) {
+    struct rxbuf rx;
+    uint8_t *reply;
+
+    if (write(server->sock, rad, RADLEN(rad)) != RADLEN(rad) || !rxbuf_init(&rx))
+	return NULL;
+    reply = radtcpget(server->sock, &rx, timeout);
+    free(rx.buf);
+    return reply;
+}
+
 void *tcpclientrd(void *arg) {
     struct server *server = (struct server *)arg;
     unsigned char *buf;
     struct timeval lastconnecttry;
+    struct rxbuf rx;
 
+    if (!rxbuf_init(&rx)) {
+	debug(DBG_ERR, "tcpclientrd: malloc failed");
+	goto exit;
+    }
     for (;;) {
 	/* yes, lastconnecttry is really necessary */
 	lastconnecttry = server->lastconnecttry;
-	buf = radtcpget(server->sock, server->dynamiclookuparg ? IDLE_TIMEOUT : 0);
+	buf = radtcpget(server->sock, &rx, server->dynamiclookuparg ? IDLE_TIMEOUT : 0);
 	if (!buf) {
-        if (server->dynamiclookuparg)
+	    if (server->dynamiclookuparg || server->conf->retiredgen)
 		break;
 	    tcpconnect(server, &lastconnecttry, 0, "tcpclientrd");
+	    rx.pos = rx.len = 0;
 	    continue;
 	}
 
 	replyh(server, buf);
     }
+    free(rx.buf);
+exit:
+    if (server->conf->retiredgen && server->sock >= 0) {
+	close(server->sock);
+	server->sock = -1;
+    }
     server->clientrdgone = 1;
     pthread_mutex_lock(&server->newrq_mutex);
     pthread_cond_signal(&server->newrq_cond);
@@ -265,6 +285,8 @@ void *tcpserverwr(void *arg) {
 	    }
 	}
 	reply = (struct request *)list_shift(replyq->entries);
+	if (client->conf->queuelimit)
+	    pthread_cond_signal(&client->resume);
 	pthread_mutex_unlock(&replyq->mutex);
 	cnt = write(client->sock, reply->replybuf, RADLEN(reply->replybuf));
 	if (cnt > 0)
@@ -272,6 +294,7 @@ void *tcpserverwr(void *arg) {
 		  cnt, RADLEN(reply->replybuf), addr2string(client->addr));
 	else
 	    debug(DBG_ERR, "tcpserverwr: write error for %s", addr2string(client->addr));
+	TRACE(reply, TRACE_WRITTEN);
 	freerq(reply);
     }
 }
@@ -280,16 +303,23 @@ void tcpserverrd(struct client *client) {
     struct request *rq;
     uint8_t *buf;
     pthread_t tcpserverwrth;
+    struct rxbuf rx;
 
     debug(DBG_DBG, "tcpserverrd: starting for %s", addr2string(client->addr));
 
+    if (!rxbuf_init(&rx)) {
+	debug(DBG_ERR, "tcpserverrd: malloc failed");
+	return;
+    }
     if (pthread_create(&tcpserverwrth, &pthread_attr, tcpserverwr, (void *)client)) {
 	debug(DBG_ERR, "tcpserverrd: pthread_create failed");
+	free(rx.buf);
 	return;
     }
 
     for (;;) {
-	buf = radtcpget(client->sock, 0);
+	clientwaitload(client);
+	buf = radtcpget(client->sock, &rx, 0);
 	if (!buf) {
 	    debug(DBG_ERR, "tcpserverrd: connection from %s lost", addr2string(client->addr));
 	    break;
@@ -297,7 +327,7 @@ void tcpserverrd(struct client *client) {
 	debug(DBG_DBG, "tcpserverrd: got Radius message from %s", addr2string(client->addr));
 	rq = newrequest();
 	if (!rq) {
-	    free(buf);
+	    radbuf_free(buf);
 	    continue;
 	}
 	rq->buf = buf;
@@ -315,8 +345,42 @@ void tcpserverrd(struct client *client) {
     pthread_mutex_unlock(&client->replyq->mutex);
     debug(DBG_DBG, "tcpserverrd: waiting for writer to end");
     pthread_join(tcpserverwrth, NULL);
+    free(rx.buf);
     debug(DBG_DBG, "tcpserverrd: reader for %s exiting", addr2string(client->addr));
 }
+
+/* non-blocking variants for the event loop, returning 0 if the call
+ * would block, with *wait set to the event to wait for */
+int tcpserverconnread(struct client *client, uint8_t *buf, int num, uint8_t *wait) {
+    int cnt;
+
+    cnt = read(client->sock, buf, num);
+    if (cnt > 0)
+	return cnt;
+    *wait = EVLOOP_READ;
+    if (cnt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+	return 0;
+    return -1;
+}
+
+int tcpserverconnwrite(struct client *client, uint8_t *buf, int num, uint8_t *wait) {
+    int cnt;
+
+    *wait = EVLOOP_WRITE;
+    cnt = write(client->sock, buf, num);
+    if (cnt >= 0)
+	return cnt;
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return 0;
+    return -1;
+}
+
+void tcpserverconnclose(struct client *client) {
+    shutdown(client->sock, SHUT_RDWR);
+    close(client->sock);
+    client->sock = -1;
+}
+
 void *tcpservernew(void *arg) {
     int s;
     struct sockaddr_storage from;
@@ -334,18 +398,22 @@ void *tcpservernew(void *arg) {
 
     conf = find_clconf(handle, (struct sockaddr *)&from, NULL);
     if (conf) {
-	client = addclient(conf, 1);
+	client = addclient(conf, 1, s);
 	if (client) {
             if(conf->keepalive)
                 enable_keepalive(s);
-	    client->sock = s;
 	    client->addr = addr_copy((struct sockaddr *)&from);
+	    /* the event loop takes over the socket */
+	    if (evloop_enabled() && evloop_addclient(client, s))
+		pthread_exit(NULL);
 	    tcpserverrd(client);
 	    removeclient(client);
 	} else
 	    debug(DBG_WARN, "tcpservernew: failed to create new client instance");
-    } else
+    } else {
 	debug(DBG_WARN, "tcpservernew: ignoring request, no matching TCP client");
+	STATS_INC(stats_unknownpeers);
+    }
 
 exit:
     shutdown(s, SHUT_RDWR);
@@ -371,7 +439,7 @@ void *tcplistener(void *arg) {
         if (!s_arg)
             debugx(1, DBG_ERR, "malloc failed");
         *s_arg = s;
-	if (pthread_create(&tcpserverth, &pthread_attr, tcpservernew, (void *) s_arg)) {
+	if (affinity_create(&tcpserverth, AFFINITY_WORKER, tcpservernew, (void *) s_arg)) {
 	    debug(DBG_ERR, "tcplistener: pthread_create failed");
             free(s_arg);
 	    shutdown(s, SHUT_RDWR);
@@ -0,0 +1,97 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+/* Times what sendrq() does around queueing a request, with threads
+   forwarding to servers of their own: taking one mutex shared by all
+   threads, as before, and reading a brlock shared by all threads, as
+   now, each around locking a mutex of the thread's own server.  Run
+   with "make bench".  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../brlock.h"
+
+#define OPS 2000000
+#define MAXTHREADS 16
+
+struct _server
+{
+  pthread_mutex_t lock;
+  unsigned long queued;
+  char pad[64];
+};
+
+static struct _server servers[MAXTHREADS];
+static pthread_mutex_t globallock = PTHREAD_MUTEX_INITIALIZER;
+static struct brlock serverslock = BRLOCK_INITIALIZER;
+static int usebrlock;
+static int nthreads;
+
+static double
+_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+_forward (void *arg)
+{
+  struct _server *server = arg;
+  int i;
+
+  for (i = 0; i < OPS / nthreads; i++)
+    {
+      if (usebrlock)
+	brlock_rdlock (&serverslock);
+      else
+	pthread_mutex_lock (&globallock);
+      pthread_mutex_lock (&server->lock);
+      server->queued++;
+      pthread_mutex_unlock (&server->lock);
+      if (usebrlock)
+	brlock_rdunlock (&serverslock);
+      else
+	pthread_mutex_unlock (&globallock);
+    }
+  return NULL;
+}
+
+static int
+_bench (int threads, int brlock)
+{
+  pthread_t th[MAXTHREADS];
+  double start, t;
+  int i;
+
+  nthreads = threads;
+  usebrlock = brlock;
+  start = _now ();
+  for (i = 0; i < threads; i++)
+    if (pthread_create (&th[i], NULL, _forward, &servers[i]))
+      return 1;
+  for (i = 0; i < threads; i++)
+    pthread_join (th[i], NULL);
+  t = _now () - start;
+  printf ("%2d threads, %s: %6.1f ns per request\n", threads,
+	  brlock ? "brlock" : "global mutex", t * 1e9 / OPS);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  int i;
+
+  for (i = 0; i < MAXTHREADS; i++)
+    pthread_mutex_init (&servers[i].lock, NULL);
+  for (i = 1; i <= MAXTHREADS; i *= 2)
+    if (_bench (i, 0) || _bench (i, 1))
+      return 1;
+  return 0;
+}
@@ -0,0 +1,73 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+/* Times hash_read() on tables of different sizes, keyed like the
+   DTLS session cache.  Run with "make bench".  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../hash.h"
+
+#define LOOKUPS 1000000
+
+static double
+_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+_key (struct sockaddr_in *sa, int i)
+{
+  memset (sa, 0, sizeof(*sa));
+  sa->sin_family = AF_INET;
+  sa->sin_addr.s_addr = htonl (0x0a000000 + i / 1000);
+  sa->sin_port = htons (1024 + i % 1000);
+}
+
+static int
+_bench (int n)
+{
+  struct hash *h;
+  struct sockaddr_in sa;
+  double start, t;
+  int i, found = 0;
+
+  h = hash_create ();
+  if (!h)
+    return 1;
+  for (i = 0; i < n; i++)
+    {
+      _key (&sa, i);
+      if (!hash_insert (h, &sa, sizeof(sa), malloc (1)))
+	return 1;
+    }
+  start = _now ();
+  for (i = 0; i < LOOKUPS; i++)
+    {
+      /* every other lookup misses */
+      _key (&sa, (int)((i * 7919u) % (2 * n)));
+      found += hash_read (h, &sa, sizeof(sa)) != NULL;
+    }
+  t = _now () - start;
+  printf ("%7d entries: %6.1f ns per lookup (%d hits)\n",
+	  n, t * 1e9 / LOOKUPS, found);
+  hash_destroy (h);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (_bench (10) || _bench (1000) || _bench (10000) || _bench (100000))
+    return 1;
+  return 0;
+}
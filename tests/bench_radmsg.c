@@ -0,0 +1,146 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+/* Times radmsg2buf() and buf2radmsg() on an Access-Request like the
+   ones a NAS sends.  Run with "make bench".  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "../list.h"
+#include "../tlv11.h"
+#include "../radmsg.h"
+#include "../pool.h"
+
+#define ROUNDS 200000
+#define BATCH 32
+
+static struct radsecret _secret;
+
+static double
+_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct radmsg *
+_request (void)
+{
+  struct radmsg *msg;
+  uint8_t auth[16], zero[16], nasport[4] = { 0, 0, 0, 7 };
+  int i, ok;
+
+  for (i = 0; i < 16; i++)
+    auth[i] = i * 13;
+  memset (zero, 0, sizeof(zero));
+  msg = radmsg_init (RAD_Access_Request, 42, auth);
+  if (!msg)
+    return NULL;
+  ok = radmsg_add (msg, maketlv (RAD_Attr_User_Name, 21,
+				 "anonymous@example.org"))
+    && radmsg_add (msg, maketlv (RAD_Attr_Calling_Station_Id, 17,
+				 "02-00-00-00-00-01"))
+    && radmsg_add (msg, maketlv (5, 4, nasport))
+    && radmsg_add (msg, maketlv (79, 200, (uint8_t[200]) { 2, 1, 0, 200 }))
+    && radmsg_add (msg, maketlv (RAD_Attr_Message_Authenticator, 16, zero));
+  if (!ok)
+    {
+      radmsg_free (msg);
+      return NULL;
+    }
+  return msg;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct radmsg *msg, *parsed;
+  uint8_t *wire, *buf, *bufs[BATCH], ok[BATCH];
+  const struct radsecret *secrets[BATCH];
+  double start, t;
+  int i, j, len;
+
+  radsecret_init (&_secret, "sikrit");
+  msg = _request ();
+  if (!msg)
+    return 1;
+
+  start = _now ();
+  for (i = 0; i < ROUNDS; i++)
+    {
+      buf = radmsg2buf (msg, &_secret);
+      if (!buf)
+	return 1;
+      radbuf_free (buf);
+    }
+  t = _now () - start;
+  printf ("radmsg2buf: %6.1f ns per message\n", t * 1e9 / ROUNDS);
+
+  wire = radmsg2buf (msg, &_secret);
+  if (!wire)
+    return 1;
+  len = ntohs (((uint16_t *)wire)[1]);
+  start = _now ();
+  for (i = 0; i < ROUNDS; i++)
+    {
+      /* buf2radmsg keeps the buffer it parses */
+      buf = radbuf_alloc (len);
+      if (!buf)
+	return 1;
+      memcpy (buf, wire, len);
+      parsed = buf2radmsg (buf, &_secret, NULL);
+      if (!parsed)
+	return 1;
+      radmsg_free (parsed);
+    }
+  t = _now () - start;
+  printf ("buf2radmsg: %6.1f ns per message (%d bytes)\n",
+	  t * 1e9 / ROUNDS, len);
+
+  /* The Message-Authenticators alone, one at a time as buf2radmsg()
+     checks them and a batch at a time as the UDP readers do.  */
+  for (j = 0; j < BATCH; j++)
+    {
+      bufs[j] = malloc (len);
+      if (!bufs[j])
+	return 1;
+      secrets[j] = &_secret;
+    }
+  start = _now ();
+  for (i = 0; i < ROUNDS; i += BATCH)
+    for (j = 0; j < BATCH; j++)
+      {
+	memcpy (bufs[j], wire, len);
+	radmsg_checkmsgauths (1, bufs + j, secrets + j, ok + j);
+	if (!ok[j])
+	  return 1;
+      }
+  t = _now () - start;
+  printf ("radmsg_checkmsgauths: %6.1f ns per message, one at a time\n",
+	  t * 1e9 / ROUNDS);
+  start = _now ();
+  for (i = 0; i < ROUNDS; i += BATCH)
+    {
+      for (j = 0; j < BATCH; j++)
+	memcpy (bufs[j], wire, len);
+      radmsg_checkmsgauths (BATCH, bufs, secrets, ok);
+      for (j = 0; j < BATCH; j++)
+	if (!ok[j])
+	  return 1;
+    }
+  t = _now () - start;
+  printf ("radmsg_checkmsgauths: %6.1f ns per message, %d at a time\n",
+	  t * 1e9 / ROUNDS, BATCH);
+  for (j = 0; j < BATCH; j++)
+    free (bufs[j]);
+
+  radbuf_free (wire);
+  radmsg_free (msg);
+  return 0;
+}
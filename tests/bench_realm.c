@@ -0,0 +1,140 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+/* Times id2realm() over lists of realms of different lengths, and
+   dorewrite() with a typical rewrite block.  Run with "make bench".  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "../radsecproxy.h"
+
+#define LOOKUPS 200000
+#define REWRITES 200000
+
+static double
+_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct realm *
+_realm (const char *regex)
+{
+  struct realm *realm;
+
+  realm = calloc (1, sizeof(struct realm));
+  if (!realm)
+    return NULL;
+  pthread_mutex_init (&realm->mutex, NULL);
+  pthread_mutex_init (&realm->refmutex, NULL);
+  realm->refcount = 1;
+  if (regcomp (&realm->regex, regex, REG_EXTENDED | REG_ICASE | REG_NOSUB))
+    return NULL;
+  return realm;
+}
+
+static int
+_bench_realms (int n)
+{
+  struct list *realms;
+  struct realm *realm;
+  char id[64];
+  double start, t;
+  int i, lookups;
+
+  realms = list_create ();
+  if (!realms)
+    return 1;
+  for (i = 0; i < n; i++)
+    {
+      snprintf (id, sizeof(id), "@realm%d\\.example\\.org$", i);
+      realm = _realm (id);
+      if (!realm || !list_push (realms, realm))
+	return 1;
+    }
+  realm = _realm (".*");
+  if (!realm || !list_push (realms, realm))
+    return 1;
+
+  /* the list is searched in order, keep the time spent bounded */
+  lookups = n > 10 ? LOOKUPS * 10 / n : LOOKUPS;
+  start = _now ();
+  for (i = 0; i < lookups; i++)
+    {
+      /* half of the identities only match the default realm */
+      snprintf (id, sizeof(id), "user%d@realm%d.example.org", i,
+		(int)((i * 7919u) % (2 * n)));
+      realm = id2realm (realms, id);
+      if (!realm)
+	return 1;
+      /* id2realm returns it locked and with a reference */
+      pthread_mutex_unlock (&realm->mutex);
+      pthread_mutex_lock (&realm->refmutex);
+      realm->refcount--;
+      pthread_mutex_unlock (&realm->refmutex);
+    }
+  t = _now () - start;
+  printf ("id2realm, %5d realms: %8.1f ns per lookup\n",
+	  n, t * 1e9 / lookups);
+  return 0;
+}
+
+static int
+_bench_rewrite (void)
+{
+  struct rewrite rewrite;
+  struct modattr *mod;
+  struct radmsg *msg;
+  uint8_t auth[16];
+  char modconf[] = "User-Name:/^(.*)@example\\.org$/\\1@example.com/";
+  double start, t;
+  int i;
+
+  memset (auth, 0, sizeof(auth));
+  memset (&rewrite, 0, sizeof(rewrite));
+  mod = extractmodattr (modconf);
+  if (!mod)
+    return 1;
+  ATTRMAP_SET (rewrite.removeattrs, 31);
+  ATTRMAP_SET (rewrite.modattrtypes, RAD_Attr_User_Name);
+  rewrite.modattrs = list_create ();
+  rewrite.addattrs = list_create ();
+  if (!rewrite.modattrs || !rewrite.addattrs
+      || !list_push (rewrite.modattrs, mod)
+      || !list_push (rewrite.addattrs, maketlv (RAD_Attr_Reply_Message, 7,
+						 "rewrote")))
+    return 1;
+
+  start = _now ();
+  for (i = 0; i < REWRITES; i++)
+    {
+      msg = radmsg_init (RAD_Access_Request, i, auth);
+      if (!msg
+	  || !radmsg_add (msg, maketlv (RAD_Attr_User_Name, 21,
+					"anonymous@example.org"))
+	  || !radmsg_add (msg, maketlv (RAD_Attr_Calling_Station_Id, 17,
+					"02-00-00-00-00-01"))
+	  || !dorewrite (msg, &rewrite))
+	return 1;
+      radmsg_free (msg);
+    }
+  t = _now () - start;
+  printf ("dorewrite: %8.1f ns per message, with building it\n",
+	  t * 1e9 / REWRITES);
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  if (_bench_realms (1) || _bench_realms (10) || _bench_realms (100)
+      || _bench_realms (1000) || _bench_rewrite ())
+    return 1;
+  return 0;
+}
@@ -0,0 +1,53 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <pthread.h>
+#include "../brlock.h"
+
+#define READERS 4
+#define WRITES 1000
+
+static struct brlock lock = BRLOCK_INITIALIZER;
+/* changed by the writer only, and always put back */
+static volatile int value;
+static int bad, done;
+
+static void *
+_read (void *arg)
+{
+  while (!__atomic_load_n (&done, __ATOMIC_ACQUIRE))
+    {
+      brlock_rdlock (&lock);
+      if (value)
+	__atomic_store_n (&bad, 1, __ATOMIC_RELAXED);
+      brlock_rdunlock (&lock);
+    }
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t th[READERS];
+  int i;
+
+  for (i = 0; i < READERS; i++)
+    if (pthread_create (&th[i], NULL, _read, NULL))
+      return 1;
+  /* The writer gets in while readers keep coming, and none of them
+     sees what it does meanwhile.  */
+  for (i = 0; i < WRITES; i++)
+    {
+      brlock_wrlock (&lock);
+      value = 1;
+      value = 0;
+      brlock_wrunlock (&lock);
+    }
+  __atomic_store_n (&done, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < READERS; i++)
+    pthread_join (th[i], NULL);
+  if (bad)
+    return !!fprintf (stderr, "reader saw the writer\n");
+  return 0;
+}
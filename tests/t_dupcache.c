@@ -0,0 +1,94 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <string.h>
+#include "../timewheel.h"
+#include "../dupcache.h"
+
+#define N 8
+
+static struct dupcache_node nodes[N];
+static int expired[N];
+
+static void
+_expired (struct dupcache_node *node)
+{
+  expired[node - nodes]++;
+}
+
+static void
+_freed (struct dupcache_node *node, void *arg)
+{
+  (*(int *) arg)++;
+}
+
+static int
+_count (void)
+{
+  int i, n = 0;
+
+  for (i = 0; i < N; i++)
+    n += expired[i];
+  return n;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct dupcache cache;
+  uint8_t auth[16], key[DUPCACHE_KEYLEN];
+  int i, freed = 0;
+
+  memset (auth, 0xab, sizeof (auth));
+  if (!dupcache_init (&cache, 2, 4, _expired, 1000))
+    return 1;
+
+  /* Same id and authenticator, but from different ports.  */
+  for (i = 0; i < 3; i++)
+    {
+      dupcache_key (nodes[i].key, 1812 + i, 7, auth);
+      dupcache_add (&cache, &nodes[i], 1000);
+    }
+  for (i = 0; i < 3; i++)
+    {
+      dupcache_key (key, 1812 + i, 7, auth);
+      if (dupcache_find (&cache, key) != &nodes[i])
+	return !!fprintf (stderr, "node %d not found\n", i);
+    }
+  dupcache_key (key, 1812, 8, auth);
+  if (dupcache_find (&cache, key))
+    return !!fprintf (stderr, "found key never added\n");
+
+  /* Kept while no more than 2 seconds old.  */
+  dupcache_expire (&cache, 1002);
+  if (_count () || cache.count != 3)
+    return !!fprintf (stderr, "expired too early\n");
+
+  dupcache_del (&cache, &nodes[1]);
+  if (dupcache_pending (&nodes[1]) || !dupcache_pending (&nodes[0]))
+    return !!fprintf (stderr, "bad pending state\n");
+  dupcache_key (key, 1813, 7, auth);
+  if (dupcache_find (&cache, key))
+    return !!fprintf (stderr, "found deleted node\n");
+
+  /* When full, the oldest are evicted to make room.  */
+  for (i = 3; i < 6; i++)
+    {
+      dupcache_key (nodes[i].key, 1812, i, auth);
+      dupcache_add (&cache, &nodes[i], 1002);
+    }
+  if (expired[0] != 1 || expired[2] != 1 || _count () != 2 || cache.count != 3)
+    return !!fprintf (stderr, "bad eviction\n");
+
+  dupcache_expire (&cache, 1005);
+  if (_count () != 5 || cache.count)
+    return !!fprintf (stderr, "not expired\n");
+
+  dupcache_key (nodes[6].key, 1812, 6, auth);
+  dupcache_add (&cache, &nodes[6], 1005);
+  dupcache_free (&cache, _freed, &freed);
+  if (freed != 1 || _count () != 5)
+    return !!fprintf (stderr, "bad free\n");
+  return 0;
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../hash.h"
+
+#define N 5000
+
+static int
+_check_entries (struct hash *h, int n, int step)
+{
+  int i, *d;
+
+  for (i = 0; i < n; i++)
+    {
+      d = hash_read (h, &i, sizeof(i));
+      if (i % step == 0)
+	{
+	  if (!d || *d != i)
+	    return !!fprintf (stderr, "entry %d missing\n", i);
+	}
+      else if (d)
+	return !!fprintf (stderr, "entry %d not removed\n", i);
+    }
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct hash *h;
+  struct hash_entry *e, *next;
+  int i, count, *d, a = 1, b = 2;
+
+  h = hash_create ();
+  if (!h)
+    return 1;
+  for (i = 0; i < N; i++)
+    {
+      d = malloc (sizeof(int));
+      *d = i;
+      if (!hash_insert (h, &i, sizeof(i), d))
+	return 1;
+    }
+  if (_check_entries (h, N, 1) != 0)
+    return 1;
+
+  /* Every entry is walked through exactly once, also while
+     extracting the one just returned.  */
+  count = 0;
+  for (e = hash_first (h); e; e = next)
+    {
+      next = hash_next (e);
+      count++;
+      if (*(int *)e->key % 2)
+	free (hash_extract (h, e->key, e->keylen));
+    }
+  if (count != N)
+    return !!fprintf (stderr, "walked through %d of %d entries\n", count, N);
+  if (_check_entries (h, N, 2) != 0)
+    return 1;
+
+  /* The oldest of equal keys is found first.  */
+  if (!hash_insert (h, "dup", 3, &a) || !hash_insert (h, "dup", 3, &b))
+    return 1;
+  if (hash_read (h, "dup", 3) != &a || hash_extract (h, "dup", 3) != &a)
+    return 1;
+  if (hash_extract (h, "dup", 3) != &b || hash_read (h, "dup", 3))
+    return 1;
+
+  /* Keys of different length don't match.  */
+  if (hash_read (h, "du", 2) || hash_read (h, "", 0))
+    return 1;
+
+  hash_destroy (h);
+  return 0;
+}
@@ -0,0 +1,62 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nettle/hmac.h>
+#include "../md5mb.h"
+
+#define N 300
+
+static uint8_t data[N][N];
+static uint8_t secrets[3][100];
+static size_t secretlens[3] = { 6, 64, 100 };
+
+int
+main (int argc, char *argv[])
+{
+  struct md5mb_hmackey keys[3];
+  const struct md5mb_hmackey *keyp[N];
+  const uint8_t *msgs[N];
+  size_t lens[N];
+  uint8_t macs[N][16], mac[16];
+  struct hmac_md5_ctx ctx;
+  int i, j, n;
+
+  srand (1);
+  for (i = 0; i < N; i++)
+    for (j = 0; j < N; j++)
+      data[i][j] = rand ();
+  for (i = 0; i < 3; i++)
+    {
+      for (j = 0; j < sizeof (secrets[i]); j++)
+	secrets[i][j] = rand ();
+      md5mb_hmackey (&keys[i], secrets[i], secretlens[i]);
+    }
+
+  /* All lengths from 0 to N - 1 bytes, in batches of increasing size
+     so that lanes are left idle and are refilled.  */
+  for (n = 1; n <= N; n += n)
+    {
+      for (i = 0; i < N; i++)
+	{
+	  keyp[i] = &keys[i % 3];
+	  msgs[i] = data[i];
+	  lens[i] = (i * 7 + n) % N;
+	}
+      for (i = 0; i < N; i += n)
+	md5mb_hmac (i + n > N ? N - i : n, keyp + i, msgs + i, lens + i,
+		    macs + i);
+      for (i = 0; i < N; i++)
+	{
+	  hmac_md5_set_key (&ctx, secretlens[i % 3], secrets[i % 3]);
+	  hmac_md5_update (&ctx, lens[i], msgs[i]);
+	  hmac_md5_digest (&ctx, sizeof (mac), mac);
+	  if (memcmp (mac, macs[i], 16))
+	    return !!fprintf (stderr, "batch %d: message %d of %d bytes wrong\n",
+			      n, i, (int) lens[i]);
+	}
+    }
+  return 0;
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../pool.h"
+
+#define N 1000
+
+static struct pool testpool = POOL_INITIALIZER ("test", 64, 8, 4);
+static void *objs[N];
+
+/* Frees what main allocated, from a thread of its own.  */
+static void *
+_putall (void *arg)
+{
+  int i;
+
+  for (i = 0; i < N; i++)
+    pool_put (&testpool, objs[i]);
+  return NULL;
+}
+
+int
+main (int argc, char *argv[])
+{
+  pthread_t th;
+  uint64_t hits, misses, releases;
+  uint8_t *buf;
+  int i;
+
+  for (i = 0; i < N; i++)
+    {
+      objs[i] = pool_get (&testpool);
+      if (!objs[i])
+	return 1;
+      memset (objs[i], i, 64);
+    }
+  if (pthread_create (&th, NULL, _putall, NULL) || pthread_join (th, NULL))
+    return 1;
+
+  /* The thread has exited, giving its magazines to the depot, so the
+     objects it freed are reused here.  */
+  for (i = 0; i < N; i++)
+    objs[i] = pool_get (&testpool);
+  _putall (NULL);
+  pool_getstats (&testpool, &hits, &misses, &releases);
+  if (pool_next (NULL) != &testpool || hits == 0
+      || hits + misses != 2 * N || releases == 0)
+    return !!fprintf (stderr, "bad counters: %llu hits, %llu misses, "
+		      "%llu released\n", (unsigned long long) hits,
+		      (unsigned long long) misses,
+		      (unsigned long long) releases);
+
+  /* Objects from malloc may be given to the pool.  */
+  pool_put (&testpool, malloc (64));
+  pool_put (&testpool, NULL);
+
+  buf = radbuf_alloc (4096);
+  if (!buf)
+    return 1;
+  memset (buf, 0, 4096);
+  radbuf_free (buf);
+  buf = radbuf_alloc (65535);
+  if (!buf)
+    return 1;
+  memset (buf, 0, 65535);
+  radbuf_free (buf);
+  radbuf_free (NULL);
+  return 0;
+}
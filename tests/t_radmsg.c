@@ -0,0 +1,163 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include "../list.h"
+#include "../tlv11.h"
+#include "../radmsg.h"
+#include "../pool.h"
+#include "../debug.h"
+
+#define RADLEN(x) ntohs (((uint16_t *) (x))[1])
+
+static struct radsecret _client, _server;
+
+/* a request as a NAS would send it, signed with the client secret,
+   with a Message-Authenticator if msgauth and a User-Password if
+   password */
+static uint8_t *
+_request (uint8_t code, int msgauth, int password)
+{
+  struct radmsg *msg;
+  uint8_t zero[16], auth[16], status[4] = { 0, 0, 0, 1 };
+  uint8_t *buf;
+  int ok, i;
+
+  memset (zero, 0, sizeof (zero));
+  for (i = 0; i < 16; i++)
+    auth[i] = code == RAD_Accounting_Request ? 0 : i * 13;
+  msg = radmsg_init (code, 42, auth);
+  if (!msg)
+    return NULL;
+  ok = radmsg_add (msg, maketlv (RAD_Attr_User_Name, 16, "user@example.org"))
+    && radmsg_add (msg, maketlv (40, 4, status))
+    && radmsg_add (msg, maketlv (RAD_Attr_Calling_Station_Id, 17,
+				 "02-00-00-00-00-01"))
+    && radmsg_add (msg, maketlv (44, 8, "0000002a"));
+  if (ok && msgauth)
+    ok = radmsg_add (msg, maketlv (RAD_Attr_Message_Authenticator, 16, zero));
+  if (ok && password)
+    ok = radmsg_add (msg, maketlv (RAD_Attr_User_Password, 16, zero));
+  buf = ok ? radmsg2buf (msg, &_client) : NULL;
+  radmsg_free (msg);
+  return buf;
+}
+
+static uint8_t *
+_copy (const uint8_t *buf)
+{
+  uint8_t *copy = radbuf_alloc (RADLEN (buf));
+
+  if (copy)
+    memcpy (copy, buf, RADLEN (buf));
+  return copy;
+}
+
+/* what radsrv() sends on, the request given a new id and
+   authenticator */
+static uint8_t *
+_forward (struct radmsg *msg)
+{
+  msg->id = 7;
+  memset (msg->auth, msg->code == RAD_Accounting_Request ? 0 : 0x55, 16);
+  return radmsg2buf (msg, &_server);
+}
+
+int
+main (int argc, char *argv[])
+{
+  uint32_t pick[8], refuse[8];
+  struct radmsg *msg, *full;
+  const struct radsecret *secrets[1] = { &_client };
+  uint8_t *buf, *a, *b, ok;
+  int msgauth;
+
+  /* the failures expected are logged as warnings */
+  debug_init ("t_radmsg");
+  debug_set_level (1);
+  radsecret_init (&_client, "client secret");
+  radsecret_init (&_server, "server secret");
+  memset (pick, 0, sizeof (pick));
+  memset (refuse, 0, sizeof (refuse));
+  ATTRMAP_SET (pick, RAD_Attr_User_Name);
+  ATTRMAP_SET (refuse, RAD_Attr_User_Password);
+
+  /* an Access-Request to have a Message-Authenticator to sign */
+  for (msgauth = 0; msgauth < 2; msgauth++)
+    {
+      buf = _request (msgauth ? RAD_Access_Request : RAD_Accounting_Request,
+		      msgauth, 0);
+      if (!buf)
+	return 1;
+      full = buf2radmsg (_copy (buf), &_client, NULL);
+      msg = buf2radmsgpicked (buf, &_client, pick, refuse);
+      if (!full || !msg)
+	return !!fprintf (stderr, "request %d not parsed\n", msgauth);
+      if (!msg->picked || list_count (msg->attrs) != 1 + msgauth
+	  || !radmsg_gettype (msg, RAD_Attr_User_Name))
+	return !!fprintf (stderr, "request %d: wrong attributes picked\n",
+			  msgauth);
+      a = _forward (full);
+      b = _forward (msg);
+      if (!a || !b || RADLEN (a) != RADLEN (b)
+	  || memcmp (a, b, RADLEN (a)))
+	return !!fprintf (stderr, "request %d: picked one sent differently\n",
+			  msgauth);
+      if (memcmp (full->auth, msg->auth, 16))
+	return !!fprintf (stderr, "request %d: authenticator not kept\n",
+			  msgauth);
+      radbuf_free (b);
+
+      if (!radmsg_unpick (msg) || msg->picked
+	  || list_count (msg->attrs) != list_count (full->attrs))
+	return !!fprintf (stderr, "request %d not unpicked\n", msgauth);
+      b = _forward (msg);
+      if (!b || memcmp (a, b, RADLEN (a)))
+	return !!fprintf (stderr, "request %d: unpicked one sent differently\n",
+			  msgauth);
+      radbuf_free (a);
+      radbuf_free (b);
+      radmsg_free (full);
+      radmsg_free (msg);
+    }
+
+  /* refused, left to the caller to decode in full */
+  buf = _request (RAD_Accounting_Request, 0, 1);
+  if (!buf)
+    return 1;
+  a = _copy (buf);
+  if (buf2radmsgpicked (buf, &_client, pick, refuse))
+    return !!fprintf (stderr, "User-Password not refused\n");
+  if (memcmp (a, buf, RADLEN (a)))
+    return !!fprintf (stderr, "refused request changed\n");
+  msg = buf2radmsg (buf, &_client, NULL);
+  if (!msg)
+    return !!fprintf (stderr, "refused request not parsed in full\n");
+  radmsg_free (msg);
+
+  /* a wrong authenticator is not accepted either */
+  buf = _request (RAD_Accounting_Request, 0, 0);
+  buf[30] ^= 1;
+  if (buf2radmsgpicked (buf, &_client, pick, refuse))
+    return !!fprintf (stderr, "bad authenticator accepted\n");
+  radbuf_free (buf);
+  radbuf_free (a);
+
+  /* the Message-Authenticator is checked in place, and put back */
+  buf = _request (RAD_Access_Request, 1, 0);
+  if (!buf)
+    return 1;
+  a = _copy (buf);
+  radmsg_checkmsgauths (1, &buf, secrets, &ok);
+  if (!ok)
+    return !!fprintf (stderr, "Message-Authenticator not found ok\n");
+  if (memcmp (a, buf, RADLEN (a)))
+    return !!fprintf (stderr, "checked request changed\n");
+  radbuf_free (buf);
+  radbuf_free (a);
+  return 0;
+}
@@ -0,0 +1,79 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../radsecproxy.h"
+
+static int
+_has (struct radmsg *msg, uint8_t t, const char *v, uint8_t l)
+{
+  struct tlv *attr = radmsg_gettype (msg, t);
+
+  return attr && attr->l == l && !memcmp (attr->v, v, l);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct rewrite rewrite;
+  struct modattr *mod, *unmatched;
+  struct radmsg *msg;
+  uint8_t auth[16];
+  /* vendor 9 with subattributes 1, 2 and 3, and vendor 311 */
+  uint8_t vsa9[] = { 0, 0, 0, 9, 1, 3, 'a', 2, 3, 'b', 3, 3, 'c' };
+  uint8_t vsa311[] = { 0, 0, 1, 55, 16, 3, 'k' };
+  uint32_t rmva[] = { 9, 1, 9, 3, 311, 256 };
+  char modconf[] = "User-Name:/^(.*)@example\\.org$/\\1@example.com/";
+  char unmatchedconf[] = "18:/^(x)?hello$/\\1\\2 there/";
+
+  memset (auth, 0, sizeof (auth));
+  memset (&rewrite, 0, sizeof (rewrite));
+  mod = extractmodattr (modconf);
+  unmatched = extractmodattr (unmatchedconf);
+  if (!mod || !unmatched)
+    return 1;
+  ATTRMAP_SET (rewrite.removeattrs, RAD_Attr_Calling_Station_Id);
+  ATTRMAP_SET (rewrite.modattrtypes, RAD_Attr_User_Name);
+  ATTRMAP_SET (rewrite.modattrtypes, RAD_Attr_Reply_Message);
+  rewrite.removevendorattrs = rmva;
+  rewrite.nremovevendorattrs = 3;
+  rewrite.modattrs = list_create ();
+  rewrite.addattrs = list_create ();
+  if (!rewrite.modattrs || !rewrite.addattrs
+      || !list_push (rewrite.modattrs, mod)
+      || !list_push (rewrite.modattrs, unmatched)
+      || !list_push (rewrite.addattrs, maketlv (RAD_Attr_Proxy_State, 2, "ps")))
+    return 1;
+
+  msg = radmsg_init (RAD_Access_Request, 1, auth);
+  if (!msg
+      || !radmsg_add (msg, maketlv (RAD_Attr_Calling_Station_Id, 3, "abc"))
+      || !radmsg_add (msg, maketlv (RAD_Attr_User_Name, 16, "user@example.org"))
+      || !radmsg_add (msg, maketlv (RAD_Attr_Calling_Station_Id, 3, "def"))
+      || !radmsg_add (msg, maketlv (RAD_Attr_Vendor_Specific, sizeof (vsa9), vsa9))
+      || !radmsg_add (msg, maketlv (RAD_Attr_Vendor_Specific, sizeof (vsa311), vsa311))
+      || !radmsg_add (msg, maketlv (RAD_Attr_Reply_Message, 5, "hello")))
+    return 1;
+  if (!dorewrite (msg, &rewrite))
+    return !!fprintf (stderr, "dorewrite failed\n");
+
+  if (radmsg_gettype (msg, RAD_Attr_Calling_Station_Id))
+    return !!fprintf (stderr, "attribute not removed\n");
+  if (!_has (msg, RAD_Attr_User_Name, "user@example.com", 16))
+    return !!fprintf (stderr, "attribute not modified\n");
+  /* \1 matched nothing and \2 is no subexpression, both kept as is */
+  if (!_has (msg, RAD_Attr_Reply_Message, "\\1\\2 there", 10))
+    return !!fprintf (stderr, "unmatched subexpressions not kept\n");
+  if (!_has (msg, RAD_Attr_Vendor_Specific, "\0\0\0\x09\x02\x03" "b", 7))
+    return !!fprintf (stderr, "vendor subattributes not removed\n");
+  if (list_count (msg->attrs) != 4)
+    return !!fprintf (stderr, "vendor attribute not removed\n");
+  if (!_has (msg, RAD_Attr_Proxy_State, "ps", 2))
+    return !!fprintf (stderr, "attribute not added\n");
+
+  radmsg_free (msg);
+  return 0;
+}
@@ -0,0 +1,110 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "timewheel.h"
+
+/* each slot is the dummy head of a circular doubly linked list */
+
+int timewheel_init(struct timewheel *wheel, uint32_t nslots, time_t now) {
+    uint32_t i;
+
+    wheel->slots = malloc(nslots * sizeof(struct timewheel_node));
+    if (!wheel->slots)
+	return 0;
+    for (i = 0; i < nslots; i++)
+	wheel->slots[i].next = wheel->slots[i].prev = &wheel->slots[i];
+    wheel->nslots = nslots;
+    wheel->now = now;
+    return 1;
+}
+
+void timewheel_free(struct timewheel *wheel) {
+    free(wheel->slots);
+    wheel->slots = NULL;
+}
+
+void timewheel_add(struct timewheel *wheel, struct timewheel_node *node, time_t expiry) {
+    struct timewheel_node *head;
+
+    /* anything already due goes into the next slot to be expired */
+    if (expiry <= wheel->now)
+	expiry = wheel->now + 1;
+    node->expiry = expiry;
+    head = &wheel->slots[expiry % wheel->nslots];
+    node->next = head;
+    node->prev = head->prev;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void timewheel_del(struct timewheel_node *node) {
+    if (!node->next)
+	return;
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+int timewheel_pending(struct timewheel_node *node) {
+    return node->next != NULL;
+}
+
+static void expireslot(struct timewheel *wheel, struct timewheel_node *head, time_t now, void (*cb)(struct timewheel_node *, void *), void *arg) {
+    struct timewheel_node due, *node;
+
+    /* move due nodes to a list of their own first, so that cb can
+     * modify the wheel as it likes */
+    due.next = due.prev = &due;
+    for (node = head->next; node != head;) {
+	struct timewheel_node *next = node->next;
+	if (node->expiry <= now) {
+	    timewheel_del(node);
+	    node->next = &due;
+	    node->prev = due.prev;
+	    due.prev->next = node;
+	    due.prev = node;
+	}
+	node = next;
+    }
+    while (due.next != &due) {
+	node = due.next;
+	timewheel_del(node);
+	cb(node, arg);
+    }
+}
+
+void timewheel_expire(struct timewheel *wheel, time_t now, void (*cb)(struct timewheel_node *, void *), void *arg) {
+    time_t t;
+
+    if (now <= wheel->now)
+	return;
+    /* no need to look at any slot more than once */
+    t = now - wheel->now > wheel->nslots ? now - wheel->nslots : wheel->now;
+    while (t < now) {
+	t++;
+	/* nodes added by cb for time t or earlier go to slot t + 1 */
+	wheel->now = t;
+	expireslot(wheel, &wheel->slots[t % wheel->nslots], now, cb, arg);
+    }
+}
+
+time_t timewheel_next(struct timewheel *wheel) {
+    time_t t, next = 0;
+    struct timewheel_node *head, *node;
+
+    for (t = wheel->now + 1; t <= wheel->now + (time_t)wheel->nslots; t++) {
+	head = &wheel->slots[t % wheel->nslots];
+	for (node = head->next; node != head; node = node->next)
+	    if (!next || node->expiry < next)
+		next = node->expiry;
+	if (next && next <= t)
+	    return next;
+    }
+    return next;
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,56 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#include <time.h>
+
+/* A timer wheel with one second resolution. Nodes are embedded in the
+ * structures being timed, so adding and removing never allocates. The
+ * wheel does no locking of its own, it is meant to be owned by a
+ * single thread. */
+
+struct timewheel_node {
+    struct timewheel_node *next, *prev;
+    time_t expiry;
+};
+
+struct timewheel {
+    struct timewheel_node *slots;
+    uint32_t nslots;
+    time_t now; /* all slots up to and including now have been expired */
+};
+
+/* allocates the slots for a wheel with nslots seconds horizon, timers
+ * further away are kept and checked once per turn; returns 1 if ok,
+ * 0 if malloc fails */
+int timewheel_init(struct timewheel *wheel, uint32_t nslots, time_t now);
+
+/* frees the slots, any nodes still added are just forgotten */
+void timewheel_free(struct timewheel *wheel);
+
+/* adds node to expire at the given time, node must not be added already */
+void timewheel_add(struct timewheel *wheel, struct timewheel_node *node, time_t expiry);
+
+/* removes node if added, may be called for nodes never added if they
+ * have been zeroed */
+void timewheel_del(struct timewheel_node *node);
+
+/* returns 1 if node is added */
+int timewheel_pending(struct timewheel_node *node);
+
+/* calls cb for every node that has expired at now, in no particular
+ * order; the node is removed before cb is called and cb may add it
+ * again, or add or remove other nodes */
+void timewheel_expire(struct timewheel *wheel, time_t now, void (*cb)(struct timewheel_node *, void *), void *arg);
+
+/* returns the expiry time of the first node that is due, looking no
+ * further than the horizon, or 0 if the wheel is empty */
+time_t timewheel_next(struct timewheel *wheel);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -9,9 +9,9 @@
 #include <string.h>
 #include <unistd.h>
 #include <limits.h>
-#ifdef SYS_SOLARIS9
+#include <errno.h>
 #include <fcntl.h>
-#endif
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/select.h>
@@ -28,6 +28,9 @@
 #ifdef RADPROT_TLS
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
+#include "evloop.h"
+#include "affinity.h"
 
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
@@ -35,7 +38,12 @@ void *tlslistener(void *arg);
 int tlsconnect(struct server *server, struct timeval *when, int timeout, char *text);
 void *tlsclientrd(void *arg);
 int clientradputtls(struct server *server, unsigned char *rad);
+uint8_t *clientradprobetls(struct server *server, uint8_t *rad, int timeout);
+void clientradflushtls(struct server *server);
 void tlssetsrcres();
+int tlsserverconnread(struct client *client, uint8_t *buf, int num, uint8_t *wait);
+int tlsserverconnwrite(struct client *client, uint8_t *buf, int num, uint8_t *wait);
+void tlsserverconnclose(struct client *client);
 
 static const struct protodefs protodefs = {
     "tls",
@@ -56,7 +64,12 @@ static const struct protodefs protodefs = {
     NULL, /* addclient */
     NULL, /* addserverextra */
     tlssetsrcres, /* setsrcres */
-    NULL /* initextra */
+    NULL, /* initextra */
+    tlsserverconnread, /* serverconnread */
+    tlsserverconnwrite, /* serverconnwrite */
+    tlsserverconnclose, /* serverconnclose */
+    clientradflushtls, /* clientradflush */
+    clientradprobetls /* clientradprobe */
 };
 
 static struct addrinfo *srcres = NULL;
@@ -102,8 +115,9 @@ int tlsconnect(struct server *server, struct timeval *when, int timeout, char *t
     for (;;) {
 	gettimeofday(&now, NULL);
 	elapsed = now.tv_sec - server->lastconnecttry.tv_sec;
-	if (timeout && server->lastconnecttry.tv_sec && elapsed > timeout) {
-	    debug(DBG_DBG, "tlsconnect: timeout");
+	if (server->conf->retiredgen ||
+	    (timeout && server->lastconnecttry.tv_sec && elapsed > timeout)) {
+	    debug(DBG_DBG, "tlsconnect: timeout, or server removed by a reload");
 	    if (server->sock >= 0)
 		close(server->sock);
 	    SSL_free(server->ssl);
@@ -111,6 +125,8 @@ int tlsconnect(struct server *server, struct timeval *when, int timeout, char *t
 	    pthread_mutex_unlock(&server->lock);
 	    return 0;
 	}
+	if (server->state != RSP_SERVER_STATE_STARTUP && takestandby(server))
+	    break;
 	if (server->state == RSP_SERVER_STATE_CONNECTED) {
 	    server->state = RSP_SERVER_STATE_RECONNECTING;
 	    sleep(2);
@@ -143,11 +159,13 @@ int tlsconnect(struct server *server, struct timeval *when, int timeout, char *t
 	    continue;
 
 	SSL_set_fd(server->ssl, server->sock);
+	tlssetsession(server->ssl, server);
 	if (SSL_connect(server->ssl) <= 0) {
 	    while ((error = ERR_get_error()))
 		debug(DBG_ERR, "tlsconnect: TLS: %s", ERR_error_string(error, NULL));
 	    continue;
 	}
+	tlscounthandshake(server->ssl, server->conf);
 	cert = verifytlscert(server->ssl);
 	if (!cert)
 	    continue;
@@ -164,10 +182,10 @@ int tlsconnect(struct server *server, struct timeval *when, int timeout, char *t
     return 1;
 }
 
-/* timeout in seconds, 0 means no timeout (blocking), returns when num bytes have been read, or timeout */
-/* returns 0 on timeout, -1 on error and num if ok */
+/* timeout in seconds, 0 means no timeout (blocking), returns when some bytes have been read, or timeout */
+/* returns 0 on timeout, -1 on error and the number of bytes if ok */
 int sslreadtimeout(SSL *ssl, unsigned char *buf, int num, int timeout) {
-    int s, ndesc, cnt, len;
+    int s, ndesc, cnt;
     fd_set readfds;
     struct timeval timer;
 
@@ -175,7 +193,7 @@ int sslreadtimeout(SSL *ssl, unsigned char *buf, int num, int timeout) {
     if (s < 0)
 	return -1;
     /* make socket non-blocking? */
-    for (len = 0; len < num; len += cnt) {
+    for (;;) {
 	if (SSL_pending(ssl) == 0) {
             FD_ZERO(&readfds);
             FD_SET(s, &readfds);
@@ -188,66 +206,68 @@ int sslreadtimeout(SSL *ssl, unsigned char *buf, int num, int timeout) {
                 return ndesc;
 	}
 
-	cnt = SSL_read(ssl, buf + len, num - len);
-	if (cnt <= 0)
-	    switch (SSL_get_error(ssl, cnt)) {
-	    case SSL_ERROR_WANT_READ:
-	    case SSL_ERROR_WANT_WRITE:
-		cnt = 0;
-		continue;
-	    case SSL_ERROR_ZERO_RETURN:
-		/* remote end sent close_notify, send one back */
-		SSL_shutdown(ssl);
-		return -1;
-	    default:
-		return -1;
-	    }
+	cnt = SSL_read(ssl, buf, num);
+	if (cnt > 0)
+	    return cnt;
+	switch (SSL_get_error(ssl, cnt)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+	    continue;
+	case SSL_ERROR_ZERO_RETURN:
+	    /* remote end sent close_notify, send one back */
+	    SSL_shutdown(ssl);
+	    return -1;
+	default:
+	    return -1;
+	}
     }
-    return num;
 }
 
-/* timeout in seconds, 0 means no timeout (blocking) */
-unsigned char *radtlsget(SSL *ssl, int timeout) {
-    int cnt, len;
-    unsigned char buf[4], *rad;
-
-    for (;;) {
-	cnt = sslreadtimeout(ssl, buf, 4, timeout);
-	if (cnt < 1) {
-	    debug(DBG_DBG, cnt ? "radtlsget: connection lost" : "radtlsget: timeout");
-	    return NULL;
-	}
+/* timeout in seconds, 0 means no timeout (blocking); rx holds what has
+ * been read of the following packets */
+unsigned char *radtlsget(SSL *ssl, struct rxbuf *rx, int timeout) {
+    int cnt, room;
+    unsigned char *rad, *buf;
 
-	len = RADLEN(buf);
-	if (len < 4) {
-	    debug(DBG_ERR, "radtlsget: length too small");
-	    continue;
-	}
-	rad = malloc(len);
-	if (!rad) {
+    while (!(rad = rxbuf_packet(rx))) {
+	buf = rxbuf_space(rx, &room);
+	if (!buf) {
 	    debug(DBG_ERR, "radtlsget: malloc failed");
-	    continue;
+	    return NULL;
 	}
-	memcpy(rad, buf, 4);
-
-	cnt = sslreadtimeout(ssl, rad + 4, len - 4, timeout);
+	cnt = sslreadtimeout(ssl, buf, room, timeout);
 	if (cnt < 1) {
 	    debug(DBG_DBG, cnt ? "radtlsget: connection lost" : "radtlsget: timeout");
-	    free(rad);
 	    return NULL;
 	}
-
-	if (len >= 20)
-	    break;
-
-	free(rad);
-	debug(DBG_WARN, "radtlsget: packet smaller than minimum radius size");
+	rx->len += cnt;
     }
 
-    debug(DBG_DBG, "radtlsget: got %d bytes", len);
+    debug(DBG_DBG, "radtlsget: got %d bytes", RADLEN(rad));
     return rad;
 }
 
+/* writes the requests buffered by clientradputtls() in one record */
+void clientradflushtls(struct server *server) {
+    int cnt;
+    unsigned long error;
+
+    if (!server->wlen)
+	return;
+    if (server->state != RSP_SERVER_STATE_CONNECTED) {
+	server->wlen = 0;
+	return;
+    }
+    if ((cnt = SSL_write(server->ssl, server->wbuf, server->wlen)) <= 0)
+	while ((error = ERR_get_error()))
+	    debug(DBG_ERR, "clientradflushtls: TLS: %s", ERR_error_string(error, NULL));
+    else
+	debug(DBG_DBG, "clientradflushtls: Sent %d bytes of Radius packets to TLS peer %s", cnt, server->conf->name);
+    server->wlen = 0;
+}
+
+/* the request is buffered until clientwr() is done sending for now,
+ * or the buffer is full */
 int clientradputtls(struct server *server, unsigned char *rad) {
     int cnt;
     size_t len;
@@ -257,6 +277,16 @@ int clientradputtls(struct server *server, unsigned char *rad) {
     if (server->state != RSP_SERVER_STATE_CONNECTED)
 	return 0;
     len = RADLEN(rad);
+    if (!server->wbuf)
+	server->wbuf = malloc(WRITEBUF_SIZE);
+    if (server->wbuf) {
+	if (server->wlen + len > WRITEBUF_SIZE)
+	    clientradflushtls(server);
+	memcpy(server->wbuf + server->wlen, rad, len);
+	server->wlen += len;
+	return 1;
+    }
+
     if ((cnt = SSL_write(server->ssl, rad, len)) <= 0) {
 	while ((error = ERR_get_error()))
 	    debug(DBG_ERR, "clientradputtls: TLS: %s", ERR_error_string(error, NULL));
@@ -267,19 +297,44 @@ int clientradputtls(struct server *server, unsigned char *rad) {
     return 1;
 }
 
+/* writes rad on the connection of server and returns the reply, or
+ * NULL if there is none within timeout seconds */
+uint8_t *clientradprobetls(struct server *server, uint8_t *rad, int timeout) {
+    struct rxbuf rx;
+    uint8_t *reply;
+    unsigned long error;
+
+    if (SSL_write(server->ssl, rad, RADLEN(rad)) <= 0) {
+	while ((error = ERR_get_error()))
+	    debug(DBG_DBG, "clientradprobetls: TLS: %s", ERR_error_string(error, NULL));
+	return NULL;
+    }
+    if (!rxbuf_init(&rx))
+	return NULL;
+    reply = radtlsget(server->ssl, &rx, timeout);
+    free(rx.buf);
+    return reply;
+}
+
 void *tlsclientrd(void *arg) {
     struct server *server = (struct server *)arg;
     unsigned char *buf;
     struct timeval now, lastconnecttry;
+    struct rxbuf rx;
 
+    if (!rxbuf_init(&rx)) {
+	debug(DBG_ERR, "tlsclientrd: malloc failed");
+	goto exit;
+    }
     for (;;) {
 	/* yes, lastconnecttry is really necessary */
 	lastconnecttry = server->lastconnecttry;
-	buf = radtlsget(server->ssl, server->dynamiclookuparg ? IDLE_TIMEOUT : 0);
+	buf = radtlsget(server->ssl, &rx, server->dynamiclookuparg ? IDLE_TIMEOUT : 0);
 	if (!buf) {
-	    if (server->dynamiclookuparg)
+	    if (server->dynamiclookuparg || server->conf->retiredgen)
 		break;
 	    tlsconnect(server, &lastconnecttry, 0, "tlsclientrd");
+	    rx.pos = rx.len = 0;
 	    continue;
 	}
 
@@ -293,6 +348,8 @@ void *tlsclientrd(void *arg) {
 	    }
 	}
     }
+    free(rx.buf);
+exit:
     debug(DBG_INFO, "tlsclientrd: exiting for %s", server->conf->name);
     SSL_shutdown(server->ssl);
     shutdown(server->sock, SHUT_RDWR);
@@ -307,17 +364,20 @@ void *tlsclientrd(void *arg) {
 }
 
 void *tlsserverwr(void *arg) {
-    int cnt;
+    int cnt, len;
     unsigned long error;
     struct client *client = (struct client *)arg;
     struct gqueue *replyq;
-    struct request *reply;
+    SSL *ssl;
+    uint8_t waited;
+    struct timeval now;
+    struct timespec flushby;
 
     debug(DBG_DBG, "tlsserverwr: starting for %s", addr2string(client->addr));
     replyq = client->replyq;
     for (;;) {
 	pthread_mutex_lock(&replyq->mutex);
-	while (!list_first(replyq->entries)) {
+	for (waited = 0; !list_first(replyq->entries); waited = 1) {
 	    if (client->ssl) {
 		debug(DBG_DBG, "tlsserverwr: waiting for signal");
 		pthread_cond_wait(&replyq->cond, &replyq->mutex);
@@ -330,16 +390,33 @@ void *tlsserverwr(void *arg) {
 		pthread_exit(NULL);
 	    }
 	}
-	reply = (struct request *)list_shift(replyq->entries);
+	/* give more replies the flush interval to join the first one */
+	if (waited && protoopts && protoopts->flushinterval) {
+	    gettimeofday(&now, NULL);
+	    flushby.tv_sec = now.tv_sec + protoopts->flushinterval / 1000;
+	    flushby.tv_nsec = (now.tv_usec + protoopts->flushinterval % 1000 * 1000) * 1000;
+	    if (flushby.tv_nsec >= 1000000000) {
+		flushby.tv_sec++;
+		flushby.tv_nsec -= 1000000000;
+	    }
+	    while (client->ssl && pthread_cond_timedwait(&replyq->cond, &replyq->mutex, &flushby) != ETIMEDOUT);
+	}
+	ssl = client->ssl;
 	pthread_mutex_unlock(&replyq->mutex);
-	cnt = SSL_write(client->ssl, reply->replybuf, RADLEN(reply->replybuf));
+	if (!ssl) {
+	    debug(DBG_DBG, "tlsserverwr: exiting as requested");
+	    pthread_exit(NULL);
+	}
+
+	len = takereplies(client, client->wbuf, WRITEBUF_SIZE);
+	if (!len)
+	    continue;
+	cnt = SSL_write(ssl, client->wbuf, len);
 	if (cnt > 0)
-	    debug(DBG_DBG, "tlsserverwr: sent %d bytes, Radius packet of length %d to %s",
-		  cnt, RADLEN(reply->replybuf), addr2string(client->addr));
+	    debug(DBG_DBG, "tlsserverwr: sent %d bytes of Radius packets to %s", cnt, addr2string(client->addr));
 	else
 	    while ((error = ERR_get_error()))
 		debug(DBG_ERR, "tlsserverwr: SSL: %s", ERR_error_string(error, NULL));
-	freerq(reply);
     }
 }
 
@@ -347,16 +424,28 @@ void tlsserverrd(struct client *client) {
     struct request *rq;
     uint8_t *buf;
     pthread_t tlsserverwrth;
+    struct rxbuf rx;
 
     debug(DBG_DBG, "tlsserverrd: starting for %s", addr2string(client->addr));
 
+    client->wbuf = malloc(WRITEBUF_SIZE);
+    if (!client->wbuf || !rxbuf_init(&rx)) {
+	debug(DBG_ERR, "tlsserverrd: malloc failed");
+	free(client->wbuf);
+	client->wbuf = NULL;
+	return;
+    }
     if (pthread_create(&tlsserverwrth, &pthread_attr, tlsserverwr, (void *)client)) {
 	debug(DBG_ERR, "tlsserverrd: pthread_create failed");
+	free(client->wbuf);
+	client->wbuf = NULL;
+	free(rx.buf);
 	return;
     }
 
     for (;;) {
-	buf = radtlsget(client->ssl, IDLE_TIMEOUT * 3);
+	clientwaitload(client);
+	buf = radtlsget(client->ssl, &rx, IDLE_TIMEOUT * 3);
 	if (!buf) {
 	    debug(DBG_ERR, "tlsserverrd: connection from %s lost", addr2string(client->addr));
 	    break;
@@ -364,7 +453,7 @@ void tlsserverrd(struct client *client) {
 	debug(DBG_DBG, "tlsserverrd: got Radius message from %s", addr2string(client->addr));
 	rq = newrequest();
 	if (!rq) {
-	    free(buf);
+	    radbuf_free(buf);
 	    continue;
 	}
 	rq->buf = buf;
@@ -382,10 +471,124 @@ void tlsserverrd(struct client *client) {
     pthread_mutex_unlock(&client->replyq->mutex);
     debug(DBG_DBG, "tlsserverrd: waiting for writer to end");
     pthread_join(tlsserverwrth, NULL);
+    free(client->wbuf);
+    client->wbuf = NULL;
+    free(rx.buf);
     debug(DBG_DBG, "tlsserverrd: reader for %s exiting", addr2string(client->addr));
 }
 
-void *tlsservernew(void *arg) {
+/* non-blocking variants for the event loop, returning 0 if the call
+ * would block, with *wait set to the event to wait for; a read may
+ * have to wait for writing and a write for reading */
+int tlsserverconnread(struct client *client, uint8_t *buf, int num, uint8_t *wait) {
+    int cnt;
+
+    /* the error queue is per thread and shared by all connections of a worker */
+    ERR_clear_error();
+    cnt = SSL_read(client->ssl, buf, num);
+    if (cnt > 0)
+	return cnt;
+    switch (SSL_get_error(client->ssl, cnt)) {
+    case SSL_ERROR_WANT_READ:
+	*wait = EVLOOP_READ;
+	return 0;
+    case SSL_ERROR_WANT_WRITE:
+	*wait = EVLOOP_WRITE;
+	return 0;
+    case SSL_ERROR_ZERO_RETURN:
+	/* remote end sent close_notify, send one back */
+	SSL_shutdown(client->ssl);
+	return -1;
+    default:
+	return -1;
+    }
+}
+
+int tlsserverconnwrite(struct client *client, uint8_t *buf, int num, uint8_t *wait) {
+    int cnt;
+    unsigned long error;
+
+    ERR_clear_error();
+    cnt = SSL_write(client->ssl, buf, num);
+    if (cnt > 0)
+	return cnt;
+    switch (SSL_get_error(client->ssl, cnt)) {
+    case SSL_ERROR_WANT_READ:
+	*wait = EVLOOP_READ;
+	return 0;
+    case SSL_ERROR_WANT_WRITE:
+	*wait = EVLOOP_WRITE;
+	return 0;
+    default:
+	while ((error = ERR_get_error()))
+	    debug(DBG_ERR, "tlsserverconnwrite: SSL: %s", ERR_error_string(error, NULL));
+	return -1;
+    }
+}
+
+void tlsserverconnclose(struct client *client) {
+    int s = SSL_get_fd(client->ssl);
+
+    SSL_shutdown(client->ssl);
+    SSL_free(client->ssl);
+    client->ssl = NULL;
+    shutdown(s, SHUT_RDWR);
+    close(s);
+}
+
+/* serves a client whose handshake is done, for when there is no event loop */
+void *tlsserverconn(void *arg) {
+    struct client *client = (struct client *)arg;
+    SSL *ssl = client->ssl;
+    int s = SSL_get_fd(ssl);
+
+    tlsserverrd(client);
+    removeclient(client);
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    shutdown(s, SHUT_RDWR);
+    close(s);
+    return NULL;
+}
+
+/* accepts the connection on s, giving up HANDSHAKE_TIMEOUT seconds
+ * after starting, so that no client, however slowly it sends, holds
+ * a handshake worker for longer; returns 1 if ok */
+static int tlsaccept(SSL *ssl, int s) {
+    struct pollfd pfd;
+    struct timeval start, now;
+    int flags, r, ms, ok = 0;
+
+    flags = fcntl(s, F_GETFL);
+    if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0)
+	return 0;
+    pfd.fd = s;
+    gettimeofday(&start, NULL);
+    for (;;) {
+	r = SSL_accept(ssl);
+	if (r > 0) {
+	    ok = 1;
+	    break;
+	}
+	r = SSL_get_error(ssl, r);
+	if (r != SSL_ERROR_WANT_READ && r != SSL_ERROR_WANT_WRITE)
+	    break;
+	pfd.events = r == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+	gettimeofday(&now, NULL);
+	ms = HANDSHAKE_TIMEOUT * 1000 - (now.tv_sec - start.tv_sec) * 1000 - (now.tv_usec - start.tv_usec) / 1000;
+	if (ms <= 0) {
+	    debug(DBG_ERR, "tlsaccept: handshake not done after %d seconds", HANDSHAKE_TIMEOUT);
+	    break;
+	}
+	if (poll(&pfd, 1, ms) < 0 && errno != EINTR)
+	    break;
+    }
+    fcntl(s, F_SETFL, flags);
+    return ok;
+}
+
+/* run by a handshake worker for each new connection */
+static void tlsservernew(void *arg) {
     int s;
     struct sockaddr_storage from;
     socklen_t fromlen = sizeof(from);
@@ -397,6 +600,7 @@ void *tlsservernew(void *arg) {
     unsigned long error;
     struct client *client;
     struct tls *accepted_tls = NULL;
+    pthread_t th;
 
     s = *(int *)arg;
     free(arg);
@@ -416,7 +620,7 @@ void *tlsservernew(void *arg) {
 	    goto exit;
 	SSL_set_fd(ssl, s);
 
-	if (SSL_accept(ssl) <= 0) {
+	if (!tlsaccept(ssl, s)) {
 	    while ((error = ERR_get_error()))
 		debug(DBG_ERR, "tlsservernew: SSL: %s", ERR_error_string(error, NULL));
 	    debug(DBG_ERR, "tlsservernew: SSL_accept failed");
@@ -429,23 +633,32 @@ void *tlsservernew(void *arg) {
     }
 
     while (conf) {
-        if (accepted_tls == conf->tlsconf && verifyconfcert(cert, conf)) {
-            X509_free(cert);
-            client = addclient(conf, 1);
+	if (accepted_tls == conf->tlsconf && verifyconfcert(cert, conf)) {
+	    X509_free(cert);
+	    tlscounthandshake(ssl, conf);
+	    client = addclient(conf, 1, s);
             if (client) {
                 if (conf->keepalive)
                     enable_keepalive(s);
                 client->ssl = ssl;
                 client->addr = addr_copy((struct sockaddr *)&from);
-                tlsserverrd(client);
-                removeclient(client);
-            } else
+		/* the event loop or a thread of its own takes over the connection */
+		if (evloop_enabled() && evloop_addclient(client, s))
+		    return;
+		if (!affinity_create(&th, AFFINITY_WORKER, tlsserverconn, (void *)client)) {
+		    pthread_detach(th);
+		    return;
+		}
+		debug(DBG_ERR, "tlsservernew: pthread_create failed");
+		removeclient(client);
+	    } else
                 debug(DBG_WARN, "tlsservernew: failed to create new client instance");
             goto exit;
         }
         conf = find_clconf(handle, (struct sockaddr *)&from, &cur);
     }
     debug(DBG_WARN, "tlsservernew: ignoring request, no matching TLS client");
+    STATS_INC(stats_unknownpeers);
     if (cert)
 	X509_free(cert);
 
@@ -456,11 +669,9 @@ exit:
     }
     shutdown(s, SHUT_RDWR);
     close(s);
-    pthread_exit(NULL);
 }
 
 void *tlslistener(void *arg) {
-    pthread_t tlsserverth;
     int s, *sp = (int *)arg, *s_arg = NULL;
     struct sockaddr_storage from;
     socklen_t fromlen = sizeof(from);
@@ -477,14 +688,11 @@ void *tlslistener(void *arg) {
         if (!s_arg)
             debugx(1, DBG_ERR, "malloc failed");
         *s_arg = s;
-	if (pthread_create(&tlsserverth, &pthread_attr, tlsservernew, (void *) s_arg)) {
-	    debug(DBG_ERR, "tlslistener: pthread_create failed");
-            free(s_arg);
+	if (!tlsaddhandshake(tlsservernew, s_arg)) {
+	    free(s_arg);
 	    shutdown(s, SHUT_RDWR);
 	    close(s);
-	    continue;
 	}
-	pthread_detach(tlsserverth);
     }
     free(sp);
     return NULL;
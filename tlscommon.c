@@ -15,6 +15,8 @@
 #endif
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include <sys/select.h>
 #include <ctype.h>
 #include <sys/wait.h>
@@ -27,14 +29,227 @@
 #include <openssl/err.h>
 #include <openssl/md5.h>
 #include <openssl/x509v3.h>
+#include <nettle/hmac.h>
 #include "debug.h"
 #include "hash.h"
 #include "util.h"
-#include "hostport.h"
 #include "radsecproxy.h"
+#include "hostport.h"
+#include "affinity.h"
+
+#define TLSCTX_THREADS 8
 
 static struct hash *tlsconfs = NULL;
 
+/* the session to resume for a server is kept in the server, the ssl
+ * of a connection to a server refers to it to have new sessions
+ * stored, which for TLS 1.3 may happen on the reader thread. A copy
+ * is kept since OpenSSL marks the session of a connection that failed
+ * as not resumable, which a server going away would do. */
+static pthread_once_t sessionidxonce = PTHREAD_ONCE_INIT;
+static int sessionidx = -1;
+static pthread_mutex_t sessionlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void createsessionidx() {
+    sessionidx = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+static int newsession_cb(SSL *ssl, SSL_SESSION *session) {
+    struct server *server;
+
+    if (sessionidx < 0)
+	return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000
+    session = SSL_SESSION_dup(session);
+    if (!session)
+	return 0;
+#endif
+    /* under the lock, tlsmovesession() changing the server */
+    pthread_mutex_lock(&sessionlock);
+    server = (struct server *)SSL_get_ex_data(ssl, sessionidx);
+    if (!server) {
+	pthread_mutex_unlock(&sessionlock);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000
+	SSL_SESSION_free(session);
+#endif
+	return 0;
+    }
+    if (server->tlssession)
+	SSL_SESSION_free(server->tlssession);
+    server->tlssession = session;
+    pthread_mutex_unlock(&sessionlock);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000
+    return 0;
+#else
+    return 1;
+#endif
+}
+
+/* offers the last session with server for resumption, and has new
+ * sessions on ssl stored for next time; call before SSL_connect() */
+void tlssetsession(SSL *ssl, struct server *server) {
+    pthread_once(&sessionidxonce, createsessionidx);
+    if (sessionidx < 0 || !SSL_set_ex_data(ssl, sessionidx, server))
+	return;
+    pthread_mutex_lock(&sessionlock);
+    if (server->tlssession && !SSL_set_session(ssl, server->tlssession))
+	debug(DBG_DBG, "tlssetsession: failed to set session to resume");
+    pthread_mutex_unlock(&sessionlock);
+}
+
+/* has the sessions on ssl, a connection set up for another server,
+ * stored for server from now on, as when a channel takes over the
+ * connection of the standby */
+void tlsmovesession(SSL *ssl, struct server *server) {
+    if (sessionidx < 0)
+	return;
+    pthread_mutex_lock(&sessionlock);
+    SSL_set_ex_data(ssl, sessionidx, server);
+    pthread_mutex_unlock(&sessionlock);
+}
+
+/* Handshakes with new clients are done by a fixed number of threads
+ * taking them from a bounded queue, so that a burst of new peers can't
+ * make us create threads without limit */
+struct handshakejob {
+    void (*handshake)(void *);
+    void *arg;
+};
+
+static struct handshakejob handshakejobs[HANDSHAKE_BACKLOG];
+static uint32_t handshakehead, nhandshakes;
+static uint8_t handshakeworkers;
+static pthread_mutex_t handshakelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handshakecond = PTHREAD_COND_INITIALIZER;
+
+static void *handshakeworker(void *arg) {
+    struct handshakejob job;
+
+    for (;;) {
+	pthread_mutex_lock(&handshakelock);
+	while (!nhandshakes)
+	    pthread_cond_wait(&handshakecond, &handshakelock);
+	job = handshakejobs[handshakehead];
+	handshakehead = (handshakehead + 1) % HANDSHAKE_BACKLOG;
+	nhandshakes--;
+	pthread_mutex_unlock(&handshakelock);
+	job.handshake(job.arg);
+	ERR_clear_error();
+    }
+    return NULL;
+}
+
+int tlshandshakeinit(uint8_t workers) {
+    pthread_t th;
+
+    for (; handshakeworkers < workers; handshakeworkers++) {
+	if (affinity_create(&th, AFFINITY_WORKER, handshakeworker, NULL))
+	    return 0;
+	pthread_detach(th);
+    }
+    return 1;
+}
+
+/* queues handshake(arg) for a handshake worker; returns 0 if the
+ * backlog is full, in which case the caller must give up on arg */
+int tlsaddhandshake(void (*handshake)(void *), void *arg) {
+    pthread_mutex_lock(&handshakelock);
+    if (!handshakeworkers || nhandshakes == HANDSHAKE_BACKLOG) {
+	pthread_mutex_unlock(&handshakelock);
+	debug(DBG_WARN, "tlsaddhandshake: %d handshakes waiting, dropping new peer", HANDSHAKE_BACKLOG);
+	return 0;
+    }
+    handshakejobs[(handshakehead + nhandshakes) % HANDSHAKE_BACKLOG].handshake = handshake;
+    handshakejobs[(handshakehead + nhandshakes) % HANDSHAKE_BACKLOG].arg = arg;
+    nhandshakes++;
+    pthread_cond_signal(&handshakecond);
+    pthread_mutex_unlock(&handshakelock);
+    return 1;
+}
+
+#if defined(RADPROT_DTLS) && OPENSSL_VERSION_NUMBER >= 0x10100000
+/* DTLS cookies are an HMAC of the peer address and port with a key
+ * made up at startup, so they can be checked without keeping state */
+static pthread_once_t cookiekeyonce = PTHREAD_ONCE_INIT;
+static struct hmac_sha256_ctx cookiekey;
+static uint8_t cookiekeyok;
+
+static void createcookiekey() {
+    uint8_t key[32];
+
+    if (RAND_bytes(key, sizeof(key)) != 1)
+	return;
+    hmac_sha256_set_key(&cookiekey, sizeof(key), key);
+    cookiekeyok = 1;
+}
+
+static int makecookie(SSL *ssl, uint8_t *cookie) {
+    struct hmac_sha256_ctx hmac;
+    BIO_ADDR *peer;
+    uint8_t addr[16];
+    size_t addrlen = sizeof(addr);
+    uint16_t port;
+    int ok;
+
+    pthread_once(&cookiekeyonce, createcookiekey);
+    peer = BIO_ADDR_new();
+    if (!cookiekeyok || !peer)
+	return 0;
+    ok = BIO_dgram_get_peer(SSL_get_wbio(ssl), peer) > 0 && BIO_ADDR_rawaddress(peer, addr, &addrlen);
+    port = BIO_ADDR_rawport(peer);
+    BIO_ADDR_free(peer);
+    if (!ok)
+	return 0;
+    memcpy(&hmac, &cookiekey, sizeof(hmac));
+    hmac_sha256_update(&hmac, addrlen, addr);
+    hmac_sha256_update(&hmac, sizeof(port), (uint8_t *)&port);
+    hmac_sha256_digest(&hmac, 16, cookie);
+    return 1;
+}
+
+static int cookiegenerate_cb(SSL *ssl, unsigned char *cookie, unsigned int *len) {
+    if (!makecookie(ssl, cookie))
+	return 0;
+    *len = 16;
+    return 1;
+}
+
+static int cookieverify_cb(SSL *ssl, const unsigned char *cookie, unsigned int len) {
+    uint8_t expected[16];
+
+    return len == 16 && makecookie(ssl, expected) && !CRYPTO_memcmp(cookie, expected, 16);
+}
+
+/* does the cookie exchange for the ClientHello read by ssl, answering
+ * with a HelloVerifyRequest if it has no good cookie; returns 1 if
+ * the peer has proven its address and the handshake can go on with
+ * SSL_accept(), else 0 */
+int dtlscheckcookie(SSL *ssl) {
+    BIO_ADDR *peer;
+    int r;
+
+    peer = BIO_ADDR_new();
+    if (!peer)
+	return 0;
+    SSL_set_options(ssl, SSL_OP_COOKIE_EXCHANGE);
+    r = DTLSv1_listen(ssl, peer);
+    BIO_ADDR_free(peer);
+    return r > 0;
+}
+#else
+int dtlscheckcookie(SSL *ssl) {
+    return 1;
+}
+#endif
+
+void tlscounthandshake(SSL *ssl, struct clsrvconf *conf) {
+    STATS_INC(conf->stats.tlshandshakes);
+    if (SSL_session_reused(ssl)) {
+	STATS_INC(conf->stats.tlsresumed);
+	debug(DBG_DBG, "tlscounthandshake: resumed session with %s", conf->name);
+    }
+}
+
 static int pem_passwd_cb(char *buf, int size, int rwflag, void *userdata) {
     int pwdlen = strlen(userdata);
     if (rwflag != 0 || pwdlen > size) /* not for decryption or too large */
@@ -148,50 +363,355 @@ static X509_VERIFY_PARAM *createverifyparams(char **poids) {
     return pm;
 }
 
-static int tlsaddcacrl(SSL_CTX *ctx, struct tls *conf) {
-    STACK_OF(X509_NAME) *calist;
-    X509_STORE *x509_s;
-    unsigned long error;
+/* The CA certificates, CRLs and CA names of a CACertificateFile and
+ * CACertificatePath, shared by all the tls blocks naming them. They
+ * are checked for changes when the CRLs are reloaded, and only what
+ * changed is read again: the file if its inode, size or times
+ * differ, and the names in the directory if the certificates there
+ * do. The directory itself is looked up lazily by OpenSSL. CRL
+ * checks and policies are set on the contexts instead. */
+struct castore {
+    X509_STORE *store;
+    STACK_OF(X509_NAME) *calist; /* filenames and dirnames */
+    uint32_t canames; /* incremented when calist changes */
+    X509_STORE *filestore; /* CACertificateFile only */
+    STACK_OF(X509_NAME) *filenames, *dirnames;
+    struct stat filest;
+    uint64_t dirsig, dircertsig;
+    uint32_t gen; /* castoregen when checked */
+    uint8_t loading;
+};
+
+/* a replaced store, which a handshake may still be verifying with */
+struct retiredstore {
+    X509_STORE *store;
+    time_t retired;
+};
+
+#define CASTORE_GRACE 60
+
+static struct hash *castores;
+static struct list *retiredstores;
+static uint32_t castoregen;
+static pthread_mutex_t castorelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t castorecond = PTHREAD_COND_INITIALIZER;
+
+/* called with castorelock held */
+static void retirestore(X509_STORE *store) {
+    struct retiredstore *r;
+    time_t now = time(NULL);
+
+    while (list_first(retiredstores)) {
+	r = (struct retiredstore *)list_first(retiredstores)->data;
+	if (r->retired + CASTORE_GRACE >= now)
+	    break;
+	list_shift(retiredstores);
+	X509_STORE_free(r->store);
+	free(r);
+    }
+    if (!store)
+	return;
+    if (!retiredstores)
+	retiredstores = list_create();
+    r = malloc(sizeof(struct retiredstore));
+    if (!r || !list_push(retiredstores, r)) {
+	/* leaked rather than freed while it may be in use */
+	free(r);
+	return;
+    }
+    r->store = store;
+    r->retired = now;
+}
 
-    SSL_CTX_set_cert_store(ctx, X509_STORE_new());
-    if (!SSL_CTX_load_verify_locations(ctx, conf->cacertfile, conf->cacertpath)) {
-	while ((error = ERR_get_error()))
-	    debug(DBG_ERR, "SSL: %s", ERR_error_string(error, NULL));
-	debug(DBG_ERR, "tlsaddcacrl: Error updating TLS context %s", conf->name);
+static void freecastore(struct castore *c) {
+    retirestore(c->store);
+    if (c->filestore)
+	X509_STORE_free(c->filestore);
+    sk_X509_NAME_pop_free(c->calist, X509_NAME_free);
+    sk_X509_NAME_pop_free(c->filenames, X509_NAME_free);
+    sk_X509_NAME_pop_free(c->dirnames, X509_NAME_free);
+    free(c);
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    while (len--)
+	h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+
+/* Sums a hash of the name, inode, size and times, nanoseconds
+ * included, of each file in dir, into certsig for the files not
+ * named as CRLs (hash.rN) too, so that the order they are listed
+ * in does not matter. */
+static int dirsignature(const char *dir, uint64_t *sig, uint64_t *certsig) {
+    char path[PATH_MAX];
+    struct dirent *d;
+    struct stat st;
+    uint64_t h;
+    const char *r;
+    DIR *dp;
+
+    *sig = *certsig = 0;
+    dp = opendir(dir);
+    if (!dp)
 	return 0;
+    while ((d = readdir(dp))) {
+	if (*d->d_name == '.' ||
+	    snprintf(path, sizeof(path), "%s/%s", dir, d->d_name) >= (int)sizeof(path) ||
+	    stat(path, &st))
+	    continue;
+	h = fnv1a(0xcbf29ce484222325ULL, d->d_name, strlen(d->d_name));
+	h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+	h = fnv1a(h, &st.st_size, sizeof(st.st_size));
+	h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+	h = fnv1a(h, &st.st_ctim, sizeof(st.st_ctim));
+	*sig += h;
+	r = strrchr(d->d_name, '.');
+	if (!r || r[1] != 'r' || !r[2] || strspn(r + 2, "0123456789") != strlen(r + 2))
+	    *certsig += h;
     }
+    closedir(dp);
+    return 1;
+}
+
+static int xnamecmp(const X509_NAME *const *a, const X509_NAME *const *b) {
+    return X509_NAME_cmp(*a, *b);
+}
+
+/* the names of a and b, without duplicates */
+static STACK_OF(X509_NAME) *mergenames(STACK_OF(X509_NAME) *a, STACK_OF(X509_NAME) *b) {
+    STACK_OF(X509_NAME) *names, *l[2] = { a, b };
+    X509_NAME *name;
+    int i, j;
 
-    calist = conf->cacertfile ? SSL_load_client_CA_file(conf->cacertfile) : NULL;
-    if (!conf->cacertfile || calist) {
-	if (conf->cacertpath) {
-	    if (!calist)
-		calist = sk_X509_NAME_new_null();
-	    if (!SSL_add_dir_cert_subjects_to_stack(calist, conf->cacertpath)) {
-		sk_X509_NAME_free(calist);
-		calist = NULL;
+    names = sk_X509_NAME_new(xnamecmp);
+    if (!names)
+	return NULL;
+    for (i = 0; i < 2; i++)
+	for (j = 0; j < sk_X509_NAME_num(l[i]); j++) {
+	    name = sk_X509_NAME_value(l[i], j);
+	    if (sk_X509_NAME_find(names, name) >= 0)
+		continue;
+	    name = X509_NAME_dup(name);
+	    if (!name || !sk_X509_NAME_push(names, name)) {
+		X509_NAME_free(name);
+		sk_X509_NAME_pop_free(names, X509_NAME_free);
+		return NULL;
 	    }
 	}
+    return names;
+}
+
+static void sslerrors(const char *msg, const char *name) {
+    unsigned long error;
+
+    while ((error = ERR_get_error()))
+	debug(DBG_ERR, "SSL: %s", ERR_error_string(error, NULL));
+    debug(DBG_ERR, "tlsaddcacrl: %s in TLS context %s", msg, name);
+}
+
+/* Reads again what changed of the CA store for conf, keeping it as
+ * it was if that fails. Called with c->loading set, so that no one
+ * else looks at c meanwhile. */
+static int updatecastore(struct castore *c, struct tls *conf) {
+    X509_STORE *filestore = c->filestore, *store = NULL;
+    STACK_OF(X509_NAME) *filenames = c->filenames, *dirnames = c->dirnames, *calist = NULL;
+    STACK_OF(X509_OBJECT) *objs;
+    X509_OBJECT *obj;
+    struct stat st;
+    uint64_t dirsig = 0, dircertsig = 0;
+    uint8_t filechanged = 0, dirchanged = 0;
+    int i;
+
+    memset(&st, 0, sizeof(st));
+    if (conf->cacertfile) {
+	if (stat(conf->cacertfile, &st)) {
+	    debugerrno(errno, DBG_ERR, "tlsaddcacrl: can't read %s", conf->cacertfile);
+	    return 0;
+	}
+	filechanged = !c->filestore || st.st_ino != c->filest.st_ino || st.st_size != c->filest.st_size ||
+	    st.st_mtim.tv_sec != c->filest.st_mtim.tv_sec || st.st_mtim.tv_nsec != c->filest.st_mtim.tv_nsec ||
+	    st.st_ctim.tv_sec != c->filest.st_ctim.tv_sec || st.st_ctim.tv_nsec != c->filest.st_ctim.tv_nsec;
     }
-    if (!calist) {
-	while ((error = ERR_get_error()))
-	    debug(DBG_ERR, "SSL: %s", ERR_error_string(error, NULL));
-	debug(DBG_ERR, "tlsaddcacrl: Error adding CA subjects in TLS context %s", conf->name);
-	return 0;
+    if (conf->cacertpath) {
+	if (!dirsignature(conf->cacertpath, &dirsig, &dircertsig)) {
+	    debugerrno(errno, DBG_ERR, "tlsaddcacrl: can't read %s", conf->cacertpath);
+	    return 0;
+	}
+	dirchanged = !c->dirnames || dirsig != c->dirsig;
     }
-    ERR_clear_error(); /* add_dir_cert_subj returns errors on success */
-    SSL_CTX_set_client_CA_list(ctx, calist);
+    if (c->store && !filechanged && !dirchanged)
+	return 1;
 
-    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_cb);
-    SSL_CTX_set_verify_depth(ctx, MAX_CERT_DEPTH + 1);
+    if (filechanged) {
+	filestore = X509_STORE_new();
+	if (!filestore || !X509_STORE_load_locations(filestore, conf->cacertfile, NULL)) {
+	    sslerrors("Error updating", conf->name);
+	    goto errexit;
+	}
+	filenames = SSL_load_client_CA_file(conf->cacertfile);
+	if (!filenames) {
+	    sslerrors("Error adding CA subjects", conf->name);
+	    goto errexit;
+	}
+    }
+    if (conf->cacertpath && (!c->dirnames || dircertsig != c->dircertsig)) {
+	dirnames = sk_X509_NAME_new_null();
+	if (!dirnames || !SSL_add_dir_cert_subjects_to_stack(dirnames, conf->cacertpath)) {
+	    sslerrors("Error adding CA subjects", conf->name);
+	    goto errexit;
+	}
+	ERR_clear_error(); /* add_dir_cert_subj returns errors on success */
+    }
 
-    if (conf->crlcheck || conf->vpm) {
-	x509_s = SSL_CTX_get_cert_store(ctx);
-	if (conf->crlcheck)
-	    X509_STORE_set_flags(x509_s, X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
-	if (conf->vpm)
-	    X509_STORE_set1_param(x509_s, conf->vpm);
+    store = X509_STORE_new();
+    if (!store)
+	goto errexit;
+    objs = filestore ? X509_STORE_get0_objects(filestore) : NULL;
+    for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+	obj = sk_X509_OBJECT_value(objs, i);
+	if ((X509_OBJECT_get_type(obj) == X509_LU_X509 && !X509_STORE_add_cert(store, X509_OBJECT_get0_X509(obj))) ||
+	    (X509_OBJECT_get_type(obj) == X509_LU_CRL && !X509_STORE_add_crl(store, X509_OBJECT_get0_X509_CRL(obj)))) {
+	    sslerrors("Error updating", conf->name);
+	    goto errexit;
+	}
+    }
+    if (conf->cacertpath && !X509_STORE_load_locations(store, NULL, conf->cacertpath)) {
+	sslerrors("Error updating", conf->name);
+	goto errexit;
+    }
+    if (filenames != c->filenames || dirnames != c->dirnames) {
+	calist = mergenames(filenames, dirnames);
+	if (!calist)
+	    goto errexit;
+    }
+
+    retirestore(c->store);
+    c->store = store;
+    if (calist) {
+	sk_X509_NAME_pop_free(c->calist, X509_NAME_free);
+	c->calist = calist;
+	c->canames++;
+    }
+    if (filestore != c->filestore) {
+	if (c->filestore)
+	    X509_STORE_free(c->filestore);
+	sk_X509_NAME_pop_free(c->filenames, X509_NAME_free);
+	c->filestore = filestore;
+	c->filenames = filenames;
+    }
+    if (dirnames != c->dirnames) {
+	sk_X509_NAME_pop_free(c->dirnames, X509_NAME_free);
+	c->dirnames = dirnames;
+    }
+    c->filest = st;
+    c->dirsig = dirsig;
+    c->dircertsig = dircertsig;
+    debug(DBG_DBG, "tlsaddcacrl: read %s%s%s%s for TLS context %s",
+	  filechanged ? conf->cacertfile : "", filechanged && dirchanged ? " and " : "",
+	  dirchanged ? conf->cacertpath : "", calist ? " with new CA names" : "", conf->name);
+    return 1;
+
+errexit:
+    if (store)
+	X509_STORE_free(store);
+    if (filestore && filestore != c->filestore)
+	X509_STORE_free(filestore);
+    if (filenames != c->filenames)
+	sk_X509_NAME_pop_free(filenames, X509_NAME_free);
+    if (dirnames != c->dirnames)
+	sk_X509_NAME_pop_free(dirnames, X509_NAME_free);
+    return 0;
+}
+
+/* Gets the CA store for conf with a reference, and a copy of its CA
+ * names if they changed since *canames. The files are checked for
+ * changes unless that was done since the CRLs were last reloaded, or
+ * in any case if check is set. */
+static int getcastore(struct tls *conf, uint8_t check, X509_STORE **store, STACK_OF(X509_NAME) **calist, uint32_t *canames) {
+    struct castore *c;
+    char *key;
+    size_t filelen = conf->cacertfile ? strlen(conf->cacertfile) : 0;
+    size_t keylen = filelen + 1 + (conf->cacertpath ? strlen(conf->cacertpath) : 0);
+    uint8_t waited = 0;
+    int ok = 1;
+
+    key = malloc(keylen);
+    if (!key) {
+	debug(DBG_ERR, "tlsaddcacrl: malloc failed");
+	return 0;
+    }
+    memcpy(key, conf->cacertfile ? conf->cacertfile : "", filelen + 1);
+    memcpy(key + filelen + 1, conf->cacertpath ? conf->cacertpath : "", keylen - filelen - 1);
+
+    pthread_mutex_lock(&castorelock);
+    if (!castores)
+	castores = hash_create();
+    while ((c = hash_read(castores, key, keylen)) && c->loading) {
+	pthread_cond_wait(&castorecond, &castorelock);
+	waited = 1;
+    }
+    if (!c) {
+	c = calloc(1, sizeof(struct castore));
+	if (!c || !hash_insert(castores, key, keylen, c)) {
+	    pthread_mutex_unlock(&castorelock);
+	    free(c);
+	    free(key);
+	    debug(DBG_ERR, "tlsaddcacrl: malloc failed");
+	    return 0;
+	}
+    }
+    free(key);
+    if (!c->store || (!waited && (check || c->gen != castoregen))) {
+	c->loading = 1;
+	pthread_mutex_unlock(&castorelock);
+	ok = updatecastore(c, conf);
+	pthread_mutex_lock(&castorelock);
+	/* not tried again until the next reload if it failed */
+	c->gen = castoregen;
+	c->loading = 0;
+	pthread_cond_broadcast(&castorecond);
+    }
+    if (!c->store) {
+	pthread_mutex_unlock(&castorelock);
+	return 0;
+    }
+    X509_STORE_up_ref(c->store);
+    *store = c->store;
+    *calist = NULL;
+    if (c->canames != *canames) {
+	*calist = SSL_dup_CA_list(c->calist);
+	if (!*calist) {
+	    pthread_mutex_unlock(&castorelock);
+	    X509_STORE_free(*store);
+	    sslerrors("Error copying CA subjects", conf->name);
+	    return 0;
+	}
+	*canames = c->canames;
     }
+    pthread_mutex_unlock(&castorelock);
+    return ok;
+}
+
+/* gives ctx the current CA store of conf, *canames being the version
+ * of the CA names it has */
+static int tlsaddcacrl(SSL_CTX *ctx, struct tls *conf, uint8_t check, uint32_t *canames) {
+    X509_STORE *store;
+    STACK_OF(X509_NAME) *calist;
 
+    if (!getcastore(conf, check, &store, &calist, canames))
+	return 0;
+    /* the replaced store is kept for a while by retirestore() */
+    if (SSL_CTX_get_cert_store(ctx) == store) {
+	X509_STORE_free(store);
+	if (!calist)
+	    return 1;
+    } else
+	SSL_CTX_set_cert_store(ctx, store);
+    if (calist)
+	SSL_CTX_set_client_CA_list(ctx, calist);
     debug(DBG_DBG, "tlsaddcacrl: updated TLS context %s", conf->name);
     return 1;
 }
@@ -229,6 +749,10 @@ static SSL_CTX *tlscreatectx(uint8_t type, struct tls *conf) {
 	SSL_CTX_set_info_callback(ctx, ssl_info_callback);
 #endif
 	SSL_CTX_set_read_ahead(ctx, 1);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000
+	SSL_CTX_set_cookie_generate_cb(ctx, cookiegenerate_cb);
+	SSL_CTX_set_cookie_verify_cb(ctx, cookieverify_cb);
+#endif
 	break;
 #endif
     }
@@ -237,6 +761,21 @@ static SSL_CTX *tlscreatectx(uint8_t type, struct tls *conf) {
 	return NULL;
     }
 
+    if (conf->sessiontimeout) {
+	/* sessions are only resumed within the same block */
+	SSL_CTX_set_session_id_context(ctx, (unsigned char *)conf->name,
+				       strlen(conf->name) < SSL_MAX_SID_CTX_LENGTH ? strlen(conf->name) : SSL_MAX_SID_CTX_LENGTH);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_BOTH);
+	SSL_CTX_sess_set_new_cb(ctx, newsession_cb);
+	SSL_CTX_set_timeout(ctx, conf->sessiontimeout);
+    } else {
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000
+	SSL_CTX_set_num_tickets(ctx, 0);
+#endif
+    }
+
     if (sslversion < 0x00908100L ||
         (sslversion >= 0x10000000L && sslversion < 0x10000020L)) {
         debug(DBG_WARN, "%s: %s seems to be of a version with a "
@@ -271,7 +810,14 @@ static SSL_CTX *tlscreatectx(uint8_t type, struct tls *conf) {
 	}
     }
 
-    if (!tlsaddcacrl(ctx, conf)) {
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, verify_cb);
+    SSL_CTX_set_verify_depth(ctx, MAX_CERT_DEPTH + 1);
+    if (conf->crlcheck)
+	X509_VERIFY_PARAM_set_flags(SSL_CTX_get0_param(ctx), X509_V_FLAG_CRL_CHECK | X509_V_FLAG_CRL_CHECK_ALL);
+    if (conf->vpm)
+	SSL_CTX_set1_param(ctx, conf->vpm);
+
+    if (!tlsaddcacrl(ctx, conf, 0, type == RAD_TLS ? &conf->tlscanames : &conf->dtlscanames)) {
 	if (conf->vpm) {
 	    X509_VERIFY_PARAM_free(conf->vpm);
 	    conf->vpm = NULL;
@@ -295,18 +841,20 @@ struct tls *tlsgettls(char *alt1, char *alt2) {
 
 SSL_CTX *tlsgetctx(uint8_t type, struct tls *t) {
     struct timeval now;
+    SSL_CTX *ctx = NULL;
 
     if (!t)
 	return NULL;
     gettimeofday(&now, NULL);
 
+    pthread_mutex_lock(&t->lock);
     switch (type) {
 #ifdef RADPROT_TLS
     case RAD_TLS:
 	if (t->tlsexpiry && t->tlsctx) {
 	    if (t->tlsexpiry < now.tv_sec) {
 		t->tlsexpiry = now.tv_sec + t->cacheexpiry;
-		tlsaddcacrl(t->tlsctx, t);
+		tlsaddcacrl(t->tlsctx, t, 1, &t->tlscanames);
 	    }
 	}
 	if (!t->tlsctx) {
@@ -314,14 +862,15 @@ SSL_CTX *tlsgetctx(uint8_t type, struct tls *t) {
 	    if (t->cacheexpiry)
 		t->tlsexpiry = now.tv_sec + t->cacheexpiry;
 	}
-	return t->tlsctx;
+	ctx = t->tlsctx;
+	break;
 #endif
 #ifdef RADPROT_DTLS
     case RAD_DTLS:
 	if (t->dtlsexpiry && t->dtlsctx) {
 	    if (t->dtlsexpiry < now.tv_sec) {
 		t->dtlsexpiry = now.tv_sec + t->cacheexpiry;
-		tlsaddcacrl(t->dtlsctx, t);
+		tlsaddcacrl(t->dtlsctx, t, 1, &t->dtlscanames);
 	    }
 	}
 	if (!t->dtlsctx) {
@@ -329,36 +878,173 @@ SSL_CTX *tlsgetctx(uint8_t type, struct tls *t) {
 	    if (t->cacheexpiry)
 		t->dtlsexpiry = now.tv_sec + t->cacheexpiry;
 	}
-	return t->dtlsctx;
+	ctx = t->dtlsctx;
+	break;
 #endif
     }
-    return NULL;
+    pthread_mutex_unlock(&t->lock);
+    return ctx;
 }
 
-void tlsreloadcrls() {
+static void *createctxworker(void *arg) {
+    struct list *confs = (struct list *)arg;
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
     struct tls *conf;
+
+    for (;;) {
+	pthread_mutex_lock(&lock);
+	conf = (struct tls *)list_shift(confs);
+	pthread_mutex_unlock(&lock);
+	if (!conf)
+	    return NULL;
+	if (!tlsgetctx(RAD_TLS, conf))
+	    debug(DBG_ERR, "tlscreatectxs: error creating ctx for TLS block %s", conf->name);
+    }
+}
+
+void tlscreatectxs() {
+    pthread_t threads[TLSCTX_THREADS - 1];
     struct hash_entry *entry;
+    struct list *confs;
+    int i, n;
+
+    confs = list_create();
+    if (!confs) {
+	debug(DBG_ERR, "tlscreatectxs: malloc failed");
+	return;
+    }
+    for (entry = hash_first(tlsconfs); entry; entry = hash_next(entry))
+	if (!list_push(confs, entry->data))
+	    tlsgetctx(RAD_TLS, (struct tls *)entry->data);
+    for (n = 0; n < TLSCTX_THREADS - 1 && n < list_count(confs) - 1; n++)
+	if (pthread_create(&threads[n], NULL, createctxworker, confs))
+	    break;
+    createctxworker(confs);
+    for (i = 0; i < n; i++)
+	pthread_join(threads[i], NULL);
+    list_destroy(confs);
+}
+
+/* Caches the outcome of checkconfcert() for a certificate, by its
+ * SHA-256 fingerprint, and a conf, so that peers reconnecting with the
+ * same certificate don't have their names matched again. It is emptied
+ * when the configuration or CRLs are reloaded, and checks started
+ * before that are not cached, since their confs may be freed. */
+#define VERIFYCACHE_MAX 4096
+
+struct verifycache {
+    uint8_t ok;
+};
+
+static struct hash *verifycache;
+static uint32_t verifycachegen;
+static pthread_mutex_t verifycachelock = PTHREAD_MUTEX_INITIALIZER;
+
+static void verifycacheflush() {
+    pthread_mutex_lock(&verifycachelock);
+    verifycachegen++;
+    hash_destroy(verifycache);
+    verifycache = NULL;
+    pthread_mutex_unlock(&verifycachelock);
+}
+
+/* Checks each distinct CA source for changes and reads again what
+ * changed, and only then gives the contexts the new stores. The
+ * contexts are not locked while reading, so this can take its time. */
+void tlsreloadcrls() {
+    struct tls *conf;
+    struct hash_entry *entry, *next;
+    struct castore *c;
     struct timeval now;
+    X509_STORE *store;
+    STACK_OF(X509_NAME) *calist;
+    uint32_t canames;
 
-    gettimeofday(&now, NULL);
+    verifycacheflush();
+    pthread_mutex_lock(&castorelock);
+    castoregen++;
+    pthread_mutex_unlock(&castorelock);
+
+    for (entry = hash_first(tlsconfs); entry; entry = hash_next(entry)) {
+	conf = (struct tls *)entry->data;
+	canames = ~0;
+	if (getcastore(conf, 0, &store, &calist, &canames)) {
+	    X509_STORE_free(store);
+	    sk_X509_NAME_pop_free(calist, X509_NAME_free);
+	}
+    }
 
+    gettimeofday(&now, NULL);
     for (entry = hash_first(tlsconfs); entry; entry = hash_next(entry)) {
 	conf = (struct tls *)entry->data;
+	pthread_mutex_lock(&conf->lock);
 #ifdef RADPROT_TLS
 	if (conf->tlsctx) {
 	    if (conf->tlsexpiry)
 		conf->tlsexpiry = now.tv_sec + conf->cacheexpiry;
-	    tlsaddcacrl(conf->tlsctx, conf);
+	    tlsaddcacrl(conf->tlsctx, conf, 0, &conf->tlscanames);
 	}
 #endif
 #ifdef RADPROT_DTLS
 	if (conf->dtlsctx) {
 	    if (conf->dtlsexpiry)
 		conf->dtlsexpiry = now.tv_sec + conf->cacheexpiry;
-	    tlsaddcacrl(conf->dtlsctx, conf);
+	    tlsaddcacrl(conf->dtlsctx, conf, 0, &conf->dtlscanames);
 	}
 #endif
+	pthread_mutex_unlock(&conf->lock);
     }
+
+    /* the stores no longer named by any tls block */
+    pthread_mutex_lock(&castorelock);
+    for (entry = hash_first(castores); entry; entry = next) {
+	next = hash_next(entry);
+	c = (struct castore *)entry->data;
+	if (c->loading || c->gen == castoregen)
+	    continue;
+	hash_extract(castores, entry->key, entry->keylen);
+	freecastore(c);
+    }
+    retirestore(NULL);
+    pthread_mutex_unlock(&castorelock);
+}
+
+struct hash *tlsnewconfs() {
+    struct hash *confs = tlsconfs;
+
+    verifycacheflush();
+    tlsconfs = NULL;
+    return confs;
+}
+
+void tlskeepconfs(struct hash *confs) {
+    verifycacheflush();
+    tlsconfs = confs;
+}
+
+void tlsfreeconfs(struct hash *confs) {
+    struct tls *conf;
+    struct hash_entry *entry;
+
+    for (entry = hash_first(confs); entry; entry = hash_next(entry)) {
+	conf = (struct tls *)entry->data;
+	free(conf->name);
+	free(conf->cacertfile);
+	free(conf->cacertpath);
+	free(conf->certfile);
+	free(conf->certkeyfile);
+	free(conf->certkeypwd);
+	freegconfmstr(conf->policyoids);
+	if (conf->vpm)
+	    X509_VERIFY_PARAM_free(conf->vpm);
+	/* connections made with them hold references of their own */
+	if (conf->tlsctx)
+	    SSL_CTX_free(conf->tlsctx);
+	if (conf->dtlsctx)
+	    SSL_CTX_free(conf->dtlsctx);
+	pthread_mutex_destroy(&conf->lock);
+    }
+    hash_destroy(confs);
 }
 
 X509 *verifytlscert(SSL *ssl) {
@@ -545,7 +1231,7 @@ int certnamecheck(X509 *cert, struct list *hostports) {
     return 0;
 }
 
-int verifyconfcert(X509 *cert, struct clsrvconf *conf) {
+static int checkconfcert(X509 *cert, struct clsrvconf *conf) {
     if (conf->certnamecheck) {
 	if (!certnamecheck(cert, conf->hostports)) {
 	    debug(DBG_WARN, "verifyconfcert: certificate name check failed");
@@ -570,9 +1256,58 @@ int verifyconfcert(X509 *cert, struct clsrvconf *conf) {
     return 1;
 }
 
+int verifyconfcert(X509 *cert, struct clsrvconf *conf) {
+    uint8_t key[EVP_MAX_MD_SIZE + sizeof(conf)];
+    unsigned int keylen;
+    struct verifycache *v;
+    uint32_t gen;
+    int ok;
+
+    if (!conf->certnamecheck && !conf->certcnregex && !conf->certuriregex)
+	return 1;
+    /* dynamic servers come and go between reloads */
+    if ((conf->servers && conf->servers->dynamiclookuparg) ||
+	!X509_digest(cert, EVP_sha256(), key, &keylen))
+	return checkconfcert(cert, conf);
+    memcpy(key + keylen, &conf, sizeof(conf));
+    keylen += sizeof(conf);
+
+    pthread_mutex_lock(&verifycachelock);
+    gen = verifycachegen;
+    v = verifycache ? hash_read(verifycache, key, keylen) : NULL;
+    ok = v ? v->ok : -1;
+    pthread_mutex_unlock(&verifycachelock);
+    if (ok == 1) {
+	debug(DBG_DBG, "verifyconfcert: certificate names matched before");
+	return 1;
+    }
+    if (!ok) {
+	debug(DBG_WARN, "verifyconfcert: certificate names did not match before");
+	return 0;
+    }
+
+    ok = checkconfcert(cert, conf);
+    pthread_mutex_lock(&verifycachelock);
+    if (gen == verifycachegen) {
+	if (verifycache && verifycache->count >= VERIFYCACHE_MAX) {
+	    hash_destroy(verifycache);
+	    verifycache = NULL;
+	}
+	if (!verifycache)
+	    verifycache = hash_create();
+	v = malloc(sizeof(struct verifycache));
+	if (v)
+	    v->ok = ok;
+	if (!v || !verifycache || hash_read(verifycache, key, keylen) || !hash_insert(verifycache, key, keylen, v))
+	    free(v);
+    }
+    pthread_mutex_unlock(&verifycachelock);
+    return ok;
+}
+
 int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val) {
     struct tls *conf;
-    long int expiry = LONG_MIN;
+    long int expiry = LONG_MIN, sessiontimeout = LONG_MIN;
 
     debug(DBG_DBG, "conftls_cb called for %s", block);
 
@@ -592,6 +1327,7 @@ int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *v
 			  "CacheExpiry", CONF_LINT, &expiry,
 			  "CRLCheck", CONF_BLN, &conf->crlcheck,
 			  "PolicyOID", CONF_MSTR, &conf->policyoids,
+			  "SessionTimeout", CONF_LINT, &sessiontimeout,
 			  NULL
 	    )) {
 	debug(DBG_ERR, "conftls_cb: configuration error in block %s", val);
@@ -612,6 +1348,14 @@ int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *v
 	}
 	conf->cacheexpiry = expiry;
     }
+    conf->sessiontimeout = 300;
+    if (sessiontimeout != LONG_MIN) {
+	if (sessiontimeout < 0 || sessiontimeout > 86400) {
+	    debug(DBG_ERR, "error in block %s, value of option SessionTimeout is %ld, must be 0-86400", val, sessiontimeout);
+	    goto errexit;
+	}
+	conf->sessiontimeout = sessiontimeout;
+    }
 
     conf->name = stringcopy(val, 0);
     if (!conf->name) {
@@ -625,8 +1369,7 @@ int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *v
 	debug(DBG_ERR, "conftls_cb: malloc failed");
 	goto errexit;
     }
-    if (!tlsgetctx(RAD_TLS, conf))
-	debug(DBG_ERR, "conftls_cb: error creating ctx for TLS block %s", val);
+    pthread_mutex_init(&conf->lock, NULL);
     debug(DBG_DBG, "conftls_cb: added TLS block %s", val);
     return 1;
 
@@ -7,6 +7,11 @@
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #define ASN1_STRING_get0_data(o) ((o)->data)
 #define ASN1_STRING_length(o) ((o)->length)
+#define X509_STORE_up_ref(s) CRYPTO_add(&(s)->references, 1, CRYPTO_LOCK_X509_STORE)
+#define X509_STORE_get0_objects(s) ((s)->objs)
+#define X509_OBJECT_get_type(o) ((o)->type)
+#define X509_OBJECT_get0_X509(o) ((o)->data.x509)
+#define X509_OBJECT_get0_X509_CRL(o) ((o)->data.crl)
 #endif
 
 struct tls {
@@ -21,9 +26,12 @@ struct tls {
     uint32_t cacheexpiry;
     uint32_t tlsexpiry;
     uint32_t dtlsexpiry;
+    uint32_t sessiontimeout; /* 0 if resumption is off */
     X509_VERIFY_PARAM *vpm;
     SSL_CTX *tlsctx;
     SSL_CTX *dtlsctx;
+    uint32_t tlscanames, dtlscanames; /* versions of the CA names in the contexts */
+    pthread_mutex_t lock; /* for creating and updating the contexts */
 };
 
 #if defined(RADPROT_TLS) || defined(RADPROT_DTLS)
@@ -34,6 +42,21 @@ int verifyconfcert(X509 *cert, struct clsrvconf *conf);
 int conftls_cb(struct gconffile **cf, void *arg, char *block, char *opt, char *val);
 int addmatchcertattr(struct clsrvconf *conf);
 void tlsreloadcrls();
+/* creates the TLS contexts of the tls blocks just read, in parallel */
+void tlscreatectxs();
+/* makes the TLS blocks read from now on go in a new set, and returns
+ * the old one, to be freed with tlsfreeconfs() once unused */
+struct hash *tlsnewconfs();
+/* makes confs, from tlsnewconfs(), the current ones again, leaving
+ * those read since behind */
+void tlskeepconfs(struct hash *confs);
+void tlsfreeconfs(struct hash *confs);
+void tlssetsession(SSL *ssl, struct server *server);
+void tlsmovesession(SSL *ssl, struct server *server);
+void tlscounthandshake(SSL *ssl, struct clsrvconf *conf);
+int tlshandshakeinit(uint8_t workers);
+int tlsaddhandshake(void (*handshake)(void *), void *arg);
+int dtlscheckcookie(SSL *ssl);
 #endif
 
 /* Local Variables: */
@@ -9,22 +9,26 @@
 #endif
 #include "list.h"
 #include "tlv11.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 
+static struct pool tlvpool = POOL_INITIALIZER("tlv", sizeof(struct tlv), 64, 64);
+
 struct tlv *maketlv(uint8_t t, uint8_t l, void *v) {
     struct tlv *tlv;
 
-    tlv = malloc(sizeof(struct tlv));
+    tlv = pool_get(&tlvpool);
     if (!tlv)
 	return NULL;
     tlv->t = t;
     tlv->l = l;
+    tlv->borrowed = 0;
     if (l && v) {
 	tlv->v = malloc(l);
 	if (!tlv->v) {
-	    free(tlv);
+	    pool_put(&tlvpool, tlv);
 	    return NULL;
 	}
 	memcpy(tlv->v, v, l);
@@ -33,14 +37,28 @@ struct tlv *maketlv(uint8_t t, uint8_t l, void *v) {
     return tlv;
 }
 
+struct tlv *maketlvref(uint8_t t, uint8_t l, uint8_t *v) {
+    struct tlv *tlv;
+
+    tlv = pool_get(&tlvpool);
+    if (!tlv)
+	return NULL;
+    tlv->t = t;
+    tlv->l = l;
+    tlv->borrowed = 1;
+    tlv->v = l ? v : NULL;
+    return tlv;
+}
+
 struct tlv *copytlv(struct tlv *in) {
     return in ? maketlv(in->t, in->l, in->v) : NULL;
 }
 
 void freetlv(struct tlv *tlv) {
     if (tlv) {
-	free(tlv->v);
-	free(tlv);
+	if (!tlv->borrowed)
+	    free(tlv->v);
+	pool_put(&tlvpool, tlv);
     }
 }
 
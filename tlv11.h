@@ -5,10 +5,13 @@
 struct tlv {
     uint8_t t;
     uint8_t l;
+    uint8_t borrowed; /* v is not ours, leave it when freeing */
     uint8_t *v;
 };
 
 struct tlv *maketlv(uint8_t, uint8_t, void *);
+/* like maketlv() but v is used as is, it must outlive the tlv */
+struct tlv *maketlvref(uint8_t, uint8_t, uint8_t *);
 struct tlv *copytlv(struct tlv *);
 void freetlv(struct tlv *);
 int eqtlv(struct tlv *, struct tlv *);
@@ -0,0 +1,99 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "radsecproxy.h"
+#include "debug.h"
+
+static const char *stagenames[TRACE_STAGES] = {
+    "received", "parse", "route", "queue", "send", "upstream", "reply", "write"
+};
+
+static uint32_t samplerate;
+static uint32_t samplecount;
+/* the time spent in each stage, and the number of traces going
+ * through it, by the stage ended */
+static uint64_t stagens[TRACE_STAGES];
+static uint64_t stagecount[TRACE_STAGES];
+static uint64_t traces;
+
+static uint64_t now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_setrate(uint32_t rate) {
+    samplerate = rate;
+}
+
+struct trace *trace_start() {
+    struct trace *trace;
+
+    if (!samplerate || __atomic_add_fetch(&samplecount, 1, __ATOMIC_RELAXED) % samplerate)
+	return NULL;
+    trace = calloc(1, sizeof(struct trace));
+    if (trace)
+	trace->ns[TRACE_RECEIVED] = now();
+    return trace;
+}
+
+static void report(struct trace *trace) {
+    char line[512];
+    uint64_t prev, ns;
+    int i, n;
+
+    STATS_INC(traces);
+    n = snprintf(line, sizeof(line), "trace: %s from %s%s%s:",
+		 trace->code ? radmsgtype2string(trace->code) : "request",
+		 *trace->client ? trace->client : "unknown client",
+		 *trace->server ? " to " : "", trace->server);
+    prev = trace->ns[TRACE_RECEIVED];
+    for (i = TRACE_RECEIVED + 1; i < TRACE_STAGES; i++) {
+	if (!trace->ns[i])
+	    continue;
+	ns = trace->ns[i] - prev;
+	prev = trace->ns[i];
+	STATS_ADD(stagens[i], ns);
+	STATS_INC(stagecount[i]);
+	if (n < sizeof(line))
+	    n += snprintf(line + n, sizeof(line) - n, " %s %lluus", stagenames[i], (unsigned long long)(ns / 1000));
+    }
+    if (n < sizeof(line))
+	snprintf(line + n, sizeof(line) - n, ", total %lluus",
+		 (unsigned long long)((trace->ns[TRACE_WRITTEN] - trace->ns[TRACE_RECEIVED]) / 1000));
+    debug(DBG_INFO, "%s", line);
+}
+
+void trace_stage(struct trace *trace, enum trace_stage stage) {
+    /* the first time only, not for retransmissions or resent replies */
+    if (trace->ns[stage])
+	return;
+    trace->ns[stage] = now();
+    if (stage == TRACE_WRITTEN)
+	report(trace);
+}
+
+void trace_collect(struct statsbuf *sb) {
+    int i;
+
+    if (!samplerate)
+	return;
+    stats_header(sb, "radsecproxy_traced_requests_total", "counter", "Requests sampled for tracing.");
+    stats_sample(sb, "radsecproxy_traced_requests_total", NULL, NULL, STATS_GET(traces));
+    stats_header(sb, "radsecproxy_trace_stage_seconds", "summary", "Time spent by sampled requests in each stage.");
+    for (i = TRACE_RECEIVED + 1; i < TRACE_STAGES; i++) {
+	statsbuf_printf(sb, "radsecproxy_trace_stage_seconds_sum{stage=\"%s\"} %.6f\n",
+			stagenames[i], STATS_GET(stagens[i]) / 1e9);
+	statsbuf_printf(sb, "radsecproxy_trace_stage_seconds_count{stage=\"%s\"} %llu\n",
+			stagenames[i], (unsigned long long)STATS_GET(stagecount[i]));
+    }
+}
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
@@ -0,0 +1,70 @@
+/* Copyright (c) 2018, SWITCH */
+/* See LICENSE for licensing information. */
+
+#ifdef SYS_SOLARIS9
+#include <sys/inttypes.h>
+#else
+#include <stdint.h>
+#endif
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+/* Tracing of where the time of a request goes. One in every
+ * TraceSampleRate requests gets a struct trace, which the stages it
+ * goes through are timestamped in with the monotonic clock. When the
+ * reply is written the time spent in each stage is logged and added
+ * to the totals served with the statistics. With sys/sdt.h, every
+ * stage of every request is also a USDT probe, radsecproxy:request,
+ * with the request and the stage as arguments, whether sampled or
+ * not. stats.h must be included first. */
+
+enum trace_stage {
+    TRACE_RECEIVED, /* the request was read, by newrequest() */
+    TRACE_PARSED, /* by radsrv() */
+    TRACE_ROUTED, /* a server was found and rewrites done */
+    TRACE_QUEUED, /* for the client writer, by sendrq() */
+    TRACE_SENT, /* to the server, by clientwr */
+    TRACE_REPLIED, /* the server reply was read, by replyh() */
+    TRACE_REPLYQUEUED, /* for the server writer, by sendreply() */
+    TRACE_WRITTEN, /* the reply, to the client */
+    TRACE_STAGES
+};
+
+struct trace {
+    uint64_t ns[TRACE_STAGES]; /* 0 for the stages not gone through */
+    uint8_t code;
+    char client[64], server[64];
+};
+
+#ifdef HAVE_SYS_SDT_H
+#define TRACE_PROBE(rq, stage) DTRACE_PROBE2(radsecproxy, request, rq, stage)
+#else
+#define TRACE_PROBE(rq, stage)
+#endif
+
+/* timestamps a stage of rq, a struct request */
+#define TRACE(rq, stage)				\
+    do {						\
+	TRACE_PROBE(rq, stage);				\
+	if ((rq)->trace)				\
+	    trace_stage((rq)->trace, (stage));		\
+    } while (0)
+
+/* samples one in every rate requests, none if 0 */
+void trace_setrate(uint32_t rate);
+
+/* returns a new trace with TRACE_RECEIVED set if this request is to
+ * be sampled, else NULL */
+struct trace *trace_start();
+
+/* timestamps stage unless done before, logging and counting the
+ * trace if it is TRACE_WRITTEN */
+void trace_stage(struct trace *trace, enum trace_stage stage);
+
+/* writes the totals of the traces in the Prometheus text format */
+void trace_collect(struct statsbuf *sb);
+
+/* Local Variables: */
+/* c-file-style: "stroustrup" */
+/* End: */
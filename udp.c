@@ -2,6 +2,9 @@
  * Copyright (c) 2012-2013, 2017, NORDUnet A/S */
 /* See LICENSE for licensing information. */
 
+#if defined(HAVE_RECVMMSG) || defined(HAVE_SENDMMSG)
+#define _GNU_SOURCE /* for recvmmsg() and sendmmsg() */
+#endif
 #include <signal.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -21,19 +24,26 @@
 #include <regex.h>
 #include <pthread.h>
 #include <assert.h>
+#include <stddef.h>
+#include <errno.h>
 #include "radsecproxy.h"
 #include "hostport.h"
+#include "hash.h"
 
 #ifdef RADPROT_UDP
 #include "debug.h"
 #include "util.h"
+#include "pool.h"
+#include "affinity.h"
 
 static void setprotoopts(struct commonprotoopts *opts);
 static char **getlistenerargs();
 void *udpserverrd(void *arg);
+void *udpserverwr(void *arg);
+void *udpchannelrd(void *arg);
 int clientradputudp(struct server *server, unsigned char *rad);
 void addclientudp(struct client *client);
-void addserverextraudp(struct clsrvconf *conf);
+void addserverextraudp(struct server *server);
 void udpsetsrcres();
 void initextraudp();
 
@@ -51,22 +61,51 @@ static const struct protodefs protodefs = {
     getlistenerargs, /* getlistenerargs */
     udpserverrd, /* listener */
     NULL, /* connecter */
-    NULL, /* clientconnreader */
+    udpchannelrd, /* clientconnreader */
     clientradputudp, /* clientradput */
     addclientudp, /* addclient */
     addserverextraudp, /* addserverextra */
     udpsetsrcres, /* setsrcres */
-    initextraudp /* initextra */
+    initextraudp, /* initextra */
+    NULL, /* serverconnread */
+    NULL, /* serverconnwrite */
+    NULL, /* serverconnclose */
+    NULL, /* clientradflush */
+    NULL /* clientradprobe */
 };
 
 static int client4_sock = -1;
 static int client6_sock = -1;
-static struct gqueue *server_replyq = NULL;
 
 static struct addrinfo *srcres = NULL;
 static uint8_t handle;
 static struct commonprotoopts *protoopts = NULL;
 
+#define UDP_CLIENT_EXPIRY 60
+/* the largest packet RFC 2865 allows */
+#define UDP_SLOT_SIZE 4096
+
+struct udpbatch;
+
+/* The clients seen on a listening socket, indexed by address. Only
+ * the reader of the socket uses it, and the reader is the only one
+ * adding or removing the clients, so no locking is needed beyond the
+ * conf lock protecting conf->clients. Each listening socket has a
+ * reply queue and writer of its own, shared by its clients. */
+struct udpclients {
+    struct hash *clients;
+    struct timewheel expiry;
+    struct udpbatch *batch; /* NULL unless receiving in batches */
+    uint8_t msgauthok; /* the Message-Authenticator of the packet last
+			* returned was checked with the batch */
+    struct gqueue *replyq;
+};
+
+struct udpclientkey {
+    uint8_t family;
+    uint8_t addr[16];
+};
+
 const struct protodefs *udpinit(uint8_t h) {
     handle = h;
     return &protodefs;
@@ -80,6 +119,10 @@ static char **getlistenerargs() {
     return protoopts ? protoopts->listenargs : NULL;
 }
 
+static uint16_t getbatchsize() {
+    return protoopts && protoopts->batchsize > 1 ? protoopts->batchsize : 1;
+}
+
 void udpsetsrcres() {
     if (!srcres)
 	srcres =
@@ -101,21 +144,6 @@ void removeudpclientfromreplyq(struct client *c) {
     pthread_mutex_unlock(&c->replyq->mutex);
 }
 
-static int addr_equal(struct sockaddr *a, struct sockaddr *b) {
-    switch (a->sa_family) {
-    case AF_INET:
-	return !memcmp(&((struct sockaddr_in*)a)->sin_addr,
-		       &((struct sockaddr_in*)b)->sin_addr,
-		       sizeof(struct in_addr));
-    case AF_INET6:
-	return IN6_ARE_ADDR_EQUAL(&((struct sockaddr_in6*)a)->sin6_addr,
-				  &((struct sockaddr_in6*)b)->sin6_addr);
-    default:
-	/* Must not reach */
-	return 0;
-    }
-}
-
 uint16_t port_get(struct sockaddr *sa) {
     switch (sa->sa_family) {
     case AF_INET:
@@ -126,29 +154,312 @@ uint16_t port_get(struct sockaddr *sa) {
     return 0;
 }
 
+static void udpclientkey(struct udpclientkey *key, struct sockaddr *addr) {
+    memset(key, 0, sizeof(struct udpclientkey));
+    key->family = addr->sa_family;
+    switch (addr->sa_family) {
+    case AF_INET:
+	memcpy(key->addr, &((struct sockaddr_in *)addr)->sin_addr, sizeof(struct in_addr));
+	break;
+    case AF_INET6:
+	memcpy(key->addr, &((struct sockaddr_in6 *)addr)->sin6_addr, sizeof(struct in6_addr));
+	break;
+    }
+}
+
+static void removeudpclient(struct udpclients *uc, struct client *c) {
+    struct clsrvconf *conf = c->conf;
+    struct udpclientkey key;
+
+    udpclientkey(&key, c->addr);
+    hash_extract(uc->clients, &key, sizeof(key));
+    pthread_mutex_lock(conf->lock);
+    removeudpclientfromreplyq(c);
+    c->replyq = NULL; /* stop removeclient() from removing common udp replyq */
+    removelockedclient(c);
+    pthread_mutex_unlock(conf->lock);
+}
+
+static void expireudpclient(struct timewheel_node *node, void *arg) {
+    struct udpclients *uc = (struct udpclients *)arg;
+    struct client *c = (struct client *)((char *)node - offsetof(struct client, expirynode));
+
+    /* the expiry time is pushed forward for every packet received,
+     * wait until it has really passed */
+    if (c->expiry >= uc->expiry.now) {
+	timewheel_add(&uc->expiry, node, c->expiry + 1);
+	return;
+    }
+    debug(DBG_DBG, "radudpget: removing expired client (%s)", addr2string(c->addr));
+    removeudpclient(uc, c);
+}
+
+/* returns the client in uc->clients for key, if any; one whose client
+ * block was removed by a reload is dropped, to be looked up again */
+static struct client *udpfindclient(struct udpclients *uc, struct udpclientkey *key) {
+    struct client *c;
+
+    c = (struct client *)hash_read(uc->clients, key, sizeof(struct udpclientkey));
+    if (c && c->conf->retiredgen) {
+	debug(DBG_DBG, "radudpget: removing client (%s) of a removed client block", addr2string(c->addr));
+	timewheel_del(&c->expirynode);
+	removeudpclient(uc, c);
+	c = NULL;
+    }
+    return c;
+}
+
+/* runs the client expiry; returns the timeout for select(), or NULL if
+ * there are no clients to expire */
+static struct timeval *udpexpireclients(struct udpclients *uc, time_t now, struct timeval *timeout) {
+    time_t next;
+
+    timewheel_expire(&uc->expiry, now, expireudpclient, uc);
+    next = timewheel_next(&uc->expiry);
+    if (!next)
+	return NULL;
+    timeout->tv_sec = next > now ? next - now : 1;
+    timeout->tv_usec = 0;
+    return timeout;
+}
+
+/* returns the client to use for a packet from from, c is the one found
+ * in uc->clients if any, otherwise a new client is added for p;
+ * returns NULL on failure */
+static struct client *udpgetclient(struct udpclients *uc, struct clsrvconf *p, struct client *c, struct udpclientkey *key, struct sockaddr *from, int s, time_t now) {
+    struct sockaddr *fromcopy;
+
+    if (!c) {
+	fromcopy = addr_copy(from);
+	if (!fromcopy)
+	    return NULL;
+	pthread_mutex_lock(p->lock);
+	c = addclient(p, 0, -1);
+	pthread_mutex_unlock(p->lock);
+	if (!c) {
+	    free(fromcopy);
+	    return NULL;
+	}
+	c->sock = s;
+	c->addr = fromcopy;
+	c->replyq = uc->replyq;
+	if (!hash_insert(uc->clients, key, sizeof(struct udpclientkey), c)) {
+	    debug(DBG_ERR, "radudpget: malloc failed");
+	    c->replyq = NULL; /* stop removeclient() from removing common udp replyq */
+	    removeclient(c);
+	    return NULL;
+	}
+	timewheel_add(&uc->expiry, &c->expirynode, now + UDP_CLIENT_EXPIRY + 1);
+    }
+    c->expiry = now + UDP_CLIENT_EXPIRY;
+    return c;
+}
+
+#ifdef HAVE_RECVMMSG
+/* A ring of receive slots, filled by one recvmmsg() and then handed
+ * out one packet at a time */
+struct udpbatch {
+    uint16_t size, count, next;
+    unsigned char *slots;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *addrs;
+    uint8_t **bufs; /* the slots */
+    const struct radsecret **secrets; /* checking the slots, or NULL */
+    uint8_t *msgauthok;
+};
+
+static struct udpbatch *udpbatch_create(uint16_t size) {
+    struct udpbatch *b;
+    uint16_t i;
+
+    b = malloc(sizeof(struct udpbatch));
+    if (!b)
+	return NULL;
+    memset(b, 0, sizeof(struct udpbatch));
+    b->slots = malloc(size * UDP_SLOT_SIZE);
+    b->msgs = calloc(size, sizeof(struct mmsghdr));
+    b->iovs = calloc(size, sizeof(struct iovec));
+    b->addrs = calloc(size, sizeof(struct sockaddr_storage));
+    b->bufs = calloc(size, sizeof(uint8_t *));
+    b->secrets = calloc(size, sizeof(struct radsecret *));
+    b->msgauthok = calloc(size, 1);
+    if (!b->slots || !b->msgs || !b->iovs || !b->addrs || !b->bufs || !b->secrets || !b->msgauthok) {
+	free(b->slots);
+	free(b->msgs);
+	free(b->iovs);
+	free(b->addrs);
+	free(b->bufs);
+	free(b->secrets);
+	free(b->msgauthok);
+	free(b);
+	return NULL;
+    }
+    for (i = 0; i < size; i++) {
+	b->bufs[i] = b->slots + i * UDP_SLOT_SIZE;
+	b->iovs[i].iov_base = b->bufs[i];
+	b->iovs[i].iov_len = UDP_SLOT_SIZE;
+	b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+	b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+	b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    b->size = size;
+    return b;
+}
+
+/* checks the Message-Authenticators of the packets just received from
+ * clients already known, all at once. Packets from new clients, or
+ * failing, are checked again one by one by buf2radmsg() */
+static void udpbatch_checkmsgauths(struct udpbatch *b, struct udpclients *uc) {
+    struct udpclientkey key;
+    struct client *c;
+    int i;
+
+    for (i = 0; i < b->count; i++) {
+	b->secrets[i] = NULL;
+	if (b->msgs[i].msg_len < 20 || b->msgs[i].msg_len < RADLEN(b->bufs[i]) ||
+	    (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+	    continue;
+	udpclientkey(&key, (struct sockaddr *)&b->addrs[i]);
+	c = (struct client *)hash_read(uc->clients, &key, sizeof(struct udpclientkey));
+	if (c && !c->conf->retiredgen)
+	    b->secrets[i] = &c->conf->radsecret;
+    }
+    radmsg_checkmsgauths(b->count, b->bufs, b->secrets, b->msgauthok);
+}
+
+/* radudpget() for listening sockets receiving in batches. The packet
+ * is copied out of its slot since the slot is reused by the next
+ * recvmmsg(), while the request may live on for long */
+static unsigned char *radudpgetbatch(int s, struct udpclients *uc, struct client **client, uint16_t *port) {
+    struct udpbatch *b = uc->batch;
+    struct mmsghdr *m;
+    struct sockaddr *from;
+    unsigned char *buf, *rad;
+    struct clsrvconf *p;
+    struct client *c;
+    struct udpclientkey key;
+    struct timeval timeout, *tv;
+    fd_set readfds;
+    time_t now;
+    int cnt, len, i;
+
+    for (;;) {
+	now = time(NULL);
+	if (b->next == b->count) {
+	    tv = udpexpireclients(uc, now, &timeout);
+	    FD_ZERO(&readfds);
+	    FD_SET(s, &readfds);
+	    if (select(s + 1, &readfds, NULL, NULL, tv) < 1)
+		continue;
+	    for (i = 0; i < b->size; i++)
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+	    cnt = recvmmsg(s, b->msgs, b->size, MSG_DONTWAIT, NULL);
+	    if (cnt < 1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		    debug(DBG_WARN, "radudpget: recv failed");
+		continue;
+	    }
+	    debug(DBG_DBG, "radudpget: got batch of %d packets", cnt);
+	    b->count = cnt;
+	    b->next = 0;
+	    udpbatch_checkmsgauths(b, uc);
+	}
+	i = b->next;
+	m = &b->msgs[b->next++];
+	from = (struct sockaddr *)m->msg_hdr.msg_name;
+	buf = (unsigned char *)m->msg_hdr.msg_iov->iov_base;
+	cnt = m->msg_len;
+
+	udpclientkey(&key, from);
+	c = udpfindclient(uc, &key);
+	p = c ? c->conf : find_clconf(handle, from, NULL);
+	if (!p) {
+	    debug(DBG_WARN, "radudpget: got packet from wrong or unknown UDP peer %s, ignoring", addr2string(from));
+	    STATS_INC(stats_unknownpeers);
+	    continue;
+	}
+
+	if (cnt < 4 || (len = RADLEN(buf)) < 20) {
+	    debug(DBG_WARN, "radudpget: length too small");
+	    continue;
+	}
+	if (m->msg_hdr.msg_flags & MSG_TRUNC) {
+	    debug(DBG_WARN, "radudpget: packet larger than %d bytes, ignoring", UDP_SLOT_SIZE);
+	    continue;
+	}
+	debug(DBG_DBG, "radudpget: got %d bytes from %s", cnt, addr2string(from));
+	if (cnt < len) {
+	    debug(DBG_WARN, "radudpget: packet smaller than length field in radius header");
+	    continue;
+	}
+	if (cnt > len)
+	    debug(DBG_DBG, "radudpget: packet was padded with %d bytes", cnt - len);
+
+	rad = radbuf_alloc(len);
+	if (!rad) {
+	    debug(DBG_ERR, "radudpget: malloc failed");
+	    continue;
+	}
+	memcpy(rad, buf, len);
+
+	c = udpgetclient(uc, p, c, &key, from, s, now);
+	if (!c) {
+	    radbuf_free(rad);
+	    continue;
+	}
+	*client = c;
+	uc->msgauthok = b->msgauthok[i] && b->secrets[i] == &p->radsecret;
+	if (port)
+	    *port = port_get(from);
+	return rad;
+    }
+}
+#endif
+
 /* exactly one of client and server must be non-NULL */
 /* return who we received from in *client or *server */
 /* return from in sa if not NULL */
-unsigned char *radudpget(int s, struct client **client, struct server **server, uint16_t *port) {
+/* for a server, returns NULL after timeout secs without a reply,
+ * unless timeout is 0; if *server is set, only its replies are read */
+unsigned char *radudpget(int s, struct udpclients *uc, struct client **client, struct server **server, uint16_t *port, int timeout) {
     int cnt, len;
     unsigned char buf[4], *rad = NULL;
     struct sockaddr_storage from;
-    struct sockaddr *fromcopy;
     socklen_t fromlen = sizeof(from);
     struct clsrvconf *p;
-    struct list_node *node;
     fd_set readfds;
     struct client *c = NULL;
-    struct timeval now;
+    struct udpclientkey key;
+    struct timeval tvbuf, *tv;
+    time_t now = 0, end = timeout ? time(NULL) + timeout : 0;
 
+#ifdef HAVE_RECVMMSG
+    if (client && uc->batch)
+	return radudpgetbatch(s, uc, client, port);
+#endif
+    if (uc)
+	uc->msgauthok = 0;
     for (;;) {
 	if (rad) {
-	    free(rad);
+	    radbuf_free(rad);
 	    rad = NULL;
 	}
+	tv = NULL;
+	if (client) {
+	    now = time(NULL);
+	    tv = udpexpireclients(uc, now, &tvbuf);
+	} else if (end) {
+	    now = time(NULL);
+	    if (now >= end)
+		return NULL;
+	    tvbuf.tv_sec = end - now;
+	    tvbuf.tv_usec = 0;
+	    tv = &tvbuf;
+	}
 	FD_ZERO(&readfds);
-        FD_SET(s, &readfds);
-	if (select(s + 1, &readfds, NULL, NULL, NULL) < 1)
+	FD_SET(s, &readfds);
+	if (select(s + 1, &readfds, NULL, NULL, tv) < 1)
 	    continue;
 	cnt = recvfrom(s, buf, 4, MSG_PEEK | MSG_TRUNC, (struct sockaddr *)&from, &fromlen);
 	if (cnt == -1) {
@@ -156,11 +467,17 @@ unsigned char *radudpget(int s, struct client **client, struct server **server,
 	    continue;
 	}
 
-	p = client
-	    ? find_clconf(handle, (struct sockaddr *)&from, NULL)
-	    : find_srvconf(handle, (struct sockaddr *)&from, NULL);
+	if (client) {
+	    udpclientkey(&key, (struct sockaddr *)&from);
+	    c = udpfindclient(uc, &key);
+	    p = c ? c->conf : find_clconf(handle, (struct sockaddr *)&from, NULL);
+	} else if (*server)
+	    p = addressmatches((*server)->conf->hostports, (struct sockaddr *)&from, 1) ? (*server)->conf : NULL;
+	else
+	    p = find_srvconf(handle, (struct sockaddr *)&from, NULL);
 	if (!p) {
 	    debug(DBG_WARN, "radudpget: got packet from wrong or unknown UDP peer %s, ignoring", addr2string((struct sockaddr *)&from));
+	    STATS_INC(stats_unknownpeers);
 	    recv(s, buf, 4, 0);
 	    continue;
 	}
@@ -172,7 +489,7 @@ unsigned char *radudpget(int s, struct client **client, struct server **server,
 	    continue;
 	}
 
-	rad = malloc(len);
+	rad = radbuf_alloc(len);
 	if (!rad) {
 	    debug(DBG_ERR, "radudpget: malloc failed");
 	    recv(s, buf, 4, 0);
@@ -190,47 +507,11 @@ unsigned char *radudpget(int s, struct client **client, struct server **server,
 	    debug(DBG_DBG, "radudpget: packet was padded with %d bytes", cnt - len);
 
 	if (client) {
-	    *client = NULL;
-	    pthread_mutex_lock(p->lock);
-	    for (node = list_first(p->clients); node;) {
-		c = (struct client *)node->data;
-		node = list_next(node);
-		if (s != c->sock)
-		    continue;
-		gettimeofday(&now, NULL);
-		if (!*client && addr_equal((struct sockaddr *)&from, c->addr)) {
-		    c->expiry = now.tv_sec + 60;
-		    *client = c;
-		}
-		if (c->expiry >= now.tv_sec)
-		    continue;
-
-		debug(DBG_DBG, "radudpget: removing expired client (%s)", addr2string(c->addr));
-		removeudpclientfromreplyq(c);
-		c->replyq = NULL; /* stop removeclient() from removing common udp replyq */
-		removelockedclient(c);
-		break;
-	    }
-	    if (!*client) {
-		fromcopy = addr_copy((struct sockaddr *)&from);
-		if (!fromcopy) {
-		    pthread_mutex_unlock(p->lock);
-		    continue;
-		}
-		c = addclient(p, 0);
-		if (!c) {
-		    free(fromcopy);
-		    pthread_mutex_unlock(p->lock);
-		    continue;
-		}
-		c->sock = s;
-		c->addr = fromcopy;
-		gettimeofday(&now, NULL);
-		c->expiry = now.tv_sec + 60;
-		*client = c;
-	    }
-	    pthread_mutex_unlock(p->lock);
-	} else if (server)
+	    c = udpgetclient(uc, p, c, &key, (struct sockaddr *)&from, s, now);
+	    if (!c)
+		continue;
+	    *client = c;
+	} else if (!*server)
 	    *server = p->servers;
 	break;
     }
@@ -262,34 +543,143 @@ void *udpclientrd(void *arg) {
 
     for (;;) {
 	server = NULL;
-	buf = radudpget(*s, NULL, &server, NULL);
+	buf = radudpget(*s, NULL, NULL, &server, NULL, 0);
 	replyh(server, buf);
     }
 }
 
 void *udpserverrd(void *arg) {
     struct request *rq;
+    struct client *from;
+    unsigned char *buf;
+    uint16_t udpport;
     int *sp = (int *)arg;
+    struct udpclients uc;
+    pthread_t wrth;
+
+    uc.clients = hash_create();
+    if (!uc.clients || !timewheel_init(&uc.expiry, 64, time(NULL)))
+	debugx(1, DBG_ERR, "malloc failed");
+    uc.batch = NULL;
+    uc.msgauthok = 0;
+#ifdef HAVE_RECVMMSG
+    if (getbatchsize() > 1 && !(uc.batch = udpbatch_create(getbatchsize())))
+	debugx(1, DBG_ERR, "malloc failed");
+#endif
+    uc.replyq = newqueue();
+    if (pthread_create(&wrth, &pthread_attr, udpserverwr, (void *)uc.replyq))
+	debugx(1, DBG_ERR, "pthread_create failed");
 
     for (;;) {
+	/* read first, so that the request is stamped when received */
+	buf = radudpget(*sp, &uc, &from, NULL, &udpport, 0);
 	rq = newrequest();
 	if (!rq) {
-	    sleep(5); /* malloc failed */
+	    radbuf_free(buf);
 	    continue;
 	}
-	rq->buf = radudpget(*sp, &rq->from, NULL, &rq->udpport);
+	rq->buf = buf;
+	rq->from = from;
+	rq->udpport = udpport;
 	rq->udpsock = *sp;
+	rq->msgauthok = uc.msgauthok;
 	radsrv(rq);
     }
     free(sp);
     return NULL;
 }
 
+#ifdef HAVE_SENDMMSG
+static void udpsendbatch(int s, struct mmsghdr *msgs, int n) {
+    int sent;
+
+    while (n > 0) {
+	sent = sendmmsg(s, msgs, n, 0);
+	if (sent < 1) {
+	    debug(DBG_WARN, "udpserverwr: send failed");
+	    sent = 1; /* skip the one failing */
+	}
+	msgs += sent;
+	n -= sent;
+    }
+}
+
+/* udpserverwr() taking up to size replies off the queue at once, the
+ * replies are sent with one sendmmsg() per run of replies for the same
+ * socket */
+static void *udpserverwrbatch(struct gqueue *replyq, uint16_t size) {
+    struct request *reply, **replies;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct sockaddr_storage *to;
+    int i, n, k, s;
+
+    replies = calloc(size, sizeof(struct request *));
+    msgs = calloc(size, sizeof(struct mmsghdr));
+    iovs = calloc(size, sizeof(struct iovec));
+    to = calloc(size, sizeof(struct sockaddr_storage));
+    if (!replies || !msgs || !iovs || !to)
+	debugx(1, DBG_ERR, "malloc failed");
+
+    for (;;) {
+	pthread_mutex_lock(&replyq->mutex);
+	while (!list_first(replyq->entries)) {
+	    debug(DBG_DBG, "udp server writer, waiting for signal");
+	    pthread_cond_wait(&replyq->cond, &replyq->mutex);
+	    debug(DBG_DBG, "udp server writer, got signal");
+	}
+	for (n = 0; n < size && (reply = (struct request *)list_shift(replyq->entries)); n++) {
+	    replies[n] = reply;
+	    /* do this with lock, udpserverrd may set from = NULL if from expires */
+	    if (reply->from)
+		memcpy(&to[n], reply->from->addr, SOCKADDRP_SIZE(reply->from->addr));
+	    else
+		to[n].ss_family = AF_UNSPEC;
+	}
+	pthread_mutex_unlock(&replyq->mutex);
+
+	s = -1;
+	k = 0;
+	for (i = 0; i < n; i++) {
+	    reply = replies[i];
+	    if (to[i].ss_family == AF_UNSPEC)
+		continue;
+	    if (k && reply->udpsock != s) {
+		udpsendbatch(s, msgs, k);
+		k = 0;
+	    }
+	    s = reply->udpsock;
+	    port_set((struct sockaddr *)&to[i], reply->udpport);
+	    iovs[k].iov_base = reply->replybuf;
+	    iovs[k].iov_len = RADLEN(reply->replybuf);
+	    memset(&msgs[k], 0, sizeof(struct mmsghdr));
+	    msgs[k].msg_hdr.msg_name = &to[i];
+	    msgs[k].msg_hdr.msg_namelen = SOCKADDR_SIZE(to[i]);
+	    msgs[k].msg_hdr.msg_iov = &iovs[k];
+	    msgs[k].msg_hdr.msg_iovlen = 1;
+	    k++;
+	}
+	if (k)
+	    udpsendbatch(s, msgs, k);
+	debug(DBG_DBG, "udpserverwr: sent batch of %d replies", n);
+	for (i = 0; i < n; i++) {
+	    TRACE(replies[i], TRACE_WRITTEN);
+	    freerq(replies[i]);
+	}
+    }
+    return NULL;
+}
+#endif
+
 void *udpserverwr(void *arg) {
     struct gqueue *replyq = (struct gqueue *)arg;
     struct request *reply;
     struct sockaddr_storage to;
 
+#ifdef HAVE_SENDMMSG
+    if (getbatchsize() > 1)
+	return udpserverwrbatch(replyq, getbatchsize());
+#endif
     for (;;) {
 	pthread_mutex_lock(&replyq->mutex);
 	while (!(reply = (struct request *)list_shift(replyq->entries))) {
@@ -307,58 +697,91 @@ void *udpserverwr(void *arg) {
 		debug(DBG_WARN, "udpserverwr: send failed");
 	}
 	debug(DBG_DBG, "udpserverwr: refcount %d", reply->refcount);
+	TRACE(reply, TRACE_WRITTEN);
 	freerq(reply);
     }
 }
 
 void addclientudp(struct client *client) {
-    client->replyq = server_replyq;
+    /* replyq is set by the reader adding the client, to the one of
+     * its listening socket */
 }
 
-void addserverextraudp(struct clsrvconf *conf) {
+/* reads the replies to a channel other than the first, on a socket of
+ * its own, for clientwr; closes it and exits once a reload removed
+ * the server, for clientwr to free it */
+void *udpchannelrd(void *arg) {
+    struct server *server = (struct server *)arg, *from;
+    unsigned char *buf;
+
+    while (!server->conf->retiredgen) {
+	/* the socket is of this channel, but any peer may send to it */
+	from = server;
+	buf = radudpget(server->sock, NULL, NULL, &from, NULL, 1);
+	if (buf)
+	    replyh(server, buf);
+    }
+    close(server->sock);
+    server->sock = -1;
+    server->clientrdgone = 1;
+    pthread_mutex_lock(&server->newrq_mutex);
+    pthread_cond_signal(&server->newrq_cond);
+    pthread_mutex_unlock(&server->newrq_mutex);
+    return NULL;
+}
+
+void addserverextraudp(struct server *server) {
+    struct clsrvconf *conf = server->conf;
+    pthread_t th;
+    int family;
+
     assert(list_first(conf->hostports) != NULL);
-    switch (((struct hostportres *)list_first(conf->hostports)->data)->addrinfo->ai_family) {
-    case AF_INET:
+    family = ((struct hostportres *)list_first(conf->hostports)->data)->addrinfo->ai_family;
+    if (family != AF_INET && family != AF_INET6)
+	debugx(1, DBG_ERR, "addserver: unsupported address family");
+
+    /* further channels need a source port of their own, since the
+     * server tells them apart by it */
+    if (server->channel) {
+	server->sock = bindtoaddr(srcres, family, 0);
+	if (server->sock < 0)
+	    debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
+	return;
+    }
+
+    /* the socket of the family, and its reader, are made for the first
+     * server of it, which may be added by a reload */
+    if (family == AF_INET) {
 	if (client4_sock < 0) {
 	    client4_sock = bindtoaddr(srcres, AF_INET, 0);
 	    if (client4_sock < 0)
 		debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
+	    if (affinity_create(&th, AFFINITY_UPSTREAM, udpclientrd, (void *)&client4_sock))
+		debugx(1, DBG_ERR, "pthread_create failed");
 	}
-	conf->servers->sock = client4_sock;
-	break;
-    case AF_INET6:
+	server->sock = client4_sock;
+    } else {
 	if (client6_sock < 0) {
 	    client6_sock = bindtoaddr(srcres, AF_INET6, 0);
 	    if (client6_sock < 0)
 		debugx(1, DBG_ERR, "addserver: failed to create client socket for server %s", conf->name);
+	    if (affinity_create(&th, AFFINITY_UPSTREAM, udpclientrd, (void *)&client6_sock))
+		debugx(1, DBG_ERR, "pthread_create failed");
 	}
-	conf->servers->sock = client6_sock;
-	break;
-    default:
-	debugx(1, DBG_ERR, "addserver: unsupported address family");
+	server->sock = client6_sock;
     }
 }
 
 void initextraudp() {
-    pthread_t cl4th, cl6th, srvth;
-
     if (srcres) {
 	freeaddrinfo(srcres);
 	srcres = NULL;
     }
 
-    if (client4_sock >= 0)
-	if (pthread_create(&cl4th, &pthread_attr, udpclientrd, (void *)&client4_sock))
-	    debugx(1, DBG_ERR, "pthread_create failed");
-    if (client6_sock >= 0)
-	if (pthread_create(&cl6th, &pthread_attr, udpclientrd, (void *)&client6_sock))
-	    debugx(1, DBG_ERR, "pthread_create failed");
-
-    if (find_clconf_type(handle, NULL)) {
-	server_replyq = newqueue();
-	if (pthread_create(&srvth, &pthread_attr, udpserverwr, (void *)server_replyq))
-	    debugx(1, DBG_ERR, "pthread_create failed");
-    }
+#if !defined(HAVE_RECVMMSG) || !defined(HAVE_SENDMMSG)
+    if (getbatchsize() > 1 && find_clconf_type(handle, NULL))
+	debug(DBG_WARN, "BatchSizeUDP needs recvmmsg() and sendmmsg(), batching only where available");
+#endif
 }
 #else
 const struct protodefs *udpinit(uint8_t h) {